@@ -10,6 +10,8 @@
 #include "iot/thing_manager.h"
 #include "assets/lang_config.h"
 #include "mcp_server.h"
+#include "latency_trace.h"
+#include "json_writer.h"
 
 #if CONFIG_USE_AUDIO_PROCESSOR
 #include "afe_audio_processor.h"
@@ -26,6 +28,7 @@
 #endif
 
 #include <cstring>
+#include <algorithm>
 #include <esp_log.h>
 #include <cJSON.h>
 #include <driver/gpio.h>
@@ -150,10 +153,7 @@ void Application::CheckNewVersion() {
             auto codec = board.GetAudioCodec();
             codec->EnableInput(false);
             codec->EnableOutput(false);
-            {
-                std::lock_guard<std::mutex> lock(mutex_);
-                audio_decode_queue_.clear();
-            }
+            ClearDecodeQueue();
             background_task_->WaitForCompletion();
             delete background_task_;
             background_task_ = nullptr;
@@ -261,31 +261,44 @@ void Application::DismissAlert() {
 }
 
 void Application::PlaySound(const std::string_view& sound) {
-    // Wait for the previous sound to finish
-    {
-        std::unique_lock<std::mutex> lock(mutex_);
-        audio_decode_cv_.wait(lock, [this]() {
-            return audio_decode_queue_.empty();
-        });
+    std::shared_ptr<const SoundPcm> pcm;
+    if (sound_cache_) {
+        pcm = sound_cache_->Get(sound, Board::GetInstance().GetAudioCodec()->output_sample_rate());
     }
+
+    // Wait for the previous sound to finish
+    WaitForDecodeQueue(0);
     background_task_->WaitForCompletion();
 
+    if (pcm) {
+        std::lock_guard<std::mutex> lock(sound_mutex_);
+        sound_pcm_ = std::move(pcm);
+        sound_offset_ = 0;
+        sound_playing_ = true;
+        return;
+    }
+
     const char* data = sound.data();
     size_t size = sound.size();
     for (const char* p = data; p < data + size; ) {
         auto p3 = (BinaryProtocol3*)p;
         p += sizeof(BinaryProtocol3);
-
         auto payload_size = ntohs(p3->payload_size);
-        AudioStreamPacket packet;
-        packet.sample_rate = 16000;
-        packet.frame_duration = 60;
-        packet.payload.resize(payload_size);
-        memcpy(packet.payload.data(), p3->payload, payload_size);
-        p += payload_size;
 
-        std::lock_guard<std::mutex> lock(mutex_);
-        audio_decode_queue_.emplace_back(std::move(packet));
+        std::unique_lock<std::mutex> lock(audio_decode_push_mutex_);
+        AudioStreamPacket* slot;
+        while ((slot = audio_decode_queue_.BeginPush()) == nullptr) {
+            // Long sounds do not fit in the queue, wait for the audio loop to drain half of it
+            lock.unlock();
+            WaitForDecodeQueue(MAX_AUDIO_PACKETS_IN_QUEUE / 2);
+            lock.lock();
+        }
+        slot->sample_rate = 16000;
+        slot->frame_duration = 60;
+        slot->timestamp = 0;
+        slot->payload.assign(p3->payload, p3->payload + payload_size);
+        audio_decode_queue_.CommitPush();
+        p += payload_size;
     }
 }
 
@@ -378,23 +391,42 @@ void Application::Start() {
 
     /* Setup the audio codec */
     auto codec = board.GetAudioCodec();
-    opus_decoder_ = std::make_unique<OpusDecoderWrapper>(codec->output_sample_rate(), 1, OPUS_FRAME_DURATION_MS);
+    SetDecodeSampleRate(codec->output_sample_rate(), OPUS_FRAME_DURATION_MS);
+#if CONFIG_USE_SOUND_CACHE
+    sound_cache_ = std::make_unique<SoundCache>(CONFIG_SOUND_CACHE_SIZE_KB * 1024);
+    // Decode the short cues now, so the first wake up or connect does not wait for them
+    background_task_->Schedule([this, sample_rate = codec->output_sample_rate()]() {
+        sound_cache_->Preload({ Lang::Sounds::P3_POPUP, Lang::Sounds::P3_SUCCESS }, sample_rate);
+    });
+#endif
     opus_encoder_ = std::make_unique<OpusEncoderWrapper>(16000, 1, OPUS_FRAME_DURATION_MS);
+    // The starting point, the encoder controller moves it with the CPU headroom while listening
+    int complexity = 0;
     if (aec_mode_ != kAecOff) {
         ESP_LOGI(TAG, "AEC mode: %d, setting opus encoder complexity to 0", aec_mode_);
-        opus_encoder_->SetComplexity(0);
     } else if (board.GetBoardType() == "ml307") {
         ESP_LOGI(TAG, "ML307 board detected, setting opus encoder complexity to 5");
-        opus_encoder_->SetComplexity(5);
+        complexity = 5;
     } else {
         ESP_LOGI(TAG, "WiFi board detected, setting opus encoder complexity to 0");
-        opus_encoder_->SetComplexity(0);
     }
+    encoder_controller_.Reset(complexity, CONFIG_OPUS_ENCODER_MAX_COMPLEXITY);
+    opus_encoder_->SetComplexity(encoder_controller_.settings().complexity);
 
     if (codec->input_sample_rate() != 16000) {
         input_resampler_.Configure(codec->input_sample_rate(), 16000);
         reference_resampler_.Configure(codec->input_sample_rate(), 16000);
     }
+    // Reserve one frame of headroom for every capture stage, so the audio loop never allocates
+    size_t max_input_samples = std::max(codec->input_sample_rate(), 16000) * OPUS_FRAME_DURATION_MS / 1000;
+    capture_buffer_.reserve(max_input_samples * codec->input_channels());
+    capture_mic_.reserve(max_input_samples);
+    capture_reference_.reserve(max_input_samples);
+    capture_resampled_mic_.reserve(max_input_samples);
+    capture_resampled_reference_.reserve(max_input_samples);
+    encode_ring_.resize(ENCODE_FRAME_SAMPLES * MAX_AUDIO_PACKETS_IN_QUEUE);
+    encode_frame_.resize(ENCODE_FRAME_SAMPLES);
+    free_payloads_.reserve(MAX_AUDIO_PACKETS_IN_QUEUE);
     codec->Start();
 
 #if CONFIG_USE_AUDIO_PROCESSOR
@@ -440,14 +472,18 @@ void Application::Start() {
         protocol_ = std::make_unique<MqttProtocol>();
     }
 
+#if CONFIG_USE_AUDIO_CHANNEL_KEEP_WARM
+    protocol_->SetKeepWarm(CONFIG_AUDIO_CHANNEL_LINGER_SECONDS);
+#endif
     protocol_->OnNetworkError([this](const std::string& message) {
         SetDeviceState(kDeviceStateIdle);
         Alert(Lang::Strings::ERROR, message.c_str(), "sad", Lang::Sounds::P3_EXCLAMATION);
     });
     protocol_->OnIncomingAudio([this](AudioStreamPacket&& packet) {
-        std::lock_guard<std::mutex> lock(mutex_);
-        if (device_state_ == kDeviceStateSpeaking && audio_decode_queue_.size() < MAX_AUDIO_PACKETS_IN_QUEUE) {
-            audio_decode_queue_.emplace_back(std::move(packet));
+        if (device_state_ == kDeviceStateSpeaking) {
+            LatencyTrace::GetInstance().RecordFirst(kLatencyEventFirstAudioReceived);
+            // Drop the packet if the queue is full
+            PushDecodePacket(std::move(packet));
         }
     });
     protocol_->OnAudioChannelOpened([this, codec, &board]() {
@@ -474,19 +510,22 @@ void Application::Start() {
             SetDeviceState(kDeviceStateIdle);
         });
     });
-    protocol_->OnIncomingJson([this, display](const cJSON* root) {
-        // Parse JSON data
-        auto type = cJSON_GetObjectItem(root, "type");
-        if (strcmp(type->valuestring, "tts") == 0) {
-            auto state = cJSON_GetObjectItem(root, "state");
-            if (strcmp(state->valuestring, "start") == 0) {
+    protocol_->OnIncomingJson([this, display](const JsonMessage& message) {
+        switch (message.type()) {
+        case kJsonMessageTts:
+            if (message.state() == kJsonStateStart) {
+                auto& trace = LatencyTrace::GetInstance();
+                trace.Record(kLatencyEventTtsStart);
+                trace.Arm(kLatencyEventFirstAudioReceived);
+                trace.Arm(kLatencyEventFirstAudioOutput);
                 Schedule([this]() {
                     aborted_ = false;
                     if (device_state_ == kDeviceStateIdle || device_state_ == kDeviceStateListening) {
                         SetDeviceState(kDeviceStateSpeaking);
                     }
                 });
-            } else if (strcmp(state->valuestring, "stop") == 0) {
+            } else if (message.state() == kJsonStateStop) {
+                LatencyTrace::GetInstance().Record(kLatencyEventTtsStop);
                 Schedule([this]() {
                     background_task_->WaitForCompletion();
                     if (device_state_ == kDeviceStateSpeaking) {
@@ -497,40 +536,50 @@ void Application::Start() {
                         }
                     }
                 });
-            } else if (strcmp(state->valuestring, "sentence_start") == 0) {
-                auto text = cJSON_GetObjectItem(root, "text");
-                if (cJSON_IsString(text)) {
-                    ESP_LOGI(TAG, "<< %s", text->valuestring);
-                    Schedule([this, display, message = std::string(text->valuestring)]() {
+            } else if (message.state() == kJsonStateSentenceStart) {
+                LatencyTrace::GetInstance().Record(kLatencyEventTtsSentenceStart);
+                if (message.Has(kJsonFieldText)) {
+                    auto text = message.GetString(kJsonFieldText);
+                    ESP_LOGI(TAG, "<< %s", text.c_str());
+                    Schedule([this, display, message = std::move(text)]() {
                         display->SetChatMessage("assistant", message.c_str());
                     });
                 }
             }
-        } else if (strcmp(type->valuestring, "stt") == 0) {
-            auto text = cJSON_GetObjectItem(root, "text");
-            if (cJSON_IsString(text)) {
-                ESP_LOGI(TAG, ">> %s", text->valuestring);
-                Schedule([this, display, message = std::string(text->valuestring)]() {
+            break;
+        case kJsonMessageStt:
+            LatencyTrace::GetInstance().Record(kLatencyEventStt);
+            if (message.Has(kJsonFieldText)) {
+                auto text = message.GetString(kJsonFieldText);
+                ESP_LOGI(TAG, ">> %s", text.c_str());
+                Schedule([this, display, message = std::move(text)]() {
                     display->SetChatMessage("user", message.c_str());
                 });
             }
-        } else if (strcmp(type->valuestring, "llm") == 0) {
-            auto emotion = cJSON_GetObjectItem(root, "emotion");
-            if (cJSON_IsString(emotion)) {
-                Schedule([this, display, emotion_str = std::string(emotion->valuestring)]() {
+            break;
+        case kJsonMessageLlm:
+            if (message.Has(kJsonFieldEmotion)) {
+                Schedule([this, display, emotion_str = message.GetString(kJsonFieldEmotion)]() {
                     display->SetEmotion(emotion_str.c_str());
                 });
             }
+            break;
 #if CONFIG_IOT_PROTOCOL_MCP
-        } else if (strcmp(type->valuestring, "mcp") == 0) {
-            auto payload = cJSON_GetObjectItem(root, "payload");
-            if (cJSON_IsObject(payload)) {
-                McpServer::GetInstance().ParseMessage(payload);
+        case kJsonMessageMcp: {
+            // The only message that needs a tree, and only of its payload, a request or a batch of them
+            auto payload = message.Get(kJsonFieldPayload);
+            auto root = cJSON_ParseWithLength(payload.data(), payload.size());
+            if (cJSON_IsObject(root) || cJSON_IsArray(root)) {
+                McpServer::GetInstance().ParseMessage(root);
             }
+            cJSON_Delete(root);
+            break;
+        }
 #endif
 #if CONFIG_IOT_PROTOCOL_XIAOZHI
-        } else if (strcmp(type->valuestring, "iot") == 0) {
-            auto commands = cJSON_GetObjectItem(root, "commands");
+        case kJsonMessageIot: {
+            auto json = message.Get(kJsonFieldCommands);
+            auto commands = cJSON_ParseWithLength(json.data(), json.size());
             if (cJSON_IsArray(commands)) {
                 auto& thing_manager = iot::ThingManager::GetInstance();
                 for (int i = 0; i < cJSON_GetArraySize(commands); ++i) {
@@ -538,69 +587,48 @@ void Application::Start() {
                     thing_manager.Invoke(command);
                 }
             }
+            cJSON_Delete(commands);
+            break;
+        }
 #endif
-        } else if (strcmp(type->valuestring, "system") == 0) {
-            auto command = cJSON_GetObjectItem(root, "command");
-            if (cJSON_IsString(command)) {
-                ESP_LOGI(TAG, "System command: %s", command->valuestring);
-                if (strcmp(command->valuestring, "reboot") == 0) {
+        case kJsonMessageSystem:
+            if (message.Has(kJsonFieldCommand)) {
+                auto command = message.Get(kJsonFieldCommand);
+                ESP_LOGI(TAG, "System command: %.*s", (int)command.size(), command.data());
+                if (command == "reboot") {
                     // Do a reboot if user requests a OTA update
                     Schedule([this]() {
                         Reboot();
                     });
                 } else {
-                    ESP_LOGW(TAG, "Unknown system command: %s", command->valuestring);
+                    ESP_LOGW(TAG, "Unknown system command: %.*s", (int)command.size(), command.data());
                 }
             }
-        } else if (strcmp(type->valuestring, "alert") == 0) {
-            auto status = cJSON_GetObjectItem(root, "status");
-            auto message = cJSON_GetObjectItem(root, "message");
-            auto emotion = cJSON_GetObjectItem(root, "emotion");
-            if (cJSON_IsString(status) && cJSON_IsString(message) && cJSON_IsString(emotion)) {
-                Alert(status->valuestring, message->valuestring, emotion->valuestring, Lang::Sounds::P3_VIBRATION);
+            break;
+        case kJsonMessageAlert:
+            if (message.Has(kJsonFieldStatus) && message.Has(kJsonFieldMessage) && message.Has(kJsonFieldEmotion)) {
+                Alert(message.GetString(kJsonFieldStatus).c_str(), message.GetString(kJsonFieldMessage).c_str(),
+                    message.GetString(kJsonFieldEmotion).c_str(), Lang::Sounds::P3_VIBRATION);
             } else {
                 ESP_LOGW(TAG, "Alert command requires status, message and emotion");
             }
-        } else {
-            ESP_LOGW(TAG, "Unknown message type: %s", type->valuestring);
+            break;
+        default: {
+            auto type = message.Get(kJsonFieldType);
+            ESP_LOGW(TAG, "Unknown message type: %.*s", (int)type.size(), type.data());
+            break;
+        }
         }
     });
     bool protocol_started = protocol_->Start();
 
     audio_processor_->Initialize(codec);
     audio_processor_->OnOutput([this](std::vector<int16_t>&& data) {
-        background_task_->Schedule([this, data = std::move(data)]() mutable {
-            opus_encoder_->Encode(std::move(data), [this](std::vector<uint8_t>&& opus) {
-                AudioStreamPacket packet;
-                packet.payload = std::move(opus);
-#ifdef CONFIG_USE_SERVER_AEC
-                {
-                    std::lock_guard<std::mutex> lock(timestamp_mutex_);
-                    if (!timestamp_queue_.empty()) {
-                        packet.timestamp = timestamp_queue_.front();
-                        timestamp_queue_.pop_front();
-                    } else {
-                        packet.timestamp = 0;
-                    }
-
-                    if (timestamp_queue_.size() > 3) { // 限制队列长度3
-                        timestamp_queue_.pop_front(); // 该包发送前先出队保持队列长度
-                        return;
-                    }
-                }
-#endif
-                std::lock_guard<std::mutex> lock(mutex_);
-                if (audio_send_queue_.size() >= MAX_AUDIO_PACKETS_IN_QUEUE) {
-                    ESP_LOGW(TAG, "Too many audio packets in queue, drop the oldest packet");
-                    audio_send_queue_.pop_front();
-                }
-                audio_send_queue_.emplace_back(std::move(packet));
-                xEventGroupSetBits(event_group_, SEND_AUDIO_EVENT);
-            });
-        });
+        QueueEncodePcm(std::move(data));
     });
     audio_processor_->OnVadStateChange([this](bool speaking) {
         if (device_state_ == kDeviceStateListening) {
+            LatencyTrace::GetInstance().Record(speaking ? kLatencyEventVoiceStart : kLatencyEventVoiceEnd);
             Schedule([this, speaking]() {
                 if (speaking) {
                     voice_detected_ = true;
@@ -615,7 +643,12 @@ void Application::Start() {
 
     wake_word_->Initialize(codec);
     wake_word_->OnWakeWordDetected([this](const std::string& wake_word) {
-        Schedule([this, &wake_word]() {
+        LatencyTrace::GetInstance().Record(kLatencyEventWakeWord);
+        // Start capturing right away, the main loop may be busy for a while
+        if (device_state_ == kDeviceStateIdle && protocol_) {
+            StartPreroll();
+        }
+        Schedule([this, wake_word]() {
             if (!protocol_) {
                 return;
             }
@@ -626,6 +659,7 @@ void Application::Start() {
                 if (!protocol_->IsAudioChannelOpened()) {
                     SetDeviceState(kDeviceStateConnecting);
                     if (!protocol_->OpenAudioChannel()) {
+                        StopPreroll();
                         wake_word_->StartDetection();
                         return;
                     }
@@ -638,6 +672,7 @@ void Application::Start() {
                 while (wake_word_->GetWakeWordOpus(packet.payload)) {
                     protocol_->SendAudio(packet);
                 }
+                LatencyTrace::GetInstance().Record(kLatencyEventWakeWordAudioSent);
                 // Set the chat state to wake word detected
                 protocol_->SendWakeWordDetected(wake_word);
 #else
@@ -648,7 +683,14 @@ void Application::Start() {
                 vTaskDelay(pdMS_TO_TICKS(60));
 #endif
                 SetListeningMode(aec_mode_ == kAecOff ? kListeningModeAutoStop : kListeningModeRealtime);
-            } else if (device_state_ == kDeviceStateSpeaking) {
+                return;
+            }
+
+            // The state moved on before this ran, a connection started meanwhile still uses the pre-roll
+            if (preroll_ && device_state_ != kDeviceStateConnecting && device_state_ != kDeviceStateListening) {
+                StopPreroll();
+            }
+            if (device_state_ == kDeviceStateSpeaking) {
                 AbortSpeaking(kAbortReasonWakeWordDetected);
             } else if (device_state_ == kDeviceStateActivating) {
                 SetDeviceState(kDeviceStateIdle);
@@ -668,6 +710,14 @@ void Application::Start() {
         // Play the success sound to indicate the device is ready
         ResetDecoder();
         PlaySound(Lang::Sounds::P3_SUCCESS);
+#if CONFIG_USE_AUDIO_CHANNEL_KEEP_WARM
+        // Connect while idle, so the first wake up only needs a hello round trip
+        Schedule([this]() {
+            if (device_state_ == kDeviceStateIdle) {
+                protocol_->PrewarmAudioChannel();
+            }
+        });
+#endif
     }
 
     // Print heap stats
@@ -683,12 +733,58 @@ void Application::OnClockTimer() {
     auto display = Board::GetInstance().GetDisplay();
     display->UpdateStatusBar();
 
+    if (device_state_ == kDeviceStateListening) {
+        // Reading the signal may take an AT command on cellular boards, so not every second
+        if (clock_ticks_ % 5 == 0) {
+            signal_quality_ = Board::GetInstance().GetSignalQuality();
+        }
+        UpdateEncoderController();
+    }
+
     // Print the debug info every 10 seconds
     if (clock_ticks_ % 10 == 0) {
         // SystemInfo::PrintTaskCpuUsage(pdMS_TO_TICKS(1000));
         // SystemInfo::PrintTaskList();
         SystemInfo::PrintHeapStats();
 
+        // Print the latency histograms when a new turn has been measured
+        auto& trace = LatencyTrace::GetInstance();
+        auto latency_samples = trace.GetSampleCount();
+        if (latency_samples != latency_samples_logged_) {
+            latency_samples_logged_ = latency_samples;
+            trace.Dump();
+        }
+
+        auto stats = GetEncodeStats();
+        if (device_state_ == kDeviceStateListening && stats.frames > 0) {
+            auto encoder = GetEncoderStatus();
+            ESP_LOGI(TAG, "Encode: %lu frames, avg %lld us, max %lld us, dropped %lu, send queue %u (max %u), "
+                "queue drops %lu, send failures %lu, complexity %d, dtx %d",
+                stats.frames, stats.total_encode_us / stats.frames, stats.max_encode_us, stats.dropped_frames,
+                stats.send_queue_depth, stats.max_send_queue_depth, stats.queue_dropped_packets, stats.send_failures,
+                encoder.settings.complexity, encoder.settings.dtx);
+        }
+        if (device_state_ == kDeviceStateSpeaking) {
+            auto jitter = GetJitterStats();
+            ESP_LOGI(TAG, "Jitter: %lu played, %lu concealed, %lu underruns, %lu late, %lu duplicate, %lu overflow, depth %lu (target %lu ms)",
+                jitter.played_frames, jitter.concealed_frames, jitter.underruns, jitter.late_packets,
+                jitter.duplicate_packets, jitter.overflow_packets, jitter.depth, jitter.target_depth_ms);
+            if (protocol_) {
+                auto channel = protocol_->audio_channel_stats();
+                ESP_LOGI(TAG, "Audio channel: %lu received, %lu lost, %lu late, %lu reordered, %lu duplicate, %lu concealed",
+                    channel.received_packets, channel.lost_packets, channel.late_packets, channel.reordered_packets,
+                    channel.duplicate_packets, channel.concealed_packets);
+            }
+        }
+
+#if CONFIG_USE_AUDIO_CHANNEL_KEEP_WARM
+        if (device_state_ == kDeviceStateIdle && protocol_) {
+            Schedule([this]() {
+                protocol_->CheckKeepWarm();
+            });
+        }
+#endif
+
         // If we have synchronized server time, set the status to clock "HH:MM" if the device is idle
         if (ota_.HasServerTime()) {
             if (device_state_ == kDeviceStateIdle) {
@@ -720,14 +816,22 @@ void Application::MainEventLoop() {
     while (true) {
         auto bits = xEventGroupWaitBits(event_group_, SCHEDULE_EVENT | SEND_AUDIO_EVENT, pdTRUE, pdFALSE, portMAX_DELAY);
 
-        if (bits & SEND_AUDIO_EVENT) {
+        // Pre-roll stays queued until the listen start has gone out, SetDeviceState() sets the event again
+        if ((bits & SEND_AUDIO_EVENT) && (!preroll_ || device_state_ == kDeviceStateListening)) {
             std::unique_lock<std::mutex> lock(mutex_);
             auto packets = std::move(audio_send_queue_);
             lock.unlock();
-            for (auto& packet : packets) {
-                if (!protocol_->SendAudio(packet)) {
-                    break;
-                }
+            if (preroll_) {
+                preroll_ = false;
+                ESP_LOGI(TAG, "Flushing %u pre-roll packets", packets.size());
+            }
+            auto sent = protocol_->SendAudioBatch(packets);
+            if (sent > 0) {
+                LatencyTrace::GetInstance().RecordFirst(kLatencyEventFirstAudioSent);
+            }
+            if (sent < packets.size()) {
+                std::lock_guard<std::mutex> lock(encode_mutex_);
+                encode_stats_.send_failures++;
             }
         }
 
@@ -754,16 +858,28 @@ void Application::AudioLoop() {
 }
 
 void Application::OnAudioOutput() {
-    if (busy_decoding_audio_) {
-        return;
-    }
-
     auto now = std::chrono::steady_clock::now();
     auto codec = Board::GetInstance().GetAudioCodec();
     const int max_silence_seconds = 10;
 
-    std::unique_lock<std::mutex> lock(mutex_);
-    if (audio_decode_queue_.empty()) {
+    DrainDecodeQueue();
+    if (busy_decoding_audio_) {
+        return;
+    }
+    if (sound_playing_) {
+        OutputSound();
+        return;
+    }
+
+    AudioStreamPacket packet;
+    auto now_ms = esp_timer_get_time() / 1000;
+    auto result = jitter_buffer_.Pop(packet, now_ms);
+    jitter_depth_ = jitter_buffer_.size();
+    if (result == kJitterBufferEmpty) {
+        if (audio_decode_queue_.empty() && jitter_buffer_.empty()) {
+            std::lock_guard<std::mutex> lock(audio_decode_cv_mutex_);
+            audio_decode_cv_.notify_all();
+        }
         // Disable the output if there is no audio data for a long time
         if (device_state_ == kDeviceStateIdle) {
             auto duration = std::chrono::duration_cast<std::chrono::seconds>(now - last_output_time_).count();
@@ -774,58 +890,400 @@ void Application::OnAudioOutput() {
         return;
     }
 
-    auto packet = std::move(audio_decode_queue_.front());
-    audio_decode_queue_.pop_front();
-    lock.unlock();
-    audio_decode_cv_.notify_all();
+    {
+        std::lock_guard<std::mutex> lock(jitter_stats_mutex_);
+        jitter_stats_ = jitter_buffer_.stats();
+    }
 
     // Synchronize the sample rate and frame duration
     SetDecodeSampleRate(packet.sample_rate, packet.frame_duration);
 
+    // Write out the partial DMA block when nothing follows, so the tail of a sentence is not held back
+    bool flush = jitter_buffer_.empty() && audio_decode_queue_.empty();
+    bool discard_pending = discard_pending_pcm_;
+    discard_pending_pcm_ = false;
     busy_decoding_audio_ = true;
-    background_task_->Schedule([this, codec, packet = std::move(packet)]() mutable {
-        busy_decoding_audio_ = false;
-        if (aborted_) {
-            return;
+    background_task_->Schedule([this, packet = std::move(packet), flush, discard_pending]() mutable {
+        if (!aborted_) {
+            DecodeAndOutput(packet, flush, discard_pending);
         }
+        busy_decoding_audio_ = false;
+    }, kBackgroundTaskPriorityPlayback);
+}
 
-        std::vector<int16_t> pcm;
-        if (!opus_decoder_->Decode(std::move(packet.payload), pcm)) {
-            return;
+// Moves everything the producers queued into the jitter buffer. Runs on the audio loop only.
+void Application::DrainDecodeQueue() {
+    auto now_ms = esp_timer_get_time() / 1000;
+    if (jitter_reset_pending_.exchange(false)) {
+        jitter_buffer_.Reset();
+        discard_pending_pcm_ = true;
+    }
+
+    bool drained = false;
+    AudioStreamPacket* slot;
+    // Leave packets in the ring when the jitter buffer is full, so PlaySound() blocks instead of dropping
+    while (!jitter_buffer_.full() && (slot = audio_decode_queue_.Front()) != nullptr) {
+        jitter_buffer_.Push(std::move(*slot), now_ms);
+        audio_decode_queue_.Pop();
+        drained = true;
+    }
+    jitter_depth_ = jitter_buffer_.size();
+
+    if (drained) {
+        std::lock_guard<std::mutex> lock(jitter_stats_mutex_);
+        jitter_stats_ = jitter_buffer_.stats();
+    }
+}
+
+// Plays the next chunk of a cached sound. No decoding is involved, so the first
+// chunk reaches the codec within one DMA period.
+void Application::OutputSound() {
+    const size_t chunk_samples = AUDIO_CODEC_DMA_FRAME_NUM * 4;
+    std::shared_ptr<const SoundPcm> pcm;
+    size_t offset;
+    size_t samples = 0;
+    {
+        std::lock_guard<std::mutex> lock(sound_mutex_);
+        pcm = sound_pcm_;
+        offset = sound_offset_;
+        if (pcm) {
+            samples = std::min(chunk_samples, pcm->count - offset);
+            sound_offset_ += samples;
         }
-        // Resample if the sample rate is different
-        if (opus_decoder_->sample_rate() != codec->output_sample_rate()) {
-            int target_size = output_resampler_.GetOutputSamples(pcm.size());
-            std::vector<int16_t> resampled(target_size);
-            output_resampler_.Process(pcm.data(), pcm.size(), resampled.data());
-            pcm = std::move(resampled);
+        if (!pcm || sound_offset_ >= pcm->count) {
+            sound_pcm_.reset();
+            sound_playing_ = false;
         }
-        codec->OutputData(pcm);
+    }
+    if (!sound_playing_) {
+        std::lock_guard<std::mutex> lock(audio_decode_cv_mutex_);
+        audio_decode_cv_.notify_all();
+    }
+    if (samples == 0) {
+        return;
+    }
+
+    busy_decoding_audio_ = true;
+    background_task_->Schedule([this, pcm = std::move(pcm), offset, samples]() {
+        if (!aborted_) {
+            playback_block_.assign(pcm->samples + offset, pcm->samples + offset + samples);
+            Board::GetInstance().GetAudioCodec()->OutputData(playback_block_);
+#ifdef CONFIG_USE_SERVER_AEC
+            std::lock_guard<std::mutex> lock(timestamp_mutex_);
+            timestamp_queue_.push_back(0);
+#endif
+            last_output_time_ = std::chrono::steady_clock::now();
+        }
+        busy_decoding_audio_ = false;
+    }, kBackgroundTaskPriorityPlayback);
+}
+
+// Runs on the playback lane of the background task, one packet at a time
+void Application::DecodeAndOutput(AudioStreamPacket& packet, bool flush, bool discard_pending) {
+    auto codec = Board::GetInstance().GetAudioCodec();
+    if (discard_pending) {
+        playback_pcm_.clear();
+    }
+
+    // An empty payload makes the decoder run packet loss concealment
+    bool decoded = opus_decoder_->Decode(std::move(packet.payload), decode_pcm_);
+    RecyclePayload(std::move(packet.payload));
+    if (!decoded) {
+        return;
+    }
+    // Resample if the sample rate is different
+    if (output_resampler_ != nullptr) {
+        size_t offset = playback_pcm_.size();
+        playback_pcm_.resize(offset + output_resampler_->GetOutputSamples(decode_pcm_.size()));
+        output_resampler_->Process(decode_pcm_.data(), decode_pcm_.size(), playback_pcm_.data() + offset);
+    } else {
+        playback_pcm_.insert(playback_pcm_.end(), decode_pcm_.begin(), decode_pcm_.end());
+    }
+
+    // Feed the codec in whole DMA blocks so every write fills the I2S buffers evenly
+    const size_t block_samples = AUDIO_CODEC_DMA_FRAME_NUM;
+    size_t written = 0;
+    while (playback_pcm_.size() - written >= block_samples) {
+        playback_block_.assign(playback_pcm_.begin() + written, playback_pcm_.begin() + written + block_samples);
+        codec->OutputData(playback_block_);
+        written += block_samples;
+        LatencyTrace::GetInstance().RecordFirst(kLatencyEventFirstAudioOutput);
+    }
+    if (flush && written < playback_pcm_.size()) {
+        playback_block_.assign(playback_pcm_.begin() + written, playback_pcm_.end());
+        codec->OutputData(playback_block_);
+        written = playback_pcm_.size();
+        LatencyTrace::GetInstance().RecordFirst(kLatencyEventFirstAudioOutput);
+    }
+    playback_pcm_.erase(playback_pcm_.begin(), playback_pcm_.begin() + written);
+
 #ifdef CONFIG_USE_SERVER_AEC
+    {
         std::lock_guard<std::mutex> lock(timestamp_mutex_);
         timestamp_queue_.push_back(packet.timestamp);
+    }
 #endif
-        last_output_time_ = std::chrono::steady_clock::now();
-    });
+    last_output_time_ = std::chrono::steady_clock::now();
+}
+
+JitterBufferStats Application::GetJitterStats() {
+    std::lock_guard<std::mutex> lock(jitter_stats_mutex_);
+    return jitter_stats_;
+}
+
+// Called from the audio processor task for every fetched chunk. Chunks are only
+// accumulated here; one background job encodes all whole frames available.
+void Application::QueueEncodePcm(std::vector<int16_t>&& data) {
+    bool schedule = false;
+    {
+        std::lock_guard<std::mutex> lock(encode_mutex_);
+        size_t ring_size = encode_ring_.size();
+        // More than the ring holds: the older samples would be overwritten anyway, skip them
+        const int16_t* samples = data.data();
+        size_t count = data.size();
+        if (count > ring_size) {
+            samples += count - ring_size;
+            encode_write_ += count - ring_size;
+            count = ring_size;
+        }
+        size_t offset = encode_write_ % ring_size;
+        size_t first = std::min(count, ring_size - offset);
+        memcpy(encode_ring_.data() + offset, samples, first * sizeof(int16_t));
+        memcpy(encode_ring_.data(), samples + first, (count - first) * sizeof(int16_t));
+        encode_write_ += count;
+
+        // Keep the backlog bounded if the encoder cannot keep up
+        while (encode_write_ - encode_read_ > ring_size) {
+            ESP_LOGW(TAG, "Encoder is falling behind, drop the oldest frame");
+            encode_read_ += ENCODE_FRAME_SAMPLES;
+            encode_stats_.dropped_frames++;
+        }
+
+        if (!encode_scheduled_ && encode_write_ - encode_read_ >= ENCODE_FRAME_SAMPLES) {
+            encode_scheduled_ = true;
+            schedule = true;
+        }
+    }
+
+    // Schedule() blocks while the background lane is full, and the encode running
+    // there takes encode_mutex_ for every frame, so it must not be called under it
+    if (schedule) {
+        background_task_->Schedule([this]() {
+            EncodePendingPcm();
+        });
+    }
+}
+
+// Copies the oldest whole frame out of the encode ring, false if there is none
+bool Application::PopEncodeFrame() {
+    std::lock_guard<std::mutex> lock(encode_mutex_);
+    if (encode_write_ - encode_read_ < ENCODE_FRAME_SAMPLES) {
+        return false;
+    }
+    size_t ring_size = encode_ring_.size();
+    size_t offset = encode_read_ % ring_size;
+    size_t first = std::min<size_t>(ENCODE_FRAME_SAMPLES, ring_size - offset);
+    memcpy(encode_frame_.data(), encode_ring_.data() + offset, first * sizeof(int16_t));
+    memcpy(encode_frame_.data() + first, encode_ring_.data(), (ENCODE_FRAME_SAMPLES - first) * sizeof(int16_t));
+    encode_read_ += ENCODE_FRAME_SAMPLES;
+    return true;
+}
+
+void Application::EncodePendingPcm() {
+    {
+        std::lock_guard<std::mutex> lock(encode_mutex_);
+        encode_scheduled_ = false;
+        if (encode_write_ - encode_read_ < ENCODE_FRAME_SAMPLES) {
+            return;
+        }
+    }
+
+    // Settings chosen by the controller are applied here, so they never race an Encode()
+    EncoderSettings settings;
+    bool apply_settings = false;
+    {
+        std::lock_guard<std::mutex> lock(encode_mutex_);
+        if (encoder_settings_changed_) {
+            encoder_settings_changed_ = false;
+            settings = encoder_controller_.settings();
+            apply_settings = true;
+        }
+    }
+    if (apply_settings) {
+        opus_encoder_->SetComplexity(settings.complexity);
+        opus_encoder_->SetDtx(settings.dtx);
+    }
+
+    auto start_time = esp_timer_get_time();
+    uint32_t encoded = 0;
+    // Frames are encoded one by one from the reused frame buffer, this Encode() overload
+    // only reads it
+    while (PopEncodeFrame()) {
+        AudioStreamPacket packet;
+        if (!opus_encoder_->Encode(std::move(encode_frame_), packet.payload)) {
+            continue;
+        }
+        encoded++;
+#ifdef CONFIG_USE_SERVER_AEC
+        {
+            std::lock_guard<std::mutex> lock(timestamp_mutex_);
+            if (!timestamp_queue_.empty()) {
+                packet.timestamp = timestamp_queue_.front();
+                timestamp_queue_.pop_front();
+            } else {
+                packet.timestamp = 0;
+            }
+
+            if (timestamp_queue_.size() > 3) { // 限制队列长度3
+                timestamp_queue_.pop_front(); // 该包发送前先出队保持队列长度
+                continue;
+            }
+        }
+#endif
+        size_t depth;
+        bool dropped = false;
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            size_t limit = preroll_ ? std::max(MAX_AUDIO_PACKETS_IN_QUEUE, PREROLL_MAX_PACKETS) : MAX_AUDIO_PACKETS_IN_QUEUE;
+            if (audio_send_queue_.size() >= limit) {
+                ESP_LOGW(TAG, "Too many audio packets in queue, drop the oldest packet");
+                audio_send_queue_.pop_front();
+                dropped = true;
+            }
+            audio_send_queue_.emplace_back(std::move(packet));
+            depth = audio_send_queue_.size();
+        }
+        xEventGroupSetBits(event_group_, SEND_AUDIO_EVENT);
+
+        std::lock_guard<std::mutex> lock(encode_mutex_);
+        if (dropped) {
+            encode_stats_.queue_dropped_packets++;
+        }
+        encode_stats_.send_queue_depth = depth;
+        encode_stats_.max_send_queue_depth = std::max(encode_stats_.max_send_queue_depth, depth);
+    }
+
+    if (encoded > 0) {
+        auto per_frame_us = (esp_timer_get_time() - start_time) / encoded;
+        std::lock_guard<std::mutex> lock(encode_mutex_);
+        encode_stats_.frames += encoded;
+        encode_stats_.total_encode_us += per_frame_us * encoded;
+        encode_stats_.max_encode_us = std::max(encode_stats_.max_encode_us, per_frame_us);
+    }
+}
+
+void Application::ResetEncodeQueue() {
+    std::lock_guard<std::mutex> lock(encode_mutex_);
+    encode_read_ = encode_write_;
+}
+
+// Runs the audio processor from the wake word on, so nothing said while the
+// channel connects is lost. The packets wait in audio_send_queue_.
+void Application::StartPreroll() {
+    if (PREROLL_MAX_PACKETS == 0 || audio_processor_->IsRunning()) {
+        return;
+    }
+    ResetEncodeQueue();
+    opus_encoder_->ResetState();
+    preroll_ = true;
+    audio_processor_->Start();
+}
+
+void Application::StopPreroll() {
+    audio_processor_->Stop();
+    background_task_->WaitForCompletion();
+    ResetEncodeQueue();
+    std::lock_guard<std::mutex> lock(mutex_);
+    audio_send_queue_.clear();
+    preroll_ = false;
+}
+
+AudioEncodeStats Application::GetEncodeStats() {
+    std::lock_guard<std::mutex> lock(encode_mutex_);
+    return encode_stats_;
+}
+
+// Feeds the encoder controller with what happened since the previous call
+void Application::UpdateEncoderController() {
+    std::lock_guard<std::mutex> lock(encode_mutex_);
+    auto& last = controller_stats_;
+    EncoderTelemetry telemetry;
+    telemetry.frames = encode_stats_.frames - last.frames;
+    telemetry.encode_us = encode_stats_.total_encode_us - last.total_encode_us;
+    telemetry.encoder_dropped_frames = encode_stats_.dropped_frames - last.dropped_frames;
+    telemetry.queue_dropped_packets = encode_stats_.queue_dropped_packets - last.queue_dropped_packets;
+    telemetry.send_failures = encode_stats_.send_failures - last.send_failures;
+    telemetry.send_queue_depth = encode_stats_.send_queue_depth;
+    telemetry.signal_quality = signal_quality_;
+    last = encode_stats_;
+
+    if (encoder_controller_.Update(telemetry)) {
+        encoder_settings_changed_ = true;
+    }
+}
+
+EncoderControllerStatus Application::GetEncoderStatus() {
+    std::lock_guard<std::mutex> lock(encode_mutex_);
+    return encoder_controller_.status();
+}
+
+std::string Application::GetEncoderStatusJson() {
+    auto status = GetEncoderStatus();
+    auto stats = GetEncodeStats();
+    JsonWriter json(512);
+    json.BeginObject();
+    json.Field("complexity", status.settings.complexity);
+    json.Field("max_complexity", status.max_complexity);
+    json.Field("dtx", status.settings.dtx);
+    json.Field("frame_duration", OPUS_FRAME_DURATION_MS);
+    json.Field("cpu_load", status.cpu_load);
+    json.Field("link_congested", status.link_congested);
+    json.Field("signal_quality", signal_quality_);
+    json.Field("changes", (int)status.changes);
+    json.Field("reason", status.reason);
+    json.Key("totals").BeginObject();
+    json.Field("frames", (int)stats.frames);
+    json.Field("encoder_dropped_frames", (int)stats.dropped_frames);
+    json.Field("queue_dropped_packets", (int)stats.queue_dropped_packets);
+    json.Field("send_failures", (int)stats.send_failures);
+    json.EndObject();
+    if (background_task_ != nullptr) {
+        // Decode and encode share the background task, a deep or slow lane shows up here first
+        static const char* const lane_names[] = { "playback", "bulk" };
+        json.Key("background_lanes").BeginArray();
+        for (int i = 0; i < kBackgroundTaskPriorityCount; i++) {
+            auto lane = background_task_->GetLaneStats(static_cast<BackgroundTaskPriority>(i));
+            json.BeginObject();
+            json.Field("lane", lane_names[i]);
+            json.Field("executed", (int)lane.executed);
+            json.Field("dropped", (int)lane.dropped);
+            json.Field("depth", (int)lane.depth);
+            json.Field("max_depth", (int)lane.max_depth);
+            json.Field("avg_wait_us", lane.executed > 0 ? (int)(lane.total_wait_us / lane.executed) : 0);
+            json.Field("max_wait_us", (int)lane.max_wait_us);
+            json.EndObject();
+        }
+        json.EndArray();
+    }
+    json.EndObject();
+    return json.str();
 }
 
 void Application::OnAudioInput() {
     if (wake_word_->IsDetectionRunning()) {
-        std::vector<int16_t> data;
         int samples = wake_word_->GetFeedSize();
         if (samples > 0) {
-            if (ReadAudio(data, 16000, samples)) {
-                wake_word_->Feed(data);
+            if (ReadAudio(capture_buffer_, 16000, samples)) {
+                wake_word_->Feed(capture_buffer_);
                 return;
             }
         }
     }
     if (audio_processor_->IsRunning()) {
-        std::vector<int16_t> data;
         int samples = audio_processor_->GetFeedSize();
         if (samples > 0) {
-            if (ReadAudio(data, 16000, samples)) {
-                audio_processor_->Feed(data);
+            if (ReadAudio(capture_buffer_, 16000, samples)) {
+                audio_processor_->Feed(capture_buffer_);
                 return;
             }
         }
@@ -846,25 +1304,26 @@ bool Application::ReadAudio(std::vector<int16_t>& data, int sample_rate, int sam
             return false;
         }
         if (codec->input_channels() == 2) {
-            auto mic_channel = std::vector<int16_t>(data.size() / 2);
-            auto reference_channel = std::vector<int16_t>(data.size() / 2);
-            for (size_t i = 0, j = 0; i < mic_channel.size(); ++i, j += 2) {
-                mic_channel[i] = data[j];
-                reference_channel[i] = data[j + 1];
+            // resize() stays within the capacity reserved in Start(), so no allocation happens here
+            capture_mic_.resize(data.size() / 2);
+            capture_reference_.resize(data.size() / 2);
+            for (size_t i = 0, j = 0; i < capture_mic_.size(); ++i, j += 2) {
+                capture_mic_[i] = data[j];
+                capture_reference_[i] = data[j + 1];
             }
-            auto resampled_mic = std::vector<int16_t>(input_resampler_.GetOutputSamples(mic_channel.size()));
-            auto resampled_reference = std::vector<int16_t>(reference_resampler_.GetOutputSamples(reference_channel.size()));
-            input_resampler_.Process(mic_channel.data(), mic_channel.size(), resampled_mic.data());
-            reference_resampler_.Process(reference_channel.data(), reference_channel.size(), resampled_reference.data());
-            data.resize(resampled_mic.size() + resampled_reference.size());
-            for (size_t i = 0, j = 0; i < resampled_mic.size(); ++i, j += 2) {
-                data[j] = resampled_mic[i];
-                data[j + 1] = resampled_reference[i];
+            capture_resampled_mic_.resize(input_resampler_.GetOutputSamples(capture_mic_.size()));
+            capture_resampled_reference_.resize(reference_resampler_.GetOutputSamples(capture_reference_.size()));
+            input_resampler_.Process(capture_mic_.data(), capture_mic_.size(), capture_resampled_mic_.data());
+            reference_resampler_.Process(capture_reference_.data(), capture_reference_.size(), capture_resampled_reference_.data());
+            data.resize(capture_resampled_mic_.size() + capture_resampled_reference_.size());
+            for (size_t i = 0, j = 0; i < capture_resampled_mic_.size(); ++i, j += 2) {
+                data[j] = capture_resampled_mic_[i];
+                data[j + 1] = capture_resampled_reference_[i];
             }
         } else {
-            auto resampled = std::vector<int16_t>(input_resampler_.GetOutputSamples(data.size()));
-            input_resampler_.Process(data.data(), data.size(), resampled.data());
-            data = std::move(resampled);
+            capture_resampled_mic_.resize(input_resampler_.GetOutputSamples(data.size()));
+            input_resampler_.Process(data.data(), data.size(), capture_resampled_mic_.data());
+            data.assign(capture_resampled_mic_.begin(), capture_resampled_mic_.end());
         }
     } else {
         data.resize(samples);
@@ -895,6 +1354,16 @@ void Application::SetDeviceState(DeviceState state) {
     auto previous_state = device_state_;
     device_state_ = state;
     ESP_LOGI(TAG, "STATE: %s", STATE_STRINGS[device_state_]);
+    auto& trace = LatencyTrace::GetInstance();
+    trace.Record(kLatencyEventStateChange, state);
+    if (state == kDeviceStateListening) {
+        trace.Record(kLatencyEventListening);
+        // Split by how the channel was opened, to compare keep-warm with a fresh connection
+        if (previous_state == kDeviceStateConnecting) {
+            trace.Record(protocol_->audio_channel_reused() ? kLatencyEventListeningWarm : kLatencyEventListeningConnected);
+        }
+        trace.Arm(kLatencyEventFirstAudioSent);
+    }
     // The state is changed, wait for all background tasks to finish
     background_task_->WaitForCompletion();
 
@@ -925,17 +1394,22 @@ void Application::SetDeviceState(DeviceState state) {
 #endif
 
             // Make sure the audio processor is running
-            if (!audio_processor_->IsRunning()) {
+            if (!audio_processor_->IsRunning() || preroll_) {
                 // Send the start listening command
                 protocol_->SendStartListening(listening_mode_);
                 if (previous_state == kDeviceStateSpeaking) {
-                    audio_decode_queue_.clear();
-                    audio_decode_cv_.notify_all();
+                    ClearDecodeQueue();
                     // FIXME: Wait for the speaker to empty the buffer
                     vTaskDelay(pdMS_TO_TICKS(120));
                 }
-                opus_encoder_->ResetState();
-                audio_processor_->Start();
+                if (preroll_) {
+                    // Already capturing since the wake word, send what was said meanwhile
+                    xEventGroupSetBits(event_group_, SEND_AUDIO_EVENT);
+                } else {
+                    ResetEncodeQueue();
+                    opus_encoder_->ResetState();
+                    audio_processor_->Start();
+                }
                 wake_word_->StopDetection();
             }
             break;
@@ -960,28 +1434,107 @@ void Application::SetDeviceState(DeviceState state) {
 }
 
 void Application::ResetDecoder() {
-    std::lock_guard<std::mutex> lock(mutex_);
     opus_decoder_->ResetState();
-    audio_decode_queue_.clear();
-    audio_decode_cv_.notify_all();
+    ClearDecodeQueue();
     last_output_time_ = std::chrono::steady_clock::now();
     auto codec = Board::GetInstance().GetAudioCodec();
     codec->EnableOutput(true);
 }
 
-void Application::SetDecodeSampleRate(int sample_rate, int frame_duration) {
-    if (opus_decoder_->sample_rate() == sample_rate && opus_decoder_->duration_ms() == frame_duration) {
+bool Application::PushDecodePacket(AudioStreamPacket&& packet) {
+    std::lock_guard<std::mutex> lock(audio_decode_push_mutex_);
+    auto slot = audio_decode_queue_.BeginPush();
+    if (slot == nullptr) {
+        return false;
+    }
+    slot->sample_rate = packet.sample_rate;
+    slot->frame_duration = packet.frame_duration;
+    slot->timestamp = packet.timestamp;
+    // Swap so the slot hands its old buffer back to the caller instead of freeing it here
+    slot->payload.swap(packet.payload);
+    audio_decode_queue_.CommitPush();
+    if (packet.payload.capacity() == 0 && !free_payloads_.empty()) {
+        packet.payload.swap(free_payloads_.back());
+        free_payloads_.pop_back();
+    }
+    return true;
+}
+
+// Keeps decoded payload buffers for the producers, so receiving a packet does not allocate
+void Application::RecyclePayload(std::vector<uint8_t>&& payload) {
+    if (payload.capacity() == 0) {
         return;
     }
+    std::lock_guard<std::mutex> lock(audio_decode_push_mutex_);
+    if (free_payloads_.size() < free_payloads_.capacity()) {
+        payload.clear();
+        free_payloads_.push_back(std::move(payload));
+    }
+}
 
-    opus_decoder_.reset();
-    opus_decoder_ = std::make_unique<OpusDecoderWrapper>(sample_rate, 1, frame_duration);
+void Application::ClearDecodeQueue() {
+    audio_decode_queue_.Clear();
+    jitter_reset_pending_ = true;
+    {
+        std::lock_guard<std::mutex> lock(sound_mutex_);
+        sound_pcm_.reset();
+        sound_playing_ = false;
+    }
+    std::lock_guard<std::mutex> lock(audio_decode_cv_mutex_);
+    audio_decode_cv_.notify_all();
+}
+
+void Application::WaitForDecodeQueue(size_t max_pending) {
+    std::unique_lock<std::mutex> lock(audio_decode_cv_mutex_);
+    // The audio loop only signals when the queue drains, so poll once per frame for partial drains
+    while (audio_decode_queue_.size() + jitter_depth_ + (sound_playing_ ? 1 : 0) > max_pending) {
+        audio_decode_cv_.wait_for(lock, std::chrono::milliseconds(OPUS_FRAME_DURATION_MS));
+    }
+}
+
+void Application::SetDecodeSampleRate(int sample_rate, int frame_duration) {
+    if (opus_decoder_ != nullptr && opus_decoder_->sample_rate() == sample_rate && opus_decoder_->duration_ms() == frame_duration) {
+        return;
+    }
 
     auto codec = Board::GetInstance().GetAudioCodec();
-    if (opus_decoder_->sample_rate() != codec->output_sample_rate()) {
-        ESP_LOGI(TAG, "Resampling audio from %d to %d", opus_decoder_->sample_rate(), codec->output_sample_rate());
-        output_resampler_.Configure(opus_decoder_->sample_rate(), codec->output_sample_rate());
+    DecoderCacheEntry* entry = nullptr;
+    for (auto& cached : decoder_cache_) {
+        if (cached.decoder && cached.sample_rate == sample_rate && cached.frame_duration == frame_duration) {
+            entry = &cached;
+            break;
+        }
+    }
+
+    if (entry != nullptr) {
+        // The cached decoder still holds the state of an earlier stream
+        entry->decoder->ResetState();
+    } else {
+        // Replace the least recently used entry, empty entries come first
+        entry = std::min_element(std::begin(decoder_cache_), std::end(decoder_cache_),
+            [](const DecoderCacheEntry& a, const DecoderCacheEntry& b) { return a.last_used < b.last_used; });
+        ESP_LOGI(TAG, "Create decoder for %d Hz, %d ms", sample_rate, frame_duration);
+        entry->decoder.reset();
+        entry->decoder = std::make_unique<OpusDecoderWrapper>(sample_rate, 1, frame_duration);
+        entry->sample_rate = sample_rate;
+        entry->frame_duration = frame_duration;
+        if (sample_rate != codec->output_sample_rate()) {
+            if (!entry->resampler) {
+                entry->resampler = std::make_unique<OpusResampler>();
+            }
+        } else {
+            entry->resampler.reset();
+        }
     }
+
+    if (entry->resampler) {
+        // Configure only resets the filter state, it does not allocate
+        ESP_LOGI(TAG, "Resampling audio from %d to %d", sample_rate, codec->output_sample_rate());
+        entry->resampler->Configure(sample_rate, codec->output_sample_rate());
+    }
+    entry->last_used = ++decoder_cache_clock_;
+    opus_decoder_ = entry->decoder.get();
+    output_resampler_ = entry->resampler.get();
 }
 
 void Application::UpdateIotStates() {
@@ -1033,11 +1586,14 @@ bool Application::CanEnterSleepMode() {
     return true;
 }
 
-void Application::SendMcpMessage(const std::string& payload) {
-    Schedule([this, payload]() {
+void Application::SendMcpMessage(const std::string& payload, std::function<void()> on_sent) {
+    Schedule([this, payload, on_sent]() {
         if (protocol_) {
             protocol_->SendMcpMessage(payload);
         }
+        if (on_sent) {
+            on_sent();
+        }
     });
 }
 
@@ -12,6 +12,7 @@
 #include <vector>
 #include <condition_variable>
 #include <memory>
+#include <atomic>
 
 #include <opus_encoder.h>
 #include <opus_decoder.h>
@@ -22,6 +23,10 @@
 #include "background_task.h"
 #include "audio_processor.h"
 #include "wake_word.h"
+#include "spsc_ring.h"
+#include "jitter_buffer.h"
+#include "sound_cache.h"
+#include "encoder_controller.h"
 
 #define SCHEDULE_EVENT (1 << 0)
 #define SEND_AUDIO_EVENT (1 << 1)
@@ -48,6 +53,37 @@ enum DeviceState {
 
 #define OPUS_FRAME_DURATION_MS 60
 #define MAX_AUDIO_PACKETS_IN_QUEUE (2400 / OPUS_FRAME_DURATION_MS)
+#define ENCODE_FRAME_SAMPLES (16000 / 1000 * OPUS_FRAME_DURATION_MS)
+// Audio captured after a wake word while the channel connects, held back until listening starts
+#define PREROLL_MAX_PACKETS (CONFIG_UPLINK_PREROLL_MS / OPUS_FRAME_DURATION_MS)
+
+// Playout depth of the jitter buffer, the target adapts between min and max
+#define JITTER_BUFFER_MIN_DEPTH_MS 60
+#define JITTER_BUFFER_TARGET_DEPTH_MS 120
+#define JITTER_BUFFER_MAX_DEPTH_MS 480
+
+// Decoders kept alive per (sample_rate, frame_duration), enough for system sounds plus server TTS
+#define DECODER_CACHE_SIZE 2
+
+struct AudioEncodeStats {
+    uint32_t frames = 0;
+    uint32_t dropped_frames = 0;
+    int64_t total_encode_us = 0;
+    int64_t max_encode_us = 0;
+    size_t send_queue_depth = 0;
+    size_t max_send_queue_depth = 0;
+    uint32_t queue_dropped_packets = 0;
+    uint32_t send_failures = 0;
+};
+
+struct DecoderCacheEntry {
+    int sample_rate = 0;
+    int frame_duration = 0;
+    uint32_t last_used = 0;
+    std::unique_ptr<OpusDecoderWrapper> decoder;
+    // Only created when sample_rate differs from the codec output rate
+    std::unique_ptr<OpusResampler> resampler;
+};
 
 class Application {
 public:
@@ -75,10 +111,15 @@ public:
     void WakeWordInvoke(const std::string& wake_word);
     void PlaySound(const std::string_view& sound);
     bool CanEnterSleepMode();
-    void SendMcpMessage(const std::string& payload);
+    // on_sent runs on the main loop once the payload is handed to the protocol
+    void SendMcpMessage(const std::string& payload, std::function<void()> on_sent = nullptr);
     void SetAecMode(AecMode mode);
     AecMode GetAecMode() const { return aec_mode_; }
     BackgroundTask* GetBackgroundTask() const { return background_task_; }
+    AudioEncodeStats GetEncodeStats();
+    EncoderControllerStatus GetEncoderStatus();
+    std::string GetEncoderStatusJson();
+    JitterBufferStats GetJitterStats();
 
 private:
     Application();
@@ -100,6 +141,7 @@ private:
     bool voice_detected_ = false;
     bool busy_decoding_audio_ = false;
     int clock_ticks_ = 0;
+    uint32_t latency_samples_logged_ = 0;
     TaskHandle_t check_new_version_task_handle_ = nullptr;
 
     // Audio encode / decode
@@ -107,25 +149,92 @@ private:
     BackgroundTask* background_task_ = nullptr;
     std::chrono::steady_clock::time_point last_output_time_;
     std::list<AudioStreamPacket> audio_send_queue_;
-    std::list<AudioStreamPacket> audio_decode_queue_;
+    // Set from wake word detection until the backlog is flushed after the listen start
+    std::atomic<bool> preroll_ = false;
+    // Incoming packets waiting to be decoded, consumed only by the audio loop
+    SpscRing<AudioStreamPacket, MAX_AUDIO_PACKETS_IN_QUEUE> audio_decode_queue_;
+    // Serializes producers (network callbacks, PlaySound), never taken by the audio loop
+    std::mutex audio_decode_push_mutex_;
+    // Payload buffers returned by the decode job, handed back to producers by PushDecodePacket()
+    std::vector<std::vector<uint8_t>> free_payloads_;
+    // Only used to wake PlaySound() when the decode queue drains
+    std::mutex audio_decode_cv_mutex_;
     std::condition_variable audio_decode_cv_;
+    // Reorders and paces packets drained from audio_decode_queue_, owned by the audio loop
+    JitterBuffer jitter_buffer_{MAX_AUDIO_PACKETS_IN_QUEUE, JITTER_BUFFER_MIN_DEPTH_MS,
+        JITTER_BUFFER_TARGET_DEPTH_MS, JITTER_BUFFER_MAX_DEPTH_MS};
+    std::atomic<bool> jitter_reset_pending_ = false;
+    std::atomic<size_t> jitter_depth_ = 0;
+    bool discard_pending_pcm_ = false;
+    std::mutex jitter_stats_mutex_;
+    JitterBufferStats jitter_stats_;
+    // Built-in sounds decoded ahead of time, played by the audio loop without going through the decoder
+    std::unique_ptr<SoundCache> sound_cache_;
+    std::mutex sound_mutex_;
+    std::shared_ptr<const SoundPcm> sound_pcm_;
+    size_t sound_offset_ = 0;
+    std::atomic<bool> sound_playing_ = false;
+    // Owned by the playback job: decoded PCM and the samples not yet written in a whole DMA block
+    std::vector<int16_t> decode_pcm_;
+    std::vector<int16_t> playback_pcm_;
+    std::vector<int16_t> playback_block_;
 
     // 新增：用于维护音频包的timestamp队列
     std::list<uint32_t> timestamp_queue_;
     std::mutex timestamp_mutex_;
 
+    // Uplink encode stage: processed PCM accumulates here and is encoded in whole frames.
+    // A fixed ring indexed by free running sample counts, the oldest frame is dropped when full
+    std::mutex encode_mutex_;
+    std::vector<int16_t> encode_ring_;
+    size_t encode_read_ = 0;
+    size_t encode_write_ = 0;
+    // Only used by the encode job
+    std::vector<int16_t> encode_frame_;
+    bool encode_scheduled_ = false;
+    AudioEncodeStats encode_stats_;
+    // Adapts the encoder to the link and the CPU once a second while listening, applied by the encode job
+    EncoderController encoder_controller_{OPUS_FRAME_DURATION_MS, 0, 0};
+    AudioEncodeStats controller_stats_;
+    bool encoder_settings_changed_ = false;
+    std::atomic<int> signal_quality_ = -1;
+
     std::unique_ptr<OpusEncoderWrapper> opus_encoder_;
-    std::unique_ptr<OpusDecoderWrapper> opus_decoder_;
+    DecoderCacheEntry decoder_cache_[DECODER_CACHE_SIZE];
+    uint32_t decoder_cache_clock_ = 0;
+    // The active entry of decoder_cache_, switched by SetDecodeSampleRate()
+    OpusDecoderWrapper* opus_decoder_ = nullptr;
+    OpusResampler* output_resampler_ = nullptr;
 
     OpusResampler input_resampler_;
     OpusResampler reference_resampler_;
-    OpusResampler output_resampler_;
+
+    // Capture scratch buffers, reserved in Start() so ReadAudio() does not allocate per frame
+    std::vector<int16_t> capture_buffer_;
+    std::vector<int16_t> capture_mic_;
+    std::vector<int16_t> capture_reference_;
+    std::vector<int16_t> capture_resampled_mic_;
+    std::vector<int16_t> capture_resampled_reference_;
 
     void MainEventLoop();
     void OnAudioInput();
     void OnAudioOutput();
+    void DrainDecodeQueue();
+    void OutputSound();
+    void DecodeAndOutput(AudioStreamPacket& packet, bool flush, bool discard_pending);
+    void QueueEncodePcm(std::vector<int16_t>&& data);
+    void EncodePendingPcm();
+    bool PopEncodeFrame();
+    void ResetEncodeQueue();
+    void StartPreroll();
+    void StopPreroll();
+    void UpdateEncoderController();
     bool ReadAudio(std::vector<int16_t>& data, int sample_rate, int samples);
     void ResetDecoder();
+    bool PushDecodePacket(AudioStreamPacket&& packet);
+    void RecyclePayload(std::vector<uint8_t>&& payload);
+    void ClearDecodeQueue();
+    void WaitForDecodeQueue(size_t max_pending);
     void SetDecodeSampleRate(int sample_rate, int frame_duration);
     void CheckNewVersion();
     void ShowActivationCode();
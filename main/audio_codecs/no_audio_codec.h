@@ -6,8 +6,16 @@
 #include <driver/gpio.h>
 #include <driver/i2s_pdm.h>
 
+#include <vector>
+
 class NoAudioCodec : public AudioCodec {
 private:
+    // I2S staging buffers, grown on demand and reused so Read()/Write() do not allocate per call
+    std::vector<int32_t> write_buffer_;
+    std::vector<int32_t> read_buffer_;
+    int volume_factor_volume_ = -1;
+    int32_t volume_factor_ = 0;
+
     virtual int Write(const int16_t* data, int samples) override;
     virtual int Read(int16_t* dest, int samples) override;
 
@@ -0,0 +1,79 @@
+#ifndef _PCM_CONVERT_H
+#define _PCM_CONVERT_H
+
+#include <cstddef>
+#include <cstdint>
+#include <algorithm>
+
+#ifdef ESP_PLATFORM
+#include <sdkconfig.h>
+#endif
+
+/*
+ * Sample format kernels for 32-bit I2S slots.
+ *
+ * The loops are unrolled by four and branch free, which lets the compiler keep
+ * everything in registers (and vectorize on targets with SIMD). They only
+ * depend on the standard library so they can be built and measured on a host.
+ *
+ * On the ESP32-S3 PcmInt32ToInt16() runs its aligned middle part on the PIE
+ * vector unit (pcm_convert_esp32s3.S), eight samples per iteration. PIE has no
+ * 32-bit lane multiply, so PcmInt16ToInt32Scaled() stays scalar there: the
+ * core's single cycle MULL already keeps up with the loads and stores.
+ */
+
+#if CONFIG_IDF_TARGET_ESP32S3
+#define PCM_CONVERT_PIE 1
+extern "C" void PcmInt32ToInt16Pie(const int32_t* src, int16_t* dst, size_t blocks, int shift);
+#endif
+
+// dst = src * gain_q16, where gain_q16 is in [0, 65536].
+// |src| <= 32768, so the product always fits in int32 and needs no saturation.
+inline void PcmInt16ToInt32Scaled(const int16_t* src, int32_t* dst, size_t samples, int32_t gain_q16) {
+    size_t i = 0;
+    for (; i + 4 <= samples; i += 4) {
+        int32_t s0 = src[i] * gain_q16;
+        int32_t s1 = src[i + 1] * gain_q16;
+        int32_t s2 = src[i + 2] * gain_q16;
+        int32_t s3 = src[i + 3] * gain_q16;
+        dst[i] = s0;
+        dst[i + 1] = s1;
+        dst[i + 2] = s2;
+        dst[i + 3] = s3;
+    }
+    for (; i < samples; i++) {
+        dst[i] = src[i] * gain_q16;
+    }
+}
+
+// dst = clamp(src >> shift, -INT16_MAX, INT16_MAX)
+inline void PcmInt32ToInt16(const int32_t* src, int16_t* dst, size_t samples, int shift) {
+    size_t i = 0;
+#if PCM_CONVERT_PIE
+    // Up to the first 16 byte aligned source sample, then whole vectors if the
+    // destination is word aligned there
+    for (; i < samples && (reinterpret_cast<uintptr_t>(src + i) & 15) != 0; i++) {
+        dst[i] = std::clamp<int32_t>(src[i] >> shift, -INT16_MAX, INT16_MAX);
+    }
+    size_t blocks = (samples - i) / 8;
+    if (blocks > 0 && (reinterpret_cast<uintptr_t>(dst + i) & 3) == 0) {
+        PcmInt32ToInt16Pie(src + i, dst + i, blocks, shift);
+        i += blocks * 8;
+    }
+#endif
+    for (; i + 4 <= samples; i += 4) {
+        int32_t s0 = std::clamp<int32_t>(src[i] >> shift, -INT16_MAX, INT16_MAX);
+        int32_t s1 = std::clamp<int32_t>(src[i + 1] >> shift, -INT16_MAX, INT16_MAX);
+        int32_t s2 = std::clamp<int32_t>(src[i + 2] >> shift, -INT16_MAX, INT16_MAX);
+        int32_t s3 = std::clamp<int32_t>(src[i + 3] >> shift, -INT16_MAX, INT16_MAX);
+        dst[i] = s0;
+        dst[i + 1] = s1;
+        dst[i + 2] = s2;
+        dst[i + 3] = s3;
+    }
+    for (; i < samples; i++) {
+        dst[i] = std::clamp<int32_t>(src[i] >> shift, -INT16_MAX, INT16_MAX);
+    }
+}
+
+#endif // _PCM_CONVERT_H
@@ -2,18 +2,19 @@
 #include "application.h"
 
 #include <esp_log.h>
+#include <esp_timer.h>
 #include <model_path.h>
 #include <arpa/inet.h>
 #include <sstream>
+#include <cstring>
+#include <algorithm>
 
 #define DETECTION_RUNNING_EVENT 1
 
 #define TAG "AfeWakeWord"
 
 AfeWakeWord::AfeWakeWord()
-    : afe_data_(nullptr),
-      wake_word_pcm_(),
-      wake_word_opus_() {
+    : afe_data_(nullptr) {
 
     event_group_ = xEventGroupCreate();
 }
@@ -26,6 +27,9 @@ AfeWakeWord::~AfeWakeWord() {
     if (wake_word_encode_task_stack_ != nullptr) {
         heap_caps_free(wake_word_encode_task_stack_);
     }
+    if (pcm_ring_ != nullptr) {
+        heap_caps_free(pcm_ring_);
+    }
 
     vEventGroupDelete(event_group_);
 }
@@ -71,6 +75,18 @@ void AfeWakeWord::Initialize(AudioCodec* codec) {
         this_->AudioDetectionTask();
         vTaskDelete(NULL);
     }, "audio_detection", 4096, this, 3, nullptr);
+
+    pcm_ring_size_ = 16000 * WAKE_WORD_HISTORY_MS / 1000;
+    pcm_ring_ = (int16_t*)heap_caps_malloc(pcm_ring_size_ * sizeof(int16_t), MALLOC_CAP_SPIRAM);
+    opus_ring_.resize(WAKE_WORD_HISTORY_MS / OPUS_FRAME_DURATION_MS);
+    wake_word_encoder_ = std::make_unique<OpusEncoderWrapper>(16000, 1, OPUS_FRAME_DURATION_MS);
+    wake_word_encoder_->SetComplexity(0); // 0 is the fastest
+    wake_word_encode_task_stack_ = (StackType_t*)heap_caps_malloc(4096 * 8, MALLOC_CAP_SPIRAM);
+    wake_word_encode_task_ = xTaskCreateStatic([](void* arg) {
+        auto this_ = (AfeWakeWord*)arg;
+        this_->WakeWordEncodeTask();
+        vTaskDelete(NULL);
+    }, "encode_detect_packets", 4096 * 8, this, 2, wake_word_encode_task_stack_, &wake_word_encode_task_buffer_);
 }
 
 void AfeWakeWord::OnWakeWordDetected(std::function<void(const std::string& wake_word)> callback) {
@@ -78,6 +94,17 @@ void AfeWakeWord::OnWakeWordDetected(std::function<void(const std::string& wake_
 }
 
 void AfeWakeWord::StartDetection() {
+    {
+        // Audio from before the detection stopped is stale
+        std::lock_guard<std::mutex> lock(wake_word_mutex_);
+        generation_++;
+        pcm_read_ = pcm_write_ = 0;
+        opus_read_ = opus_write_ = 0;
+        encoded_frames_ = 0;
+        encode_time_us_ = 0;
+        flush_requested_ = false;
+        flushed_ = false;
+    }
     xEventGroupSetBits(event_group_, DETECTION_RUNNING_EVENT);
 }
 
@@ -135,53 +162,100 @@ void AfeWakeWord::AudioDetectionTask() {
 }
 
 void AfeWakeWord::StoreWakeWordData(const int16_t* data, size_t samples) {
-    // store audio data to wake_word_pcm_
-    wake_word_pcm_.emplace_back(std::vector<int16_t>(data, data + samples));
-    // keep about 2 seconds of data, detect duration is 30ms (sample_rate == 16000, chunksize == 512)
-    while (wake_word_pcm_.size() > 2000 / 30) {
-        wake_word_pcm_.pop_front();
+    std::lock_guard<std::mutex> lock(wake_word_mutex_);
+    size_t offset = pcm_write_ % pcm_ring_size_;
+    size_t first = std::min(samples, pcm_ring_size_ - offset);
+    memcpy(pcm_ring_ + offset, data, first * sizeof(int16_t));
+    memcpy(pcm_ring_, data + first, (samples - first) * sizeof(int16_t));
+    pcm_write_ += samples;
+    if (pcm_write_ - pcm_read_ > pcm_ring_size_) {
+        // The encoder fell behind by the whole history, skip what was overwritten
+        pcm_read_ = pcm_write_ - pcm_ring_size_;
+    }
+    if (pcm_write_ - pcm_read_ >= ENCODE_FRAME_SAMPLES) {
+        wake_word_cv_.notify_all();
     }
 }
 
-void AfeWakeWord::EncodeWakeWordData() {
-    wake_word_opus_.clear();
-    if (wake_word_encode_task_stack_ == nullptr) {
-        wake_word_encode_task_stack_ = (StackType_t*)heap_caps_malloc(4096 * 8, MALLOC_CAP_SPIRAM);
-    }
-    wake_word_encode_task_ = xTaskCreateStatic([](void* arg) {
-        auto this_ = (AfeWakeWord*)arg;
+void AfeWakeWord::WakeWordEncodeTask() {
+    uint32_t encoder_generation = 0;
+    // Allocated once, the task runs for every frame while detection is on. The output
+    // buffers cycle through the opus ring and keep their capacity
+    encode_frame_.resize(ENCODE_FRAME_SAMPLES);
+    while (true) {
+        uint32_t generation;
         {
-            auto start_time = esp_timer_get_time();
-            auto encoder = std::make_unique<OpusEncoderWrapper>(16000, 1, OPUS_FRAME_DURATION_MS);
-            encoder->SetComplexity(0); // 0 is the fastest
-
-            for (auto& pcm: this_->wake_word_pcm_) {
-                encoder->Encode(std::move(pcm), [this_](std::vector<uint8_t>&& opus) {
-                    std::lock_guard<std::mutex> lock(this_->wake_word_mutex_);
-                    this_->wake_word_opus_.emplace_back(std::move(opus));
-                    this_->wake_word_cv_.notify_all();
-                });
+            std::unique_lock<std::mutex> lock(wake_word_mutex_);
+            wake_word_cv_.wait(lock, [this]() {
+                return pcm_write_ - pcm_read_ >= ENCODE_FRAME_SAMPLES || (flush_requested_ && !flushed_);
+            });
+            if (pcm_write_ - pcm_read_ < ENCODE_FRAME_SAMPLES) {
+                // Every whole frame is encoded, the partial one at the end is left out
+                flushed_ = true;
+                wake_word_cv_.notify_all();
+                continue;
             }
-            this_->wake_word_pcm_.clear();
+            size_t offset = pcm_read_ % pcm_ring_size_;
+            size_t first = std::min<size_t>(ENCODE_FRAME_SAMPLES, pcm_ring_size_ - offset);
+            memcpy(encode_frame_.data(), pcm_ring_ + offset, first * sizeof(int16_t));
+            memcpy(encode_frame_.data() + first, pcm_ring_, (ENCODE_FRAME_SAMPLES - first) * sizeof(int16_t));
+            pcm_read_ += ENCODE_FRAME_SAMPLES;
+            generation = generation_;
+        }
 
-            auto end_time = esp_timer_get_time();
-            ESP_LOGI(TAG, "Encode wake word opus %u packets in %lld ms",
-                this_->wake_word_opus_.size(), (end_time - start_time) / 1000);
+        if (generation != encoder_generation) {
+            encoder_generation = generation;
+            wake_word_encoder_->ResetState();
+        }
+        // This overload only reads the frame and copies the packet into the given buffer,
+        // so neither buffer is reallocated
+        int64_t start_time = esp_timer_get_time();
+        bool encoded = wake_word_encoder_->Encode(std::move(encode_frame_), encode_output_);
+        int64_t encode_time = esp_timer_get_time() - start_time;
 
-            std::lock_guard<std::mutex> lock(this_->wake_word_mutex_);
-            this_->wake_word_opus_.push_back(std::vector<uint8_t>());
-            this_->wake_word_cv_.notify_all();
+        std::lock_guard<std::mutex> lock(wake_word_mutex_);
+        if (!encoded || generation != generation_) {
+            continue;
         }
-        vTaskDelete(NULL);
-    }, "encode_detect_packets", 4096 * 8, this, 2, wake_word_encode_task_stack_, &wake_word_encode_task_buffer_);
+        encoded_frames_++;
+        encode_time_us_ += encode_time;
+        if (opus_write_ - opus_read_ == opus_ring_.size()) {
+            opus_read_++;
+        }
+        // The slot's old buffer comes back as the output buffer of the next frame
+        opus_ring_[opus_write_ % opus_ring_.size()].swap(encode_output_);
+        opus_write_++;
+        wake_word_cv_.notify_all();
+    }
+}
+
+void AfeWakeWord::EncodeWakeWordData() {
+    // Detection has stopped, so at most the last frame is still to be encoded
+    std::lock_guard<std::mutex> lock(wake_word_mutex_);
+    ESP_LOGI(TAG, "Wake word opus %u packets ready, %u samples pending",
+        opus_write_ - opus_read_, pcm_write_ - pcm_read_);
+    if (encoded_frames_ > 0) {
+        // What keeping the history encoded cost during this detection
+        int64_t average_us = encode_time_us_ / encoded_frames_;
+        ESP_LOGI(TAG, "Wake word encoder: %lu frames, %lld us per %d ms frame, %.1f%% of a core",
+            (unsigned long)encoded_frames_, average_us, OPUS_FRAME_DURATION_MS,
+            average_us / (OPUS_FRAME_DURATION_MS * 10.0));
+    }
+    flush_requested_ = true;
+    flushed_ = false;
+    wake_word_cv_.notify_all();
 }
 
 bool AfeWakeWord::GetWakeWordOpus(std::vector<uint8_t>& opus) {
     std::unique_lock<std::mutex> lock(wake_word_mutex_);
     wake_word_cv_.wait(lock, [this]() {
-        return !wake_word_opus_.empty();
+        return opus_write_ != opus_read_ || flushed_;
     });
-    opus.swap(wake_word_opus_.front());
-    wake_word_opus_.pop_front();
-    return !opus.empty();
+    if (opus_write_ == opus_read_) {
+        return false;
+    }
+    // The caller's buffer goes back into the ring for reuse
+    opus.swap(opus_ring_[opus_read_ % opus_ring_.size()]);
+    opus_read_++;
+    return true;
 }
@@ -8,9 +8,11 @@
 #include <esp_afe_sr_models.h>
 #include <esp_nsn_models.h>
 
-#include <list>
+#include <opus_encoder.h>
+
 #include <string>
 #include <vector>
+#include <memory>
 #include <functional>
 #include <mutex>
 #include <condition_variable>
@@ -18,6 +20,9 @@
 #include "audio_codec.h"
 #include "wake_word.h"
 
+// Audio before the detection that is sent to the server, e.g. for speaker recognition
+#define WAKE_WORD_HISTORY_MS 2000
+
 class AfeWakeWord : public WakeWord {
 public:
     AfeWakeWord();
@@ -44,16 +49,36 @@ private:
     AudioCodec* codec_ = nullptr;
     std::string last_detected_wake_word_;
 
+    // The history is encoded while detection runs, so it is ready when a wake word is detected
     TaskHandle_t wake_word_encode_task_ = nullptr;
     StaticTask_t wake_word_encode_task_buffer_;
     StackType_t* wake_word_encode_task_stack_ = nullptr;
-    std::list<std::vector<int16_t>> wake_word_pcm_;
-    std::list<std::vector<uint8_t>> wake_word_opus_;
+    std::unique_ptr<OpusEncoderWrapper> wake_word_encoder_;
+    // Only used by the encode task
+    std::vector<int16_t> encode_frame_;
+    std::vector<uint8_t> encode_output_;
+    // PCM waiting for the encoder, a contiguous ring in PSRAM indexed by free running sample counts
+    int16_t* pcm_ring_ = nullptr;
+    size_t pcm_ring_size_ = 0;
+    size_t pcm_read_ = 0;
+    size_t pcm_write_ = 0;
+    // Encoded history, the oldest packet is overwritten when full
+    std::vector<std::vector<uint8_t>> opus_ring_;
+    size_t opus_read_ = 0;
+    size_t opus_write_ = 0;
+    // Encoder time spent since detection started, logged when the history is flushed
+    uint32_t encoded_frames_ = 0;
+    int64_t encode_time_us_ = 0;
+    // Bumped by StartDetection(), packets of an older generation are discarded
+    uint32_t generation_ = 0;
+    bool flush_requested_ = false;
+    bool flushed_ = false;
     std::mutex wake_word_mutex_;
     std::condition_variable wake_word_cv_;
 
     void StoreWakeWordData(const int16_t* data, size_t size);
     void AudioDetectionTask();
+    void WakeWordEncodeTask();
 };
 
 #endif
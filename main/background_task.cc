@@ -2,10 +2,15 @@
 
 #include <esp_log.h>
 #include <esp_task_wdt.h>
+#include <esp_timer.h>
+#include <algorithm>
 
 #define TAG "BackgroundTask"
 
 BackgroundTask::BackgroundTask(uint32_t stack_size) {
+    lanes_[kBackgroundTaskPriorityPlayback].slots.resize(BACKGROUND_TASK_PLAYBACK_LANE_SIZE);
+    lanes_[kBackgroundTaskPriorityBulk].slots.resize(BACKGROUND_TASK_BULK_LANE_SIZE);
+
     xTaskCreate([](void* arg) {
         BackgroundTask* task = (BackgroundTask*)arg;
         task->BackgroundTaskLoop();
@@ -18,46 +23,84 @@ BackgroundTask::~BackgroundTask() {
     }
 }
 
-void BackgroundTask::Schedule(std::function<void()> callback) {
-    std::lock_guard<std::mutex> lock(mutex_);
-    if (active_tasks_ >= 30) {
-        int free_sram = heap_caps_get_free_size(MALLOC_CAP_INTERNAL);
-        if (free_sram < 10000) {
-            ESP_LOGW(TAG, "active_tasks_ == %u, free_sram == %u", active_tasks_.load(), free_sram);
-        }
-    }
-    active_tasks_++;
-    main_tasks_.emplace_back([this, cb = std::move(callback)]() {
-        cb();
-        {
-            std::lock_guard<std::mutex> lock(mutex_);
-            active_tasks_--;
-            if (main_tasks_.empty() && active_tasks_ == 0) {
-                condition_variable_.notify_all();
+bool BackgroundTask::Schedule(SmallTask&& callback, BackgroundTaskPriority priority) {
+    {
+        std::unique_lock<std::mutex> lock(mutex_);
+        auto& lane = lanes_[priority];
+        auto capacity = lane.slots.size();
+        if (lane.count == capacity) {
+            // Blocking on our own lane from inside a task would never return
+            if (xTaskGetCurrentTaskHandle() == background_task_handle_) {
+                lane.stats.dropped++;
+                ESP_LOGW(TAG, "Lane %d is full, drop the new task", priority);
+                return false;
             }
+            condition_variable_.wait(lock, [&lane, capacity]() {
+                return lane.count < capacity;
+            });
         }
-    });
+
+        auto& slot = lane.slots[(lane.head + lane.count) % capacity];
+        slot.task = std::move(callback);
+        slot.enqueue_time = esp_timer_get_time();
+        lane.count++;
+        pending_tasks_++;
+        lane.stats.max_depth = std::max(lane.stats.max_depth, lane.count);
+    }
     condition_variable_.notify_all();
+    return true;
 }
 
 void BackgroundTask::WaitForCompletion() {
     std::unique_lock<std::mutex> lock(mutex_);
     condition_variable_.wait(lock, [this]() {
-        return main_tasks_.empty() && active_tasks_ == 0;
+        return pending_tasks_ == 0 && !running_task_;
     });
 }
 
+BackgroundTaskLaneStats BackgroundTask::GetLaneStats(BackgroundTaskPriority priority) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto stats = lanes_[priority].stats;
+    stats.depth = lanes_[priority].count;
+    return stats;
+}
+
 void BackgroundTask::BackgroundTaskLoop() {
     ESP_LOGI(TAG, "background_task started");
     while (true) {
-        std::unique_lock<std::mutex> lock(mutex_);
-        condition_variable_.wait(lock, [this]() { return !main_tasks_.empty(); });
-        
-        std::list<std::function<void()>> tasks = std::move(main_tasks_);
-        lock.unlock();
+        SmallTask task;
+        {
+            std::unique_lock<std::mutex> lock(mutex_);
+            condition_variable_.wait(lock, [this]() { return pending_tasks_ > 0; });
+
+            // Always serve the highest priority lane first
+            for (auto& lane : lanes_) {
+                if (lane.count == 0) {
+                    continue;
+                }
+                auto& slot = lane.slots[lane.head];
+                auto wait_us = esp_timer_get_time() - slot.enqueue_time;
+                task = std::move(slot.task);
+                lane.head = (lane.head + 1) % lane.slots.size();
+                lane.count--;
+                lane.stats.executed++;
+                lane.stats.total_wait_us += wait_us;
+                lane.stats.max_wait_us = std::max(lane.stats.max_wait_us, wait_us);
+                break;
+            }
+            pending_tasks_--;
+            running_task_ = true;
+        }
+        // A slot was freed, wake up any producer blocked on a full lane
+        condition_variable_.notify_all();
+
+        task();
+        task.Reset();
 
-        for (auto& task : tasks) {
-            task();
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            running_task_ = false;
         }
+        condition_variable_.notify_all();
     }
 }
@@ -4,24 +4,153 @@
 #include <freertos/FreeRTOS.h>
 #include <freertos/task.h>
 #include <mutex>
-#include <list>
+#include <vector>
 #include <condition_variable>
-#include <atomic>
+#include <functional>
+#include <type_traits>
+#include <utility>
+#include <cstddef>
+#include <new>
+
+#define BACKGROUND_TASK_PLAYBACK_LANE_SIZE 8
+#define BACKGROUND_TASK_BULK_LANE_SIZE 32
+
+// Lanes are served strictly in this order
+enum BackgroundTaskPriority {
+    kBackgroundTaskPriorityPlayback,    // Work the speaker is waiting for, e.g. opus decode
+    kBackgroundTaskPriorityBulk,        // Everything else, e.g. uplink encode
+    kBackgroundTaskPriorityCount
+};
+
+struct BackgroundTaskLaneStats {
+    uint32_t executed = 0;
+    uint32_t dropped = 0;
+    size_t depth = 0;
+    size_t max_depth = 0;
+    int64_t total_wait_us = 0;
+    int64_t max_wait_us = 0;
+};
+
+// A move-only void() callable that stores small captures inline, so scheduling
+// a typical lambda does not touch the heap. Larger callables fall back to new.
+class SmallTask {
+public:
+    static constexpr size_t kInlineSize = 48;
+
+    SmallTask() = default;
+
+    template <typename F, typename = std::enable_if_t<!std::is_same_v<std::decay_t<F>, SmallTask>>>
+    SmallTask(F&& callable) {
+        using Callable = std::decay_t<F>;
+        if constexpr (sizeof(Callable) <= kInlineSize && alignof(Callable) <= alignof(std::max_align_t)
+                && std::is_nothrow_move_constructible_v<Callable>) {
+            new (storage_) Callable(std::forward<F>(callable));
+            ops_ = &kInlineOps<Callable>;
+        } else {
+            *reinterpret_cast<Callable**>(storage_) = new Callable(std::forward<F>(callable));
+            ops_ = &kHeapOps<Callable>;
+        }
+    }
+
+    SmallTask(SmallTask&& other) noexcept {
+        MoveFrom(other);
+    }
+
+    SmallTask& operator=(SmallTask&& other) noexcept {
+        if (this != &other) {
+            Reset();
+            MoveFrom(other);
+        }
+        return *this;
+    }
+
+    SmallTask(const SmallTask&) = delete;
+    SmallTask& operator=(const SmallTask&) = delete;
+
+    ~SmallTask() {
+        Reset();
+    }
+
+    explicit operator bool() const { return ops_ != nullptr; }
+
+    void operator()() {
+        ops_->invoke(storage_);
+    }
+
+    void Reset() {
+        if (ops_ != nullptr) {
+            ops_->destroy(storage_);
+            ops_ = nullptr;
+        }
+    }
+
+private:
+    struct Ops {
+        void (*invoke)(void* storage);
+        void (*move)(void* dst, void* src);
+        void (*destroy)(void* storage);
+    };
+
+    template <typename Callable>
+    static constexpr Ops kInlineOps = {
+        [](void* storage) { (*static_cast<Callable*>(storage))(); },
+        [](void* dst, void* src) {
+            new (dst) Callable(std::move(*static_cast<Callable*>(src)));
+            static_cast<Callable*>(src)->~Callable();
+        },
+        [](void* storage) { static_cast<Callable*>(storage)->~Callable(); },
+    };
+
+    template <typename Callable>
+    static constexpr Ops kHeapOps = {
+        [](void* storage) { (**static_cast<Callable**>(storage))(); },
+        [](void* dst, void* src) { *static_cast<Callable**>(dst) = *static_cast<Callable**>(src); },
+        [](void* storage) { delete *static_cast<Callable**>(storage); },
+    };
+
+    void MoveFrom(SmallTask& other) {
+        ops_ = other.ops_;
+        if (ops_ != nullptr) {
+            ops_->move(storage_, other.storage_);
+            other.ops_ = nullptr;
+        }
+    }
+
+    alignas(std::max_align_t) unsigned char storage_[kInlineSize];
+    const Ops* ops_ = nullptr;
+};
 
 class BackgroundTask {
 public:
     BackgroundTask(uint32_t stack_size = 4096 * 2);
     ~BackgroundTask();
 
-    void Schedule(std::function<void()> callback);
+    // Waits for a free slot when the lane is full. Only a task scheduled from inside the
+    // background task itself is dropped instead, and then false is returned
+    bool Schedule(SmallTask&& callback, BackgroundTaskPriority priority = kBackgroundTaskPriorityBulk);
     void WaitForCompletion();
+    BackgroundTaskLaneStats GetLaneStats(BackgroundTaskPriority priority);
 
 private:
+    struct Slot {
+        SmallTask task;
+        int64_t enqueue_time = 0;
+    };
+
+    // Fixed capacity FIFO, slots are allocated once in the constructor
+    struct Lane {
+        std::vector<Slot> slots;
+        size_t head = 0;
+        size_t count = 0;
+        BackgroundTaskLaneStats stats;
+    };
+
     std::mutex mutex_;
-    std::list<std::function<void()>> main_tasks_;
+    Lane lanes_[kBackgroundTaskPriorityCount];
     std::condition_variable condition_variable_;
     TaskHandle_t background_task_handle_ = nullptr;
-    std::atomic<size_t> active_tasks_{0};
+    size_t pending_tasks_ = 0;
+    bool running_task_ = false;
 
     void BackgroundTaskLoop();
 };
@@ -47,6 +47,8 @@ public:
     virtual Udp* CreateUdp() = 0;
     virtual void StartNetwork() = 0;
     virtual const char* GetNetworkStateIcon() = 0;
+    // Link quality from 0 (unusable) to 100, -1 if unknown
+    virtual int GetSignalQuality() { return -1; }
     virtual bool GetBatteryLevel(int &level, bool& charging, bool& discharging);
     virtual std::string GetJson();
     virtual void SetPowerSaveMode(bool enabled) = 0;
@@ -2,6 +2,8 @@
 #define CAMERA_H
 
 #include <string>
+#include <string_view>
+#include <functional>
 
 class Camera {
 public:
@@ -9,7 +11,9 @@ public:
     virtual bool Capture() = 0;
     virtual bool SetHMirror(bool enabled) = 0;
     virtual bool SetVFlip(bool enabled) = 0;
-    virtual std::string Explain(const std::string& question) = 0;
+    // With on_data the explanation goes there as it arrives and an empty string is
+    // returned, on_data returns false to stop reading
+    virtual std::string Explain(const std::string& question, std::function<bool(std::string_view data)> on_data = nullptr) = 0;
 };
 
 #endif // CAMERA_H
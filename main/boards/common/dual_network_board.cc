@@ -92,6 +92,10 @@ const char* DualNetworkBoard::GetNetworkStateIcon() {
     return current_board_->GetNetworkStateIcon();
 }
 
+int DualNetworkBoard::GetSignalQuality() {
+    return current_board_->GetSignalQuality();
+}
+
 void DualNetworkBoard::SetPowerSaveMode(bool enabled) {
     current_board_->SetPowerSaveMode(enabled);
 }
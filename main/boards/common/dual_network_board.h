@@ -54,6 +54,7 @@ public:
     virtual Mqtt* CreateMqtt() override;
     virtual Udp* CreateUdp() override;
     virtual const char* GetNetworkStateIcon() override;
+    virtual int GetSignalQuality() override;
     virtual void SetPowerSaveMode(bool enabled) override;
     virtual std::string GetBoardJson() override;
     virtual std::string GetDeviceStatusJson() override;
@@ -174,16 +174,18 @@ bool Esp32Camera::SetVFlip(bool enabled) {
  * - 支持设备ID、客户端ID和认证令牌的HTTP头部配置
  * 
  * @param question 要向AI提出的关于图像的问题，将作为表单字段发送
+ * @param on_data 可选，服务器响应边收边交给它，不在内存中拼出完整响应
  * @return std::string 服务器返回的JSON格式响应字符串
  *         成功时包含AI分析结果，失败时包含错误信息
  *         格式示例：{"success": true, "result": "分析结果"}
  *                  {"success": false, "message": "错误信息"}
+ *         设置了on_data时成功返回空字符串
  * 
  * @note 调用此函数前必须先调用SetExplainUrl()设置服务器URL
  * @note 函数会等待之前的编码线程完成后再开始新的处理
  * @warning 如果摄像头缓冲区为空或网络连接失败，将返回错误信息
  */
-std::string Esp32Camera::Explain(const std::string& question) {
+std::string Esp32Camera::Explain(const std::string& question, std::function<bool(std::string_view data)> on_data) {
     if (explain_url_.empty()) {
         return "{\"success\": false, \"message\": \"Image explain URL or token is not set\"}";
     }
@@ -292,12 +294,26 @@ std::string Esp32Camera::Explain(const std::string& question) {
         return "{\"success\": false, \"message\": \"Failed to upload photo\"}";
     }
 
-    std::string result = http->ReadAll();
+    std::string result;
+    if (on_data) {
+        char buffer[512];
+        size_t total_read = 0;
+        int ret;
+        while ((ret = http->Read(buffer, sizeof(buffer))) > 0) {
+            total_read += ret;
+            if (!on_data(std::string_view(buffer, ret))) {
+                break;
+            }
+        }
+        result = "(" + std::to_string(total_read) + " bytes streamed)";
+    } else {
+        result = http->ReadAll();
+    }
     http->Close();
 
     // Get remain task stack size
     size_t remain_stack_size = uxTaskGetStackHighWaterMark(nullptr);
     ESP_LOGI(TAG, "Explain image size=%dx%d, compressed size=%d, remain stack size=%d, question=%s\n%s",
         fb_->width, fb_->height, total_sent, remain_stack_size, question.c_str(), result.c_str());
-    return result;
+    return on_data ? "" : result;
 }
@@ -33,7 +33,7 @@ public:
     // 翻转控制函数
     virtual bool SetHMirror(bool enabled) override;
     virtual bool SetVFlip(bool enabled) override;
-    virtual std::string Explain(const std::string& question);
+    virtual std::string Explain(const std::string& question, std::function<bool(std::string_view data)> on_data = nullptr);
 };
 
 #endif // ESP32_CAMERA_H
\ No newline at end of file
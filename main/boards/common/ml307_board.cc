@@ -104,6 +104,18 @@ const char* Ml307Board::GetNetworkStateIcon() {
     return FONT_AWESOME_SIGNAL_OFF;
 }
 
+int Ml307Board::GetSignalQuality() {
+    if (!modem_.network_ready()) {
+        return -1;
+    }
+    // CSQ runs from 0 to 31, 99 means unknown
+    int csq = modem_.GetCsq();
+    if (csq < 0 || csq > 31) {
+        return -1;
+    }
+    return csq * 100 / 31;
+}
+
 std::string Ml307Board::GetBoardJson() {
     // Set the board type for OTA
     std::string board_json = std::string("{\"type\":\"" BOARD_TYPE "\",");
@@ -19,6 +19,7 @@ public:
     virtual Mqtt* CreateMqtt() override;
     virtual Udp* CreateUdp() override;
     virtual const char* GetNetworkStateIcon() override;
+    virtual int GetSignalQuality() override;
     virtual void SetPowerSaveMode(bool enabled) override;
     virtual AudioCodec* GetAudioCodec() override { return nullptr; }
     virtual std::string GetDeviceStatusJson() override;
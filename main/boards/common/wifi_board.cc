@@ -7,6 +7,7 @@
 #include "settings.h"
 #include "assets/lang_config.h"
 
+#include <algorithm>
 #include <freertos/FreeRTOS.h>
 #include <freertos/task.h>
 #include <esp_http.h>
@@ -150,6 +151,15 @@ const char* WifiBoard::GetNetworkStateIcon() {
     }
 }
 
+int WifiBoard::GetSignalQuality() {
+    auto& wifi_station = WifiStation::GetInstance();
+    if (wifi_config_mode_ || !wifi_station.IsConnected()) {
+        return -1;
+    }
+    // -100 dBm and below is 0, -50 dBm and above is 100
+    return std::clamp(2 * (wifi_station.GetRssi() + 100), 0, 100);
+}
+
 std::string WifiBoard::GetBoardJson() {
     // Set the board type for OTA
     auto& wifi_station = WifiStation::GetInstance();
@@ -261,20 +261,29 @@ private:
             Property("query", kPropertyTypeString)         
         }), [this](const PropertyList& properties) -> ReturnValue {
             auto query = properties["query"].value<std::string>();
-            std::string result = "";         
-            int ret = web_search(query.c_str(), result, 1);   
+            auto& mcp_server = McpServer::GetInstance();
+            // 每条结果取到就先发出去，总长度仍限制在5000以内
+            size_t length = 0;
+            int ret = web_search(query.c_str(), [&mcp_server, &length](const std::string& item) {
+                if (length == 0) {
+                    mcp_server.StreamResult("搜索结果：");
+                }
+                if (length + item.size() > 5000) {
+                    ESP_LOGI(TAG, "联网搜索结果长度超过5000，截断返回");
+                    mcp_server.StreamResult(item.substr(0, 5000 - length) + "...");
+                    length = 5000;
+                    return false;
+                }
+                length += item.size();
+                return mcp_server.StreamResult(item);
+            }, 1);
             if (ret <= 0) {
-                result = "没有搜索到结果";
                 ESP_LOGI(TAG, "联网搜索：%s, 没有搜索到结果", query.c_str());
-            }else {
-                ESP_LOGI(TAG, "联网搜索：%s, 搜到%d条结果，内容长度%d", query.c_str(), ret, result.size());
+                return "没有搜索到结果";
             }
-            if (result.size() > 5000) {
-                ESP_LOGI(TAG, "联网搜索结果长度超过5000，截断返回:%s", result.substr(0, 5000).c_str());
-                return "搜索结果: " + result.substr(0, 5000) + "...";
-            }
-            return "搜索结果：" + result + "\n";
-        });
+            ESP_LOGI(TAG, "联网搜索：%s, 搜到%d条结果，内容长度%d", query.c_str(), ret, length);
+            return "\n";
+        }, McpToolOptions{ kToolStackLarge });
     }
 
     void InitializeTools() {
@@ -0,0 +1,127 @@
+#include "encoder_controller.h"
+
+#include <esp_log.h>
+#include <algorithm>
+
+#define TAG "EncoderController"
+
+// Percent of real time spent encoding
+static const int kHighLoad = 50;
+static const int kLowLoad = 20;
+// Windows without trouble before a setting is relaxed again, doubled each time
+// the link relapses soon after DTX was turned off
+static const int kCalmWindows = 10;
+static const int kMaxCalmWindows = 160;
+// Windows without overload before the learned complexity ceiling is raised by one
+static const int kCeilingRetryWindows = 60;
+// Windows to wait after a complexity change before judging it
+static const int kHoldWindows = 3;
+// Audio waiting in the send queue before the link counts as congested
+static const int kCongestedQueueMs = 600;
+static const int kWeakSignal = 30;
+
+EncoderController::EncoderController(int frame_duration_ms, int initial_complexity, int max_complexity)
+    : frame_duration_ms_(frame_duration_ms) {
+    Reset(initial_complexity, max_complexity);
+}
+
+void EncoderController::Reset(int initial_complexity, int max_complexity) {
+    configured_max_complexity_ = std::clamp(max_complexity, 0, 10);
+    status_ = EncoderControllerStatus();
+    status_.max_complexity = configured_max_complexity_;
+    status_.settings.complexity = std::clamp(initial_complexity, 0, configured_max_complexity_);
+    hold_windows_ = 0;
+    cpu_calm_windows_ = 0;
+    link_calm_windows_ = 0;
+    link_calm_required_ = kCalmWindows;
+    link_clean_windows_ = 0;
+    overload_free_windows_ = 0;
+}
+
+bool EncoderController::Update(const EncoderTelemetry& telemetry) {
+    if (telemetry.frames == 0 && telemetry.queue_dropped_packets == 0 && telemetry.send_failures == 0) {
+        // Not streaming, nothing to learn from this window
+        return false;
+    }
+    auto& settings = status_.settings;
+    auto before = settings;
+    const char* reason = nullptr;
+
+    // Link
+    bool congested = telemetry.queue_dropped_packets > 0 || telemetry.send_failures > 0 ||
+        telemetry.send_queue_depth * frame_duration_ms_ >= (size_t)kCongestedQueueMs;
+    bool weak = telemetry.signal_quality >= 0 && telemetry.signal_quality < kWeakSignal;
+    status_.link_congested = congested;
+    if (congested || weak) {
+        link_calm_windows_ = 0;
+        if (!settings.dtx) {
+            settings.dtx = true;
+            reason = congested ? "link congested" : "weak signal";
+            // A link that only copes with DTX on has to prove itself for longer next time
+            if (link_clean_windows_ < link_calm_required_) {
+                link_calm_required_ = std::min(link_calm_required_ * 2, kMaxCalmWindows);
+            } else {
+                link_calm_required_ = kCalmWindows;
+            }
+        }
+    } else if (settings.dtx) {
+        if (++link_calm_windows_ >= link_calm_required_) {
+            settings.dtx = false;
+            link_calm_windows_ = 0;
+            link_clean_windows_ = 0;
+            reason = "link recovered";
+        }
+    } else {
+        link_clean_windows_++;
+    }
+
+    // CPU
+    if (telemetry.frames > 0) {
+        status_.cpu_load = telemetry.encode_us * 100 / ((int64_t)telemetry.frames * frame_duration_ms_ * 1000);
+    }
+    if (hold_windows_ > 0) {
+        hold_windows_--;
+    }
+    bool overloaded = telemetry.encoder_dropped_frames > 0 || status_.cpu_load > kHighLoad;
+    if (overloaded) {
+        cpu_calm_windows_ = 0;
+        overload_free_windows_ = 0;
+        if (settings.complexity > 0) {
+            // Do not come back to the level that overloaded until kCeilingRetryWindows have passed
+            status_.max_complexity = settings.complexity - 1;
+            settings.complexity = std::max(0, settings.complexity - 2);
+            hold_windows_ = kHoldWindows;
+            reason = "encoder overloaded";
+        }
+    } else {
+        if (++overload_free_windows_ >= kCeilingRetryWindows && status_.max_complexity < configured_max_complexity_) {
+            // Whatever loaded the CPU may be gone, give the next level another try
+            status_.max_complexity++;
+            overload_free_windows_ = 0;
+        }
+        if (status_.cpu_load < kLowLoad && !congested && hold_windows_ == 0 &&
+            settings.complexity < status_.max_complexity) {
+            if (++cpu_calm_windows_ >= kCalmWindows) {
+                settings.complexity++;
+                cpu_calm_windows_ = 0;
+                hold_windows_ = kHoldWindows;
+                reason = "cpu headroom";
+            }
+        } else {
+            cpu_calm_windows_ = 0;
+        }
+    }
+
+    if (settings.complexity == before.complexity && settings.dtx == before.dtx) {
+        return false;
+    }
+    Change(reason);
+    return true;
+}
+
+void EncoderController::Change(const char* reason) {
+    status_.changes++;
+    status_.reason = reason;
+    ESP_LOGI(TAG, "complexity %d (max %d), dtx %s: %s, load %d%%", status_.settings.complexity,
+        status_.max_complexity, status_.settings.dtx ? "on" : "off", reason, status_.cpu_load);
+}
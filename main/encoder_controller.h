@@ -0,0 +1,73 @@
+#ifndef ENCODER_CONTROLLER_H
+#define ENCODER_CONTROLLER_H
+
+#include <cstddef>
+#include <cstdint>
+
+// One window of uplink telemetry, counters are deltas since the previous window
+struct EncoderTelemetry {
+    uint32_t frames = 0;
+    int64_t encode_us = 0;
+    uint32_t encoder_dropped_frames = 0;    // The encoder fell behind the microphone
+    uint32_t queue_dropped_packets = 0;     // The send queue overflowed
+    uint32_t send_failures = 0;
+    size_t send_queue_depth = 0;
+    int signal_quality = -1;                // 0-100, -1 if unknown
+};
+
+struct EncoderSettings {
+    int complexity = 0;
+    bool dtx = false;
+};
+
+struct EncoderControllerStatus {
+    EncoderSettings settings;
+    int max_complexity = 0;
+    int cpu_load = 0;                       // Percent of real time spent encoding in the last window
+    bool link_congested = false;
+    uint32_t changes = 0;
+    const char* reason = "initial";         // Why the settings last changed
+};
+
+/*
+ * Picks the Opus encoder settings from what the uplink looks like.
+ *
+ * Two independent loops run once per window:
+ *  - CPU: the share of real time spent encoding. Above kHighLoad the
+ *    complexity drops by two and the level below the one that overloaded
+ *    becomes the ceiling until a minute passes without overload; below
+ *    kLowLoad for kCalmWindows in a row it climbs one step at a time.
+ *  - Link: queue overflows, failed sends, a deep send queue or a weak signal
+ *    turn on DTX, which stops sending full frames through silence. It is
+ *    turned off again after a run of clean windows that doubles each time
+ *    the link relapses soon after.
+ *
+ * Not thread safe, the owner applies settings() to the encoder itself.
+ */
+class EncoderController {
+public:
+    EncoderController(int frame_duration_ms, int initial_complexity, int max_complexity);
+
+    // Returns true if the settings changed
+    bool Update(const EncoderTelemetry& telemetry);
+    // Forgets the learned ceiling, e.g. when the audio processing setup changes
+    void Reset(int initial_complexity, int max_complexity);
+
+    inline const EncoderSettings& settings() const { return status_.settings; }
+    inline const EncoderControllerStatus& status() const { return status_; }
+
+private:
+    int frame_duration_ms_;
+    int configured_max_complexity_;
+    EncoderControllerStatus status_;
+    int hold_windows_ = 0;
+    int cpu_calm_windows_ = 0;
+    int link_calm_windows_ = 0;
+    int link_calm_required_ = 0;
+    int link_clean_windows_ = 0;
+    int overload_free_windows_ = 0;
+
+    void Change(const char* reason);
+};
+
+#endif // ENCODER_CONTROLLER_H
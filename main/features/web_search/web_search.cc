@@ -4,7 +4,6 @@
 #include "web_search.h"
 #include "html.hpp"
 #include <vector>
-#include <list>
 
 typedef struct {
     std::string title;
@@ -130,12 +129,13 @@ std::string parse_html_content(const char *html) {
     return content;
 }
 
-int bing_parse_result(const char *html, std::list<SearchResult> &results, int max_results) {
+int bing_parse_result(const char *html, std::function<bool(SearchResult &)> on_result, int max_results) {
     html::parser p;
     html::node_ptr node = p.parse(html);
     std::vector<html::node*> selected = node->select("li.b_algo");
+    int count = 0;
     for(auto elem : selected) {
-        if (results.size() >= max_results) {
+        if (count >= max_results) {
             break;
         }
         auto hrefNodes = elem->select("h2 a");
@@ -160,13 +160,16 @@ int bing_parse_result(const char *html, std::list<SearchResult> &results, int ma
         result.content = parsedContent.empty() ? rawHtmlContent : parsedContent;
         result.url = url;
         // ESP_LOGI(TAG, "parsed content: %s", parsedContent.c_str());
-        results.push_back(result);        
+        count++;
+        if (!on_result(result)) {
+            break;
+        }
     }
         
-    return results.size();
+    return count;
 }
 
-int bing_search(const char *keyword, std::list<SearchResult> &results, int max_results) {
+int bing_search(const char *keyword, std::function<bool(SearchResult &)> on_result, int max_results) {
     // 构建请求URL
     char url[256];
     int retcode = -1;
@@ -192,7 +195,7 @@ int bing_search(const char *keyword, std::list<SearchResult> &results, int max_r
         if (status == 200) {
             ESP_LOGI(TAG, "HTTP Request Successful");
             // ESP_LOGI(TAG, "HTTP Response: %s", g_http_response.c_str());
-            retcode = bing_parse_result(g_http_response.c_str(), results, max_results);
+            retcode = bing_parse_result(g_http_response.c_str(), on_result, max_results);
         } else {
             ESP_LOGE(TAG, "HTTP Status: %d", status);
         }
@@ -204,12 +207,16 @@ int bing_search(const char *keyword, std::list<SearchResult> &results, int max_r
     return retcode;
 }
 int web_search(const char *keyword, std::string &result, int max_results) {
-    std::list<SearchResult> results;
-    bing_search(keyword, results, max_results);
-    for (auto item : results) {
-        result += item.title + "\n";
-        result += item.content + "\n";
-        result += item.url + "\n";
-    }
-    return results.size();
+    return web_search(keyword, [&result](const std::string &item) {
+        result += item;
+        return true;
+    }, max_results);
+}
+
+int web_search(const char *keyword, std::function<bool(const std::string &item)> on_result, int max_results) {
+    // Each page is handed on and freed before the next one is fetched
+    int count = bing_search(keyword, [&on_result](SearchResult &result) {
+        return on_result(result.title + "\n" + result.content + "\n" + result.url + "\n");
+    }, max_results);
+    return count > 0 ? count : 0;
 }
\ No newline at end of file
@@ -2,7 +2,10 @@
 #define E63C479A_C455_47CD_BAF7_C1F384AD001E
 
 #include <string>
+#include <functional>
 
 int web_search(const char *keyword, std::string &result, int max_results = 10);
+// Hands each result to on_result as soon as its page is fetched, stops when it returns false
+int web_search(const char *keyword, std::function<bool(const std::string &item)> on_result, int max_results = 10);
 
 #endif /* E63C479A_C455_47CD_BAF7_C1F384AD001E */
@@ -0,0 +1,160 @@
+#include "jitter_buffer.h"
+
+#include <esp_log.h>
+#include <algorithm>
+
+#define TAG "JitterBuffer"
+
+// Holes longer than this are skipped instead of concealed
+static const int kMaxConcealedFrames = 3;
+// Running dry and receiving audio again within this window is an underrun, not the end of a stream
+static const int64_t kUnderrunWindowMs = 1000;
+// Shrink the target depth after this many frames played without an underrun
+static const uint32_t kShrinkAfterFrames = 500;
+
+JitterBuffer::JitterBuffer(size_t capacity, int min_depth_ms, int target_depth_ms, int max_depth_ms)
+    : capacity_(capacity) {
+    packets_.reserve(capacity_);
+    SetTargetDepth(min_depth_ms, target_depth_ms, max_depth_ms);
+}
+
+void JitterBuffer::SetTargetDepth(int min_depth_ms, int target_depth_ms, int max_depth_ms) {
+    min_depth_ms_ = min_depth_ms;
+    max_depth_ms_ = std::max(min_depth_ms, max_depth_ms);
+    target_depth_ms_ = std::clamp(target_depth_ms, min_depth_ms_, max_depth_ms_);
+}
+
+bool JitterBuffer::Push(AudioStreamPacket&& packet, int64_t now_ms) {
+    auto position = packets_.end();
+    if (packet.timestamp != 0) {
+        if (has_last_timestamp_ && static_cast<int32_t>(packet.timestamp - last_timestamp_) <= 0) {
+            stats_.late_packets++;
+            return false;
+        }
+        // Usually the packet belongs at the end, so search backwards
+        while (position != packets_.begin()) {
+            auto& previous = *(position - 1);
+            if (previous.timestamp == 0) {
+                break;
+            }
+            int32_t diff = static_cast<int32_t>(previous.timestamp - packet.timestamp);
+            if (diff == 0) {
+                stats_.duplicate_packets++;
+                return false;
+            }
+            if (diff < 0) {
+                break;
+            }
+            --position;
+        }
+    }
+
+    if (packets_.size() >= capacity_) {
+        stats_.overflow_packets++;
+        return false;
+    }
+    packets_.insert(position, std::move(packet));
+
+    if (state_ == kStateBuffering && buffering_since_ms_ < 0) {
+        buffering_since_ms_ = now_ms;
+        if (starved_at_ms_ >= 0 && now_ms - starved_at_ms_ < kUnderrunWindowMs) {
+            stats_.underruns++;
+            stable_frames_ = 0;
+            int frame_ms = packets_.front().frame_duration;
+            if (target_depth_ms_ + frame_ms <= max_depth_ms_) {
+                target_depth_ms_ += frame_ms;
+                ESP_LOGI(TAG, "Underrun, raise target depth to %d ms", target_depth_ms_);
+            }
+        }
+        starved_at_ms_ = -1;
+    }
+    return true;
+}
+
+JitterBufferResult JitterBuffer::Pop(AudioStreamPacket& packet, int64_t now_ms) {
+    if (state_ == kStateBuffering) {
+        if (packets_.empty()) {
+            return kJitterBufferEmpty;
+        }
+        // Start when enough audio is buffered, or when the stream is too short to ever reach the target
+        if (BufferedMs() < target_depth_ms_ && now_ms - buffering_since_ms_ < target_depth_ms_) {
+            return kJitterBufferEmpty;
+        }
+        state_ = kStatePlaying;
+        buffering_since_ms_ = -1;
+    }
+
+    if (packets_.empty()) {
+        state_ = kStateBuffering;
+        starved_at_ms_ = now_ms;
+        return kJitterBufferEmpty;
+    }
+
+    auto& front = packets_.front();
+    if (front.timestamp != 0 && has_last_timestamp_ && timestamp_step_ != 0) {
+        // Frames still missing before the front packet, the hole's full length once
+        // the ones concealed so far are added back
+        uint32_t missing = (front.timestamp - last_timestamp_) / timestamp_step_ - 1;
+        if (missing >= 1 && concealed_in_row_ + missing <= kMaxConcealedFrames) {
+            // The packet right after the last played one is missing
+            packet.sample_rate = front.sample_rate;
+            packet.frame_duration = front.frame_duration;
+            packet.timestamp = last_timestamp_ + timestamp_step_;
+            packet.payload.clear();
+            last_timestamp_ = packet.timestamp;
+            concealed_in_row_++;
+            stats_.concealed_frames++;
+            return kJitterBufferConceal;
+        }
+    }
+
+    packet = std::move(front);
+    packets_.erase(packets_.begin());
+    concealed_in_row_ = 0;
+
+    if (packet.timestamp != 0) {
+        if (has_last_timestamp_) {
+            uint32_t delta = packet.timestamp - last_timestamp_;
+            if (static_cast<int32_t>(delta) > 0 && (timestamp_step_ == 0 || delta < timestamp_step_)) {
+                timestamp_step_ = delta;
+            }
+        }
+        last_timestamp_ = packet.timestamp;
+        has_last_timestamp_ = true;
+    }
+
+    stats_.played_frames++;
+    if (++stable_frames_ >= kShrinkAfterFrames) {
+        stable_frames_ = 0;
+        if (target_depth_ms_ - packet.frame_duration >= min_depth_ms_) {
+            target_depth_ms_ -= packet.frame_duration;
+        }
+    }
+    return kJitterBufferPacket;
+}
+
+void JitterBuffer::Reset() {
+    packets_.clear();
+    state_ = kStateBuffering;
+    buffering_since_ms_ = -1;
+    starved_at_ms_ = -1;
+    has_last_timestamp_ = false;
+    last_timestamp_ = 0;
+    timestamp_step_ = 0;
+    concealed_in_row_ = 0;
+}
+
+JitterBufferStats JitterBuffer::stats() const {
+    auto stats = stats_;
+    stats.depth = packets_.size();
+    stats.target_depth_ms = target_depth_ms_;
+    return stats;
+}
+
+int JitterBuffer::BufferedMs() const {
+    int total = 0;
+    for (auto& packet : packets_) {
+        total += packet.frame_duration;
+    }
+    return total;
+}
@@ -0,0 +1,82 @@
+#ifndef JITTER_BUFFER_H
+#define JITTER_BUFFER_H
+
+#include <cstdint>
+#include <vector>
+
+#include "protocol.h"
+
+struct JitterBufferStats {
+    uint32_t played_frames = 0;
+    uint32_t concealed_frames = 0;
+    uint32_t underruns = 0;
+    uint32_t late_packets = 0;
+    uint32_t duplicate_packets = 0;
+    uint32_t overflow_packets = 0;
+    uint32_t depth = 0;
+    uint32_t target_depth_ms = 0;
+};
+
+enum JitterBufferResult {
+    kJitterBufferEmpty,     // Nothing to play yet
+    kJitterBufferPacket,    // The next packet in playout order
+    kJitterBufferConceal,   // A packet is missing, the caller should run loss concealment
+};
+
+/*
+ * Adaptive playout buffer between the network and the decoder.
+ *
+ * Packets are kept in timestamp order (packets without a timestamp keep
+ * arrival order). Playout starts once target_depth_ms of audio is buffered,
+ * or the oldest packet has waited that long. Running dry in the middle of a
+ * stream counts as an underrun and grows the target depth; long stretches
+ * without underruns shrink it again.
+ *
+ * Timestamps are only compared with each other, so their unit does not
+ * matter. The frame step is learned from consecutive packets and used to
+ * detect holes. Short holes are reported as kJitterBufferConceal, longer
+ * ones (e.g. a pause between sentences) are played across without filling.
+ *
+ * Not thread safe, the owner must call it from a single task.
+ */
+class JitterBuffer {
+public:
+    JitterBuffer(size_t capacity, int min_depth_ms, int target_depth_ms, int max_depth_ms);
+
+    void SetTargetDepth(int min_depth_ms, int target_depth_ms, int max_depth_ms);
+    bool Push(AudioStreamPacket&& packet, int64_t now_ms);
+    JitterBufferResult Pop(AudioStreamPacket& packet, int64_t now_ms);
+    void Reset();
+
+    inline bool empty() const { return packets_.empty(); }
+    inline bool full() const { return packets_.size() >= capacity_; }
+    inline size_t size() const { return packets_.size(); }
+    JitterBufferStats stats() const;
+
+private:
+    enum State {
+        kStateBuffering,
+        kStatePlaying,
+    };
+
+    std::vector<AudioStreamPacket> packets_;
+    size_t capacity_;
+    State state_ = kStateBuffering;
+    int min_depth_ms_;
+    int target_depth_ms_;
+    int max_depth_ms_;
+    int64_t buffering_since_ms_ = -1;
+    int64_t starved_at_ms_ = -1;
+
+    bool has_last_timestamp_ = false;
+    uint32_t last_timestamp_ = 0;
+    uint32_t timestamp_step_ = 0;
+    int concealed_in_row_ = 0;
+    uint32_t stable_frames_ = 0;
+
+    JitterBufferStats stats_;
+
+    int BufferedMs() const;
+};
+
+#endif // JITTER_BUFFER_H
@@ -0,0 +1,250 @@
+#ifndef JSON_WRITER_H
+#define JSON_WRITER_H
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <string_view>
+
+/*
+ * Streaming writer for outgoing JSON messages.
+ *
+ * Writes straight into a std::string, so a message costs one allocation when
+ * the capacity is reserved up front and none when a buffer is reused. The string
+ * is sized to its capacity while writing and trimmed by str() or when the writer
+ * goes out of scope, which keeps the appends down to a bounds check and a
+ * memcpy. Keys are
+ * string literals whose length is known at compile time and are copied without
+ * escaping, values given as strings are escaped. Raw() splices in text that is
+ * already JSON, such as a tool result or a states array.
+ *
+ *     JsonWriter json(64 + session_id_.size());
+ *     json.BeginObject();
+ *     json.Field("session_id", session_id_);
+ *     json.Field("type", "listen");
+ *     json.EndObject();
+ *     SendText(json.str());
+ */
+class JsonWriter {
+public:
+    explicit JsonWriter(size_t reserve = 64) : out_(own_) {
+        out_.resize(reserve);
+    }
+
+    // Writes into `out`, replacing its content but keeping its capacity. `out` holds
+    // the message once str() was called or the writer is gone, not before
+    explicit JsonWriter(std::string& out) : out_(out) {
+        out_.resize(out_.capacity());
+    }
+
+    // A caller's string must not keep the unwritten tail
+    ~JsonWriter() {
+        out_.resize(size_);
+    }
+
+    JsonWriter(const JsonWriter&) = delete;
+    JsonWriter& operator=(const JsonWriter&) = delete;
+
+    inline const std::string& str() {
+        out_.resize(size_);
+        return out_;
+    }
+
+    JsonWriter& BeginObject() {
+        Separate();
+        Put('{');
+        need_comma_ = false;
+        return *this;
+    }
+
+    JsonWriter& EndObject() {
+        Put('}');
+        need_comma_ = true;
+        return *this;
+    }
+
+    JsonWriter& BeginArray() {
+        Separate();
+        Put('[');
+        need_comma_ = false;
+        return *this;
+    }
+
+    JsonWriter& EndArray() {
+        Put(']');
+        need_comma_ = true;
+        return *this;
+    }
+
+    // Keys must be literals that need no escaping
+    template <size_t N>
+    JsonWriter& Key(const char (&key)[N]) {
+        AppendKey<N, false>(key);
+        need_comma_ = false;
+        return *this;
+    }
+
+    JsonWriter& String(std::string_view value) {
+        Separate();
+        Put('"');
+        AppendEscaped(value);
+        Put('"');
+        return *this;
+    }
+
+    JsonWriter& Int(int64_t value) {
+        Separate();
+        char buffer[20];
+        char* end = buffer + sizeof(buffer);
+        char* p = end;
+        // Work on the magnitude as unsigned so INT64_MIN does not overflow
+        uint64_t magnitude = value < 0 ? 0 - static_cast<uint64_t>(value) : static_cast<uint64_t>(value);
+        do {
+            *--p = '0' + magnitude % 10;
+            magnitude /= 10;
+        } while (magnitude != 0);
+        if (value < 0) {
+            Put('-');
+        }
+        Append(p, end - p);
+        return *this;
+    }
+
+    JsonWriter& Bool(bool value) {
+        Separate();
+        if (value) {
+            Append("true", 4);
+        } else {
+            Append("false", 5);
+        }
+        return *this;
+    }
+
+    JsonWriter& Null() {
+        Separate();
+        Append("null", 4);
+        return *this;
+    }
+
+    // Appends text that is already valid JSON
+    JsonWriter& Raw(std::string_view json) {
+        Separate();
+        Append(json.data(), json.size());
+        return *this;
+    }
+
+    template <size_t N>
+    JsonWriter& Field(const char (&key)[N], std::string_view value) {
+        // The key, colon and opening quote go out in a single append
+        AppendKey<N, true>(key);
+        AppendEscaped(value);
+        Put('"');
+        need_comma_ = true;
+        return *this;
+    }
+
+    template <size_t N>
+    JsonWriter& Field(const char (&key)[N], const char* value) {
+        return Field(key, std::string_view(value));
+    }
+
+    template <size_t N>
+    JsonWriter& Field(const char (&key)[N], const std::string& value) {
+        return Field(key, std::string_view(value));
+    }
+
+    template <size_t N>
+    JsonWriter& Field(const char (&key)[N], int value) {
+        return Key(key).Int(value);
+    }
+
+    template <size_t N>
+    JsonWriter& Field(const char (&key)[N], bool value) {
+        return Key(key).Bool(value);
+    }
+
+    template <size_t N>
+    JsonWriter& RawField(const char (&key)[N], std::string_view json) {
+        return Key(key).Raw(json);
+    }
+
+private:
+    std::string own_;
+    std::string& out_;
+    size_t size_ = 0;
+    bool need_comma_ = false;
+
+    inline void Append(const char* data, size_t size) {
+        if (size_ + size > out_.size()) {
+            out_.resize(std::max(out_.size() * 2, size_ + size));
+        }
+        memcpy(&out_[size_], data, size);
+        size_ += size;
+    }
+
+    inline void Put(char c) {
+        if (size_ == out_.size()) {
+            out_.resize(out_.size() * 2 + 1);
+        }
+        out_[size_++] = c;
+    }
+
+    // Writes [,]"key": and the opening quote of a string value if asked for
+    template <size_t N, bool Quote>
+    inline void AppendKey(const char (&key)[N]) {
+        char buffer[N + 4];
+        buffer[0] = ',';
+        buffer[1] = '"';
+        memcpy(buffer + 2, key, N - 1);
+        buffer[N + 1] = '"';
+        buffer[N + 2] = ':';
+        buffer[N + 3] = '"';
+        size_t size = N + (Quote ? 4 : 3);
+        if (need_comma_) {
+            Append(buffer, size);
+        } else {
+            Append(buffer + 1, size - 1);
+        }
+    }
+
+    inline void Separate() {
+        if (need_comma_) {
+            Put(',');
+        }
+        need_comma_ = true;
+    }
+
+    void AppendEscaped(std::string_view value) {
+        static const char hex_chars[] = "0123456789abcdef";
+        const char* data = value.data();
+        size_t size = value.size();
+        size_t start = 0;
+        for (size_t i = 0; i < size; i++) {
+            auto c = static_cast<uint8_t>(data[i]);
+            if (c >= 0x20 && c != '"' && c != '\\') {
+                continue;
+            }
+            // Copy the run of plain characters in one go, then the escape
+            Append(data + start, i - start);
+            start = i + 1;
+            switch (c) {
+                case '"': Append("\\\"", 2); break;
+                case '\\': Append("\\\\", 2); break;
+                case '\b': Append("\\b", 2); break;
+                case '\f': Append("\\f", 2); break;
+                case '\n': Append("\\n", 2); break;
+                case '\r': Append("\\r", 2); break;
+                case '\t': Append("\\t", 2); break;
+                default: {
+                    char escape[6] = { '\\', 'u', '0', '0', hex_chars[c >> 4], hex_chars[c & 0xF] };
+                    Append(escape, sizeof(escape));
+                    break;
+                }
+            }
+        }
+        Append(data + start, size - start);
+    }
+};
+
+#endif // JSON_WRITER_H
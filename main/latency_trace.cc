@@ -0,0 +1,160 @@
+#include "latency_trace.h"
+
+#include <esp_log.h>
+#include <esp_timer.h>
+#include <cJSON.h>
+#include <algorithm>
+
+#define TAG "LatencyTrace"
+
+static const char* const EVENT_NAMES[] = {
+    "wake_word",
+    "state",
+    "voice_start",
+    "voice_end",
+    "first_audio_sent",
+    "stt",
+    "tts_start",
+    "tts_sentence_start",
+    "tts_stop",
+    "first_audio_received",
+    "first_audio_output",
+    "listening",
+    "wake_word_audio_sent",
+    "listening_connected",
+    "listening_warm",
+};
+static_assert(sizeof(EVENT_NAMES) / sizeof(EVENT_NAMES[0]) == kLatencyEventCount, "EVENT_NAMES is out of sync");
+
+struct LatencySpanInfo {
+    const char* name;
+    LatencyEvent start;
+    LatencyEvent end;
+};
+
+static const LatencySpanInfo SPANS[] = {
+    { "wake_word_to_first_send", kLatencyEventWakeWord, kLatencyEventFirstAudioSent },
+    { "wake_word_to_listening", kLatencyEventWakeWord, kLatencyEventListening },
+    { "wake_word_to_listening_connected", kLatencyEventWakeWord, kLatencyEventListeningConnected },
+    { "wake_word_to_listening_warm", kLatencyEventWakeWord, kLatencyEventListeningWarm },
+    { "wake_word_to_audio_sent", kLatencyEventWakeWord, kLatencyEventWakeWordAudioSent },
+    { "voice_end_to_stt", kLatencyEventVoiceEnd, kLatencyEventStt },
+    { "stt_to_tts_start", kLatencyEventStt, kLatencyEventTtsStart },
+    { "tts_start_to_first_audio", kLatencyEventTtsStart, kLatencyEventFirstAudioReceived },
+    { "first_audio_to_output", kLatencyEventFirstAudioReceived, kLatencyEventFirstAudioOutput },
+    { "voice_end_to_output", kLatencyEventVoiceEnd, kLatencyEventFirstAudioOutput },
+};
+static_assert(sizeof(SPANS) / sizeof(SPANS[0]) == kLatencySpanCount, "SPANS is out of sync");
+
+void LatencyTrace::Record(LatencyEvent event, uint32_t arg) {
+    auto now = esp_timer_get_time();
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto& record = records_[record_count_ % LATENCY_TRACE_SIZE];
+    record.time_us = now;
+    record.event = event;
+    record.arg = arg;
+    record_count_++;
+    last_time_us_[event] = now;
+
+    for (int i = 0; i < kLatencySpanCount; i++) {
+        auto& span = SPANS[i];
+        auto start = last_time_us_[span.start];
+        // Measure each start once, a later end of the same kind belongs to another turn
+        if (span.end != event || start == 0 || start == measured_start_us_[i]) {
+            continue;
+        }
+        measured_start_us_[i] = start;
+
+        uint32_t ms = (now - start) / 1000;
+        auto& histogram = histograms_[i];
+        histogram.count++;
+        histogram.total_ms += ms;
+        histogram.max_ms = std::max(histogram.max_ms, ms);
+        int bucket = 0;
+        while (bucket < LATENCY_BUCKET_COUNT - 1 && ms >= (50u << bucket)) {
+            bucket++;
+        }
+        histogram.buckets[bucket]++;
+        sample_count_++;
+    }
+}
+
+void LatencyTrace::Arm(LatencyEvent event) {
+    armed_.fetch_or(1u << event);
+}
+
+LatencyHistogram LatencyTrace::GetHistogram(LatencySpan span) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return histograms_[span];
+}
+
+uint32_t LatencyTrace::GetSampleCount() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return sample_count_;
+}
+
+void LatencyTrace::Dump() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    for (int i = 0; i < kLatencySpanCount; i++) {
+        auto& histogram = histograms_[i];
+        if (histogram.count == 0) {
+            continue;
+        }
+        auto& b = histogram.buckets;
+        ESP_LOGI(TAG, "%s: n=%lu avg=%lums max=%lums [<50:%lu <100:%lu <200:%lu <400:%lu <800:%lu <1600:%lu <3200:%lu more:%lu]",
+            SPANS[i].name, histogram.count, (uint32_t)(histogram.total_ms / histogram.count), histogram.max_ms,
+            b[0], b[1], b[2], b[3], b[4], b[5], b[6], b[7]);
+    }
+}
+
+std::string LatencyTrace::GetJson() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    cJSON* root = cJSON_CreateObject();
+
+    cJSON* spans = cJSON_CreateObject();
+    for (int i = 0; i < kLatencySpanCount; i++) {
+        auto& histogram = histograms_[i];
+        cJSON* span = cJSON_CreateObject();
+        cJSON_AddNumberToObject(span, "count", histogram.count);
+        cJSON_AddNumberToObject(span, "avg_ms", histogram.count ? histogram.total_ms / histogram.count : 0);
+        cJSON_AddNumberToObject(span, "max_ms", histogram.max_ms);
+        cJSON* buckets = cJSON_CreateArray();
+        for (int j = 0; j < LATENCY_BUCKET_COUNT; j++) {
+            cJSON_AddItemToArray(buckets, cJSON_CreateNumber(histogram.buckets[j]));
+        }
+        cJSON_AddItemToObject(span, "buckets", buckets);
+        cJSON_AddItemToObject(spans, SPANS[i].name, span);
+    }
+    cJSON_AddItemToObject(root, "spans", spans);
+
+    // Most recent events, oldest first, with times relative to the newest one
+    cJSON* events = cJSON_CreateArray();
+    uint32_t count = std::min<uint32_t>(record_count_, LATENCY_TRACE_SIZE);
+    int64_t newest = count > 0 ? records_[(record_count_ - 1) % LATENCY_TRACE_SIZE].time_us : 0;
+    for (uint32_t i = record_count_ - count; i < record_count_; i++) {
+        auto& record = records_[i % LATENCY_TRACE_SIZE];
+        cJSON* event = cJSON_CreateObject();
+        cJSON_AddStringToObject(event, "event", EVENT_NAMES[record.event]);
+        cJSON_AddNumberToObject(event, "ms", (double)(record.time_us - newest) / 1000);
+        if (record.event == kLatencyEventStateChange) {
+            cJSON_AddNumberToObject(event, "state", record.arg);
+        }
+        cJSON_AddItemToArray(events, event);
+    }
+    cJSON_AddItemToObject(root, "events", events);
+
+    auto json_str = cJSON_PrintUnformatted(root);
+    std::string json(json_str);
+    cJSON_free(json_str);
+    cJSON_Delete(root);
+    return json;
+}
+
+void LatencyTrace::Reset() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    record_count_ = 0;
+    sample_count_ = 0;
+    std::fill(std::begin(last_time_us_), std::end(last_time_us_), 0);
+    std::fill(std::begin(measured_start_us_), std::end(measured_start_us_), 0);
+    std::fill(std::begin(histograms_), std::end(histograms_), LatencyHistogram());
+}
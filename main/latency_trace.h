@@ -0,0 +1,108 @@
+#ifndef LATENCY_TRACE_H
+#define LATENCY_TRACE_H
+
+#include <cstdint>
+#include <atomic>
+#include <mutex>
+#include <string>
+
+#define LATENCY_TRACE_SIZE 64
+#define LATENCY_BUCKET_COUNT 8
+
+enum LatencyEvent {
+    kLatencyEventWakeWord,
+    kLatencyEventStateChange,           // arg: the new DeviceState
+    kLatencyEventVoiceStart,
+    kLatencyEventVoiceEnd,
+    kLatencyEventFirstAudioSent,        // First uplink packet after entering listening
+    kLatencyEventStt,
+    kLatencyEventTtsStart,
+    kLatencyEventTtsSentenceStart,
+    kLatencyEventTtsStop,
+    kLatencyEventFirstAudioReceived,    // First downlink packet after tts start
+    kLatencyEventFirstAudioOutput,      // First PCM handed to the codec after tts start
+    kLatencyEventListening,             // Entered the listening state
+    kLatencyEventWakeWordAudioSent,     // The last packet of the wake word history went out
+    kLatencyEventListeningConnected,    // Entered listening on a channel that had to be connected first
+    kLatencyEventListeningWarm,         // Entered listening on a kept-warm channel
+    kLatencyEventCount
+};
+
+// Intervals derived from pairs of events
+enum LatencySpan {
+    kLatencySpanWakeWordToFirstSend,
+    kLatencySpanWakeWordToListening,
+    kLatencySpanWakeWordToListeningConnected,
+    kLatencySpanWakeWordToListeningWarm,
+    kLatencySpanWakeWordToAudioSent,
+    kLatencySpanVoiceEndToStt,
+    kLatencySpanSttToTtsStart,
+    kLatencySpanTtsStartToFirstAudio,
+    kLatencySpanFirstAudioToOutput,
+    kLatencySpanVoiceEndToOutput,
+    kLatencySpanCount
+};
+
+struct LatencyRecord {
+    int64_t time_us;
+    uint16_t event;
+    uint16_t reserved;
+    uint32_t arg;
+};
+
+struct LatencyHistogram {
+    uint32_t count = 0;
+    uint32_t max_ms = 0;
+    uint64_t total_ms = 0;
+    // Bucket i counts latencies below 50ms << i, the last bucket takes the rest
+    uint32_t buckets[LATENCY_BUCKET_COUNT] = {};
+};
+
+/*
+ * Timestamped trace of the voice pipeline, used to tune end-to-end latency.
+ *
+ * Events go into a fixed ring of records; every time an event closes a span
+ * (e.g. voice end -> first audio output) the interval is added to that span's
+ * histogram. First* events are only recorded once per turn after Arm(), so
+ * they can be called from the audio hot paths at the cost of an atomic load.
+ */
+class LatencyTrace {
+public:
+    static LatencyTrace& GetInstance() {
+        static LatencyTrace instance;
+        return instance;
+    }
+    // 删除拷贝构造函数和赋值运算符
+    LatencyTrace(const LatencyTrace&) = delete;
+    LatencyTrace& operator=(const LatencyTrace&) = delete;
+
+    void Record(LatencyEvent event, uint32_t arg = 0);
+    void Arm(LatencyEvent event);
+    inline void RecordFirst(LatencyEvent event) {
+        if (armed_.load(std::memory_order_relaxed) & (1u << event)) {
+            if (armed_.fetch_and(~(1u << event)) & (1u << event)) {
+                Record(event);
+            }
+        }
+    }
+
+    LatencyHistogram GetHistogram(LatencySpan span);
+    uint32_t GetSampleCount();
+    void Dump();
+    std::string GetJson();
+    void Reset();
+
+private:
+    LatencyTrace() = default;
+
+    std::mutex mutex_;
+    std::atomic<uint32_t> armed_ = 0;
+    LatencyRecord records_[LATENCY_TRACE_SIZE] = {};
+    uint32_t record_count_ = 0;
+    int64_t last_time_us_[kLatencyEventCount] = {};
+    int64_t measured_start_us_[kLatencySpanCount] = {};
+    LatencyHistogram histograms_[kLatencySpanCount];
+    uint32_t sample_count_ = 0;
+};
+
+#endif // LATENCY_TRACE_H
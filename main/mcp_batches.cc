@@ -0,0 +1,77 @@
+#include "mcp_server.h"
+
+void McpBatches::Begin() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    current_ = std::make_shared<Batch>();
+    task_ = xTaskGetCurrentTaskHandle();
+}
+
+std::string McpBatches::Seal(int& pending) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto batch = std::move(current_);
+    batch->sealed = true;
+    pending = batch->pending;
+    // A batch of only notifications gets no response at all
+    if (pending > 0 || batch->replies.empty()) {
+        return "";
+    }
+    return "[" + batch->replies + "]";
+}
+
+void McpBatches::AddCall(int id) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (current_ && xTaskGetCurrentTaskHandle() == task_) {
+        calls_[id] = current_;
+        current_->pending++;
+    }
+}
+
+std::string McpBatches::Reply(int id, const std::string& message) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto it = calls_.find(id);
+    if (it == calls_.end()) {
+        if (current_ && xTaskGetCurrentTaskHandle() == task_) {
+            return Collect(*current_, message);
+        }
+        return message;
+    }
+    // A tool call of a batch has finished
+    auto batch = std::move(it->second);
+    calls_.erase(it);
+    batch->pending--;
+    return Collect(*batch, message);
+}
+
+std::string McpBatches::Reply(const std::string& message) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (current_ && xTaskGetCurrentTaskHandle() == task_) {
+        return Collect(*current_, message);
+    }
+    return message;
+}
+
+std::string McpBatches::Drop(int id) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto it = calls_.find(id);
+    if (it == calls_.end()) {
+        return "";
+    }
+    auto batch = std::move(it->second);
+    calls_.erase(it);
+    // The rest of the batch must not wait for a reply that never comes
+    if (--batch->pending > 0 || !batch->sealed || batch->replies.empty()) {
+        return "";
+    }
+    return "[" + batch->replies + "]";
+}
+
+std::string McpBatches::Collect(Batch& batch, const std::string& message) {
+    if (!batch.replies.empty()) {
+        batch.replies += ',';
+    }
+    batch.replies += message;
+    if (!batch.sealed || batch.pending > 0) {
+        return "";
+    }
+    return "[" + batch.replies + "]";
+}
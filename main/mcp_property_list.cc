@@ -0,0 +1,81 @@
+#include "mcp_server.h"
+
+#include <cstring>
+#include <strings.h>
+
+int PropertyList::FindSlot(std::string_view name, bool ignore_case, uint32_t skip) const {
+    if (slot_table_.empty()) {
+        return -1;
+    }
+    size_t index = HashName(name) % kSlotTableSize;
+    int best = -1;
+    // Names that differ only in case share a probe chain, so walk it to its end
+    for (; slot_table_[index] != 0; index = (index + 1) % kSlotTableSize) {
+        int slot = slot_table_[index] - 1;
+        auto& property_name = properties_[slot].name();
+        if (property_name.size() != name.size() || (skip & (1u << slot))) {
+            continue;
+        }
+        if (!ignore_case) {
+            if (property_name == name) {
+                return slot;
+            }
+        } else if (strncasecmp(property_name.data(), name.data(), name.size()) == 0 && (best < 0 || slot < best)) {
+            best = slot;
+        }
+    }
+    return best;
+}
+
+bool PropertyList::Bind(const cJSON* json, PropertyList& arguments, std::string& error) const {
+    auto& schema = schema_list();
+    auto& properties = schema.properties_;
+    arguments.schema_ = &schema;
+    arguments.values_.resize(properties.size());
+
+    uint32_t found = 0;
+    const cJSON* item;
+    cJSON_ArrayForEach(item, json) {
+        if (item->string == nullptr) {
+            continue;
+        }
+        // Case insensitive and first one wins, like cJSON_GetObjectItem
+        int i = schema.FindSlot(item->string, true, found);
+        if (i < 0) {
+            continue;
+        }
+        auto& property = properties[i];
+        auto& value = arguments.values_[i].data;
+        if (property.type() == kPropertyTypeBoolean && cJSON_IsBool(item)) {
+            value = (bool)cJSON_IsTrue(item);
+        } else if (property.type() == kPropertyTypeInteger && cJSON_IsNumber(item)) {
+            if (property.has_range() && item->valueint < property.min_value()) {
+                error = "Value is below minimum allowed: " + std::to_string(property.min_value());
+                return false;
+            }
+            if (property.has_range() && item->valueint > property.max_value()) {
+                error = "Value exceeds maximum allowed: " + std::to_string(property.max_value());
+                return false;
+            }
+            value = item->valueint;
+        } else if (property.type() == kPropertyTypeString && cJSON_IsString(item)) {
+            value = std::string(item->valuestring);
+        } else {
+            // A value of the wrong type counts as missing
+            continue;
+        }
+        found |= 1u << i;
+    }
+
+    for (size_t i = 0; i < properties.size(); i++) {
+        if (found & (1u << i)) {
+            continue;
+        }
+        if (!properties[i].has_default_value()) {
+            error = "Missing valid argument: " + properties[i].name();
+            return false;
+        }
+        arguments.values_[i] = properties[i].default_value();
+    }
+    return true;
+}
@@ -8,17 +8,26 @@
 #include <esp_app_desc.h>
 #include <algorithm>
 #include <cstring>
-#include <esp_pthread.h>
 
 #include "application.h"
 #include "display.h"
 #include "board.h"
+#include "latency_trace.h"
+#include "json_writer.h"
 
 #define TAG "MCP"
 
 #define DEFAULT_TOOLCALL_STACK_SIZE 6144
+#define MCP_STREAM_CHUNK_SIZE 1024
+#define MCP_STREAM_MAX_IN_FLIGHT 2
 
 McpServer::McpServer() {
+    tool_call_pool_.OnResult([this](int id, const std::string& result) {
+        ReplyResult(id, result);
+    });
+    tool_call_pool_.OnError([this](int id, const std::string& message) {
+        ReplyError(id, message);
+    });
 }
 
 McpServer::~McpServer() {
@@ -26,6 +35,7 @@ McpServer::~McpServer() {
         delete tool;
     }
     tools_.clear();
+    tool_index_.clear();
 }
 
 void McpServer::AddCommonTools() {
@@ -94,32 +104,69 @@ void McpServer::AddCommonTools() {
             PropertyList({
                 Property("question", kPropertyTypeString)
             }),
-            [camera](const PropertyList& properties) -> ReturnValue {
+            [this, camera](const PropertyList& properties) -> ReturnValue {
                 if (!camera->Capture()) {
                     return "{\"success\": false, \"message\": \"Failed to capture photo\"}";
                 }
+                NotifyProgress(1, 2, "Photo captured");
                 auto question = properties["question"].value<std::string>();
-                return camera->Explain(question);
-            });
+                return camera->Explain(question, [this](std::string_view data) {
+                    return StreamResult(data);
+                });
+            },
+            // Uploads the photo and waits for the explanation over HTTP
+            McpToolOptions{ kToolStackLarge, "", 60000 });
     }
 
+#if CONFIG_USE_LATENCY_TRACE_TOOL
+    AddTool("self.debug.get_latency_stats",
+        "Get the voice pipeline latency histograms and the most recent trace events of the device.\n"
+        "Use this tool only when the user asks for latency or performance diagnostics.",
+        PropertyList(),
+        [](const PropertyList& properties) -> ReturnValue {
+            return LatencyTrace::GetInstance().GetJson();
+        });
+
+    AddTool("self.debug.get_encoder_status",
+        "Get the current Opus encoder settings of the device, why the encoder controller chose them, and how the encode and decode jobs queue up.\n"
+        "Use this tool only when the user asks for audio upload or performance diagnostics.",
+        PropertyList(),
+        [](const PropertyList& properties) -> ReturnValue {
+            return Application::GetInstance().GetEncoderStatusJson();
+        });
+
+    AddTool("self.debug.get_tool_call_stats",
+        "Get how long the tool calls of the device waited in the queue and ran, per tool.\n"
+        "Use this tool only when the user asks for tool call performance diagnostics.",
+        PropertyList(),
+        [this](const PropertyList& properties) -> ReturnValue {
+            return tool_call_pool_.GetStatsJson();
+        });
+#endif
+
     // Restore the original tools list to the end of the tools list
     tools_.insert(tools_.end(), original_tools.begin(), original_tools.end());
+    tools_pages_.clear();
 }
 
 void McpServer::AddTool(McpTool* tool) {
-    // Prevent adding duplicate tools
-    if (std::find_if(tools_.begin(), tools_.end(), [tool](const McpTool* t) { return t->name() == tool->name(); }) != tools_.end()) {
+    // Prevent adding duplicate tools, the index still holds the tools moved aside by AddCommonTools
+    if (tool_index_.find(tool->name()) != tool_index_.end()) {
         ESP_LOGW(TAG, "Tool %s already added", tool->name().c_str());
+        delete tool;
         return;
     }
 
     ESP_LOGI(TAG, "Add tool: %s", tool->name().c_str());
     tools_.push_back(tool);
+    tool_index_.emplace(tool->name(), tool);
+    tools_pages_.clear();
+    NotifyToolsChanged();
 }
 
-void McpServer::AddTool(const std::string& name, const std::string& description, const PropertyList& properties, std::function<ReturnValue(const PropertyList&)> callback) {
-    AddTool(new McpTool(name, description, properties, callback));
+void McpServer::AddTool(const std::string& name, const std::string& description, const PropertyList& properties, std::function<ReturnValue(const PropertyList&)> callback,
+    const McpToolOptions& options) {
+    AddTool(new McpTool(name, description, properties, callback, options));
 }
 
 void McpServer::ParseMessage(const std::string& message) {
@@ -133,6 +180,9 @@ void McpServer::ParseMessage(const std::string& message) {
 }
 
 void McpServer::ParseCapabilities(const cJSON* capabilities) {
+    // Result chunks in notifications/progress are our own extension, a client that
+    // does not know them would only see the tail of the result
+    result_streaming_ = cJSON_IsTrue(cJSON_GetObjectItem(capabilities, "resultStreaming"));
     auto vision = cJSON_GetObjectItem(capabilities, "vision");
     if (cJSON_IsObject(vision)) {
         auto url = cJSON_GetObjectItem(vision, "url");
@@ -151,7 +201,45 @@ void McpServer::ParseCapabilities(const cJSON* capabilities) {
     }
 }
 
+// JSON-RPC 2.0 answers an element of a batch that is not a request object with this
+static const char kInvalidRequestError[] =
+    "{\"jsonrpc\":\"2.0\",\"id\":null,\"error\":{\"code\":-32600,\"message\":\"Invalid Request\"}}";
+
+void McpServer::ParseBatch(const cJSON* json) {
+    // An empty batch is an invalid request itself, answered with one error and no array
+    if (json->child == nullptr) {
+        ESP_LOGE(TAG, "Empty batch");
+        Application::GetInstance().SendMcpMessage(kInvalidRequestError);
+        return;
+    }
+
+    batches_.Begin();
+    int count = 0;
+    cJSON* request;
+    cJSON_ArrayForEach(request, json) {
+        count++;
+        if (!cJSON_IsObject(request)) {
+            ESP_LOGE(TAG, "Invalid request in batch");
+            batches_.Reply(kInvalidRequestError);
+            continue;
+        }
+        ParseMessage(request);
+    }
+
+    int pending;
+    auto replies = batches_.Seal(pending);
+    ESP_LOGI(TAG, "Batch of %d requests, %d tool calls pending", count, pending);
+    if (!replies.empty()) {
+        Application::GetInstance().SendMcpMessage(replies);
+    }
+}
+
 void McpServer::ParseMessage(const cJSON* json) {
+    if (cJSON_IsArray(json)) {
+        ParseBatch(json);
+        return;
+    }
+
     // Check JSONRPC version
     auto version = cJSON_GetObjectItem(json, "jsonrpc");
     if (version == nullptr || !cJSON_IsString(version) || strcmp(version->valuestring, "2.0") != 0) {
@@ -167,6 +255,15 @@ void McpServer::ParseMessage(const cJSON* json) {
     }
     
     auto method_str = std::string(method->valuestring);
+    if (method_str == "notifications/cancelled") {
+        // The server no longer wants the reply, drop the call if it has not finished
+        auto params = cJSON_GetObjectItem(json, "params");
+        auto request_id = cJSON_GetObjectItem(params, "requestId");
+        if (cJSON_IsNumber(request_id) && tool_call_pool_.Cancel(request_id->valueint)) {
+            DropReply(request_id->valueint);
+        }
+        return;
+    }
     if (method_str.find("notifications") == 0) {
         return;
     }
@@ -186,17 +283,25 @@ void McpServer::ParseMessage(const cJSON* json) {
     auto id_int = id->valueint;
     
     if (method_str == "initialize") {
+        result_streaming_ = false;
         if (cJSON_IsObject(params)) {
             auto capabilities = cJSON_GetObjectItem(params, "capabilities");
             if (cJSON_IsObject(capabilities)) {
                 ParseCapabilities(capabilities);
             }
         }
+        initialized_ = true;
         auto app_desc = esp_app_get_description();
-        std::string message = "{\"protocolVersion\":\"2024-11-05\",\"capabilities\":{\"tools\":{}},\"serverInfo\":{\"name\":\"" BOARD_NAME "\",\"version\":\"";
-        message += app_desc->version;
-        message += "\"}}";
-        ReplyResult(id_int, message);
+        JsonWriter json(128);
+        json.BeginObject();
+        json.Field("protocolVersion", "2024-11-05");
+        json.Key("capabilities").BeginObject().Key("tools").BeginObject().Field("listChanged", true).EndObject().EndObject();
+        json.Key("serverInfo").BeginObject();
+        json.Field("name", BOARD_NAME);
+        json.Field("version", app_desc->version);
+        json.EndObject();
+        json.EndObject();
+        ReplyResult(id_int, json.str());
     } else if (method_str == "tools/list") {
         std::string cursor_str = "";
         if (params != nullptr) {
@@ -230,7 +335,18 @@ void McpServer::ParseMessage(const cJSON* json) {
             ReplyError(id_int, "Invalid stackSize");
             return;
         }
-        DoToolCall(id_int, std::string(tool_name->valuestring), tool_arguments, stack_size ? stack_size->valueint : DEFAULT_TOOLCALL_STACK_SIZE);
+        // Kept as JSON, the token goes back verbatim in notifications/progress
+        std::string progress_token;
+        auto meta = cJSON_GetObjectItem(params, "_meta");
+        auto token = cJSON_GetObjectItem(meta, "progressToken");
+        if (cJSON_IsString(token)) {
+            JsonWriter json(16 + strlen(token->valuestring));
+            progress_token = json.String(token->valuestring).str();
+        } else if (cJSON_IsNumber(token)) {
+            progress_token = std::to_string(token->valueint);
+        }
+        DoToolCall(id_int, std::string(tool_name->valuestring), tool_arguments, stack_size ? stack_size->valueint : DEFAULT_TOOLCALL_STACK_SIZE,
+            progress_token);
     } else {
         ESP_LOGE(TAG, "Method not implemented: %s", method_str.c_str());
         ReplyError(id_int, "Method not implemented: " + method_str);
@@ -238,130 +354,241 @@ void McpServer::ParseMessage(const cJSON* json) {
 }
 
 void McpServer::ReplyResult(int id, const std::string& result) {
-    std::string payload = "{\"jsonrpc\":\"2.0\",\"id\":";
-    payload += std::to_string(id) + ",\"result\":";
-    payload += result;
-    payload += "}";
-    Application::GetInstance().SendMcpMessage(payload);
+    JsonWriter json(48 + result.size());
+    json.BeginObject();
+    json.Field("jsonrpc", "2.0");
+    json.Field("id", id);
+    json.RawField("result", result);
+    json.EndObject();
+    SendReply(id, json.str());
 }
 
 void McpServer::ReplyError(int id, const std::string& message) {
-    std::string payload = "{\"jsonrpc\":\"2.0\",\"id\":";
-    payload += std::to_string(id);
-    payload += ",\"error\":{\"message\":\"";
-    payload += message;
-    payload += "\"}}";
-    Application::GetInstance().SendMcpMessage(payload);
+    JsonWriter json(64 + message.size());
+    json.BeginObject();
+    json.Field("jsonrpc", "2.0");
+    json.Field("id", id);
+    json.Key("error").BeginObject();
+    json.Field("message", message);
+    json.EndObject();
+    json.EndObject();
+    SendReply(id, json.str());
 }
 
-void McpServer::GetToolsList(int id, const std::string& cursor) {
-    const int max_payload_size = 8000;
-    std::string json = "{\"tools\":[";
-    
-    bool found_cursor = cursor.empty();
-    auto it = tools_.begin();
-    std::string next_cursor = "";
-    
-    while (it != tools_.end()) {
-        // 如果我们还没有找到起始位置，继续搜索
-        if (!found_cursor) {
-            if ((*it)->name() == cursor) {
-                found_cursor = true;
-            } else {
-                ++it;
-                continue;
-            }
+void McpServer::SendReply(int id, const std::string& message) {
+    auto reply = batches_.Reply(id, message);
+    if (!reply.empty()) {
+        Application::GetInstance().SendMcpMessage(reply);
+    }
+}
+
+void McpServer::DropReply(int id) {
+    auto replies = batches_.Drop(id);
+    if (!replies.empty()) {
+        Application::GetInstance().SendMcpMessage(replies);
+    }
+}
+
+void McpServer::SendNotification(const char* method, std::string_view params, std::function<void()> on_sent) {
+    JsonWriter json(64 + params.size());
+    json.BeginObject();
+    json.Field("jsonrpc", "2.0");
+    json.Field("method", method);
+    if (!params.empty()) {
+        json.RawField("params", params);
+    }
+    json.EndObject();
+    Application::GetInstance().SendMcpMessage(json.str(), on_sent);
+}
+
+void McpServer::NotifyToolsChanged() {
+    // Tools added before the client initialized are in its first tools/list anyway
+    if (!initialized_ || tools_changed_pending_.exchange(true)) {
+        return;
+    }
+    // Tools usually come in groups, send one notification after the group is in
+    Application::GetInstance().Schedule([this]() {
+        tools_changed_pending_ = false;
+        SendNotification("notifications/tools/list_changed");
+    });
+}
+
+void McpServer::NotifyProgress(int progress, int total, const std::string& message) {
+    auto progress_token = tool_call_pool_.GetProgressToken();
+    if (progress_token.empty()) {
+        return;
+    }
+    JsonWriter json(96 + progress_token.size() + message.size());
+    json.BeginObject();
+    json.RawField("progressToken", progress_token);
+    json.Field("progress", progress);
+    if (total > 0) {
+        json.Field("total", total);
+    }
+    if (!message.empty()) {
+        json.Field("message", message);
+    }
+    json.EndObject();
+    SendNotification("notifications/progress", json.str());
+}
+
+std::shared_ptr<McpServer::ResultStream> McpServer::GetResultStream() {
+    std::lock_guard<std::mutex> lock(stream_mutex_);
+    auto it = streams_.find(xTaskGetCurrentTaskHandle());
+    return it == streams_.end() ? nullptr : it->second;
+}
+
+bool McpServer::StreamResult(std::string_view text) {
+    auto stream = GetResultStream();
+    if (!stream) {
+        ESP_LOGW(TAG, "StreamResult: no tool call runs on this task");
+        return false;
+    }
+    if (stream->progress_token.empty()) {
+        // Not negotiated or no progress wanted, the reply carries the whole text
+        stream->pending.append(text);
+        return true;
+    }
+
+    stream->pending.append(text);
+    while (stream->pending.size() >= MCP_STREAM_CHUNK_SIZE) {
+        if (tool_call_pool_.GetProgressToken().empty()) {
+            // Cancelled or timed out, the rest of the result would be dropped anyway
+            stream->pending.clear();
+            stream->pending.shrink_to_fit();
+            return false;
         }
-        
-        // 添加tool前检查大小
-        std::string tool_json = (*it)->to_json() + ",";
-        if (json.length() + tool_json.length() + 30 > max_payload_size) {
-            // 如果添加这个tool会超出大小限制，设置next_cursor并退出循环
-            next_cursor = (*it)->name();
-            break;
+        // Do not split a UTF-8 sequence, the client decodes each chunk on its own
+        size_t size = MCP_STREAM_CHUNK_SIZE;
+        while (size > 0 && ((uint8_t)stream->pending[size] & 0xC0) == 0x80) {
+            size--;
         }
-        
-        json += tool_json;
-        ++it;
+        SendResultChunk(stream, size > 0 ? size : MCP_STREAM_CHUNK_SIZE);
     }
-    
-    if (json.back() == ',') {
-        json.pop_back();
+    return true;
+}
+
+void McpServer::SendResultChunk(const std::shared_ptr<ResultStream>& stream, size_t size) {
+    {
+        // Chunks wait in the main loop until they are sent, keep only a few of them there
+        std::unique_lock<std::mutex> lock(stream->mutex);
+        while (!stream->condition_variable.wait_for(lock, std::chrono::seconds(1),
+            [&stream]() { return stream->in_flight < MCP_STREAM_MAX_IN_FLIGHT; })) {
+            ESP_LOGW(TAG, "StreamResult: waiting for the main loop to send %d chunks", stream->in_flight);
+        }
+        stream->in_flight++;
     }
-    
-    if (json.back() == '[' && !tools_.empty()) {
+
+    auto chunk = std::string_view(stream->pending).substr(0, size);
+    stream->sent += size;
+    JsonWriter json(128 + stream->progress_token.size() + size * 2);
+    json.BeginObject();
+    json.RawField("progressToken", stream->progress_token);
+    json.Field("progress", (int)stream->sent);
+    json.Key("content").BeginArray();
+    json.BeginObject();
+    json.Field("type", "text");
+    json.Field("text", chunk);
+    json.EndObject();
+    json.EndArray();
+    json.EndObject();
+    stream->pending.erase(0, size);
+
+    SendNotification("notifications/progress", json.str(), [stream]() {
+        {
+            std::lock_guard<std::mutex> lock(stream->mutex);
+            stream->in_flight--;
+        }
+        stream->condition_variable.notify_all();
+    });
+}
+
+void McpServer::GetToolsList(int id, const std::string& cursor) {
+    if (tools_pages_.empty()) {
+        tools_pages_ = BuildToolsPages(tools_, MAX_TOOLS_LIST_PAYLOAD_SIZE);
+        ESP_LOGI(TAG, "tools/list: %u tools in %u pages", tools_.size(), tools_pages_.size());
+    }
+
+    // A cursor is the name of the first tool on its page, there are only a few pages
+    auto page = std::find_if(tools_pages_.begin(), tools_pages_.end(),
+        [&cursor](const McpToolsPage& page) { return page.cursor == cursor; });
+    if (page == tools_pages_.end()) {
+        ESP_LOGE(TAG, "tools/list: Invalid cursor: %s", cursor.c_str());
+        ReplyError(id, "Invalid cursor: " + cursor);
+        return;
+    }
+    if (page->result.empty()) {
         // 如果没有添加任何tool，返回错误
-        ESP_LOGE(TAG, "tools/list: Failed to add tool %s because of payload size limit", next_cursor.c_str());
-        ReplyError(id, "Failed to add tool " + next_cursor + " because of payload size limit");
+        ESP_LOGE(TAG, "tools/list: Failed to add tool %s because of payload size limit", page->cursor.c_str());
+        ReplyError(id, "Failed to add tool " + page->cursor + " because of payload size limit");
         return;
     }
 
-    if (next_cursor.empty()) {
-        json += "]}";
-    } else {
-        json += "],\"nextCursor\":\"" + next_cursor + "\"}";
-    }
-    
-    ReplyResult(id, json);
+    ReplyResult(id, page->result);
 }
 
-void McpServer::DoToolCall(int id, const std::string& tool_name, const cJSON* tool_arguments, int stack_size) {
-    auto tool_iter = std::find_if(tools_.begin(), tools_.end(), 
-                                 [&tool_name](const McpTool* tool) { 
-                                     return tool->name() == tool_name; 
-                                 });
-    
-    if (tool_iter == tools_.end()) {
+void McpServer::DoToolCall(int id, const std::string& tool_name, const cJSON* tool_arguments, int stack_size, const std::string& progress_token) {
+    auto tool_iter = tool_index_.find(tool_name);
+    if (tool_iter == tool_index_.end()) {
         ESP_LOGE(TAG, "tools/call: Unknown tool: %s", tool_name.c_str());
         ReplyError(id, "Unknown tool: " + tool_name);
         return;
     }
 
-    PropertyList arguments = (*tool_iter)->properties();
-    try {
-        for (auto& argument : arguments) {
-            bool found = false;
-            if (cJSON_IsObject(tool_arguments)) {
-                auto value = cJSON_GetObjectItem(tool_arguments, argument.name().c_str());
-                if (argument.type() == kPropertyTypeBoolean && cJSON_IsBool(value)) {
-                    argument.set_value<bool>(value->valueint == 1);
-                    found = true;
-                } else if (argument.type() == kPropertyTypeInteger && cJSON_IsNumber(value)) {
-                    argument.set_value<int>(value->valueint);
-                    found = true;
-                } else if (argument.type() == kPropertyTypeString && cJSON_IsString(value)) {
-                    argument.set_value<std::string>(value->valuestring);
-                    found = true;
-                }
-            }
-
-            if (!argument.has_default_value() && !found) {
-                ESP_LOGE(TAG, "tools/call: Missing valid argument: %s", argument.name().c_str());
-                ReplyError(id, "Missing valid argument: " + argument.name());
-                return;
-            }
-        }
-    } catch (const std::runtime_error& e) {
-        ESP_LOGE(TAG, "tools/call: %s", e.what());
-        ReplyError(id, e.what());
+    auto tool = tool_iter->second;
+    PropertyList arguments;
+    std::string error;
+    if (!tool->properties().Bind(tool_arguments, arguments, error)) {
+        ESP_LOGE(TAG, "tools/call: %s", error.c_str());
+        ReplyError(id, error);
         return;
     }
 
-    // Start a task to receive data with stack size
-    esp_pthread_cfg_t cfg = esp_pthread_get_default_config();
-    cfg.thread_name = "tool_call";
-    cfg.stack_size = stack_size;
-    cfg.prio = 1;
-    esp_pthread_set_cfg(&cfg);
-
-    // Use a thread to call the tool to avoid blocking the main thread
-    tool_call_thread_ = std::thread([this, id, tool_iter, arguments = std::move(arguments)]() {
+    // A stackSize from the server still picks the worker, for tools that do not declare it
+    ToolCallRequest request;
+    request.id = id;
+    request.name = tool->name();
+    request.resource = tool->options().resource;
+    request.stack_class = tool->options().stack_class;
+    request.timeout_ms = tool->options().timeout_ms;
+    request.progress_token = progress_token;
+    if (stack_size > TOOL_CALL_SMALL_STACK_SIZE) {
+        request.stack_class = kToolStackLarge;
+        if (stack_size > TOOL_CALL_LARGE_STACK_SIZE) {
+            ESP_LOGW(TAG, "tools/call: stackSize %d is larger than the workers have", stack_size);
+        }
+    }
+    request.run = [this, tool, progress_token, arguments = std::move(arguments)]() {
+        // The tool may stream its result, see StreamResult()
+        auto stream = std::make_shared<ResultStream>();
+        if (result_streaming_) {
+            stream->progress_token = progress_token;
+        }
+        auto task = xTaskGetCurrentTaskHandle();
+        {
+            std::lock_guard<std::mutex> lock(stream_mutex_);
+            streams_[task] = stream;
+        }
+        std::string result;
         try {
-            ReplyResult(id, (*tool_iter)->Call(arguments));
-        } catch (const std::runtime_error& e) {
-            ESP_LOGE(TAG, "tools/call: %s", e.what());
-            ReplyError(id, e.what());
+            // Whatever was streamed but not sent yet goes in front of the return value
+            result = tool->Call(arguments, stream->pending);
+        } catch (...) {
+            std::lock_guard<std::mutex> lock(stream_mutex_);
+            streams_.erase(task);
+            throw;
         }
-    });
-    tool_call_thread_.detach();
+        std::lock_guard<std::mutex> lock(stream_mutex_);
+        streams_.erase(task);
+        if (stream->sent > 0) {
+            ESP_LOGI(TAG, "%s: streamed %u bytes ahead of the result", tool->name().c_str(), stream->sent);
+        }
+        return result;
+    };
+
+    // Inside a batch the reply is collected when the call finishes
+    batches_.AddCall(id);
+    if (!tool_call_pool_.Submit(std::move(request))) {
+        ReplyError(id, "Too many tool calls in progress or no worker to run it");
+    }
 }
\ No newline at end of file
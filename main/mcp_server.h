@@ -8,10 +8,17 @@
 #include <variant>
 #include <optional>
 #include <stdexcept>
-#include <thread>
+#include <string_view>
+#include <unordered_map>
+#include <memory>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
 
 #include <cJSON.h>
 
+#include "tool_call_pool.h"
+
 // 添加类型别名
 using ReturnValue = std::variant<bool, int, std::string>;
 
@@ -21,11 +28,21 @@ enum PropertyType {
     kPropertyTypeString
 };
 
+// The value of a property, or of an argument bound to it
+struct PropertyValue {
+    std::variant<bool, int, std::string> data;
+
+    template<typename T>
+    inline T value() const {
+        return std::get<T>(data);
+    }
+};
+
 class Property {
 private:
     std::string name_;
     PropertyType type_;
-    std::variant<bool, int, std::string> value_;
+    PropertyValue value_;
     bool has_default_value_;
     std::optional<int> min_value_;  // 新增：整数最小值
     std::optional<int> max_value_;  // 新增：整数最大值
@@ -39,7 +56,7 @@ public:
     template<typename T>
     Property(const std::string& name, PropertyType type, const T& default_value)
         : name_(name), type_(type), has_default_value_(true) {
-        value_ = default_value;
+        value_.data = default_value;
     }
 
     Property(const std::string& name, PropertyType type, int min_value, int max_value)
@@ -57,7 +74,7 @@ public:
         if (default_value < min_value || default_value > max_value) {
             throw std::invalid_argument("Default value must be within the specified range");
         }
-        value_ = default_value;
+        value_.data = default_value;
     }
 
     inline const std::string& name() const { return name_; }
@@ -66,10 +83,11 @@ public:
     inline bool has_range() const { return min_value_.has_value() && max_value_.has_value(); }
     inline int min_value() const { return min_value_.value_or(0); }
     inline int max_value() const { return max_value_.value_or(0); }
+    inline const PropertyValue& default_value() const { return value_; }
 
     template<typename T>
     inline T value() const {
-        return std::get<T>(value_);
+        return value_.value<T>();
     }
 
     template<typename T>
@@ -83,7 +101,7 @@ public:
                 throw std::invalid_argument("Value exceeds maximum allowed: " + std::to_string(max_value_.value()));
             }
         }
-        value_ = value;
+        value_.data = value;
     }
 
     std::string to_json() const {
@@ -121,26 +139,93 @@ public:
     }
 };
 
+/*
+ * The properties of a tool, or the arguments of one call to it.
+ *
+ * A tool keeps its PropertyList as the schema. Bind() checks the arguments of a
+ * call against it in one pass and makes an argument list that refers back to the
+ * schema for names and holds only the values, slot i for property i. Lists that
+ * are not bound hold the default values.
+ */
 class PropertyList {
 private:
+    // Bind() keeps one bit per property
+    static constexpr size_t kMaxProperties = 32;
+    // Open addressed, at most half full
+    static constexpr size_t kSlotTableSize = 2 * kMaxProperties;
+
     std::vector<Property> properties_;
+    const PropertyList* schema_ = nullptr;
+    std::vector<PropertyValue> values_;
+    // Property index + 1 by the case folded hash of its name, 0 for empty. Filled as
+    // properties are added, so a tool's slots are resolved when it is registered.
+    // Argument lists use their schema's table and leave theirs empty
+    std::vector<uint8_t> slot_table_;
+
+    inline const PropertyList& schema_list() const {
+        return schema_ != nullptr ? *schema_ : *this;
+    }
+
+    inline const std::vector<Property>& schema() const {
+        return schema_list().properties_;
+    }
+
+    // Or-ing in 0x20 folds case, and names equal to strcasecmp() still hash the same
+    static inline size_t HashName(std::string_view name) {
+        if (name.empty()) {
+            return 0;
+        }
+        return name.size() * 31 + (name.front() | 0x20) * 7 + (name.back() | 0x20);
+    }
+
+    // The slot of `name` in this schema or -1. Case insensitive lookups skip the slots set
+    // in `skip` and, like the old linear scan, find the lowest matching slot first
+    int FindSlot(std::string_view name, bool ignore_case, uint32_t skip = 0) const;
 
 public:
     PropertyList() = default;
-    PropertyList(const std::vector<Property>& properties) : properties_(properties) {}
+    PropertyList(const std::vector<Property>& properties) {
+        for (const auto& property : properties) {
+            AddProperty(property);
+        }
+    }
     void AddProperty(const Property& property) {
+        if (properties_.size() == kMaxProperties) {
+            throw std::invalid_argument("Too many properties");
+        }
+        slot_table_.resize(kSlotTableSize);
+        size_t index = HashName(property.name()) % kSlotTableSize;
+        while (slot_table_[index] != 0) {
+            index = (index + 1) % kSlotTableSize;
+        }
         properties_.push_back(property);
+        values_.push_back(property.default_value());
+        slot_table_[index] = properties_.size();
     }
 
-    const Property& operator[](const std::string& name) const {
-        for (const auto& property : properties_) {
-            if (property.name() == name) {
-                return property;
-            }
+    // Resolve the index once to read a value repeatedly without the name lookup
+    int IndexOf(std::string_view name) const {
+        return schema_list().FindSlot(name, false);
+    }
+
+    // Throws for a name the tool did not declare, the tool call pool reports it as an error
+    const PropertyValue& operator[](std::string_view name) const {
+        auto index = IndexOf(name);
+        if (index < 0) {
+            throw std::runtime_error("Property not found: " + std::string(name));
         }
-        throw std::runtime_error("Property not found: " + name);
+        return values_[index];
+    }
+
+    template<typename T>
+    inline T value(int index) const {
+        return values_[index].value<T>();
     }
 
+    // Fills `arguments` from the JSON object of a call, which may be null. Returns false
+    // with `error` set if a required argument is missing or a value is out of range
+    bool Bind(const cJSON* json, PropertyList& arguments, std::string& error) const;
+
     auto begin() { return properties_.begin(); }
     auto end() { return properties_.end(); }
 
@@ -171,26 +256,49 @@ public:
     }
 };
 
+// How a tool is run by the tool call pool
+struct McpToolOptions {
+    ToolStackClass stack_class = kToolStackSmall;
+    // Calls on the same resource never overlap. Empty means the name without its
+    // last part, e.g. `self.audio_speaker` for `self.audio_speaker.set_volume`
+    std::string resource;
+    int timeout_ms = TOOL_CALL_DEFAULT_TIMEOUT_MS;
+};
+
 class McpTool {
 private:
     std::string name_;
     std::string description_;
     PropertyList properties_;
     std::function<ReturnValue(const PropertyList&)> callback_;
+    McpToolOptions options_;
+    std::string json_;
 
 public:
     McpTool(const std::string& name, 
             const std::string& description, 
             const PropertyList& properties, 
-            std::function<ReturnValue(const PropertyList&)> callback)
+            std::function<ReturnValue(const PropertyList&)> callback,
+            const McpToolOptions& options = McpToolOptions())
         : name_(name), 
         description_(description), 
         properties_(properties), 
-        callback_(callback) {}
+        callback_(callback),
+        options_(options) {
+        // Tools directly under `self`, such as self.get_device_status, only read state
+        auto last_dot = name_.rfind('.');
+        if (options_.resource.empty() && last_dot != std::string::npos && name_.find('.') != last_dot) {
+            options_.resource = name_.substr(0, last_dot);
+        }
+        // A tool never changes once created, so its descriptor is built only once
+        json_ = to_json();
+    }
 
     inline const std::string& name() const { return name_; }
     inline const std::string& description() const { return description_; }
     inline const PropertyList& properties() const { return properties_; }
+    inline const McpToolOptions& options() const { return options_; }
+    inline const std::string& json() const { return json_; }
 
     std::string to_json() const {
         std::vector<std::string> required = properties_.GetRequired();
@@ -223,20 +331,24 @@ public:
         return result;
     }
 
-    std::string Call(const PropertyList& properties) {
+    // `streamed` is read after the tool returns: what it streamed but was not sent
+    // ahead yet, which goes before the return value
+    std::string Call(const PropertyList& properties, const std::string& streamed = "") {
         ReturnValue return_value = callback_(properties);
         // 返回结果
-        cJSON* result = cJSON_CreateObject();
-        cJSON* content = cJSON_CreateArray();
-        cJSON* text = cJSON_CreateObject();
-        cJSON_AddStringToObject(text, "type", "text");
+        std::string text_str = streamed;
         if (std::holds_alternative<std::string>(return_value)) {
-            cJSON_AddStringToObject(text, "text", std::get<std::string>(return_value).c_str());
+            text_str += std::get<std::string>(return_value);
         } else if (std::holds_alternative<bool>(return_value)) {
-            cJSON_AddStringToObject(text, "text", std::get<bool>(return_value) ? "true" : "false");
+            text_str += std::get<bool>(return_value) ? "true" : "false";
         } else if (std::holds_alternative<int>(return_value)) {
-            cJSON_AddStringToObject(text, "text", std::to_string(std::get<int>(return_value)).c_str());
+            text_str += std::to_string(std::get<int>(return_value));
         }
+        cJSON* result = cJSON_CreateObject();
+        cJSON* content = cJSON_CreateArray();
+        cJSON* text = cJSON_CreateObject();
+        cJSON_AddStringToObject(text, "type", "text");
+        cJSON_AddStringToObject(text, "text", text_str.c_str());
         cJSON_AddItemToArray(content, text);
         cJSON_AddItemToObject(result, "content", content);
         cJSON_AddBoolToObject(result, "isError", false);
@@ -249,6 +361,52 @@ public:
     }
 };
 
+#define MAX_TOOLS_LIST_PAYLOAD_SIZE 8000
+
+// One page of the tools/list result
+struct McpToolsPage {
+    std::string cursor;     // Name of the first tool, empty for the first page
+    std::string result;     // Empty if the first tool alone exceeds the payload limit
+};
+
+// Cuts the tools/list result into pages of at most max_payload_size bytes, each
+// naming the first tool of the next page as its nextCursor
+std::vector<McpToolsPage> BuildToolsPages(const std::vector<McpTool*>& tools, size_t max_payload_size);
+
+// Replies to JSON-RPC batches. A batch is answered with one array, once all of its
+// requests have been dispatched and its tool calls have finished or were cancelled
+class McpBatches {
+public:
+    // Replies made on the calling task from now on belong to a new batch
+    void Begin();
+    // Every request of the batch has been dispatched. Returns the array to send, empty
+    // while tool calls are pending or if no request wanted a reply
+    std::string Seal(int& pending);
+    // A tool call dispatched on the batch task, its reply is collected when it finishes
+    void AddCall(int id);
+    // Returns what to send for the reply to request id: the reply itself outside a
+    // batch, the array it completes, or nothing while the batch waits for more
+    std::string Reply(int id, const std::string& message);
+    // A reply on the batch task that answers no id, like the error for an invalid request
+    std::string Reply(const std::string& message);
+    // The tool call was cancelled, returns the array if the batch only waited for it
+    std::string Drop(int id);
+
+private:
+    struct Batch {
+        std::string replies;
+        int pending = 0;            // Tool calls still running
+        bool sealed = false;        // Every request of the batch has been dispatched
+    };
+    std::mutex mutex_;
+    // The batch being dispatched, it takes the replies made on task_
+    std::shared_ptr<Batch> current_;
+    TaskHandle_t task_ = nullptr;
+    std::map<int, std::shared_ptr<Batch>> calls_;
+
+    std::string Collect(Batch& batch, const std::string& message);
+};
+
 class McpServer {
 public:
     static McpServer& GetInstance() {
@@ -258,24 +416,62 @@ public:
 
     void AddCommonTools();
     void AddTool(McpTool* tool);
-    void AddTool(const std::string& name, const std::string& description, const PropertyList& properties, std::function<ReturnValue(const PropertyList&)> callback);
+    void AddTool(const std::string& name, const std::string& description, const PropertyList& properties, std::function<ReturnValue(const PropertyList&)> callback,
+        const McpToolOptions& options = McpToolOptions());
     void ParseMessage(const cJSON* json);
     void ParseMessage(const std::string& message);
+    // Reports the progress of the tool call running on this task, if the client asked for it
+    void NotifyProgress(int progress, int total, const std::string& message);
+    // Adds text to the result of the tool call running on this task. If the client set
+    // the resultStreaming capability at initialize and asked for progress, full chunks go
+    // out right away in notifications/progress, so a long result never sits in memory.
+    // Otherwise the text is collected into the reply. Returns false once nobody waits
+    // for the result
+    bool StreamResult(std::string_view text);
 
 private:
     McpServer();
     ~McpServer();
 
     void ParseCapabilities(const cJSON* capabilities);
+    void ParseBatch(const cJSON* json);
 
     void ReplyResult(int id, const std::string& result);
     void ReplyError(int id, const std::string& message);
+    void SendReply(int id, const std::string& message);
+    void DropReply(int id);
+    void SendNotification(const char* method, std::string_view params = {}, std::function<void()> on_sent = nullptr);
+    void NotifyToolsChanged();
 
     void GetToolsList(int id, const std::string& cursor);
-    void DoToolCall(int id, const std::string& tool_name, const cJSON* tool_arguments, int stack_size);
+    void DoToolCall(int id, const std::string& tool_name, const cJSON* tool_arguments, int stack_size, const std::string& progress_token);
 
     std::vector<McpTool*> tools_;
-    std::thread tool_call_thread_;
+    // Keys point into the names of the tools in tools_
+    std::unordered_map<std::string_view, McpTool*> tool_index_;
+    // tools/list results, rebuilt on the first request after the tools change
+    std::vector<McpToolsPage> tools_pages_;
+    ToolCallPool tool_call_pool_;
+    McpBatches batches_;
+
+    // Result text of a tool call, see StreamResult()
+    struct ResultStream {
+        std::string progress_token;
+        std::string pending;        // Not sent ahead yet
+        size_t sent = 0;
+        std::mutex mutex;
+        std::condition_variable condition_variable;
+        int in_flight = 0;          // Chunks handed to the main loop but not sent yet
+    };
+    std::mutex stream_mutex_;
+    std::map<TaskHandle_t, std::shared_ptr<ResultStream>> streams_;
+
+    std::shared_ptr<ResultStream> GetResultStream();
+    void SendResultChunk(const std::shared_ptr<ResultStream>& stream, size_t size);
+
+    std::atomic<bool> initialized_ = false;
+    std::atomic<bool> result_streaming_ = false;
+    std::atomic<bool> tools_changed_pending_ = false;
 };
 
 #endif // MCP_SERVER_H
@@ -0,0 +1,54 @@
+#include "mcp_server.h"
+#include "json_writer.h"
+
+#include <cstring>
+
+// Bytes that close a page whose next page starts with `next`, or the last page
+static size_t PageTailSize(const std::vector<McpTool*>& tools, size_t next) {
+    if (next == tools.size()) {
+        return strlen("]}");
+    }
+    return strlen("],\"nextCursor\":\"\"}") + tools[next]->name().size();
+}
+
+std::vector<McpToolsPage> BuildToolsPages(const std::vector<McpTool*>& tools, size_t max_payload_size) {
+    std::vector<McpToolsPage> pages;
+    size_t i = 0;
+    do {
+        // Fit as many tools as the payload limit allows, with the commas between them
+        // and the nextCursor that names the tool after the last one
+        size_t first = i;
+        size_t length = strlen("{\"tools\":[");
+        while (i < tools.size()) {
+            size_t added = tools[i]->json().size() + (i > first ? 1 : 0);
+            if (length + added + PageTailSize(tools, i + 1) > max_payload_size) {
+                break;
+            }
+            length += added;
+            i++;
+        }
+
+        McpToolsPage page;
+        page.cursor = first == 0 ? "" : tools[first]->name();
+        if (i == first && i < tools.size()) {
+            // Even on its own this tool does not fit, clients stop here
+            pages.push_back(std::move(page));
+            break;
+        }
+
+        JsonWriter json(length + PageTailSize(tools, i));
+        json.BeginObject();
+        json.Key("tools").BeginArray();
+        for (size_t j = first; j < i; j++) {
+            json.Raw(tools[j]->json());
+        }
+        json.EndArray();
+        if (i < tools.size()) {
+            json.Field("nextCursor", tools[i]->name());
+        }
+        json.EndObject();
+        page.result = json.str();
+        pages.push_back(std::move(page));
+    } while (i < tools.size());
+    return pages;
+}
@@ -0,0 +1,83 @@
+#include "audio_cipher.h"
+
+#include <esp_log.h>
+#include <mbedtls/aes.h>
+#include <mbedtls/gcm.h>
+#include <cstring>
+
+#define TAG "AudioCipher"
+
+class AesCtrCipher : public AudioCipher {
+public:
+    AesCtrCipher(const std::string& key) {
+        mbedtls_aes_init(&aes_ctx_);
+        mbedtls_aes_setkey_enc(&aes_ctx_, (const unsigned char*)key.data(), key.size() * 8);
+    }
+
+    ~AesCtrCipher() {
+        mbedtls_aes_free(&aes_ctx_);
+    }
+
+    size_t overhead() const override { return 0; }
+
+    bool Encrypt(const uint8_t* iv, const uint8_t* input, size_t size, uint8_t* output) override {
+        return Crypt(iv, input, size, output);
+    }
+
+    bool Decrypt(const uint8_t* iv, const uint8_t* input, size_t size, uint8_t* output) override {
+        return Crypt(iv, input, size, output);
+    }
+
+private:
+    mbedtls_aes_context aes_ctx_;
+
+    bool Crypt(const uint8_t* iv, const uint8_t* input, size_t size, uint8_t* output) {
+        // CTR advances the counter block, work on a copy of the header
+        uint8_t counter[AUDIO_CIPHER_IV_SIZE];
+        memcpy(counter, iv, sizeof(counter));
+        uint8_t stream_block[16] = {0};
+        size_t nc_off = 0;
+        return mbedtls_aes_crypt_ctr(&aes_ctx_, size, &nc_off, counter, stream_block, input, output) == 0;
+    }
+};
+
+class AesGcmCipher : public AudioCipher {
+public:
+    AesGcmCipher(const std::string& key) {
+        mbedtls_gcm_init(&gcm_ctx_);
+        mbedtls_gcm_setkey(&gcm_ctx_, MBEDTLS_CIPHER_ID_AES, (const unsigned char*)key.data(), key.size() * 8);
+    }
+
+    ~AesGcmCipher() {
+        mbedtls_gcm_free(&gcm_ctx_);
+    }
+
+    size_t overhead() const override { return AUDIO_CIPHER_GCM_TAG_SIZE; }
+
+    bool Encrypt(const uint8_t* iv, const uint8_t* input, size_t size, uint8_t* output) override {
+        return mbedtls_gcm_crypt_and_tag(&gcm_ctx_, MBEDTLS_GCM_ENCRYPT, size, iv, AUDIO_CIPHER_IV_SIZE,
+            nullptr, 0, input, output, AUDIO_CIPHER_GCM_TAG_SIZE, output + size) == 0;
+    }
+
+    bool Decrypt(const uint8_t* iv, const uint8_t* input, size_t size, uint8_t* output) override {
+        return mbedtls_gcm_auth_decrypt(&gcm_ctx_, size, iv, AUDIO_CIPHER_IV_SIZE, nullptr, 0,
+            input + size, AUDIO_CIPHER_GCM_TAG_SIZE, input, output) == 0;
+    }
+
+private:
+    mbedtls_gcm_context gcm_ctx_;
+};
+
+std::unique_ptr<AudioCipher> AudioCipher::Create(AudioCipherMode mode, const std::string& key) {
+    if (key.size() != 16) {
+        ESP_LOGE(TAG, "Invalid key size: %u", key.size());
+        return nullptr;
+    }
+    switch (mode) {
+        case kAudioCipherAesGcm:
+            return std::make_unique<AesGcmCipher>(key);
+        case kAudioCipherAesCtr:
+        default:
+            return std::make_unique<AesCtrCipher>(key);
+    }
+}
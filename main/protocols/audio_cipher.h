@@ -0,0 +1,46 @@
+#ifndef AUDIO_CIPHER_H
+#define AUDIO_CIPHER_H
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+
+#define AUDIO_CIPHER_IV_SIZE 16
+#define AUDIO_CIPHER_GCM_TAG_SIZE 16
+// aes-128-gcm only: set in the flags byte (header[1]) of every device-to-server
+// header and never in a server-to-device one. Both directions share the key, so
+// without it two packets with the same length, timestamp and sequence would
+// reuse an IV, which gives away the keystream and the GHASH key.
+#define AUDIO_CIPHER_UPLINK_FLAG 0x01
+
+enum AudioCipherMode {
+    kAudioCipherAesCtr,     // aes-128-ctr, no integrity
+    kAudioCipherAesGcm,     // aes-128-gcm, a 16-byte tag follows the payload
+};
+
+/*
+ * Cipher backend of the UDP audio channel.
+ *
+ * The 16-byte datagram header is the IV, so every packet is encrypted on its
+ * own and packets can be decrypted in any order. Instances keep per-call state,
+ * use one for each direction.
+ *
+ * The backends are built on mbedtls: on ESP32 targets its port drives the AES
+ * peripheral (with DMA for longer inputs), on a host it runs in software.
+ */
+class AudioCipher {
+public:
+    virtual ~AudioCipher() = default;
+
+    static std::unique_ptr<AudioCipher> Create(AudioCipherMode mode, const std::string& key);
+
+    // Bytes added after the payload
+    virtual size_t overhead() const = 0;
+    // output must hold size + overhead() bytes
+    virtual bool Encrypt(const uint8_t* iv, const uint8_t* input, size_t size, uint8_t* output) = 0;
+    // input holds size + overhead() bytes, output receives size bytes
+    virtual bool Decrypt(const uint8_t* iv, const uint8_t* input, size_t size, uint8_t* output) = 0;
+};
+
+#endif // AUDIO_CIPHER_H
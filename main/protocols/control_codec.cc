@@ -0,0 +1,107 @@
+#include "control_codec.h"
+
+namespace {
+
+const char* const TYPE_NAMES[] = { nullptr, "listen", "abort", "tts", "stt", "llm", "iot" };
+const char* const STATE_NAMES[] = { nullptr, "start", "stop", "detect", "sentence_start", "sentence_end" };
+
+template <size_t N>
+const char* NameOf(const char* const (&names)[N], uint8_t value) {
+    return value < N ? names[value] : nullptr;
+}
+
+} // namespace
+
+ControlEncoder::ControlEncoder(std::string& out, ControlMessageType type) : out_(out) {
+    out_.push_back(type);
+}
+
+ControlEncoder& ControlEncoder::Byte(ControlField field, uint8_t value) {
+    char field_data[3] = { (char)field, 1, (char)value };
+    out_.append(field_data, sizeof(field_data));
+    return *this;
+}
+
+ControlEncoder& ControlEncoder::String(ControlField field, std::string_view value) {
+    out_.push_back(field);
+    size_t length = value.size();
+    do {
+        uint8_t byte = length & 0x7F;
+        length >>= 7;
+        out_.push_back(length != 0 ? byte | 0x80 : byte);
+    } while (length != 0);
+    out_.append(value.data(), value.size());
+    return *this;
+}
+
+ControlDecoder::ControlDecoder(const uint8_t* data, size_t size) : data_(data), size_(size) {
+}
+
+bool ControlDecoder::Next(uint8_t& field, std::string_view& value) {
+    if (offset_ >= size_) {
+        return false;
+    }
+    field = data_[offset_++];
+
+    size_t length = 0;
+    for (int shift = 0; ; shift += 7) {
+        // Frames are at most 64 KB, so three bytes of length are plenty
+        if (offset_ >= size_ || shift > 14) {
+            offset_ = size_;
+            truncated_ = true;
+            return false;
+        }
+        uint8_t byte = data_[offset_++];
+        length |= (size_t)(byte & 0x7F) << shift;
+        if (!(byte & 0x80)) {
+            break;
+        }
+    }
+    if (length > size_ - offset_) {
+        offset_ = size_;
+        truncated_ = true;
+        return false;
+    }
+
+    value = std::string_view((const char*)data_ + offset_, length);
+    offset_ += length;
+    return true;
+}
+
+bool DecodeControlMessage(const uint8_t* data, size_t size, JsonMessage& message) {
+    message.Clear();
+    ControlDecoder decoder(data, size);
+    if (!decoder.valid()) {
+        return false;
+    }
+    auto type = NameOf(TYPE_NAMES, decoder.type());
+    if (type == nullptr) {
+        return false;
+    }
+    message.Set(kJsonFieldType, type);
+
+    uint8_t field;
+    std::string_view value;
+    while (decoder.Next(field, value)) {
+        switch (field) {
+            case kControlFieldState: {
+                auto state = value.size() == 1 ? NameOf(STATE_NAMES, value[0]) : nullptr;
+                if (state == nullptr) {
+                    return false;
+                }
+                message.Set(kJsonFieldState, state);
+                break;
+            }
+            case kControlFieldText:
+                message.Set(kJsonFieldText, value);
+                break;
+            case kControlFieldEmotion:
+                message.Set(kJsonFieldEmotion, value);
+                break;
+            default:
+                // Fields the device does not act on, or newer than this firmware
+                break;
+        }
+    }
+    return !decoder.truncated();
+}
@@ -0,0 +1,96 @@
+#ifndef CONTROL_CODEC_H
+#define CONTROL_CODEC_H
+
+#include <cstdint>
+#include <string>
+#include <string_view>
+
+#include "json_message.h"
+
+// BinaryProtocol3 frame types
+#define BINARY_PROTOCOL3_TYPE_AUDIO 0
+#define BINARY_PROTOCOL3_TYPE_CONTROL 1
+
+/*
+ * Compact encoding of the frequent control messages, carried in BinaryProtocol3
+ * frames of type BINARY_PROTOCOL3_TYPE_CONTROL once both hellos announce
+ * features.binary_control. Everything else stays JSON.
+ *
+ * payload: |message 1u|field*|
+ * field:   |tag 1u|length varint|value|
+ *
+ * State, mode and reason values are a single byte, strings are UTF-8 without a
+ * terminator, lengths are LEB128. Unknown tags are skipped so fields can be
+ * added later. The session is implied by the connection, so it is not sent.
+ */
+enum ControlMessageType : uint8_t {
+    kControlMessageListen = 1,      // state, mode, text (wake word)
+    kControlMessageAbort = 2,       // reason
+    kControlMessageTts = 3,         // state, text
+    kControlMessageStt = 4,         // text
+    kControlMessageLlm = 5,         // emotion, text
+    kControlMessageIot = 6,         // states
+};
+
+enum ControlField : uint8_t {
+    kControlFieldState = 1,
+    kControlFieldMode = 2,
+    kControlFieldText = 3,
+    kControlFieldEmotion = 4,
+    kControlFieldReason = 5,
+    kControlFieldStates = 6,        // JSON array of IoT states
+};
+
+enum ControlState : uint8_t {
+    kControlStateStart = 1,
+    kControlStateStop = 2,
+    kControlStateDetect = 3,
+    kControlStateSentenceStart = 4,
+    kControlStateSentenceEnd = 5,
+};
+
+enum ControlMode : uint8_t {
+    kControlModeAuto = 1,
+    kControlModeManual = 2,
+    kControlModeRealtime = 3,
+};
+
+enum ControlReason : uint8_t {
+    kControlReasonWakeWordDetected = 1,
+};
+
+// Appends a message to `out` after whatever it already holds, e.g. a frame header
+class ControlEncoder {
+public:
+    ControlEncoder(std::string& out, ControlMessageType type);
+
+    ControlEncoder& Byte(ControlField field, uint8_t value);
+    ControlEncoder& String(ControlField field, std::string_view value);
+
+private:
+    std::string& out_;
+};
+
+// Walks the fields of a message, values point into the input
+class ControlDecoder {
+public:
+    ControlDecoder(const uint8_t* data, size_t size);
+
+    inline bool valid() const { return size_ > 0; }
+    inline uint8_t type() const { return data_[0]; }
+    inline bool truncated() const { return truncated_; }
+
+    // Moves to the next field, false at the end or on a truncated field
+    bool Next(uint8_t& field, std::string_view& value);
+
+private:
+    const uint8_t* data_;
+    size_t size_;
+    size_t offset_ = 1;
+    bool truncated_ = false;
+};
+
+// Fills `message` as if the JSON form had been parsed, false if the payload is malformed
+bool DecodeControlMessage(const uint8_t* data, size_t size, JsonMessage& message);
+
+#endif // CONTROL_CODEC_H
@@ -0,0 +1,329 @@
+#include "json_message.h"
+
+#include <array>
+
+namespace {
+
+struct Keyword {
+    std::string_view name;
+    int value;
+};
+
+// Collision free for each of the keyword sets below, checked at compile time
+constexpr uint32_t KeywordHash(std::string_view s) {
+    return s.empty() ? 0 : (s.size() + 2u * (uint8_t)s.front() + 11u * (uint8_t)s.back()) & 31;
+}
+
+template <size_t N>
+constexpr bool IsPerfect(const Keyword (&keywords)[N]) {
+    for (size_t i = 0; i < N; i++) {
+        for (size_t j = i + 1; j < N; j++) {
+            if (KeywordHash(keywords[i].name) == KeywordHash(keywords[j].name)) {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+template <size_t N>
+constexpr std::array<int8_t, 32> BuildTable(const Keyword (&keywords)[N]) {
+    std::array<int8_t, 32> table = {};
+    for (size_t i = 0; i < table.size(); i++) {
+        table[i] = -1;
+    }
+    for (size_t i = 0; i < N; i++) {
+        table[KeywordHash(keywords[i].name)] = i;
+    }
+    return table;
+}
+
+template <size_t N>
+int Lookup(const Keyword (&keywords)[N], const std::array<int8_t, 32>& table, std::string_view name, int fallback) {
+    int index = table[KeywordHash(name)];
+    return index >= 0 && keywords[index].name == name ? keywords[index].value : fallback;
+}
+
+constexpr Keyword TYPES[] = {
+    { "hello", kJsonMessageHello },
+    { "goodbye", kJsonMessageGoodbye },
+    { "tts", kJsonMessageTts },
+    { "stt", kJsonMessageStt },
+    { "llm", kJsonMessageLlm },
+    { "mcp", kJsonMessageMcp },
+    { "iot", kJsonMessageIot },
+    { "system", kJsonMessageSystem },
+    { "alert", kJsonMessageAlert },
+};
+static_assert(IsPerfect(TYPES), "KeywordHash collides on message types");
+constexpr auto TYPE_TABLE = BuildTable(TYPES);
+
+constexpr Keyword STATES[] = {
+    { "start", kJsonStateStart },
+    { "stop", kJsonStateStop },
+    { "sentence_start", kJsonStateSentenceStart },
+    { "sentence_end", kJsonStateSentenceEnd },
+};
+static_assert(IsPerfect(STATES), "KeywordHash collides on message states");
+constexpr auto STATE_TABLE = BuildTable(STATES);
+
+constexpr Keyword FIELDS[] = {
+    { "type", kJsonFieldType },
+    { "state", kJsonFieldState },
+    { "text", kJsonFieldText },
+    { "emotion", kJsonFieldEmotion },
+    { "command", kJsonFieldCommand },
+    { "status", kJsonFieldStatus },
+    { "message", kJsonFieldMessage },
+    { "session_id", kJsonFieldSessionId },
+    { "payload", kJsonFieldPayload },
+    { "commands", kJsonFieldCommands },
+};
+static_assert(IsPerfect(FIELDS), "KeywordHash collides on message fields");
+static_assert(sizeof(FIELDS) / sizeof(FIELDS[0]) == kJsonFieldCount, "FIELDS is out of sync");
+constexpr auto FIELD_TABLE = BuildTable(FIELDS);
+
+inline bool IsRawField(int field) {
+    return field == kJsonFieldPayload || field == kJsonFieldCommands;
+}
+
+inline void SkipSpace(const char*& p, const char* end) {
+    while (p < end && (*p == ' ' || *p == '\t' || *p == '\n' || *p == '\r')) {
+        p++;
+    }
+}
+
+// p is on the opening quote; leaves p after the closing quote
+bool ScanString(const char*& p, const char* end, std::string_view& content, bool& escaped) {
+    const char* start = ++p;
+    escaped = false;
+    while (p < end) {
+        char c = *p++;
+        if (c == '"') {
+            content = std::string_view(start, p - 1 - start);
+            return true;
+        }
+        if (c == '\\') {
+            if (p == end) {
+                return false;
+            }
+            escaped = true;
+            p++;
+        }
+    }
+    return false;
+}
+
+bool SkipValue(const char*& p, const char* end) {
+    std::string_view content;
+    bool escaped;
+    if (*p == '"') {
+        return ScanString(p, end, content, escaped);
+    }
+    if (*p == '{' || *p == '[') {
+        int depth = 0;
+        while (p < end) {
+            char c = *p;
+            if (c == '"') {
+                if (!ScanString(p, end, content, escaped)) {
+                    return false;
+                }
+                continue;
+            }
+            p++;
+            if (c == '{' || c == '[') {
+                depth++;
+            } else if (c == '}' || c == ']') {
+                if (--depth == 0) {
+                    return true;
+                }
+            }
+        }
+        return false;
+    }
+    // Number, true, false or null
+    const char* start = p;
+    while (p < end && *p != ',' && *p != '}' && *p != ']' && *p != ' ' && *p != '\t' && *p != '\n' && *p != '\r') {
+        p++;
+    }
+    return p > start;
+}
+
+int HexValue(const char* p) {
+    int value = 0;
+    for (int i = 0; i < 4; i++) {
+        char c = p[i];
+        value <<= 4;
+        if (c >= '0' && c <= '9') value |= c - '0';
+        else if (c >= 'a' && c <= 'f') value |= c - 'a' + 10;
+        else if (c >= 'A' && c <= 'F') value |= c - 'A' + 10;
+        else return -1;
+    }
+    return value;
+}
+
+void AppendUtf8(std::string& out, uint32_t code) {
+    if (code < 0x80) {
+        out.push_back(code);
+    } else if (code < 0x800) {
+        out.push_back(0xC0 | (code >> 6));
+        out.push_back(0x80 | (code & 0x3F));
+    } else if (code < 0x10000) {
+        out.push_back(0xE0 | (code >> 12));
+        out.push_back(0x80 | ((code >> 6) & 0x3F));
+        out.push_back(0x80 | (code & 0x3F));
+    } else {
+        out.push_back(0xF0 | (code >> 18));
+        out.push_back(0x80 | ((code >> 12) & 0x3F));
+        out.push_back(0x80 | ((code >> 6) & 0x3F));
+        out.push_back(0x80 | (code & 0x3F));
+    }
+}
+
+} // namespace
+
+void JsonMessage::Clear() {
+    json_ = std::string_view();
+    present_ = 0;
+    type_ = kJsonMessageUnknown;
+    state_ = kJsonStateUnknown;
+    unescaped_.clear();
+}
+
+void JsonMessage::Set(JsonMessageField field, std::string_view value) {
+    fields_[field] = value;
+    present_ |= 1u << field;
+    if (field == kJsonFieldType) {
+        type_ = (JsonMessageType)Lookup(TYPES, TYPE_TABLE, value, kJsonMessageUnknown);
+    } else if (field == kJsonFieldState) {
+        state_ = (JsonMessageState)Lookup(STATES, STATE_TABLE, value, kJsonStateUnknown);
+    }
+}
+
+bool JsonMessage::Parse(const char* json, size_t length) {
+    Clear();
+    json_ = std::string_view(json, length);
+
+    const char* p = json;
+    const char* end = json + length;
+    SkipSpace(p, end);
+    if (p == end || *p != '{') {
+        return false;
+    }
+    p++;
+    SkipSpace(p, end);
+    if (p < end && *p == '}') {
+        return true;
+    }
+
+    while (p < end) {
+        std::string_view key;
+        bool escaped;
+        if (*p != '"' || !ScanString(p, end, key, escaped)) {
+            return false;
+        }
+        SkipSpace(p, end);
+        if (p == end || *p != ':') {
+            return false;
+        }
+        p++;
+        SkipSpace(p, end);
+        if (p == end) {
+            return false;
+        }
+
+        int field = Lookup(FIELDS, FIELD_TABLE, key, -1);
+        const char* value_start = p;
+        if (*p == '"' && field >= 0 && !IsRawField(field)) {
+            std::string_view value;
+            if (!ScanString(p, end, value, escaped)) {
+                return false;
+            }
+            fields_[field] = escaped ? Unescape(value) : value;
+            present_ |= 1u << field;
+        } else {
+            if (!SkipValue(p, end)) {
+                return false;
+            }
+            if (field >= 0 && IsRawField(field)) {
+                fields_[field] = std::string_view(value_start, p - value_start);
+                present_ |= 1u << field;
+            }
+        }
+
+        SkipSpace(p, end);
+        if (p == end) {
+            return false;
+        }
+        if (*p == '}') {
+            break;
+        }
+        if (*p != ',') {
+            return false;
+        }
+        p++;
+        SkipSpace(p, end);
+    }
+    if (p == end) {
+        return false;
+    }
+
+    if (Has(kJsonFieldType)) {
+        type_ = (JsonMessageType)Lookup(TYPES, TYPE_TABLE, fields_[kJsonFieldType], kJsonMessageUnknown);
+    }
+    if (Has(kJsonFieldState)) {
+        state_ = (JsonMessageState)Lookup(STATES, STATE_TABLE, fields_[kJsonFieldState], kJsonStateUnknown);
+    }
+    return true;
+}
+
+std::string_view JsonMessage::Unescape(std::string_view raw) {
+    // Unescaped text is never longer than the input, so the buffer is never reallocated
+    // and earlier views into it stay valid
+    if (unescaped_.capacity() < json_.size()) {
+        unescaped_.reserve(json_.size());
+    }
+    size_t start = unescaped_.size();
+    for (size_t i = 0; i < raw.size(); i++) {
+        char c = raw[i];
+        if (c != '\\') {
+            unescaped_.push_back(c);
+            continue;
+        }
+        char e = raw[++i];
+        switch (e) {
+            case 'b': unescaped_.push_back('\b'); break;
+            case 'f': unescaped_.push_back('\f'); break;
+            case 'n': unescaped_.push_back('\n'); break;
+            case 'r': unescaped_.push_back('\r'); break;
+            case 't': unescaped_.push_back('\t'); break;
+            case 'u': {
+                int code = i + 4 < raw.size() ? HexValue(&raw[i + 1]) : -1;
+                if (code < 0) {
+                    unescaped_.push_back('?');
+                    break;
+                }
+                i += 4;
+                // Join a surrogate pair, lone surrogates become U+FFFD
+                if (code >= 0xD800 && code <= 0xDBFF) {
+                    int low = i + 6 < raw.size() && raw[i + 1] == '\\' && raw[i + 2] == 'u' ? HexValue(&raw[i + 3]) : -1;
+                    if (low >= 0xDC00 && low <= 0xDFFF) {
+                        code = 0x10000 + ((code - 0xD800) << 10) + (low - 0xDC00);
+                        i += 6;
+                    } else {
+                        code = 0xFFFD;
+                    }
+                } else if (code >= 0xDC00 && code <= 0xDFFF) {
+                    code = 0xFFFD;
+                }
+                AppendUtf8(unescaped_, code);
+                break;
+            }
+            default:
+                // \" \\ \/
+                unescaped_.push_back(e);
+                break;
+        }
+    }
+    return std::string_view(unescaped_.data() + start, unescaped_.size() - start);
+}
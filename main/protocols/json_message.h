@@ -0,0 +1,83 @@
+#ifndef JSON_MESSAGE_H
+#define JSON_MESSAGE_H
+
+#include <cstdint>
+#include <string>
+#include <string_view>
+
+enum JsonMessageType {
+    kJsonMessageUnknown,
+    kJsonMessageHello,
+    kJsonMessageGoodbye,
+    kJsonMessageTts,
+    kJsonMessageStt,
+    kJsonMessageLlm,
+    kJsonMessageMcp,
+    kJsonMessageIot,
+    kJsonMessageSystem,
+    kJsonMessageAlert
+};
+
+enum JsonMessageState {
+    kJsonStateUnknown,
+    kJsonStateStart,
+    kJsonStateStop,
+    kJsonStateSentenceStart,
+    kJsonStateSentenceEnd
+};
+
+enum JsonMessageField {
+    kJsonFieldType,
+    kJsonFieldState,
+    kJsonFieldText,
+    kJsonFieldEmotion,
+    kJsonFieldCommand,
+    kJsonFieldStatus,
+    kJsonFieldMessage,
+    kJsonFieldSessionId,
+    kJsonFieldPayload,      // Raw JSON of the value, e.g. the mcp payload object
+    kJsonFieldCommands,     // Raw JSON of the value
+    kJsonFieldCount
+};
+
+/*
+ * Top level view of an incoming control message.
+ *
+ * Parse() scans the object once without building a tree: the known fields are
+ * picked out through a perfect hash of their keys, everything else is skipped.
+ * String fields point into the input, or into one internal buffer if they had
+ * to be unescaped, so the input must outlive the message. Messages that need
+ * the whole tree (hello, mcp, iot) parse json() or a raw field with cJSON.
+ * Decoders of other encodings fill the same view with Clear() and Set().
+ */
+class JsonMessage {
+public:
+    bool Parse(const char* json, size_t length);
+
+    void Clear();
+    // Setting the type or state field also sets type() or state()
+    void Set(JsonMessageField field, std::string_view value);
+
+    inline JsonMessageType type() const { return type_; }
+    inline JsonMessageState state() const { return state_; }
+    inline std::string_view json() const { return json_; }
+
+    inline bool Has(JsonMessageField field) const { return present_ & (1u << field); }
+    // String fields are unescaped, raw fields hold the JSON text of the value
+    inline std::string_view Get(JsonMessageField field) const { return fields_[field]; }
+    // Copies a field for use after the input is gone
+    inline std::string GetString(JsonMessageField field) const { return std::string(fields_[field]); }
+
+private:
+    std::string_view json_;
+    std::string_view fields_[kJsonFieldCount];
+    uint32_t present_ = 0;
+    JsonMessageType type_ = kJsonMessageUnknown;
+    JsonMessageState state_ = kJsonStateUnknown;
+    // Holds unescaped strings, reserved to the input size so views into it stay valid
+    std::string unescaped_;
+
+    std::string_view Unescape(std::string_view raw);
+};
+
+#endif // JSON_MESSAGE_H
@@ -2,8 +2,10 @@
 #include "board.h"
 #include "application.h"
 #include "settings.h"
+#include "json_writer.h"
 
 #include <esp_log.h>
+#include <esp_timer.h>
 #include <ml307_mqtt.h>
 #include <ml307_udp.h>
 #include <cstring>
@@ -14,10 +16,51 @@
 
 MqttProtocol::MqttProtocol() {
     event_group_handle_ = xEventGroupCreate();
+
+    reorder_window_.OnDeliver([this](AudioStreamPacket&& packet) {
+        remote_timestamp_ = packet.timestamp;
+        if (on_incoming_audio_ != nullptr) {
+            on_incoming_audio_(std::move(packet));
+        }
+    });
+    reorder_window_.OnLoss([this](uint32_t lost, const AudioStreamPacket& next) {
+        ESP_LOGW(TAG, "Lost %lu audio packets", lost);
+        if (lost > MQTT_MAX_CONCEALED_PACKETS || on_incoming_audio_ == nullptr) {
+            return;
+        }
+        // Stand in for each lost packet with an empty one, so the decoder runs loss concealment
+        // instead of leaving a gap
+        for (uint32_t i = 1; i <= lost; i++) {
+            AudioStreamPacket missing;
+            missing.sample_rate = next.sample_rate;
+            missing.frame_duration = next.frame_duration;
+            if (next.timestamp != 0 && remote_timestamp_ != 0) {
+                missing.timestamp = remote_timestamp_ + (next.timestamp - remote_timestamp_) / (lost + 1) * i;
+            }
+            on_incoming_audio_(std::move(missing));
+        }
+        audio_channel_stats_.concealed_packets += lost;
+    });
+
+    esp_timer_create_args_t reorder_timer_args = {
+        .callback = [](void* arg) {
+            MqttProtocol* protocol = (MqttProtocol*)arg;
+            protocol->ExpireHeldPackets();
+        },
+        .arg = this,
+        .dispatch_method = ESP_TIMER_TASK,
+        .name = "reorder_window",
+        .skip_unhandled_events = true
+    };
+    esp_timer_create(&reorder_timer_args, &reorder_timer_);
 }
 
 MqttProtocol::~MqttProtocol() {
     ESP_LOGI(TAG, "MqttProtocol deinit");
+    if (reorder_timer_ != nullptr) {
+        esp_timer_stop(reorder_timer_);
+        esp_timer_delete(reorder_timer_);
+    }
     if (udp_ != nullptr) {
         delete udp_;
     }
@@ -60,32 +103,52 @@ bool MqttProtocol::StartMqttClient(bool report_error) {
     });
 
     mqtt_->OnMessage([this](const std::string& topic, const std::string& payload) {
-        cJSON* root = cJSON_Parse(payload.c_str());
-        if (root == nullptr) {
+        JsonMessage message;
+        if (!message.Parse(payload.data(), payload.size())) {
             ESP_LOGE(TAG, "Failed to parse json message %s", payload.c_str());
             return;
         }
-        cJSON* type = cJSON_GetObjectItem(root, "type");
-        if (!cJSON_IsString(type)) {
+        if (!message.Has(kJsonFieldType)) {
             ESP_LOGE(TAG, "Message type is invalid");
-            cJSON_Delete(root);
             return;
         }
 
-        if (strcmp(type->valuestring, "hello") == 0) {
+        if (message.type() == kJsonMessageHello) {
+            // The hello is rare and nested, a full tree is fine here
+            cJSON* root = cJSON_ParseWithLength(payload.data(), payload.size());
             ParseServerHello(root);
-        } else if (strcmp(type->valuestring, "goodbye") == 0) {
-            auto session_id = cJSON_GetObjectItem(root, "session_id");
-            ESP_LOGI(TAG, "Received goodbye message, session_id: %s", session_id ? session_id->valuestring : "null");
-            if (session_id == nullptr || session_id_ == session_id->valuestring) {
+            cJSON_Delete(root);
+        } else if (message.type() == kJsonMessageGoodbye) {
+            auto session_id = message.GetString(kJsonFieldSessionId);
+            ESP_LOGI(TAG, "Received goodbye message, session_id: %s", message.Has(kJsonFieldSessionId) ? session_id.c_str() : "null");
+            if (!message.Has(kJsonFieldSessionId) || session_id_ == session_id) {
                 Application::GetInstance().Schedule([this]() {
-                    CloseAudioChannel();
+                    // The server ended the session, so release the channel instead of parking it
+                    bool was_open = udp_ != nullptr && !channel_parked_;
+                    resume_token_.clear();
+                    session_resumed_ = false;
+                    ReleaseAudioChannel();
+                    if (was_open && on_audio_channel_closed_ != nullptr) {
+                        on_audio_channel_closed_();
+                    }
                 });
             }
-        } else if (on_incoming_json_ != nullptr) {
-            on_incoming_json_(root);
+        } else {
+            if (message.type() == kJsonMessageTts && message.state() == kJsonStateStart) {
+                // A new response starts its own sequence run, nothing held belongs to it
+                std::lock_guard<std::mutex> lock(reorder_mutex_);
+                reorder_window_.Reset();
+                remote_timestamp_ = 0;
+            } else if (message.type() == kJsonMessageTts && message.state() == kJsonStateStop) {
+                // No later packet will come to fill or give up the last gaps
+                std::lock_guard<std::mutex> lock(reorder_mutex_);
+                reorder_window_.Flush();
+                UpdateWindowStats();
+            }
+            if (on_incoming_json_ != nullptr && !channel_parked_) {
+                on_incoming_json_(message);
+            }
         }
-        cJSON_Delete(root);
         last_incoming_time_ = std::chrono::steady_clock::now();
     });
 
@@ -123,31 +186,68 @@ bool MqttProtocol::SendText(const std::string& text) {
 
 bool MqttProtocol::SendAudio(const AudioStreamPacket& packet) {
     std::lock_guard<std::mutex> lock(channel_mutex_);
-    if (udp_ == nullptr) {
-        return false;
+    return SendAudioLocked(packet);
+}
+
+// Encrypts and sends a whole burst under a single lock of the channel
+size_t MqttProtocol::SendAudioBatch(const std::list<AudioStreamPacket>& packets) {
+    std::lock_guard<std::mutex> lock(channel_mutex_);
+    size_t sent = 0;
+    for (auto& packet : packets) {
+        if (!SendAudioLocked(packet)) {
+            break;
+        }
+        sent++;
     }
+    return sent;
+}
 
-    std::string nonce(aes_nonce_);
-    *(uint16_t*)&nonce[2] = htons(packet.payload.size());
-    *(uint32_t*)&nonce[8] = htonl(packet.timestamp);
-    *(uint32_t*)&nonce[12] = htonl(++local_sequence_);
+bool MqttProtocol::SendAudioLocked(const AudioStreamPacket& packet) {
+    if (udp_ == nullptr || send_cipher_ == nullptr) {
+        return false;
+    }
 
-    std::string encrypted;
-    encrypted.resize(aes_nonce_.size() + packet.payload.size());
-    memcpy(encrypted.data(), nonce.data(), nonce.size());
+    // Shrinking or regrowing within the capacity does not allocate
+    send_buffer_.resize(aes_nonce_.size() + packet.payload.size() + send_cipher_->overhead());
+    auto header = (uint8_t*)send_buffer_.data();
+    memcpy(header, aes_nonce_.data(), aes_nonce_.size());
+    header[1] |= uplink_flags_;
+    *(uint16_t*)&header[2] = htons(packet.payload.size());
+    *(uint32_t*)&header[8] = htonl(packet.timestamp);
+    *(uint32_t*)&header[12] = htonl(++local_sequence_);
 
-    size_t nc_off = 0;
-    uint8_t stream_block[16] = {0};
-    if (mbedtls_aes_crypt_ctr(&aes_ctx_, packet.payload.size(), &nc_off, (uint8_t*)nonce.c_str(), stream_block,
-        (uint8_t*)packet.payload.data(), (uint8_t*)&encrypted[nonce.size()]) != 0) {
+    if (!send_cipher_->Encrypt(header, packet.payload.data(), packet.payload.size(), header + aes_nonce_.size())) {
         ESP_LOGE(TAG, "Failed to encrypt audio data");
         return false;
     }
 
-    return udp_->Send(encrypted) > 0;
+    return udp_->Send(send_buffer_) > 0;
 }
 
 void MqttProtocol::CloseAudioChannel() {
+    if (channel_parked_) {
+        // The application already saw this channel close
+        ReleaseAudioChannel();
+        return;
+    }
+
+    if (keep_warm_seconds_ > 0 && udp_ != nullptr && !error_occurred_) {
+        // No goodbye, so the server keeps the session and its UDP key for the next hello
+        SendAbortSpeaking(kAbortReasonNone);
+        SendStopListening();
+        ParkAudioChannel();
+    } else {
+        ReleaseAudioChannel();
+    }
+
+    if (on_audio_channel_closed_ != nullptr) {
+        on_audio_channel_closed_();
+    }
+}
+
+void MqttProtocol::ReleaseAudioChannel() {
+    channel_parked_ = false;
+    esp_timer_stop(reorder_timer_);
     {
         std::lock_guard<std::mutex> lock(channel_mutex_);
         if (udp_ != nullptr) {
@@ -156,31 +256,72 @@ void MqttProtocol::CloseAudioChannel() {
         }
     }
 
-    std::string message = "{";
-    message += "\"session_id\":\"" + session_id_ + "\",";
-    message += "\"type\":\"goodbye\"";
-    message += "}";
-    SendText(message);
+    JsonWriter json(48 + session_id_.size());
+    json.BeginObject();
+    json.Field("session_id", session_id_);
+    json.Field("type", "goodbye");
+    json.EndObject();
+    SendText(json.str());
+}
+
+bool MqttProtocol::OpenAudioChannel() {
+    bool parked = channel_parked_;
+    auto start_time = esp_timer_get_time();
+    channel_reused_ = false;
+    if (!SetupAudioChannel(true)) {
+        return false;
+    }
+    if (parked) {
+        ESP_LOGI(TAG, "Reopened warm channel in %lld ms, session %s", (esp_timer_get_time() - start_time) / 1000,
+            udp_channel_kept_ ? "resumed" : "restarted");
+        channel_reused_ = true;
+    }
 
-    if (on_audio_channel_closed_ != nullptr) {
-        on_audio_channel_closed_();
+    if (on_audio_channel_opened_ != nullptr) {
+        on_audio_channel_opened_();
     }
+    return true;
 }
 
-bool MqttProtocol::OpenAudioChannel() {
+void MqttProtocol::PrewarmAudioChannel() {
+    if (keep_warm_seconds_ == 0 || udp_ != nullptr || mqtt_ == nullptr || !mqtt_->IsConnected()) {
+        return;
+    }
+
+    // Failures are not reported, the next OpenAudioChannel tries again
+    if (SetupAudioChannel(false)) {
+        ParkAudioChannel();
+    }
+}
+
+void MqttProtocol::CheckKeepWarm() {
+    if (channel_parked_ && IsParkExpired()) {
+        ESP_LOGI(TAG, "Releasing warm channel");
+        ReleaseAudioChannel();
+    }
+}
+
+bool MqttProtocol::SetupAudioChannel(bool report_error) {
     if (mqtt_ == nullptr || !mqtt_->IsConnected()) {
         ESP_LOGI(TAG, "MQTT is not connected, try to connect now");
-        if (!StartMqttClient(true)) {
+        if (!StartMqttClient(report_error)) {
             return false;
         }
     }
 
+    // A parked channel stays usable only if the server resumes the session
+    bool parked = channel_parked_ && udp_ != nullptr;
+    channel_parked_ = false;
     error_occurred_ = false;
     session_id_ = "";
     xEventGroupClearBits(event_group_handle_, MQTT_PROTOCOL_SERVER_HELLO_EVENT);
 
     auto message = GetHelloMessage();
-    if (!SendText(message)) {
+    if (publish_topic_.empty() || !mqtt_->Publish(publish_topic_, message)) {
+        ESP_LOGE(TAG, "Failed to send hello");
+        if (report_error) {
+            SetError(Lang::Strings::SERVER_ERROR);
+        }
         return false;
     }
 
@@ -188,7 +329,31 @@ bool MqttProtocol::OpenAudioChannel() {
     EventBits_t bits = xEventGroupWaitBits(event_group_handle_, MQTT_PROTOCOL_SERVER_HELLO_EVENT, pdTRUE, pdFALSE, pdMS_TO_TICKS(10000));
     if (!(bits & MQTT_PROTOCOL_SERVER_HELLO_EVENT)) {
         ESP_LOGE(TAG, "Failed to receive server hello");
-        SetError(Lang::Strings::SERVER_TIMEOUT);
+        if (report_error) {
+            SetError(Lang::Strings::SERVER_TIMEOUT);
+        }
+        return false;
+    }
+
+    UdpParams params;
+    {
+        std::lock_guard<std::mutex> lock(channel_mutex_);
+        params = hello_udp_;
+        // A resumed session keeps counting sequence numbers, restarting them under the same key would reuse counters
+        udp_channel_kept_ = parked && session_resumed_ && params.server == udp_server_ && params.port == udp_port_ &&
+            params.key == aes_key_ && params.nonce == aes_nonce_ && params.cipher_mode == cipher_mode_;
+    }
+    // Same session, key and sequence numbers: the UDP socket and ciphers carry on as they are
+    if (udp_channel_kept_) {
+        return true;
+    }
+
+    auto send_cipher = AudioCipher::Create(params.cipher_mode, params.key);
+    auto receive_cipher = AudioCipher::Create(params.cipher_mode, params.key);
+    if (send_cipher == nullptr || receive_cipher == nullptr) {
+        if (report_error) {
+            SetError(Lang::Strings::SERVER_ERROR);
+        }
         return false;
     }
 
@@ -196,14 +361,29 @@ bool MqttProtocol::OpenAudioChannel() {
     if (udp_ != nullptr) {
         delete udp_;
     }
+    // The old channel is gone, nothing uses the previous endpoint, key and ciphers anymore
+    udp_server_ = params.server;
+    udp_port_ = params.port;
+    aes_key_ = params.key;
+    aes_nonce_ = params.nonce;
+    cipher_mode_ = params.cipher_mode;
+    local_sequence_ = 0;
+    send_cipher_ = std::move(send_cipher);
+    receive_cipher_ = std::move(receive_cipher);
+    uplink_flags_ = cipher_mode_ == kAudioCipherAesGcm ? AUDIO_CIPHER_UPLINK_FLAG : 0;
+    {
+        std::lock_guard<std::mutex> reorder_lock(reorder_mutex_);
+        reorder_window_.Reset();
+        remote_timestamp_ = 0;
+    }
     udp_ = Board::GetInstance().CreateUdp();
     udp_->OnMessage([this](const std::string& data) {
         /*
          * UDP Encrypted OPUS Packet Format:
          * |type 1u|flags 1u|payload_len 2u|ssrc 4u|timestamp 4u|sequence 4u|
-         * |payload payload_len|
+         * |payload payload_len|tag 16u (aes-128-gcm only)|
          */
-        if (data.size() < sizeof(aes_nonce_)) {
+        if (data.size() < aes_nonce_.size() + receive_cipher_->overhead()) {
             ESP_LOGE(TAG, "Invalid audio packet size: %u", data.size());
             return;
         }
@@ -211,71 +391,94 @@ bool MqttProtocol::OpenAudioChannel() {
             ESP_LOGE(TAG, "Invalid audio packet type: %x", data[0]);
             return;
         }
-        uint32_t timestamp = ntohl(*(uint32_t*)&data[8]);
-        uint32_t sequence = ntohl(*(uint32_t*)&data[12]);
-        if (sequence < remote_sequence_) {
-            ESP_LOGW(TAG, "Received audio packet with old sequence: %lu, expected: %lu", sequence, remote_sequence_);
+        // Only our own packets carry the uplink flag, one coming back is a replay
+        if (data[1] & uplink_flags_) {
+            ESP_LOGE(TAG, "Invalid audio packet flags: %x", data[1]);
             return;
         }
-        if (sequence != remote_sequence_ + 1) {
-            ESP_LOGW(TAG, "Received audio packet with wrong sequence: %lu, expected: %lu", sequence, remote_sequence_ + 1);
+        // Nobody listens on a parked channel
+        if (channel_parked_) {
+            return;
         }
+        uint32_t timestamp = ntohl(*(uint32_t*)&data[8]);
+        uint32_t sequence = ntohl(*(uint32_t*)&data[12]);
 
-        size_t decrypted_size = data.size() - aes_nonce_.size();
-        size_t nc_off = 0;
-        uint8_t stream_block[16] = {0};
-        auto nonce = (uint8_t*)data.data();
-        auto encrypted = (uint8_t*)data.data() + aes_nonce_.size();
-        AudioStreamPacket packet;
+        size_t decrypted_size = data.size() - aes_nonce_.size() - receive_cipher_->overhead();
+        auto header = (const uint8_t*)data.data();
+        auto& packet = receive_packet_;
         packet.sample_rate = server_sample_rate_;
         packet.frame_duration = server_frame_duration_;
         packet.timestamp = timestamp;
         packet.payload.resize(decrypted_size);
-        int ret = mbedtls_aes_crypt_ctr(&aes_ctx_, decrypted_size, &nc_off, nonce, stream_block, encrypted, (uint8_t*)packet.payload.data());
-        if (ret != 0) {
-            ESP_LOGE(TAG, "Failed to decrypt audio data, ret: %d", ret);
+        if (!receive_cipher_->Decrypt(header, header + aes_nonce_.size(), decrypted_size, packet.payload.data())) {
+            ESP_LOGE(TAG, "Failed to decrypt audio data");
             return;
         }
-        if (on_incoming_audio_ != nullptr) {
-            on_incoming_audio_(std::move(packet));
+
+        // Sequence checks run on authentic packets only, the window delivers them in order
+        audio_channel_stats_.received_packets++;
+        {
+            std::lock_guard<std::mutex> reorder_lock(reorder_mutex_);
+            reorder_window_.Push(sequence, packet, esp_timer_get_time() / 1000);
+            UpdateWindowStats();
         }
-        remote_sequence_ = sequence;
         last_incoming_time_ = std::chrono::steady_clock::now();
     });
 
     udp_->Connect(udp_server_, udp_port_);
+    esp_timer_stop(reorder_timer_);
+    esp_timer_start_periodic(reorder_timer_, MQTT_REORDER_WINDOW_MS / 2 * 1000);
+    return true;
+}
 
-    if (on_audio_channel_opened_ != nullptr) {
-        on_audio_channel_opened_();
+void MqttProtocol::ExpireHeldPackets() {
+    std::lock_guard<std::mutex> lock(reorder_mutex_);
+    if (reorder_window_.held() > 0) {
+        reorder_window_.Expire(esp_timer_get_time() / 1000);
+        UpdateWindowStats();
     }
-    return true;
+}
+
+// Call with reorder_mutex_ held
+void MqttProtocol::UpdateWindowStats() {
+    auto& window_stats = reorder_window_.stats();
+    audio_channel_stats_.lost_packets = window_stats.lost_packets;
+    audio_channel_stats_.late_packets = window_stats.late_packets;
+    audio_channel_stats_.reordered_packets = window_stats.reordered_packets;
+    audio_channel_stats_.duplicate_packets = window_stats.duplicate_packets;
 }
 
 std::string MqttProtocol::GetHelloMessage() {
+    // The hello never changes, only the resume token is added to it
+    if (!hello_message_.empty()) {
+        return AppendResumeToken(hello_message_);
+    }
+
     // 发送 hello 消息申请 UDP 通道
-    cJSON* root = cJSON_CreateObject();
-    cJSON_AddStringToObject(root, "type", "hello");
-    cJSON_AddNumberToObject(root, "version", 3);
-    cJSON_AddStringToObject(root, "transport", "udp");
-    cJSON* features = cJSON_CreateObject();
+    JsonWriter json(hello_message_);
+    json.BeginObject();
+    json.Field("type", "hello");
+    json.Field("version", 3);
+    json.Field("transport", "udp");
+    json.Key("features").BeginObject();
 #if CONFIG_USE_SERVER_AEC
-    cJSON_AddBoolToObject(features, "aec", true);
+    json.Field("aec", true);
 #endif
 #if CONFIG_IOT_PROTOCOL_MCP
-    cJSON_AddBoolToObject(features, "mcp", true);
+    json.Field("mcp", true);
 #endif
-    cJSON_AddItemToObject(root, "features", features);
-    cJSON* audio_params = cJSON_CreateObject();
-    cJSON_AddStringToObject(audio_params, "format", "opus");
-    cJSON_AddNumberToObject(audio_params, "sample_rate", 16000);
-    cJSON_AddNumberToObject(audio_params, "channels", 1);
-    cJSON_AddNumberToObject(audio_params, "frame_duration", OPUS_FRAME_DURATION_MS);
-    cJSON_AddItemToObject(root, "audio_params", audio_params);
-    auto json_str = cJSON_PrintUnformatted(root);
-    std::string message(json_str);
-    cJSON_free(json_str);
-    cJSON_Delete(root);
-    return message;
+    // The server picks aes-128-gcm in udp.encryption of its hello if it supports it,
+    // device headers then carry AUDIO_CIPHER_UPLINK_FLAG
+    json.Field("udp_aes_gcm", true);
+    json.EndObject();
+    json.Key("audio_params").BeginObject();
+    json.Field("format", "opus");
+    json.Field("sample_rate", 16000);
+    json.Field("channels", 1);
+    json.Field("frame_duration", OPUS_FRAME_DURATION_MS);
+    json.EndObject();
+    json.EndObject();
+    return AppendResumeToken(json.str());
 }
 
 void MqttProtocol::ParseServerHello(const cJSON* root) {
@@ -290,6 +493,7 @@ void MqttProtocol::ParseServerHello(const cJSON* root) {
         session_id_ = session_id->valuestring;
         ESP_LOGI(TAG, "Session ID: %s", session_id_.c_str());
     }
+    ParseResumeToken(root);
 
     // Get sample rate from hello message
     auto audio_params = cJSON_GetObjectItem(root, "audio_params");
@@ -309,18 +513,28 @@ void MqttProtocol::ParseServerHello(const cJSON* root) {
         ESP_LOGE(TAG, "UDP is not specified");
         return;
     }
-    udp_server_ = cJSON_GetObjectItem(udp, "server")->valuestring;
-    udp_port_ = cJSON_GetObjectItem(udp, "port")->valueint;
-    auto key = cJSON_GetObjectItem(udp, "key")->valuestring;
-    auto nonce = cJSON_GetObjectItem(udp, "nonce")->valuestring;
+    std::string server = cJSON_GetObjectItem(udp, "server")->valuestring;
+    int port = cJSON_GetObjectItem(udp, "port")->valueint;
+    auto key = DecodeHexString(cJSON_GetObjectItem(udp, "key")->valuestring);
+    auto nonce = DecodeHexString(cJSON_GetObjectItem(udp, "nonce")->valuestring);
+
+    auto cipher_mode = kAudioCipherAesCtr;
+    auto encryption = cJSON_GetObjectItem(udp, "encryption");
+    if (cJSON_IsString(encryption) && strcmp(encryption->valuestring, "aes-128-gcm") == 0) {
+        cipher_mode = kAudioCipherAesGcm;
+    }
+    ESP_LOGI(TAG, "UDP server: %s, port: %d, encryption: %s", server.c_str(), port,
+        cipher_mode == kAudioCipherAesGcm ? "aes-128-gcm" : "aes-128-ctr");
 
-    // auto encryption = cJSON_GetObjectItem(udp, "encryption")->valuestring;
-    // ESP_LOGI(TAG, "UDP server: %s, port: %d, encryption: %s", udp_server_.c_str(), udp_port_, encryption);
-    aes_nonce_ = DecodeHexString(nonce);
-    mbedtls_aes_init(&aes_ctx_);
-    mbedtls_aes_setkey_enc(&aes_ctx_, (const unsigned char*)DecodeHexString(key).c_str(), 128);
-    local_sequence_ = 0;
-    remote_sequence_ = 0;
+    {
+        // The current socket keeps its endpoint and key until SetupAudioChannel() replaces it
+        std::lock_guard<std::mutex> lock(channel_mutex_);
+        hello_udp_.server = server;
+        hello_udp_.port = port;
+        hello_udp_.key = key;
+        hello_udp_.nonce = nonce;
+        hello_udp_.cipher_mode = cipher_mode;
+    }
     xEventGroupSetBits(event_group_handle_, MQTT_PROTOCOL_SERVER_HELLO_EVENT);
 }
 
@@ -344,5 +558,5 @@ std::string MqttProtocol::DecodeHexString(const std::string& hex_string) {
 }
 
 bool MqttProtocol::IsAudioChannelOpened() const {
-    return udp_ != nullptr && !error_occurred_ && !IsTimeout();
+    return udp_ != nullptr && !channel_parked_ && !error_occurred_ && !IsTimeout();
 }
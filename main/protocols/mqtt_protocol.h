@@ -3,16 +3,20 @@
 
 
 #include "protocol.h"
+#include "audio_cipher.h"
+#include "reorder_window.h"
 #include <mqtt.h>
 #include <udp.h>
 #include <cJSON.h>
-#include <mbedtls/aes.h>
 #include <freertos/FreeRTOS.h>
 #include <freertos/event_groups.h>
+#include <esp_timer.h>
 
 #include <functional>
 #include <string>
 #include <map>
+#include <list>
+#include <memory>
 #include <mutex>
 
 #define MQTT_PING_INTERVAL_SECONDS 90
@@ -20,6 +24,12 @@
 
 #define MQTT_PROTOCOL_SERVER_HELLO_EVENT (1 << 0)
 
+// Longer gaps are not concealed, the decoder would only produce noise-like fill
+#define MQTT_MAX_CONCEALED_PACKETS 3
+// How many early packets, and for how long, the receive side holds while waiting for a missing one
+#define MQTT_REORDER_WINDOW_PACKETS 4
+#define MQTT_REORDER_WINDOW_MS 120
+
 class MqttProtocol : public Protocol {
 public:
     MqttProtocol();
@@ -27,9 +37,12 @@ public:
 
     bool Start() override;
     bool SendAudio(const AudioStreamPacket& packet) override;
+    size_t SendAudioBatch(const std::list<AudioStreamPacket>& packets) override;
     bool OpenAudioChannel() override;
     void CloseAudioChannel() override;
     bool IsAudioChannelOpened() const override;
+    void PrewarmAudioChannel() override;
+    void CheckKeepWarm() override;
 
 private:
     EventGroupHandle_t event_group_handle_;
@@ -39,14 +52,49 @@ private:
     std::mutex channel_mutex_;
     Mqtt* mqtt_ = nullptr;
     Udp* udp_ = nullptr;
-    mbedtls_aes_context aes_ctx_;
+    // One cipher per direction, the send side is guarded by channel_mutex_
+    std::unique_ptr<AudioCipher> send_cipher_;
+    std::unique_ptr<AudioCipher> receive_cipher_;
+    AudioCipherMode cipher_mode_ = kAudioCipherAesCtr;
+    // Or-ed into the flags byte of sent headers, see AUDIO_CIPHER_UPLINK_FLAG
+    uint8_t uplink_flags_ = 0;
+    // Endpoint and key of the current UDP socket, only changed under channel_mutex_ once
+    // the old socket is gone, its receive callback reads them
     std::string aes_nonce_;
+    std::string aes_key_;
     std::string udp_server_;
-    int udp_port_;
+    int udp_port_ = 0;
     uint32_t local_sequence_;
-    uint32_t remote_sequence_;
+    // What the last server hello asked for, SetupAudioChannel() applies it to the channel
+    struct UdpParams {
+        std::string server;
+        int port = 0;
+        std::string key;
+        std::string nonce;
+        AudioCipherMode cipher_mode = kAudioCipherAesCtr;
+    };
+    UdpParams hello_udp_;
+    // Set when the server resumed the session with the same UDP endpoint and key
+    bool udp_channel_kept_ = false;
+    std::string hello_message_;
+    // Guards the reorder window and remote_timestamp_: the UDP task pushes, the timer and
+    // the MQTT task flush, and this keeps their deliveries to the decode queue in sequence
+    std::mutex reorder_mutex_;
+    uint32_t remote_timestamp_ = 0;
+    ReorderWindow reorder_window_{MQTT_REORDER_WINDOW_PACKETS, MQTT_REORDER_WINDOW_MS};
+    // Gives up gaps when no later packet arrives to do it, e.g. at the end of a response
+    esp_timer_handle_t reorder_timer_ = nullptr;
+    // Reused for every datagram: the header is written in place and the payload encrypted right after it
+    std::string send_buffer_;
+    // Reused by the UDP receive callback, the consumer swaps a recycled payload buffer back into it
+    AudioStreamPacket receive_packet_;
 
     bool StartMqttClient(bool report_error=false);
+    bool SendAudioLocked(const AudioStreamPacket& packet);
+    bool SetupAudioChannel(bool report_error);
+    void ReleaseAudioChannel();
+    void ExpireHeldPackets();
+    void UpdateWindowStats();
     void ParseServerHello(const cJSON* root);
     std::string DecodeHexString(const std::string& hex_string);
 
@@ -1,10 +1,11 @@
 #include "protocol.h"
+#include "json_writer.h"
 
 #include <esp_log.h>
 
 #define TAG "Protocol"
 
-void Protocol::OnIncomingJson(std::function<void(const cJSON* root)> callback) {
+void Protocol::OnIncomingJson(std::function<void(const JsonMessage& message)> callback) {
     on_incoming_json_ = callback;
 }
 
@@ -24,6 +25,43 @@ void Protocol::OnNetworkError(std::function<void(const std::string& message)> ca
     on_network_error_ = callback;
 }
 
+void Protocol::SetKeepWarm(int linger_seconds) {
+    keep_warm_seconds_ = linger_seconds;
+}
+
+void Protocol::ParkAudioChannel() {
+    channel_parked_ = true;
+    parked_time_ = std::chrono::steady_clock::now();
+    ESP_LOGI(TAG, "Keeping audio channel warm for %d seconds", keep_warm_seconds_);
+}
+
+bool Protocol::IsParkExpired() const {
+    auto duration = std::chrono::duration_cast<std::chrono::seconds>(std::chrono::steady_clock::now() - parked_time_);
+    return duration.count() >= keep_warm_seconds_;
+}
+
+void Protocol::ParseResumeToken(const cJSON* root) {
+    session_resumed_ = cJSON_IsTrue(cJSON_GetObjectItem(root, "resumed"));
+    auto resume_token = cJSON_GetObjectItem(root, "resume_token");
+    if (cJSON_IsString(resume_token)) {
+        resume_token_ = resume_token->valuestring;
+    } else {
+        resume_token_.clear();
+    }
+}
+
+std::string Protocol::AppendResumeToken(const std::string& hello) const {
+    if (resume_token_.empty() || hello.empty() || hello.back() != '}') {
+        return hello;
+    }
+    // Reopen the cached hello object and add the token as its last field
+    JsonWriter json(hello.size() + resume_token_.size() + 24);
+    json.Raw(std::string_view(hello).substr(0, hello.size() - 1));
+    json.Field("resume_token", resume_token_);
+    json.EndObject();
+    return json.str();
+}
+
 void Protocol::SetError(const std::string& message) {
     error_occurred_ = true;
     if (on_network_error_ != nullptr) {
@@ -31,38 +69,65 @@ void Protocol::SetError(const std::string& message) {
     }
 }
 
+size_t Protocol::SendAudioBatch(const std::list<AudioStreamPacket>& packets) {
+    size_t sent = 0;
+    for (auto& packet : packets) {
+        if (!SendAudio(packet)) {
+            break;
+        }
+        sent++;
+    }
+    return sent;
+}
+
 void Protocol::SendAbortSpeaking(AbortReason reason) {
-    std::string message = "{\"session_id\":\"" + session_id_ + "\",\"type\":\"abort\"";
+    JsonWriter json(96 + session_id_.size());
+    json.BeginObject();
+    json.Field("session_id", session_id_);
+    json.Field("type", "abort");
     if (reason == kAbortReasonWakeWordDetected) {
-        message += ",\"reason\":\"wake_word_detected\"";
+        json.Field("reason", "wake_word_detected");
     }
-    message += "}";
-    SendText(message);
+    json.EndObject();
+    SendText(json.str());
 }
 
 void Protocol::SendWakeWordDetected(const std::string& wake_word) {
-    std::string json = "{\"session_id\":\"" + session_id_ + 
-                      "\",\"type\":\"listen\",\"state\":\"detect\",\"text\":\"" + wake_word + "\"}";
-    SendText(json);
+    JsonWriter json(96 + session_id_.size() + wake_word.size());
+    json.BeginObject();
+    json.Field("session_id", session_id_);
+    json.Field("type", "listen");
+    json.Field("state", "detect");
+    json.Field("text", wake_word);
+    json.EndObject();
+    SendText(json.str());
 }
 
 void Protocol::SendStartListening(ListeningMode mode) {
-    std::string message = "{\"session_id\":\"" + session_id_ + "\"";
-    message += ",\"type\":\"listen\",\"state\":\"start\"";
+    JsonWriter json(96 + session_id_.size());
+    json.BeginObject();
+    json.Field("session_id", session_id_);
+    json.Field("type", "listen");
+    json.Field("state", "start");
     if (mode == kListeningModeRealtime) {
-        message += ",\"mode\":\"realtime\"";
+        json.Field("mode", "realtime");
     } else if (mode == kListeningModeAutoStop) {
-        message += ",\"mode\":\"auto\"";
+        json.Field("mode", "auto");
     } else {
-        message += ",\"mode\":\"manual\"";
+        json.Field("mode", "manual");
     }
-    message += "}";
-    SendText(message);
+    json.EndObject();
+    SendText(json.str());
 }
 
 void Protocol::SendStopListening() {
-    std::string message = "{\"session_id\":\"" + session_id_ + "\",\"type\":\"listen\",\"state\":\"stop\"}";
-    SendText(message);
+    JsonWriter json(96 + session_id_.size());
+    json.BeginObject();
+    json.Field("session_id", session_id_);
+    json.Field("type", "listen");
+    json.Field("state", "stop");
+    json.EndObject();
+    SendText(json.str());
 }
 
 void Protocol::SendIotDescriptors(const std::string& descriptors) {
@@ -111,13 +176,24 @@ void Protocol::SendIotDescriptors(const std::string& descriptors) {
 }
 
 void Protocol::SendIotStates(const std::string& states) {
-    std::string message = "{\"session_id\":\"" + session_id_ + "\",\"type\":\"iot\",\"update\":true,\"states\":" + states + "}";
-    SendText(message);
+    JsonWriter json(96 + session_id_.size() + states.size());
+    json.BeginObject();
+    json.Field("session_id", session_id_);
+    json.Field("type", "iot");
+    json.Field("update", true);
+    json.RawField("states", states);
+    json.EndObject();
+    SendText(json.str());
 }
 
 void Protocol::SendMcpMessage(const std::string& payload) {
-    std::string message = "{\"session_id\":\"" + session_id_ + "\",\"type\":\"mcp\",\"payload\":" + payload + "}";
-    SendText(message);
+    JsonWriter json(96 + session_id_.size() + payload.size());
+    json.BeginObject();
+    json.Field("session_id", session_id_);
+    json.Field("type", "mcp");
+    json.RawField("payload", payload);
+    json.EndObject();
+    SendText(json.str());
 }
 
 bool Protocol::IsTimeout() const {
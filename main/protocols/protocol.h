@@ -6,6 +6,9 @@
 #include <functional>
 #include <chrono>
 #include <vector>
+#include <list>
+
+#include "json_message.h"
 
 struct AudioStreamPacket {
     int sample_rate = 0;
@@ -14,6 +17,16 @@ struct AudioStreamPacket {
     std::vector<uint8_t> payload;
 };
 
+// Receive side counters of the audio channel
+struct AudioChannelStats {
+    uint32_t received_packets = 0;
+    uint32_t lost_packets = 0;          // Missing from the sequence
+    uint32_t late_packets = 0;          // Arrived after its gap was given up, dropped
+    uint32_t reordered_packets = 0;     // Arrived out of order but put back in place
+    uint32_t duplicate_packets = 0;
+    uint32_t concealed_packets = 0;     // Loss markers handed to the decoder instead of lost packets
+};
+
 struct BinaryProtocol2 {
     uint16_t version;
     uint16_t type;          // Message type (0: OPUS, 1: JSON)
@@ -54,18 +67,33 @@ public:
     inline const std::string& session_id() const {
         return session_id_;
     }
+    inline AudioChannelStats audio_channel_stats() const {
+        return audio_channel_stats_;
+    }
+    // Whether the last OpenAudioChannel reused a kept-warm channel instead of connecting
+    inline bool audio_channel_reused() const {
+        return channel_reused_;
+    }
 
     void OnIncomingAudio(std::function<void(AudioStreamPacket&& packet)> callback);
-    void OnIncomingJson(std::function<void(const cJSON* root)> callback);
+    void OnIncomingJson(std::function<void(const JsonMessage& message)> callback);
     void OnAudioChannelOpened(std::function<void()> callback);
     void OnAudioChannelClosed(std::function<void()> callback);
     void OnNetworkError(std::function<void(const std::string& message)> callback);
+    // Keeps the channel connected for linger_seconds after CloseAudioChannel, 0 closes it right away
+    void SetKeepWarm(int linger_seconds);
 
     virtual bool Start() = 0;
     virtual bool OpenAudioChannel() = 0;
     virtual void CloseAudioChannel() = 0;
     virtual bool IsAudioChannelOpened() const = 0;
+    // Opens a channel ahead of time and keeps it warm, does nothing unless keep-warm is enabled
+    virtual void PrewarmAudioChannel() {}
+    // Releases a kept-warm channel once its linger time is over, call it periodically from the main task
+    virtual void CheckKeepWarm() {}
     virtual bool SendAudio(const AudioStreamPacket& packet) = 0;
+    // Sends packets in order until one fails, returns the number sent
+    virtual size_t SendAudioBatch(const std::list<AudioStreamPacket>& packets);
     virtual void SendWakeWordDetected(const std::string& wake_word);
     virtual void SendStartListening(ListeningMode mode);
     virtual void SendStopListening();
@@ -75,7 +103,7 @@ public:
     virtual void SendMcpMessage(const std::string& message);
 
 protected:
-    std::function<void(const cJSON* root)> on_incoming_json_;
+    std::function<void(const JsonMessage& message)> on_incoming_json_;
     std::function<void(AudioStreamPacket&& packet)> on_incoming_audio_;
     std::function<void()> on_audio_channel_opened_;
     std::function<void()> on_audio_channel_closed_;
@@ -86,7 +114,21 @@ protected:
     bool error_occurred_ = false;
     std::string session_id_;
     std::chrono::time_point<std::chrono::steady_clock> last_incoming_time_;
+    AudioChannelStats audio_channel_stats_;
+
+    int keep_warm_seconds_ = 0;
+    // Closed for the application but still connected, waiting to be reopened
+    bool channel_parked_ = false;
+    bool channel_reused_ = false;
+    std::chrono::time_point<std::chrono::steady_clock> parked_time_;
+    // Issued by the server hello and sent back in the next one, so the server can resume the session
+    std::string resume_token_;
+    bool session_resumed_ = false;
 
+    void ParkAudioChannel();
+    bool IsParkExpired() const;
+    void ParseResumeToken(const cJSON* root);
+    std::string AppendResumeToken(const std::string& hello) const;
     virtual bool SendText(const std::string& text) = 0;
     virtual void SetError(const std::string& message);
     virtual bool IsTimeout() const;
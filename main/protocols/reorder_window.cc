@@ -0,0 +1,165 @@
+#include "reorder_window.h"
+
+ReorderWindow::ReorderWindow(size_t depth, int max_hold_ms)
+    : slots_(depth), max_hold_ms_(max_hold_ms) {
+}
+
+void ReorderWindow::OnDeliver(std::function<void(AudioStreamPacket&& packet)> callback) {
+    on_deliver_ = callback;
+}
+
+void ReorderWindow::OnLoss(std::function<void(uint32_t lost, const AudioStreamPacket& next)> callback) {
+    on_loss_ = callback;
+}
+
+void ReorderWindow::Push(uint32_t sequence, AudioStreamPacket& packet, int64_t now_ms) {
+    if (!started_) {
+        started_ = true;
+        expected_ = sequence;
+    }
+
+    int32_t diff = static_cast<int32_t>(sequence - expected_);
+    if (diff < 0) {
+        uint32_t age = -diff - 1;
+        if (age < 64 && (history_ >> age) & 1) {
+            stats_.duplicate_packets++;
+        } else {
+            stats_.late_packets++;
+        }
+        return;
+    }
+
+    if (diff == 0) {
+        if (held_ > 0) {
+            stats_.reordered_packets++;
+        }
+        Deliver(packet);
+        ReleaseHeld();
+    } else {
+        for (auto& slot : slots_) {
+            if (slot.used && slot.sequence == sequence) {
+                stats_.duplicate_packets++;
+                return;
+            }
+        }
+
+        if (held_ == slots_.size()) {
+            if (static_cast<int32_t>(sequence - OldestHeld()->sequence) < 0) {
+                // The window is full and the packet is older than all it holds: give up
+                // only the gap in front of it, then it and the held ones go out in order
+                stats_.reordered_packets++;
+                SkipTo(sequence, packet);
+                Deliver(packet);
+                ReleaseHeld();
+                Expire(now_ms);
+                return;
+            }
+            // Give up the gap and place the packet again
+            SkipToOldest();
+            Push(sequence, packet, now_ms);
+            return;
+        }
+        for (auto& slot : slots_) {
+            if (!slot.used) {
+                slot.used = true;
+                slot.sequence = sequence;
+                slot.arrival_ms = now_ms;
+                slot.packet.sample_rate = packet.sample_rate;
+                slot.packet.frame_duration = packet.frame_duration;
+                slot.packet.timestamp = packet.timestamp;
+                // Swap so the caller keeps a buffer to receive into
+                slot.packet.payload.swap(packet.payload);
+                held_++;
+                break;
+            }
+        }
+    }
+
+    Expire(now_ms);
+}
+
+void ReorderWindow::Expire(int64_t now_ms) {
+    // Do not wait for a missing packet longer than max_hold_ms
+    while (held_ > 0) {
+        int64_t oldest = now_ms;
+        for (auto& slot : slots_) {
+            if (slot.used && slot.arrival_ms < oldest) {
+                oldest = slot.arrival_ms;
+            }
+        }
+        if (now_ms - oldest < max_hold_ms_) {
+            break;
+        }
+        SkipToOldest();
+    }
+}
+
+void ReorderWindow::Flush() {
+    while (held_ > 0) {
+        SkipToOldest();
+    }
+}
+
+void ReorderWindow::Reset() {
+    for (auto& slot : slots_) {
+        slot.used = false;
+    }
+    held_ = 0;
+    started_ = false;
+    expected_ = 0;
+    history_ = 0;
+}
+
+void ReorderWindow::Deliver(AudioStreamPacket& packet) {
+    expected_++;
+    history_ = (history_ << 1) | 1;
+    if (on_deliver_ != nullptr) {
+        on_deliver_(std::move(packet));
+    }
+}
+
+void ReorderWindow::ReleaseHeld() {
+    bool found = true;
+    while (held_ > 0 && found) {
+        found = false;
+        for (auto& slot : slots_) {
+            if (slot.used && slot.sequence == expected_) {
+                slot.used = false;
+                held_--;
+                Deliver(slot.packet);
+                found = true;
+                break;
+            }
+        }
+    }
+}
+
+ReorderWindow::Slot* ReorderWindow::OldestHeld() {
+    Slot* oldest = nullptr;
+    for (auto& slot : slots_) {
+        if (slot.used && (oldest == nullptr || static_cast<int32_t>(slot.sequence - oldest->sequence) < 0)) {
+            oldest = &slot;
+        }
+    }
+    return oldest;
+}
+
+// Gives up the packets before `sequence`, `next` is the packet that goes out next
+void ReorderWindow::SkipTo(uint32_t sequence, const AudioStreamPacket& next) {
+    uint32_t lost = sequence - expected_;
+    stats_.lost_packets += lost;
+    if (on_loss_ != nullptr) {
+        on_loss_(lost, next);
+    }
+    history_ = lost < 64 ? history_ << lost : 0;
+    expected_ = sequence;
+}
+
+void ReorderWindow::SkipToOldest() {
+    Slot* next = OldestHeld();
+    if (next == nullptr) {
+        return;
+    }
+    SkipTo(next->sequence, next->packet);
+    ReleaseHeld();
+}
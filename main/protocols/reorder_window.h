@@ -0,0 +1,76 @@
+#ifndef REORDER_WINDOW_H
+#define REORDER_WINDOW_H
+
+#include <cstdint>
+#include <functional>
+#include <vector>
+
+#include "protocol.h"
+
+struct ReorderWindowStats {
+    uint32_t reordered_packets = 0;     // Arrived after a later packet but still in time
+    uint32_t duplicate_packets = 0;
+    uint32_t late_packets = 0;          // Arrived after their gap was given up
+    uint32_t lost_packets = 0;
+};
+
+/*
+ * Restores sequence order of received audio packets.
+ *
+ * Packets ahead of the expected sequence are held until the gap is filled.
+ * A gap is given up once more than `depth` packets are held or the oldest one
+ * has waited `max_hold_ms`; the loss is reported and playout continues with the
+ * held packets. Packets from before the window are dropped as duplicates or late.
+ * Push() only checks the hold time when a packet arrives, so at the end of a
+ * stream the owner calls Expire() periodically or Flush().
+ *
+ * In-order packets are delivered straight from the caller's packet without
+ * being copied. Not thread safe, the owner serializes all calls.
+ */
+class ReorderWindow {
+public:
+    ReorderWindow(size_t depth, int max_hold_ms);
+
+    void OnDeliver(std::function<void(AudioStreamPacket&& packet)> callback);
+    // Called before delivering `next`, the first packet after `lost` missing ones
+    void OnLoss(std::function<void(uint32_t lost, const AudioStreamPacket& next)> callback);
+
+    void Push(uint32_t sequence, AudioStreamPacket& packet, int64_t now_ms);
+    // Gives up the gaps that held packets have waited max_hold_ms for
+    void Expire(int64_t now_ms);
+    // Gives up all gaps and delivers every held packet
+    void Flush();
+    // Drops held packets and starts over at the next pushed sequence
+    void Reset();
+
+    inline size_t held() const { return held_; }
+    inline const ReorderWindowStats& stats() const { return stats_; }
+
+private:
+    struct Slot {
+        bool used = false;
+        uint32_t sequence = 0;
+        int64_t arrival_ms = 0;
+        AudioStreamPacket packet;
+    };
+
+    std::vector<Slot> slots_;
+    size_t held_ = 0;
+    int max_hold_ms_;
+    bool started_ = false;
+    uint32_t expected_ = 0;
+    // Bit i is set if sequence expected_ - 1 - i was delivered
+    uint64_t history_ = 0;
+    ReorderWindowStats stats_;
+
+    std::function<void(AudioStreamPacket&& packet)> on_deliver_;
+    std::function<void(uint32_t lost, const AudioStreamPacket& next)> on_loss_;
+
+    void Deliver(AudioStreamPacket& packet);
+    void ReleaseHeld();
+    Slot* OldestHeld();
+    void SkipTo(uint32_t sequence, const AudioStreamPacket& next);
+    void SkipToOldest();
+};
+
+#endif // REORDER_WINDOW_H
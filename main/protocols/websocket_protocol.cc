@@ -3,10 +3,13 @@
 #include "system_info.h"
 #include "application.h"
 #include "settings.h"
+#include "json_writer.h"
+#include "control_codec.h"
 
 #include <cstring>
 #include <cJSON.h>
 #include <esp_log.h>
+#include <esp_timer.h>
 #include <arpa/inet.h>
 #include "assets/lang_config.h"
 
@@ -49,7 +52,7 @@ bool WebsocketProtocol::SendAudio(const AudioStreamPacket& packet) {
         std::string serialized;
         serialized.resize(sizeof(BinaryProtocol3) + packet.payload.size());
         auto bp3 = (BinaryProtocol3*)serialized.data();
-        bp3->type = 0;
+        bp3->type = BINARY_PROTOCOL3_TYPE_AUDIO;
         bp3->reserved = 0;
         bp3->payload_size = htons(packet.payload.size());
         memcpy(bp3->payload, packet.payload.data(), packet.payload.size());
@@ -74,11 +77,113 @@ bool WebsocketProtocol::SendText(const std::string& text) {
     return true;
 }
 
+// `frame` starts with room for the BinaryProtocol3 header, followed by the encoded message
+bool WebsocketProtocol::SendControl(std::string& frame) {
+    if (websocket_ == nullptr) {
+        return false;
+    }
+
+    auto bp3 = (BinaryProtocol3*)frame.data();
+    bp3->type = BINARY_PROTOCOL3_TYPE_CONTROL;
+    bp3->reserved = 0;
+    bp3->payload_size = htons(frame.size() - sizeof(BinaryProtocol3));
+    if (!websocket_->Send(frame.data(), frame.size(), true)) {
+        ESP_LOGE(TAG, "Failed to send control message %u", bp3->payload[0]);
+        SetError(Lang::Strings::SERVER_ERROR);
+        return false;
+    }
+    return true;
+}
+
+void WebsocketProtocol::SendWakeWordDetected(const std::string& wake_word) {
+    if (!binary_control_) {
+        Protocol::SendWakeWordDetected(wake_word);
+        return;
+    }
+    std::string frame(sizeof(BinaryProtocol3), '\0');
+    ControlEncoder(frame, kControlMessageListen)
+        .Byte(kControlFieldState, kControlStateDetect)
+        .String(kControlFieldText, wake_word);
+    SendControl(frame);
+}
+
+void WebsocketProtocol::SendStartListening(ListeningMode mode) {
+    if (!binary_control_) {
+        Protocol::SendStartListening(mode);
+        return;
+    }
+    uint8_t control_mode = kControlModeManual;
+    if (mode == kListeningModeRealtime) {
+        control_mode = kControlModeRealtime;
+    } else if (mode == kListeningModeAutoStop) {
+        control_mode = kControlModeAuto;
+    }
+    std::string frame(sizeof(BinaryProtocol3), '\0');
+    ControlEncoder(frame, kControlMessageListen)
+        .Byte(kControlFieldState, kControlStateStart)
+        .Byte(kControlFieldMode, control_mode);
+    SendControl(frame);
+}
+
+void WebsocketProtocol::SendStopListening() {
+    if (!binary_control_) {
+        Protocol::SendStopListening();
+        return;
+    }
+    std::string frame(sizeof(BinaryProtocol3), '\0');
+    ControlEncoder(frame, kControlMessageListen)
+        .Byte(kControlFieldState, kControlStateStop);
+    SendControl(frame);
+}
+
+void WebsocketProtocol::SendAbortSpeaking(AbortReason reason) {
+    if (!binary_control_) {
+        Protocol::SendAbortSpeaking(reason);
+        return;
+    }
+    std::string frame(sizeof(BinaryProtocol3), '\0');
+    ControlEncoder encoder(frame, kControlMessageAbort);
+    if (reason == kAbortReasonWakeWordDetected) {
+        encoder.Byte(kControlFieldReason, kControlReasonWakeWordDetected);
+    }
+    SendControl(frame);
+}
+
+void WebsocketProtocol::SendIotStates(const std::string& states) {
+    // A frame carries at most 64 KB, larger states go out as JSON
+    if (!binary_control_ || states.size() > UINT16_MAX - 16) {
+        Protocol::SendIotStates(states);
+        return;
+    }
+    std::string frame;
+    frame.reserve(sizeof(BinaryProtocol3) + 8 + states.size());
+    frame.resize(sizeof(BinaryProtocol3));
+    ControlEncoder(frame, kControlMessageIot)
+        .String(kControlFieldStates, states);
+    SendControl(frame);
+}
+
 bool WebsocketProtocol::IsAudioChannelOpened() const {
-    return websocket_ != nullptr && websocket_->IsConnected() && !error_occurred_ && !IsTimeout();
+    return websocket_ != nullptr && !channel_parked_ && websocket_->IsConnected() && !error_occurred_ && !IsTimeout();
 }
 
 void WebsocketProtocol::CloseAudioChannel() {
+    if (channel_parked_) {
+        ReleaseParkedChannel();
+        return;
+    }
+
+    if (keep_warm_seconds_ > 0 && websocket_ != nullptr && websocket_->IsConnected() && !error_occurred_) {
+        // Leave the connection up for the next wake up, the server only stops the current turn
+        SendAbortSpeaking(kAbortReasonNone);
+        SendStopListening();
+        ParkAudioChannel();
+        if (on_audio_channel_closed_ != nullptr) {
+            on_audio_channel_closed_();
+        }
+        return;
+    }
+
     if (websocket_ != nullptr) {
         delete websocket_;
         websocket_ = nullptr;
@@ -86,28 +191,96 @@ void WebsocketProtocol::CloseAudioChannel() {
 }
 
 bool WebsocketProtocol::OpenAudioChannel() {
+    channel_reused_ = false;
+    if (channel_parked_ && websocket_ != nullptr && websocket_->IsConnected()) {
+        // Still connected, a hello round trip is all it takes
+        auto start_time = esp_timer_get_time();
+        channel_parked_ = false;
+        error_occurred_ = false;
+        if (!ExchangeHello(true)) {
+            return false;
+        }
+        ESP_LOGI(TAG, "Reopened warm channel in %lld ms, session %s", (esp_timer_get_time() - start_time) / 1000,
+            session_resumed_ ? "resumed" : "restarted");
+        channel_reused_ = true;
+    } else if (!Connect(true)) {
+        return false;
+    }
+
+    if (on_audio_channel_opened_ != nullptr) {
+        on_audio_channel_opened_();
+    }
+    return true;
+}
+
+void WebsocketProtocol::PrewarmAudioChannel() {
+    if (keep_warm_seconds_ == 0 || websocket_ != nullptr) {
+        return;
+    }
+
+    // Failures are not reported, the next OpenAudioChannel tries again
+    if (Connect(false)) {
+        ParkAudioChannel();
+    } else {
+        ReleaseParkedChannel();
+    }
+}
+
+void WebsocketProtocol::CheckKeepWarm() {
+    if (!channel_parked_) {
+        return;
+    }
+    if (websocket_ != nullptr && websocket_->IsConnected() && !IsParkExpired()) {
+        return;
+    }
+    ESP_LOGI(TAG, "Releasing warm channel");
+    ReleaseParkedChannel();
+}
+
+void WebsocketProtocol::ReleaseParkedChannel() {
+    // The application already saw the channel close, keep the parked flag while deleting
+    // so OnDisconnected does not report it again
+    channel_parked_ = true;
     if (websocket_ != nullptr) {
         delete websocket_;
+        websocket_ = nullptr;
+    }
+    channel_parked_ = false;
+}
+
+void WebsocketProtocol::LoadSettings() {
+    if (settings_loaded_) {
+        return;
     }
 
     Settings settings("websocket", false);
-    std::string url = settings.GetString("url");
-    std::string token = settings.GetString("token");
+    url_ = settings.GetString("url");
+    token_ = settings.GetString("token");
     int version = settings.GetInt("version");
     if (version != 0) {
         version_ = version;
     }
+    // If token not has a space, add "Bearer " prefix
+    if (!token_.empty() && token_.find(" ") == std::string::npos) {
+        token_ = "Bearer " + token_;
+    }
+    settings_loaded_ = true;
+}
 
+bool WebsocketProtocol::Connect(bool report_error) {
+    if (websocket_ != nullptr) {
+        delete websocket_;
+    }
+
+    LoadSettings();
     error_occurred_ = false;
+    channel_parked_ = false;
+    binary_control_ = false;
 
     websocket_ = Board::GetInstance().CreateWebSocket();
     
-    if (!token.empty()) {
-        // If token not has a space, add "Bearer " prefix
-        if (token.find(" ") == std::string::npos) {
-            token = "Bearer " + token;
-        }
-        websocket_->SetHeader("Authorization", token.c_str());
+    if (!token_.empty()) {
+        websocket_->SetHeader("Authorization", token_.c_str());
     }
     websocket_->SetHeader("Protocol-Version", std::to_string(version_).c_str());
     websocket_->SetHeader("Device-Id", SystemInfo::GetMacAddress().c_str());
@@ -115,77 +288,59 @@ bool WebsocketProtocol::OpenAudioChannel() {
 
     websocket_->OnData([this](const char* data, size_t len, bool binary) {
         if (binary) {
-            if (on_incoming_audio_ != nullptr) {
-                if (version_ == 2) {
-                    BinaryProtocol2* bp2 = (BinaryProtocol2*)data;
-                    bp2->version = ntohs(bp2->version);
-                    bp2->type = ntohs(bp2->type);
-                    bp2->timestamp = ntohl(bp2->timestamp);
-                    bp2->payload_size = ntohl(bp2->payload_size);
-                    auto payload = (uint8_t*)bp2->payload;
-                    on_incoming_audio_(AudioStreamPacket{
-                        .sample_rate = server_sample_rate_,
-                        .frame_duration = server_frame_duration_,
-                        .timestamp = bp2->timestamp,
-                        .payload = std::vector<uint8_t>(payload, payload + bp2->payload_size)
-                    });
-                } else if (version_ == 3) {
-                    BinaryProtocol3* bp3 = (BinaryProtocol3*)data;
-                    bp3->type = bp3->type;
-                    bp3->payload_size = ntohs(bp3->payload_size);
-                    auto payload = (uint8_t*)bp3->payload;
-                    on_incoming_audio_(AudioStreamPacket{
-                        .sample_rate = server_sample_rate_,
-                        .frame_duration = server_frame_duration_,
-                        .timestamp = 0,
-                        .payload = std::vector<uint8_t>(payload, payload + bp3->payload_size)
-                    });
-                } else {
-                    on_incoming_audio_(AudioStreamPacket{
-                        .sample_rate = server_sample_rate_,
-                        .frame_duration = server_frame_duration_,
-                        .timestamp = 0,
-                        .payload = std::vector<uint8_t>((uint8_t*)data, (uint8_t*)data + len)
-                    });
-                }
+            // Nobody listens on a parked channel, neither for audio nor for control frames
+            if (!channel_parked_) {
+                OnBinaryData(data, len);
             }
         } else {
             // Parse JSON data
-            auto root = cJSON_Parse(data);
-            auto type = cJSON_GetObjectItem(root, "type");
-            if (cJSON_IsString(type)) {
-                if (strcmp(type->valuestring, "hello") == 0) {
+            JsonMessage message;
+            if (message.Parse(data, len) && message.Has(kJsonFieldType)) {
+                if (message.type() == kJsonMessageHello) {
+                    // The hello is rare and nested, a full tree is fine here
+                    auto root = cJSON_ParseWithLength(data, len);
                     ParseServerHello(root);
-                } else {
+                    cJSON_Delete(root);
+                } else if (!channel_parked_) {
                     if (on_incoming_json_ != nullptr) {
-                        on_incoming_json_(root);
+                        on_incoming_json_(message);
                     }
                 }
             } else {
-                ESP_LOGE(TAG, "Missing message type, data: %s", data);
+                ESP_LOGE(TAG, "Missing message type, data: %.*s", (int)len, data);
             }
-            cJSON_Delete(root);
         }
         last_incoming_time_ = std::chrono::steady_clock::now();
     });
 
     websocket_->OnDisconnected([this]() {
         ESP_LOGI(TAG, "Websocket disconnected");
-        if (on_audio_channel_closed_ != nullptr) {
+        if (on_audio_channel_closed_ != nullptr && !channel_parked_) {
             on_audio_channel_closed_();
         }
     });
 
-    ESP_LOGI(TAG, "Connecting to websocket server: %s with version: %d", url.c_str(), version_);
-    if (!websocket_->Connect(url.c_str())) {
+    ESP_LOGI(TAG, "Connecting to websocket server: %s with version: %d", url_.c_str(), version_);
+    if (!websocket_->Connect(url_.c_str())) {
         ESP_LOGE(TAG, "Failed to connect to websocket server");
-        SetError(Lang::Strings::SERVER_NOT_CONNECTED);
+        if (report_error) {
+            SetError(Lang::Strings::SERVER_NOT_CONNECTED);
+        }
         return false;
     }
 
+    return ExchangeHello(report_error);
+}
+
+bool WebsocketProtocol::ExchangeHello(bool report_error) {
     // Send hello message to describe the client
+    xEventGroupClearBits(event_group_handle_, WEBSOCKET_PROTOCOL_SERVER_HELLO_EVENT);
     auto message = GetHelloMessage();
-    if (!SendText(message)) {
+    if (!websocket_->Send(message)) {
+        ESP_LOGE(TAG, "Failed to send hello");
+        if (report_error) {
+            SetError(Lang::Strings::SERVER_ERROR);
+        }
         return false;
     }
 
@@ -193,42 +348,95 @@ bool WebsocketProtocol::OpenAudioChannel() {
     EventBits_t bits = xEventGroupWaitBits(event_group_handle_, WEBSOCKET_PROTOCOL_SERVER_HELLO_EVENT, pdTRUE, pdFALSE, pdMS_TO_TICKS(10000));
     if (!(bits & WEBSOCKET_PROTOCOL_SERVER_HELLO_EVENT)) {
         ESP_LOGE(TAG, "Failed to receive server hello");
-        SetError(Lang::Strings::SERVER_TIMEOUT);
+        if (report_error) {
+            SetError(Lang::Strings::SERVER_TIMEOUT);
+        }
         return false;
     }
-
-    if (on_audio_channel_opened_ != nullptr) {
-        on_audio_channel_opened_();
-    }
-
     return true;
 }
 
 std::string WebsocketProtocol::GetHelloMessage() {
+    // The hello never changes, only the resume token is added to it
+    if (!hello_message_.empty()) {
+        return AppendResumeToken(hello_message_);
+    }
+
     // keys: message type, version, audio_params (format, sample_rate, channels)
-    cJSON* root = cJSON_CreateObject();
-    cJSON_AddStringToObject(root, "type", "hello");
-    cJSON_AddNumberToObject(root, "version", version_);
-    cJSON* features = cJSON_CreateObject();
+    JsonWriter json(hello_message_);
+    json.BeginObject();
+    json.Field("type", "hello");
+    json.Field("version", version_);
+    json.Key("features").BeginObject();
 #if CONFIG_USE_SERVER_AEC
-    cJSON_AddBoolToObject(features, "aec", true);
+    json.Field("aec", true);
 #endif
 #if CONFIG_IOT_PROTOCOL_MCP
-    cJSON_AddBoolToObject(features, "mcp", true);
+    json.Field("mcp", true);
 #endif
-    cJSON_AddItemToObject(root, "features", features);
-    cJSON_AddStringToObject(root, "transport", "websocket");
-    cJSON* audio_params = cJSON_CreateObject();
-    cJSON_AddStringToObject(audio_params, "format", "opus");
-    cJSON_AddNumberToObject(audio_params, "sample_rate", 16000);
-    cJSON_AddNumberToObject(audio_params, "channels", 1);
-    cJSON_AddNumberToObject(audio_params, "frame_duration", OPUS_FRAME_DURATION_MS);
-    cJSON_AddItemToObject(root, "audio_params", audio_params);
-    auto json_str = cJSON_PrintUnformatted(root);
-    std::string message(json_str);
-    cJSON_free(json_str);
-    cJSON_Delete(root);
-    return message;
+    if (version_ == 3) {
+        json.Field("binary_control", true);
+    }
+    json.EndObject();
+    json.Field("transport", "websocket");
+    json.Key("audio_params").BeginObject();
+    json.Field("format", "opus");
+    json.Field("sample_rate", 16000);
+    json.Field("channels", 1);
+    json.Field("frame_duration", OPUS_FRAME_DURATION_MS);
+    json.EndObject();
+    json.EndObject();
+    return AppendResumeToken(json.str());
+}
+
+void WebsocketProtocol::OnBinaryData(const char* data, size_t len) {
+    if (version_ == 2) {
+        auto bp2 = (const BinaryProtocol2*)data;
+        if (len < sizeof(BinaryProtocol2) || ntohl(bp2->payload_size) > len - sizeof(BinaryProtocol2)) {
+            ESP_LOGE(TAG, "Malformed binary frame, size: %u", len);
+            return;
+        }
+        if (on_incoming_audio_ != nullptr) {
+            auto payload = bp2->payload;
+            on_incoming_audio_(AudioStreamPacket{
+                .sample_rate = server_sample_rate_,
+                .frame_duration = server_frame_duration_,
+                .timestamp = ntohl(bp2->timestamp),
+                .payload = std::vector<uint8_t>(payload, payload + ntohl(bp2->payload_size))
+            });
+        }
+    } else if (version_ == 3) {
+        // The header is read only once the frame is known to hold it
+        auto bp3 = (const BinaryProtocol3*)data;
+        if (len < sizeof(BinaryProtocol3) || ntohs(bp3->payload_size) > len - sizeof(BinaryProtocol3)) {
+            ESP_LOGE(TAG, "Malformed binary frame, size: %u", len);
+            return;
+        }
+        auto payload = bp3->payload;
+        auto payload_size = ntohs(bp3->payload_size);
+        if (bp3->type == BINARY_PROTOCOL3_TYPE_CONTROL) {
+            JsonMessage message;
+            if (!DecodeControlMessage(payload, payload_size, message)) {
+                ESP_LOGE(TAG, "Malformed control frame, size: %u", len);
+            } else if (on_incoming_json_ != nullptr) {
+                on_incoming_json_(message);
+            }
+        } else if (on_incoming_audio_ != nullptr) {
+            on_incoming_audio_(AudioStreamPacket{
+                .sample_rate = server_sample_rate_,
+                .frame_duration = server_frame_duration_,
+                .timestamp = 0,
+                .payload = std::vector<uint8_t>(payload, payload + payload_size)
+            });
+        }
+    } else if (on_incoming_audio_ != nullptr) {
+        on_incoming_audio_(AudioStreamPacket{
+            .sample_rate = server_sample_rate_,
+            .frame_duration = server_frame_duration_,
+            .timestamp = 0,
+            .payload = std::vector<uint8_t>((const uint8_t*)data, (const uint8_t*)data + len)
+        });
+    }
 }
 
 void WebsocketProtocol::ParseServerHello(const cJSON* root) {
@@ -243,6 +451,13 @@ void WebsocketProtocol::ParseServerHello(const cJSON* root) {
         session_id_ = session_id->valuestring;
         ESP_LOGI(TAG, "Session ID: %s", session_id_.c_str());
     }
+    ParseResumeToken(root);
+
+    auto features = cJSON_GetObjectItem(root, "features");
+    binary_control_ = version_ == 3 && cJSON_IsTrue(cJSON_GetObjectItem(features, "binary_control"));
+    if (binary_control_) {
+        ESP_LOGI(TAG, "Using binary control frames");
+    }
 
     auto audio_params = cJSON_GetObjectItem(root, "audio_params");
     if (cJSON_IsObject(audio_params)) {
@@ -20,14 +20,34 @@ public:
     bool OpenAudioChannel() override;
     void CloseAudioChannel() override;
     bool IsAudioChannelOpened() const override;
+    void PrewarmAudioChannel() override;
+    void CheckKeepWarm() override;
+    void SendWakeWordDetected(const std::string& wake_word) override;
+    void SendStartListening(ListeningMode mode) override;
+    void SendStopListening() override;
+    void SendAbortSpeaking(AbortReason reason) override;
+    void SendIotStates(const std::string& states) override;
 
 private:
     EventGroupHandle_t event_group_handle_;
     WebSocket* websocket_ = nullptr;
     int version_ = 1;
-
+    // Both hellos offered binary control frames, only with protocol version 3
+    bool binary_control_ = false;
+    // Read from NVS once, they only change with a new OTA config and a reboot
+    bool settings_loaded_ = false;
+    std::string url_;
+    std::string token_;
+    std::string hello_message_;
+
+    void LoadSettings();
+    bool Connect(bool report_error);
+    bool ExchangeHello(bool report_error);
+    void ReleaseParkedChannel();
     void ParseServerHello(const cJSON* root);
+    void OnBinaryData(const char* data, size_t len);
     bool SendText(const std::string& text) override;
+    bool SendControl(std::string& frame);
     std::string GetHelloMessage();
 };
 
@@ -0,0 +1,155 @@
+#include "sound_cache.h"
+#include "protocol.h"
+
+#include <esp_log.h>
+#include <esp_heap_caps.h>
+#include <arpa/inet.h>
+#include <opus_decoder.h>
+#include <opus_resampler.h>
+#include <algorithm>
+#include <cstring>
+
+#define TAG "SoundCache"
+
+// Format of the embedded P3 assets
+#define SOUND_SAMPLE_RATE 16000
+#define SOUND_FRAME_DURATION_MS 60
+
+SoundPcm::~SoundPcm() {
+    if (samples != nullptr) {
+        heap_caps_free(samples);
+    }
+}
+
+SoundCache::SoundCache(size_t budget_bytes) : budget_bytes_(budget_bytes) {
+}
+
+std::shared_ptr<const SoundPcm> SoundCache::Find(const std::string_view& sound, int output_sample_rate) {
+    for (auto& entry : entries_) {
+        if (entry.data == sound.data() && entry.sample_rate == output_sample_rate) {
+            entry.last_used = ++clock_;
+            return entry.pcm;
+        }
+    }
+    return nullptr;
+}
+
+std::shared_ptr<const SoundPcm> SoundCache::Get(const std::string_view& sound, int output_sample_rate) {
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        auto pcm = Find(sound, output_sample_rate);
+        if (pcm) {
+            return pcm;
+        }
+    }
+
+    // The frame walk only reads the headers, long sounds such as the alarm are played
+    // through the decode queue without being decoded here first
+    size_t frames = CountFrames(sound);
+    size_t capacity_bytes = frames * GetOutputFrameSamples(output_sample_rate) * sizeof(int16_t);
+    if (frames == 0 || capacity_bytes > budget_bytes_) {
+        ESP_LOGD(TAG, "Sound of %u frames, %u bytes, is not cached", frames, capacity_bytes);
+        return nullptr;
+    }
+
+    // Decode without the lock, another caller may be playing a cached sound meanwhile
+    auto pcm = Decode(sound, frames, output_sample_rate);
+    if (!pcm) {
+        return nullptr;
+    }
+    size_t bytes = pcm->count * sizeof(int16_t);
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto cached = Find(sound, output_sample_rate);
+    if (cached) {
+        // Decoded twice at the same time, keep the first one
+        return cached;
+    }
+
+    // Evict the least recently used sounds until the new one fits
+    while (used_bytes_ + bytes > budget_bytes_ && !entries_.empty()) {
+        auto lru = std::min_element(entries_.begin(), entries_.end(),
+            [](const Entry& a, const Entry& b) { return a.last_used < b.last_used; });
+        used_bytes_ -= lru->pcm->count * sizeof(int16_t);
+        entries_.erase(lru);
+    }
+    entries_.push_back({sound.data(), output_sample_rate, ++clock_, pcm});
+    used_bytes_ += bytes;
+    ESP_LOGI(TAG, "Cached sound of %u samples, %u/%u bytes used", pcm->count, used_bytes_, budget_bytes_);
+    return pcm;
+}
+
+void SoundCache::Preload(std::initializer_list<std::string_view> sounds, int output_sample_rate) {
+    for (auto& sound : sounds) {
+        Get(sound, output_sample_rate);
+    }
+}
+
+void SoundCache::Clear() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    entries_.clear();
+    used_bytes_ = 0;
+}
+
+size_t SoundCache::CountFrames(const std::string_view& sound) {
+    const char* data = sound.data();
+    size_t size = sound.size();
+    size_t frames = 0;
+    for (const char* p = data; p + sizeof(BinaryProtocol3) <= data + size; ) {
+        auto p3 = (const BinaryProtocol3*)p;
+        p += sizeof(BinaryProtocol3) + ntohs(p3->payload_size);
+        frames++;
+    }
+    return frames;
+}
+
+// Upper bound of the samples one frame decodes to, the resampler may round down
+size_t SoundCache::GetOutputFrameSamples(int output_sample_rate) {
+    size_t frame_samples = SOUND_SAMPLE_RATE / 1000 * SOUND_FRAME_DURATION_MS;
+    return (frame_samples * output_sample_rate + SOUND_SAMPLE_RATE - 1) / SOUND_SAMPLE_RATE;
+}
+
+std::shared_ptr<const SoundPcm> SoundCache::Decode(const std::string_view& sound, size_t frames, int output_sample_rate) {
+    const char* data = sound.data();
+    size_t size = sound.size();
+
+    OpusDecoderWrapper decoder(SOUND_SAMPLE_RATE, 1, SOUND_FRAME_DURATION_MS);
+    OpusResampler resampler;
+    bool resample = output_sample_rate != SOUND_SAMPLE_RATE;
+    if (resample) {
+        resampler.Configure(SOUND_SAMPLE_RATE, output_sample_rate);
+    }
+    size_t frame_samples = SOUND_SAMPLE_RATE / 1000 * SOUND_FRAME_DURATION_MS;
+    size_t output_frame_samples = resample ? resampler.GetOutputSamples(frame_samples) : frame_samples;
+
+    auto pcm = std::make_shared<SoundPcm>();
+    size_t capacity = frames * output_frame_samples;
+    pcm->samples = (int16_t*)heap_caps_malloc(capacity * sizeof(int16_t), MALLOC_CAP_SPIRAM);
+    if (pcm->samples == nullptr) {
+        ESP_LOGW(TAG, "Failed to allocate %u bytes for a sound", capacity * sizeof(int16_t));
+        return nullptr;
+    }
+
+    std::vector<int16_t> decoded;
+    for (const char* p = data; p + sizeof(BinaryProtocol3) <= data + size; ) {
+        auto p3 = (const BinaryProtocol3*)p;
+        auto payload_size = ntohs(p3->payload_size);
+        std::vector<uint8_t> payload(p3->payload, p3->payload + payload_size);
+        p += sizeof(BinaryProtocol3) + payload_size;
+
+        if (!decoder.Decode(std::move(payload), decoded)) {
+            continue;
+        }
+        size_t output_samples = resample ? resampler.GetOutputSamples(decoded.size()) : decoded.size();
+        if (pcm->count + output_samples > capacity) {
+            break;
+        }
+        if (resample) {
+            resampler.Process(decoded.data(), decoded.size(), pcm->samples + pcm->count);
+        } else {
+            memcpy(pcm->samples + pcm->count, decoded.data(), decoded.size() * sizeof(int16_t));
+        }
+        pcm->count += output_samples;
+    }
+    return pcm;
+}
@@ -0,0 +1,61 @@
+#ifndef SOUND_CACHE_H
+#define SOUND_CACHE_H
+
+#include <cstdint>
+#include <cstddef>
+#include <memory>
+#include <mutex>
+#include <string_view>
+#include <vector>
+#include <initializer_list>
+
+// Decoded PCM of one sound, allocated in PSRAM
+struct SoundPcm {
+    int16_t* samples = nullptr;
+    size_t count = 0;
+
+    SoundPcm() = default;
+    SoundPcm(const SoundPcm&) = delete;
+    SoundPcm& operator=(const SoundPcm&) = delete;
+    ~SoundPcm();
+};
+
+/*
+ * LRU cache of decoded built-in P3 sounds (Lang::Sounds).
+ *
+ * Sounds are keyed by the address of their embedded data, decoded once at the
+ * codec output rate and kept until the byte budget forces them out. Entries are
+ * handed out as shared pointers, so evicting a sound that is still playing is safe.
+ */
+class SoundCache {
+public:
+    SoundCache(size_t budget_bytes);
+
+    // Returns nullptr if the sound can not be decoded or does not fit in the budget.
+    // Sounds that do not fit are turned down before anything is decoded
+    std::shared_ptr<const SoundPcm> Get(const std::string_view& sound, int output_sample_rate);
+    // Decodes the sounds ahead of their first play
+    void Preload(std::initializer_list<std::string_view> sounds, int output_sample_rate);
+    void Clear();
+
+private:
+    struct Entry {
+        const char* data;
+        int sample_rate;
+        uint32_t last_used;
+        std::shared_ptr<const SoundPcm> pcm;
+    };
+
+    std::mutex mutex_;
+    std::vector<Entry> entries_;
+    size_t budget_bytes_;
+    size_t used_bytes_ = 0;
+    uint32_t clock_ = 0;
+
+    std::shared_ptr<const SoundPcm> Find(const std::string_view& sound, int output_sample_rate);
+    static size_t CountFrames(const std::string_view& sound);
+    static size_t GetOutputFrameSamples(int output_sample_rate);
+    std::shared_ptr<const SoundPcm> Decode(const std::string_view& sound, size_t frames, int output_sample_rate);
+};
+
+#endif // SOUND_CACHE_H
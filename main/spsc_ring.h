@@ -0,0 +1,91 @@
+#ifndef SPSC_RING_H
+#define SPSC_RING_H
+
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+
+/*
+ * Fixed capacity single-producer / single-consumer ring of preallocated slots.
+ *
+ * The producer fills the slot returned by BeginPush() in place and publishes it
+ * with CommitPush(); the consumer reads Front() and releases it with Pop().
+ * Slots are never destroyed, so element types holding buffers (e.g. a payload
+ * vector) keep their capacity and can be refilled without allocating.
+ *
+ * Clear() may be called from any thread: it marks everything written so far as
+ * discarded and the consumer skips those slots on its next Front() call.
+ */
+template <typename T, size_t N>
+class SpscRing {
+    static_assert(N > 0, "SpscRing capacity must be positive");
+
+public:
+    SpscRing() = default;
+    SpscRing(const SpscRing&) = delete;
+    SpscRing& operator=(const SpscRing&) = delete;
+
+    static constexpr size_t capacity() { return N; }
+
+    // Producer side: returns the next free slot or nullptr if the ring is full
+    T* BeginPush() {
+        uint32_t tail = tail_.load(std::memory_order_relaxed);
+        uint32_t head = head_.load(std::memory_order_acquire);
+        if (tail - head >= N) {
+            return nullptr;
+        }
+        return &slots_[tail % N];
+    }
+
+    // Producer side: publishes the slot returned by the last BeginPush()
+    void CommitPush() {
+        tail_.store(tail_.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+    }
+
+    // Consumer side: returns the oldest pending slot or nullptr if the ring is empty
+    T* Front() {
+        uint32_t head = head_.load(std::memory_order_relaxed);
+        uint32_t discard = discard_.load(std::memory_order_acquire);
+        if (static_cast<int32_t>(discard - head) > 0) {
+            head = discard;
+            head_.store(head, std::memory_order_release);
+        }
+        if (head == tail_.load(std::memory_order_acquire)) {
+            return nullptr;
+        }
+        return &slots_[head % N];
+    }
+
+    // Consumer side: releases the slot returned by the last Front()
+    void Pop() {
+        head_.store(head_.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+    }
+
+    // Any thread: drops every element pushed so far
+    void Clear() {
+        discard_.store(tail_.load(std::memory_order_acquire), std::memory_order_release);
+    }
+
+    // Any thread: number of pending (not discarded) elements, exact only on the consumer side
+    size_t size() const {
+        uint32_t tail = tail_.load(std::memory_order_acquire);
+        uint32_t head = head_.load(std::memory_order_acquire);
+        uint32_t discard = discard_.load(std::memory_order_acquire);
+        if (static_cast<int32_t>(discard - head) > 0) {
+            head = discard;
+        }
+        return tail - head;
+    }
+
+    bool empty() const { return size() == 0; }
+
+private:
+    std::array<T, N> slots_;
+    // Monotonic sequence numbers, the slot index is sequence % N
+    std::atomic<uint32_t> head_{0};
+    std::atomic<uint32_t> tail_{0};
+    std::atomic<uint32_t> discard_{0};
+};
+
+#endif // SPSC_RING_H
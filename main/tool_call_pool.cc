@@ -0,0 +1,329 @@
+#include "tool_call_pool.h"
+
+#include <esp_log.h>
+#include <algorithm>
+#include <stdexcept>
+
+#include "json_writer.h"
+
+#define TAG "ToolCallPool"
+
+ToolCallPool::ToolCallPool() {
+    queue_.reserve(TOOL_CALL_QUEUE_SIZE);
+
+    esp_timer_create_args_t timeout_timer_args = {
+        .callback = [](void* arg) {
+            ToolCallPool* pool = (ToolCallPool*)arg;
+            pool->OnTimeout();
+        },
+        .arg = this,
+        .dispatch_method = ESP_TIMER_TASK,
+        .name = "tool_call_timeout",
+        .skip_unhandled_events = true
+    };
+    esp_timer_create(&timeout_timer_args, &timeout_timer_);
+}
+
+ToolCallPool::~ToolCallPool() {
+    for (auto& worker : workers_) {
+        if (worker.handle != nullptr) {
+            vTaskDelete(worker.handle);
+        }
+    }
+    if (timeout_timer_ != nullptr) {
+        esp_timer_stop(timeout_timer_);
+        esp_timer_delete(timeout_timer_);
+    }
+}
+
+void ToolCallPool::OnResult(std::function<void(int id, const std::string& result)> callback) {
+    on_result_ = callback;
+}
+
+void ToolCallPool::OnError(std::function<void(int id, const std::string& message)> callback) {
+    on_error_ = callback;
+}
+
+void ToolCallPool::StartWorkers() {
+    // Stacks are only paid for once the server actually calls a tool. A worker that
+    // could not be created is tried again with the next call
+    for (int i = 0; i < TOOL_CALL_SMALL_WORKERS + TOOL_CALL_LARGE_WORKERS; i++) {
+        auto& worker = workers_[i];
+        if (worker.handle != nullptr) {
+            continue;
+        }
+        worker.pool = this;
+        worker.stack_class = i < TOOL_CALL_SMALL_WORKERS ? kToolStackSmall : kToolStackLarge;
+        auto stack_size = worker.stack_class == kToolStackLarge ? TOOL_CALL_LARGE_STACK_SIZE : TOOL_CALL_SMALL_STACK_SIZE;
+        if (xTaskCreate([](void* arg) {
+            Worker* worker = (Worker*)arg;
+            worker->pool->WorkerLoop(*worker);
+        }, "tool_call", stack_size, &worker, 1, &worker.handle) != pdPASS) {
+            worker.handle = nullptr;
+            ESP_LOGE(TAG, "Failed to create a tool call worker with a %d byte stack", stack_size);
+        }
+    }
+}
+
+bool ToolCallPool::HasWorker(ToolStackClass stack_class) const {
+    return std::any_of(std::begin(workers_), std::end(workers_), [stack_class](const Worker& worker) {
+        return worker.handle != nullptr && worker.stack_class >= stack_class;
+    });
+}
+
+bool ToolCallPool::Submit(ToolCallRequest&& request) {
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        StartWorkers();
+        if (!HasWorker(request.stack_class)) {
+            // Queued, the call would only wait for its timeout
+            stats_[request.name].rejected++;
+            ESP_LOGE(TAG, "No worker can run %s", request.name.c_str());
+            return false;
+        }
+        if (queue_.size() >= TOOL_CALL_QUEUE_SIZE) {
+            stats_[request.name].rejected++;
+            ESP_LOGW(TAG, "Queue is full, reject %s", request.name.c_str());
+            return false;
+        }
+
+        Call call;
+        call.enqueue_time = esp_timer_get_time();
+        call.deadline = call.enqueue_time + (int64_t)request.timeout_ms * 1000;
+        call.request = std::move(request);
+        queue_.push_back(std::move(call));
+        ArmTimeout();
+    }
+    condition_variable_.notify_all();
+    return true;
+}
+
+bool ToolCallPool::Cancel(int id) {
+    Call cancelled;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        auto it = std::find_if(queue_.begin(), queue_.end(), [id](const Call& call) { return call.request.id == id; });
+        if (it != queue_.end()) {
+            stats_[it->request.name].cancelled++;
+            // Destroy the captured arguments outside the lock
+            cancelled = std::move(*it);
+            queue_.erase(it);
+        } else {
+            auto worker = std::find_if(std::begin(workers_), std::end(workers_), [id](const Worker& worker) {
+                return worker.busy && !worker.abandoned && worker.id == id;
+            });
+            if (worker == std::end(workers_)) {
+                return false;
+            }
+            stats_[worker->name].cancelled++;
+            worker->abandoned = true;
+        }
+    }
+    // A later call on the same resource may have been waiting behind the cancelled one
+    condition_variable_.notify_all();
+    ESP_LOGI(TAG, "Cancelled call %d", id);
+    return true;
+}
+
+int ToolCallPool::NextCall(const Worker& worker) {
+    for (size_t i = 0; i < queue_.size(); i++) {
+        auto& request = queue_[i].request;
+        if (request.stack_class > worker.stack_class) {
+            continue;
+        }
+        if (request.resource.empty()) {
+            return i;
+        }
+
+        // Keep calls on one resource in order, behind both running and earlier queued calls
+        bool blocked = std::any_of(std::begin(workers_), std::end(workers_), [&request](const Worker& other) {
+            return other.busy && other.resource == request.resource;
+        });
+        for (size_t j = 0; j < i && !blocked; j++) {
+            blocked = queue_[j].request.resource == request.resource;
+        }
+        if (!blocked) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+void ToolCallPool::WorkerLoop(Worker& worker) {
+    while (true) {
+        Call call;
+        int64_t start_time;
+        int64_t wait_us;
+        {
+            std::unique_lock<std::mutex> lock(mutex_);
+            int index = -1;
+            condition_variable_.wait(lock, [this, &worker, &index]() {
+                index = NextCall(worker);
+                return index >= 0;
+            });
+            call = std::move(queue_[index]);
+            queue_.erase(queue_.begin() + index);
+
+            start_time = esp_timer_get_time();
+            wait_us = start_time - call.enqueue_time;
+            worker.busy = true;
+            worker.abandoned = false;
+            worker.id = call.request.id;
+            worker.name = call.request.name;
+            worker.resource = call.request.resource;
+            worker.progress_token = call.request.progress_token;
+            worker.deadline = call.deadline;
+
+            auto& stats = stats_[call.request.name];
+            stats.total_wait_us += wait_us;
+            stats.max_wait_us = std::max(stats.max_wait_us, wait_us);
+        }
+
+        std::string result;
+        bool failed = false;
+        // Anything escaping here would abort the device, not just this call
+        try {
+            result = call.request.run();
+        } catch (const std::exception& e) {
+            result = e.what();
+            failed = true;
+        } catch (...) {
+            result = "Unknown error";
+            failed = true;
+        }
+        call.request.run = nullptr;
+        auto run_us = esp_timer_get_time() - start_time;
+
+        bool abandoned;
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            abandoned = worker.abandoned;
+            worker.busy = false;
+            worker.resource.clear();
+            worker.progress_token.clear();
+
+            auto& stats = stats_[call.request.name];
+            stats.calls++;
+            stats.failed += failed ? 1 : 0;
+            stats.total_run_us += run_us;
+            stats.max_run_us = std::max(stats.max_run_us, run_us);
+        }
+        // The resource is free again
+        condition_variable_.notify_all();
+
+        ESP_LOGI(TAG, "%s: waited %lld ms, ran %lld ms%s", call.request.name.c_str(), wait_us / 1000, run_us / 1000,
+            abandoned ? ", result dropped" : "");
+        if (abandoned) {
+            continue;
+        }
+        if (failed) {
+            ESP_LOGE(TAG, "%s: %s", call.request.name.c_str(), result.c_str());
+            if (on_error_) {
+                on_error_(call.request.id, result);
+            }
+        } else if (on_result_) {
+            on_result_(call.request.id, result);
+        }
+    }
+}
+
+void ToolCallPool::ArmTimeout() {
+    int64_t earliest = 0;
+    for (auto& call : queue_) {
+        if (earliest == 0 || call.deadline < earliest) {
+            earliest = call.deadline;
+        }
+    }
+    for (auto& worker : workers_) {
+        if (worker.busy && !worker.abandoned && (earliest == 0 || worker.deadline < earliest)) {
+            earliest = worker.deadline;
+        }
+    }
+    if (earliest == 0 || (armed_deadline_ != 0 && armed_deadline_ <= earliest)) {
+        // Nothing to wait for, or the timer already fires early enough
+        return;
+    }
+
+    esp_timer_stop(timeout_timer_);
+    esp_timer_start_once(timeout_timer_, std::max<int64_t>(earliest - esp_timer_get_time(), 1000));
+    armed_deadline_ = earliest;
+}
+
+void ToolCallPool::OnTimeout() {
+    std::vector<int> expired;
+    std::vector<Call> dropped;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        auto now = esp_timer_get_time();
+        for (auto it = queue_.begin(); it != queue_.end();) {
+            if (it->deadline <= now) {
+                expired.push_back(it->request.id);
+                stats_[it->request.name].timeouts++;
+                dropped.push_back(std::move(*it));
+                it = queue_.erase(it);
+            } else {
+                ++it;
+            }
+        }
+        for (auto& worker : workers_) {
+            if (worker.busy && !worker.abandoned && worker.deadline <= now) {
+                expired.push_back(worker.id);
+                stats_[worker.name].timeouts++;
+                worker.abandoned = true;
+            }
+        }
+        armed_deadline_ = 0;
+        ArmTimeout();
+    }
+    if (!dropped.empty()) {
+        condition_variable_.notify_all();
+    }
+
+    for (auto id : expired) {
+        ESP_LOGW(TAG, "Call %d timed out", id);
+        if (on_error_) {
+            on_error_(id, "Tool call timed out");
+        }
+    }
+}
+
+std::string ToolCallPool::GetProgressToken() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto task = xTaskGetCurrentTaskHandle();
+    for (auto& worker : workers_) {
+        if (worker.handle == task && worker.busy && !worker.abandoned) {
+            return worker.progress_token;
+        }
+    }
+    return "";
+}
+
+std::map<std::string, ToolCallStats> ToolCallPool::GetStats() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return stats_;
+}
+
+std::string ToolCallPool::GetStatsJson() {
+    auto stats = GetStats();
+    JsonWriter json(64 + stats.size() * 200);
+    json.BeginObject();
+    json.Key("tools").BeginArray();
+    for (auto& [name, tool] : stats) {
+        auto finished = std::max<uint32_t>(tool.calls, 1);
+        json.BeginObject();
+        json.Field("name", name);
+        json.Field("calls", (int)tool.calls);
+        json.Field("failed", (int)tool.failed);
+        json.Field("rejected", (int)tool.rejected);
+        json.Field("timeouts", (int)tool.timeouts);
+        json.Field("cancelled", (int)tool.cancelled);
+        json.Field("avg_wait_ms", (int)(tool.total_wait_us / finished / 1000));
+        json.Field("max_wait_ms", (int)(tool.max_wait_us / 1000));
+        json.Field("avg_run_ms", (int)(tool.total_run_us / finished / 1000));
+        json.Field("max_run_ms", (int)(tool.max_run_us / 1000));
+        json.EndObject();
+    }
+    json.EndArray();
+    json.EndObject();
+    return json.str();
+}
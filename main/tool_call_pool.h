@@ -0,0 +1,116 @@
+#ifndef TOOL_CALL_POOL_H
+#define TOOL_CALL_POOL_H
+
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+#include <esp_timer.h>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <string>
+#include <vector>
+#include <map>
+
+#define TOOL_CALL_QUEUE_SIZE 8
+#define TOOL_CALL_SMALL_WORKERS 2
+#define TOOL_CALL_LARGE_WORKERS 1
+#define TOOL_CALL_SMALL_STACK_SIZE 6144
+#define TOOL_CALL_LARGE_STACK_SIZE 12288
+#define TOOL_CALL_DEFAULT_TIMEOUT_MS 30000
+
+// Large workers also take small calls, small workers only small ones
+enum ToolStackClass {
+    kToolStackSmall,
+    kToolStackLarge,
+};
+
+struct ToolCallStats {
+    uint32_t calls = 0;
+    uint32_t failed = 0;
+    uint32_t rejected = 0;          // The queue was full
+    uint32_t timeouts = 0;
+    uint32_t cancelled = 0;
+    int64_t total_wait_us = 0;      // Time spent in the queue
+    int64_t max_wait_us = 0;
+    int64_t total_run_us = 0;       // Time spent in the tool
+    int64_t max_run_us = 0;
+};
+
+struct ToolCallRequest {
+    int id = 0;
+    std::string name;
+    // Calls with the same non-empty resource run one at a time, in the order they came in
+    std::string resource;
+    ToolStackClass stack_class = kToolStackSmall;
+    int timeout_ms = TOOL_CALL_DEFAULT_TIMEOUT_MS;
+    // JSON of the progress token the client sent, empty if it wants no progress
+    std::string progress_token;
+    // Returns the result, throws on failure, e.g. std::runtime_error
+    std::function<std::string()> run;
+};
+
+/*
+ * Runs MCP tool calls on a fixed set of worker tasks, created on the first call.
+ *
+ * A call that is still queued when it times out or is cancelled never runs. A
+ * running call cannot be stopped, so it finishes in the background, keeps its
+ * resource busy and its result is dropped. Either way the client gets an error
+ * on timeout and no reply at all after a cancel.
+ */
+class ToolCallPool {
+public:
+    ToolCallPool();
+    ~ToolCallPool();
+
+    void OnResult(std::function<void(int id, const std::string& result)> callback);
+    void OnError(std::function<void(int id, const std::string& message)> callback);
+
+    // Returns false if the queue is full or no worker of the call's stack class could be started
+    bool Submit(ToolCallRequest&& request);
+    // Returns false if no call with this id is queued or running
+    bool Cancel(int id);
+    // Progress token of the call running on the calling task, empty if there is
+    // none or nobody waits for its result any more
+    std::string GetProgressToken();
+    std::map<std::string, ToolCallStats> GetStats();
+    std::string GetStatsJson();
+
+private:
+    struct Call {
+        ToolCallRequest request;
+        int64_t enqueue_time = 0;
+        int64_t deadline = 0;
+    };
+
+    struct Worker {
+        ToolCallPool* pool = nullptr;
+        ToolStackClass stack_class = kToolStackSmall;
+        TaskHandle_t handle = nullptr;
+        bool busy = false;
+        bool abandoned = false;     // Timed out or cancelled, drop the result
+        int id = 0;
+        std::string name;
+        std::string resource;
+        std::string progress_token;
+        int64_t deadline = 0;
+    };
+
+    std::mutex mutex_;
+    std::condition_variable condition_variable_;
+    std::vector<Call> queue_;
+    Worker workers_[TOOL_CALL_SMALL_WORKERS + TOOL_CALL_LARGE_WORKERS];
+    esp_timer_handle_t timeout_timer_ = nullptr;
+    int64_t armed_deadline_ = 0;
+    std::map<std::string, ToolCallStats> stats_;
+    std::function<void(int id, const std::string& result)> on_result_;
+    std::function<void(int id, const std::string& message)> on_error_;
+
+    void StartWorkers();
+    bool HasWorker(ToolStackClass stack_class) const;
+    void WorkerLoop(Worker& worker);
+    int NextCall(const Worker& worker);
+    void ArmTimeout();
+    void OnTimeout();
+};
+
+#endif // TOOL_CALL_POOL_H
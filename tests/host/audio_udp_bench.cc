@@ -0,0 +1,235 @@
+// The UDP audio path of MqttProtocol: AudioCipher, ReorderWindow, the decode
+// ring and the jitter buffer are the real ones. The framing around them is
+// replayed from SendAudioLocked(), the UDP receive callback and
+// PushDecodePacket(), because MqttProtocol itself needs the board and a modem.
+#include "protocols/audio_cipher.h"
+#include "protocols/reorder_window.h"
+#include "jitter_buffer.h"
+#include "spsc_ring.h"
+#include "host_test.h"
+
+#include <arpa/inet.h>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+
+static size_t allocations = 0;
+
+void* operator new(size_t size) {
+    allocations++;
+    if (void* p = malloc(size)) {
+        return p;
+    }
+    throw std::bad_alloc();
+}
+
+void operator delete(void* p) noexcept {
+    free(p);
+}
+
+void operator delete(void* p, size_t) noexcept {
+    free(p);
+}
+
+static const std::string kKey(16, '\x5a');
+static const size_t kPayloadSize = 120;
+
+static std::string MakeNonce() {
+    std::string nonce(16, '\0');
+    nonce[0] = 0x01;
+    return nonce;
+}
+
+static void TestCiphers() {
+    for (auto mode : {kAudioCipherAesCtr, kAudioCipherAesGcm}) {
+        auto encryptor = AudioCipher::Create(mode, kKey);
+        auto decryptor = AudioCipher::Create(mode, kKey);
+        uint8_t iv[AUDIO_CIPHER_IV_SIZE] = {0x01, 0, 0, kPayloadSize};
+        std::vector<uint8_t> plain(kPayloadSize), cipher(kPayloadSize + encryptor->overhead()), out(kPayloadSize);
+        for (size_t i = 0; i < plain.size(); i++) {
+            plain[i] = i;
+        }
+        EXPECT(encryptor->Encrypt(iv, plain.data(), plain.size(), cipher.data()));
+        EXPECT(decryptor->Decrypt(iv, cipher.data(), plain.size(), out.data()) && out == plain);
+        EXPECT(memcmp(cipher.data(), plain.data(), plain.size()) != 0);
+
+        // Only GCM notices a flipped bit
+        cipher[5] ^= 1;
+        bool accepted = decryptor->Decrypt(iv, cipher.data(), plain.size(), out.data());
+        EXPECT(accepted == (mode == kAudioCipherAesCtr));
+        cipher[5] ^= 1;
+        // Or a packet encrypted under a different IV
+        iv[15] = 1;
+        accepted = decryptor->Decrypt(iv, cipher.data(), plain.size(), out.data());
+        EXPECT(accepted == (mode == kAudioCipherAesCtr));
+    }
+}
+
+// Before: a nonce copy and a datagram string for every sent packet
+struct OldSender {
+    std::unique_ptr<AudioCipher> cipher = AudioCipher::Create(kAudioCipherAesCtr, kKey);
+    std::string nonce = MakeNonce();
+    uint32_t sequence = 0;
+
+    std::string Send(const AudioStreamPacket& packet) {
+        std::string header(nonce);
+        *(uint16_t*)&header[2] = htons(packet.payload.size());
+        *(uint32_t*)&header[8] = htonl(packet.timestamp);
+        *(uint32_t*)&header[12] = htonl(++sequence);
+        std::string datagram;
+        datagram.resize(header.size() + packet.payload.size());
+        memcpy(datagram.data(), header.data(), header.size());
+        cipher->Encrypt((const uint8_t*)header.data(), packet.payload.data(), packet.payload.size(), (uint8_t*)&datagram[header.size()]);
+        return datagram;
+    }
+};
+
+// As SendAudioLocked(): the header is written in place in a reused buffer
+struct Sender {
+    std::unique_ptr<AudioCipher> cipher;
+    std::string nonce = MakeNonce();
+    std::string send_buffer;
+    uint32_t sequence = 0;
+
+    explicit Sender(AudioCipherMode mode) : cipher(AudioCipher::Create(mode, kKey)) {}
+
+    const std::string& Send(const AudioStreamPacket& packet) {
+        send_buffer.resize(nonce.size() + packet.payload.size() + cipher->overhead());
+        auto header = (uint8_t*)send_buffer.data();
+        memcpy(header, nonce.data(), nonce.size());
+        *(uint16_t*)&header[2] = htons(packet.payload.size());
+        *(uint32_t*)&header[8] = htonl(packet.timestamp);
+        *(uint32_t*)&header[12] = htonl(++sequence);
+        cipher->Encrypt(header, packet.payload.data(), packet.payload.size(), header + nonce.size());
+        return send_buffer;
+    }
+};
+
+// Before: a new packet per datagram, handed on by move and freed after decoding
+struct OldReceiver {
+    std::unique_ptr<AudioCipher> cipher = AudioCipher::Create(kAudioCipherAesCtr, kKey);
+    uint32_t decoded_bytes = 0;
+
+    void Receive(const std::string& data) {
+        AudioStreamPacket packet;
+        packet.timestamp = ntohl(*(uint32_t*)&data[8]);
+        packet.payload.resize(data.size() - 16);
+        cipher->Decrypt((const uint8_t*)data.data(), (const uint8_t*)data.data() + 16, packet.payload.size(), packet.payload.data());
+        std::list<AudioStreamPacket> queue;
+        queue.push_back(std::move(packet));
+        decoded_bytes += queue.front().payload.size();
+    }
+};
+
+// The whole receive side as it is now, from the UDP callback to the decoder
+struct Receiver {
+    std::unique_ptr<AudioCipher> cipher;
+    AudioStreamPacket receive_packet;
+    ReorderWindow reorder_window{4, 120};
+    SpscRing<AudioStreamPacket, 40> decode_queue;
+    std::vector<std::vector<uint8_t>> free_payloads;
+    JitterBuffer jitter_buffer{40, 60, 60, 480};
+    int64_t now_ms = 0;
+    uint32_t decoded_bytes = 0;
+
+    explicit Receiver(AudioCipherMode mode) : cipher(AudioCipher::Create(mode, kKey)) {
+        free_payloads.reserve(40);
+        reorder_window.OnDeliver([this](AudioStreamPacket&& packet) {
+            PushDecodePacket(std::move(packet));
+        });
+    }
+
+    void Receive(const std::string& data) {
+        uint32_t sequence = ntohl(*(uint32_t*)&data[12]);
+        size_t decrypted_size = data.size() - 16 - cipher->overhead();
+        auto header = (const uint8_t*)data.data();
+        auto& packet = receive_packet;
+        packet.sample_rate = 16000;
+        packet.frame_duration = 60;
+        packet.timestamp = ntohl(*(uint32_t*)&data[8]);
+        packet.payload.resize(decrypted_size);
+        if (!cipher->Decrypt(header, header + 16, decrypted_size, packet.payload.data())) {
+            return;
+        }
+        reorder_window.Push(sequence, packet, now_ms);
+    }
+
+    void PushDecodePacket(AudioStreamPacket&& packet) {
+        auto slot = decode_queue.BeginPush();
+        if (slot == nullptr) {
+            return;
+        }
+        slot->sample_rate = packet.sample_rate;
+        slot->frame_duration = packet.frame_duration;
+        slot->timestamp = packet.timestamp;
+        slot->payload.swap(packet.payload);
+        decode_queue.CommitPush();
+        if (packet.payload.capacity() == 0 && !free_payloads.empty()) {
+            packet.payload.swap(free_payloads.back());
+            free_payloads.pop_back();
+        }
+    }
+
+    // The decode job: drain the ring into the jitter buffer, play one frame, recycle its payload
+    void Decode() {
+        AudioStreamPacket* slot;
+        while (!jitter_buffer.full() && (slot = decode_queue.Front()) != nullptr) {
+            jitter_buffer.Push(std::move(*slot), now_ms);
+            decode_queue.Pop();
+        }
+        AudioStreamPacket packet;
+        if (jitter_buffer.Pop(packet, now_ms) == kJitterBufferPacket) {
+            decoded_bytes += packet.payload.size();
+            if (packet.payload.capacity() > 0 && free_payloads.size() < free_payloads.capacity()) {
+                packet.payload.clear();
+                free_payloads.push_back(std::move(packet.payload));
+            }
+        }
+        now_ms += 60;
+    }
+};
+
+int main() {
+    TestCiphers();
+
+    AudioStreamPacket packet;
+    packet.payload.assign(kPayloadSize, 0x33);
+    const int iterations = 100000;
+
+    // Round trip before
+    {
+        OldSender sender;
+        OldReceiver receiver;
+        size_t before = allocations;
+        double ns = BenchNs(iterations, [&]() {
+            packet.timestamp += 60;
+            receiver.Receive(sender.Send(packet));
+        });
+        printf("old  aes-128-ctr: %7.0f ns, %.1f allocations per packet sent and received\n",
+            ns, double(allocations - before) / (iterations * 5));
+    }
+
+    for (auto mode : {kAudioCipherAesCtr, kAudioCipherAesGcm}) {
+        Sender sender(mode);
+        Receiver receiver(mode);
+        // Let the buffers in the cycle reach their working sizes
+        for (int i = 0; i < 100; i++) {
+            packet.timestamp += 60;
+            receiver.Receive(sender.Send(packet));
+            receiver.Decode();
+        }
+        size_t before = allocations;
+        uint32_t decoded_before = receiver.decoded_bytes;
+        double ns = BenchNs(iterations, [&]() {
+            packet.timestamp += 60;
+            receiver.Receive(sender.Send(packet));
+            receiver.Decode();
+        });
+        double per_packet = double(allocations - before) / (iterations * 5);
+        EXPECT(per_packet == 0);
+        EXPECT(receiver.decoded_bytes - decoded_before == kPayloadSize * iterations * 5);
+        printf("new  %s: %7.0f ns, %.1f allocations per packet sent and received\n",
+            mode == kAudioCipherAesCtr ? "aes-128-ctr" : "aes-128-gcm", ns, per_packet);
+    }
+    return HOST_TEST_RESULT();
+}
@@ -0,0 +1,178 @@
+#include "protocols/control_codec.h"
+#include "host_test.h"
+
+#include <algorithm>
+#include <random>
+#include <utility>
+#include <vector>
+
+static std::vector<std::pair<uint8_t, std::string>> DecodeAll(const std::string& payload, size_t size, bool& truncated) {
+    std::vector<std::pair<uint8_t, std::string>> fields;
+    ControlDecoder decoder(reinterpret_cast<const uint8_t*>(payload.data()), size);
+    uint8_t field;
+    std::string_view value;
+    while (decoder.Next(field, value)) {
+        fields.emplace_back(field, std::string(value));
+    }
+    truncated = decoder.truncated();
+    return fields;
+}
+
+// Lengths at the edges of each LEB128 byte count, up to the 3 bytes the decoder reads
+static void TestLengthEdges() {
+    const std::pair<size_t, size_t> cases[] = {
+        {0, 1}, {1, 1}, {127, 1}, {128, 2}, {129, 2}, {16383, 2}, {16384, 3}, {65535, 3}, {(1 << 21) - 1, 3},
+    };
+    for (auto [length, length_bytes] : cases) {
+        std::string payload;
+        std::string value(length, 'x');
+        if (length > 0) {
+            value.front() = 'a';
+            value.back() = 'z';
+        }
+        ControlEncoder(payload, kControlMessageTts).String(kControlFieldText, value);
+        EXPECT(payload.size() == 2 + length_bytes + length);
+
+        bool truncated;
+        auto fields = DecodeAll(payload, payload.size(), truncated);
+        EXPECT(!truncated && fields.size() == 1 && fields[0].first == kControlFieldText && fields[0].second == value);
+
+        // One byte short of the value
+        fields = DecodeAll(payload, payload.size() - 1, truncated);
+        EXPECT(fields.empty() && (truncated || length == 0));
+    }
+
+    // A length that would need a fourth byte is refused rather than read
+    const uint8_t too_long[] = { kControlMessageTts, kControlFieldText, 0x80, 0x80, 0x80, 0x01, 'x' };
+    ControlDecoder decoder(too_long, sizeof(too_long));
+    uint8_t field;
+    std::string_view value;
+    EXPECT(!decoder.Next(field, value) && decoder.truncated());
+
+    // Non-minimal lengths still decode, the encoder just never writes them
+    const uint8_t padded[] = { kControlMessageTts, kControlFieldText, 0x82, 0x00, 'h', 'i' };
+    ControlDecoder padded_decoder(padded, sizeof(padded));
+    EXPECT(padded_decoder.Next(field, value) && value == "hi");
+    EXPECT(!padded_decoder.Next(field, value) && !padded_decoder.truncated());
+}
+
+// Cut inside a tag, inside a length or inside a value
+static void TestTruncatedFrames() {
+    std::string payload;
+    ControlEncoder(payload, kControlMessageTts)
+        .Byte(kControlFieldState, kControlStateSentenceStart)
+        .String(kControlFieldText, std::string(200, 't'));
+    // |type|tag 1 s|tag 2-byte length|200 bytes|
+    const size_t text_start = 1 + 3 + 1 + 2;
+    EXPECT(payload.size() == text_start + 200);
+
+    JsonMessage message;
+    EXPECT(DecodeControlMessage(reinterpret_cast<const uint8_t*>(payload.data()), payload.size(), message));
+    EXPECT(message.state() == kJsonStateSentenceStart && message.Get(kJsonFieldText).size() == 200);
+
+    for (size_t size = 0; size < payload.size(); size++) {
+        bool truncated;
+        auto fields = DecodeAll(payload, size, truncated);
+        // Only whole fields come out, and a cut after the state field is a clean end
+        bool clean_end = size == 1 || size == 4;
+        EXPECT(truncated != clean_end || size == 0);
+        EXPECT(fields.size() == (size >= 4 ? 1u : 0u));
+
+        bool decoded = DecodeControlMessage(reinterpret_cast<const uint8_t*>(payload.data()), size, message);
+        EXPECT(decoded == clean_end);
+    }
+}
+
+static void TestRandomRoundTrip() {
+    std::mt19937 rng(7);
+    int failures = 0;
+    for (int i = 0; i < 20000; i++) {
+        // Space in front, as when the encoder appends after a frame header
+        std::string payload(4, '\0');
+        ControlEncoder encoder(payload, static_cast<ControlMessageType>(1 + rng() % 6));
+        std::vector<std::pair<uint8_t, std::string>> expected;
+        for (int count = rng() % 5; count > 0; count--) {
+            uint8_t field = 1 + rng() % 8;
+            if (rng() % 3 == 0) {
+                uint8_t value = rng();
+                encoder.Byte(static_cast<ControlField>(field), value);
+                expected.emplace_back(field, std::string(1, static_cast<char>(value)));
+                continue;
+            }
+            std::string value(rng() % 10 == 0 ? rng() % 40000 : rng() % 200, '\0');
+            for (auto& c : value) {
+                c = static_cast<char>(rng());
+            }
+            encoder.String(static_cast<ControlField>(field), value);
+            expected.emplace_back(field, std::move(value));
+        }
+        std::string body = payload.substr(4);
+        bool truncated;
+        auto fields = DecodeAll(body, body.size(), truncated);
+        if (truncated || fields != expected) {
+            failures++;
+        }
+        // Any cut decodes to a prefix of the fields
+        for (size_t size = 1; size < body.size() && size < 300; size++) {
+            auto prefix = DecodeAll(body, size, truncated);
+            if (prefix.size() > expected.size() || !std::equal(prefix.begin(), prefix.end(), expected.begin())) {
+                failures++;
+            }
+        }
+    }
+    EXPECT(failures == 0);
+}
+
+static void TestDecodeMessage() {
+    std::string payload;
+    JsonMessage message;
+    auto decode = [&]() {
+        return DecodeControlMessage(reinterpret_cast<const uint8_t*>(payload.data()), payload.size(), message);
+    };
+
+    ControlEncoder(payload, kControlMessageLlm)
+        .String(kControlFieldEmotion, "happy")
+        .String(kControlFieldText, "\xf0\x9f\x98\x80");
+    EXPECT(decode() && message.type() == kJsonMessageLlm);
+    EXPECT(message.Get(kJsonFieldEmotion) == "happy" && message.Get(kJsonFieldText) == "\xf0\x9f\x98\x80");
+
+    payload.clear();
+    ControlEncoder(payload, kControlMessageStt).String(kControlFieldText, "");
+    EXPECT(decode() && message.type() == kJsonMessageStt && message.Has(kJsonFieldText) && !message.Has(kJsonFieldState));
+
+    // Unknown fields are skipped, an unknown state is an error
+    payload.clear();
+    ControlEncoder(payload, kControlMessageTts)
+        .String(static_cast<ControlField>(200), "later")
+        .Byte(kControlFieldState, kControlStateStop);
+    EXPECT(decode() && message.state() == kJsonStateStop);
+    payload.clear();
+    ControlEncoder(payload, kControlMessageTts).Byte(kControlFieldState, 9);
+    EXPECT(!decode());
+
+    const uint8_t unknown_type[] = { 99 };
+    EXPECT(!DecodeControlMessage(unknown_type, sizeof(unknown_type), message));
+    EXPECT(!DecodeControlMessage(unknown_type, 0, message));
+}
+
+// Arbitrary bytes must never read out of bounds; run under ASan to check
+static void TestGarbage() {
+    std::mt19937 rng(11);
+    JsonMessage message;
+    for (int i = 0; i < 300000; i++) {
+        std::vector<uint8_t> data(rng() % 40);
+        for (auto& byte : data) {
+            byte = rng() % 8 == 0 ? 0x80 | rng() : rng() % 8;
+        }
+        DecodeControlMessage(data.data(), data.size(), message);
+    }
+}
+
+int main() {
+    TestLengthEdges();
+    TestTruncatedFrames();
+    TestRandomRoundTrip();
+    TestDecodeMessage();
+    TestGarbage();
+    return HOST_TEST_RESULT();
+}
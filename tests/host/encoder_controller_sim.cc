@@ -0,0 +1,173 @@
+// Closed loop simulation of EncoderController: a model of the encoder's CPU
+// cost and of the uplink feeds it one window of telemetry per second, the way
+// Application does, and applies the settings it picks to the next window.
+#include "encoder_controller.h"
+#include "host_test.h"
+
+#include <random>
+#include <vector>
+
+static const int kFrameDurationMs = 60;
+static const int kSendQueueLimit = 40;
+
+struct Conditions {
+    double cpu_factor = 1.0;            // Contention on the audio core, e.g. from AEC
+    double link_bytes_per_s = 20000;
+    int signal_quality = 80;
+};
+
+struct Window {
+    EncoderSettings settings;           // In effect during the window
+    EncoderTelemetry telemetry;
+    bool changed = false;
+};
+
+class Simulation {
+public:
+    explicit Simulation(uint32_t seed) : rng_(seed), controller_(kFrameDurationMs, 0, 5) {}
+
+    const Window& Step(const Conditions& conditions) {
+        Window window;
+        window.settings = controller_.settings();
+        auto& telemetry = window.telemetry;
+        telemetry.frames = 16 + (time_s_ % 3 == 0);
+        // Per frame cost on the target: ~4 ms at complexity 0 and 2.4 ms more per step
+        double jitter = 0.9 + 0.2 * (rng_() % 100) / 100.0;
+        double frame_us = (4000 + 2400 * window.settings.complexity) * conditions.cpu_factor * jitter;
+        telemetry.encode_us = frame_us * telemetry.frames;
+        if (frame_us > kFrameDurationMs * 1000) {
+            telemetry.encoder_dropped_frames = 1;
+        }
+        // 40% of frames are silence, which DTX shrinks from ~120 to ~3 bytes
+        double frame_bytes = 0.6 * 120 + 0.4 * (window.settings.dtx ? 3 : 120);
+        queue_ += telemetry.frames - conditions.link_bytes_per_s / frame_bytes;
+        if (queue_ < 0) {
+            queue_ = 0;
+        }
+        if (queue_ > kSendQueueLimit) {
+            telemetry.queue_dropped_packets = queue_ - kSendQueueLimit;
+            queue_ = kSendQueueLimit;
+        }
+        telemetry.send_queue_depth = queue_;
+        telemetry.signal_quality = conditions.signal_quality;
+
+        window.changed = controller_.Update(telemetry);
+        if (window.changed) {
+            auto& status = controller_.status();
+            printf("t=%3ds complexity %d (max %d) dtx %d load %2d%% queue %2.0f: %s\n", time_s_,
+                status.settings.complexity, status.max_complexity, status.settings.dtx, status.cpu_load, queue_,
+                status.reason);
+        }
+        time_s_++;
+        history_.push_back(window);
+        return history_.back();
+    }
+
+    const EncoderController& controller() const { return controller_; }
+    const std::vector<Window>& history() const { return history_; }
+
+private:
+    std::mt19937 rng_;
+    EncoderController controller_;
+    double queue_ = 0;
+    int time_s_ = 0;
+    std::vector<Window> history_;
+};
+
+/*
+ * A minute each of a clean start, CPU contention, a congested link and a
+ * weak signal, then five clean minutes.
+ */
+static void TestPhases(uint32_t seed) {
+    Simulation simulation(seed);
+    auto run = [&](int seconds, const Conditions& conditions) {
+        size_t start = simulation.history().size();
+        for (int i = 0; i < seconds; i++) {
+            simulation.Step(conditions);
+        }
+        return std::vector<Window>(simulation.history().begin() + start, simulation.history().end());
+    };
+    auto& status = simulation.controller().status();
+
+    auto clean = run(60, Conditions());
+    // Climbs while the encoder has headroom, without ever overloading
+    EXPECT(status.settings.complexity >= 3 && !status.settings.dtx);
+    int complexity_before = status.settings.complexity;
+    for (auto& window : clean) {
+        EXPECT(window.telemetry.encoder_dropped_frames == 0 && window.telemetry.queue_dropped_packets == 0);
+    }
+
+    Conditions busy;
+    busy.cpu_factor = 3.2;
+    auto contention = run(60, busy);
+    // Backs off in the first window and stays below the level that overloaded. The
+    // ceiling is retried once a minute, which may overload one more window
+    EXPECT(contention[0].changed && status.max_complexity < complexity_before);
+    int overloaded = 0;
+    for (size_t i = 1; i < contention.size(); i++) {
+        auto& telemetry = contention[i].telemetry;
+        overloaded += telemetry.encode_us * 100 / (telemetry.frames * kFrameDurationMs * 1000) > 50;
+    }
+    EXPECT(overloaded <= 2);
+
+    Conditions congested;
+    congested.link_bytes_per_s = 1700;
+    auto congestion = run(60, congested);
+    // DTX comes on before the send queue overflows, and stays on while the link is bad
+    int dtx_windows = 0;
+    for (size_t i = 0; i < congestion.size(); i++) {
+        EXPECT(congestion[i].telemetry.queue_dropped_packets == 0);
+        dtx_windows += congestion[i].settings.dtx;
+    }
+    EXPECT(dtx_windows >= 40);
+
+    Conditions weak;
+    weak.signal_quality = 20;
+    auto weak_signal = run(60, weak);
+    for (size_t i = 1; i < weak_signal.size(); i++) {
+        EXPECT(weak_signal[i].settings.dtx);
+    }
+
+    // Everything is given back once the trouble is over, the ceiling a step a minute
+    run(300, Conditions());
+    EXPECT(!status.settings.dtx);
+    EXPECT(status.settings.complexity >= 3);
+    EXPECT(status.max_complexity == 5);
+}
+
+// A link that fails every 15 s must not make DTX flap on and off each time
+static void TestFlappingLink() {
+    Simulation simulation(3);
+    int dtx_off = 0;
+    bool dtx = false;
+    for (int t = 0; t < 600; t++) {
+        Conditions conditions;
+        if (t % 15 < 2) {
+            conditions.link_bytes_per_s = 500;
+        }
+        auto& window = simulation.Step(conditions);
+        bool now = simulation.controller().settings().dtx;
+        dtx_off += window.changed && dtx && !now;
+        dtx = now;
+    }
+    EXPECT(dtx && dtx_off <= 2);
+}
+
+// Not streaming: empty windows change nothing
+static void TestIdle() {
+    EncoderController controller(kFrameDurationMs, 2, 5);
+    for (int i = 0; i < 100; i++) {
+        EXPECT(!controller.Update(EncoderTelemetry()));
+    }
+    EXPECT(controller.settings().complexity == 2 && controller.status().changes == 0);
+}
+
+int main() {
+    for (uint32_t seed = 1; seed <= 5; seed++) {
+        printf("seed %u\n", seed);
+        TestPhases(seed);
+    }
+    TestFlappingLink();
+    TestIdle();
+    return HOST_TEST_RESULT();
+}
@@ -0,0 +1,42 @@
+#ifndef HOST_TEST_H
+#define HOST_TEST_H
+
+#include <chrono>
+#include <cstdio>
+
+// Checks keep going after a failure, main() returns HOST_TEST_RESULT()
+static int host_test_failures = 0;
+
+#define EXPECT(condition) do { \
+        if (!(condition)) { \
+            printf("%s:%d: expected %s\n", __FILE__, __LINE__, #condition); \
+            host_test_failures++; \
+        } \
+    } while (0)
+
+#define HOST_TEST_RESULT() (printf("%s\n", host_test_failures == 0 ? "PASSED" : "FAILED"), host_test_failures != 0)
+
+// Best time of `rounds` runs of `iterations` calls to `body`, in nanoseconds per call
+template <typename Body>
+double BenchNs(int iterations, Body&& body, int rounds = 5) {
+    double best = 0;
+    for (int round = 0; round < rounds; round++) {
+        auto start = std::chrono::steady_clock::now();
+        for (int i = 0; i < iterations; i++) {
+            body();
+        }
+        auto elapsed = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+        if (round == 0 || elapsed < best) {
+            best = elapsed;
+        }
+    }
+    return best / iterations;
+}
+
+// Keeps the compiler from optimizing a benchmarked result away
+template <typename T>
+inline void DoNotOptimize(const T& value) {
+    asm volatile("" : : "g"(&value) : "memory");
+}
+
+#endif // HOST_TEST_H
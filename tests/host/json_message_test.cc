@@ -0,0 +1,252 @@
+// JsonMessage::Parse() on fixed messages, on every truncation of them and on
+// random strings written with every kind of escape.
+#include "protocols/json_message.h"
+#include "host_test.h"
+
+#include <cstring>
+#include <random>
+#include <string>
+#include <vector>
+
+// Fields point into the input, which has to stay alive: a literal or a named string
+static bool Parse(JsonMessage& message, std::string_view json) {
+    return message.Parse(json.data(), json.size());
+}
+
+static void TestFields() {
+    JsonMessage message;
+    std::string json = R"({"session_id":"abc","type":"tts","state":"sentence_start","text":"hi","extra":[1,2]})";
+    EXPECT(Parse(message, json));
+    EXPECT(message.type() == kJsonMessageTts && message.state() == kJsonStateSentenceStart);
+    EXPECT(message.Get(kJsonFieldSessionId) == "abc" && message.Get(kJsonFieldText) == "hi");
+    EXPECT(!message.Has(kJsonFieldEmotion) && message.json() == json);
+    // Unescaped strings point into the input
+    EXPECT(message.Get(kJsonFieldText).data() == json.data() + json.find("hi"));
+
+    // Space anywhere JSON allows it, unknown values of any kind skipped
+    json = " {\n\t\"type\" : \"llm\" ,\"n\":-1.5e3,\"t\":true,\"f\":false,\"z\":null,\"emotion\"\r:\"happy\" } ";
+    EXPECT(Parse(message, json));
+    EXPECT(message.type() == kJsonMessageLlm && message.Get(kJsonFieldEmotion) == "happy");
+
+    // Keys and keywords match exactly
+    EXPECT(Parse(message, R"({"Type":"tts","type":"TTS","state":"begin"})"));
+    EXPECT(message.type() == kJsonMessageUnknown && message.state() == kJsonStateUnknown);
+    EXPECT(message.Has(kJsonFieldType) && message.Get(kJsonFieldType) == "TTS");
+    EXPECT(Parse(message, R"({"typ":"tts","types":"tts"})") && !message.Has(kJsonFieldType));
+
+    // A known string field with a value of another type is not taken
+    EXPECT(Parse(message, R"({"type":"stt","text":12,"emotion":{"a":"b"}})"));
+    EXPECT(message.type() == kJsonMessageStt && !message.Has(kJsonFieldText) && !message.Has(kJsonFieldEmotion));
+
+    EXPECT(Parse(message, "{}") && message.type() == kJsonMessageUnknown);
+    EXPECT(Parse(message, " { } "));
+    for (const char* bad : {"", " ", "[]", "\"type\"", "{\"type\"}", "{\"type\":}", "{type:\"tts\"}",
+            "{\"type\":\"tts\",}", "{\"type\":\"tts\" \"state\":\"stop\"}", "{,}"}) {
+        EXPECT(!Parse(message, bad));
+    }
+
+    // A failed parse leaves nothing behind from the previous message
+    EXPECT(Parse(message, R"({"type":"tts","text":"a"})"));
+    EXPECT(!Parse(message, R"({"state":"stop")"));
+    EXPECT(message.type() == kJsonMessageUnknown && !message.Has(kJsonFieldText));
+}
+
+static void TestEscapes() {
+    JsonMessage message;
+    EXPECT(Parse(message, R"({"text":"a\"b\\c\/d\b\f\n\r\te"})"));
+    EXPECT(message.Get(kJsonFieldText) == "a\"b\\c/d\b\f\n\r\te");
+
+    EXPECT(Parse(message, R"({"text":"\u0041\u00e9\u4e2d\uFFFF"})"));
+    EXPECT(message.Get(kJsonFieldText) == "A\xc3\xa9\xe4\xb8\xad\xef\xbf\xbf");
+    EXPECT(Parse(message, R"({"text":"\u0000"})") && message.Get(kJsonFieldText) == std::string(1, '\0'));
+
+    // Surrogate pairs join into one code point, upper or lower case hex
+    EXPECT(Parse(message, R"({"text":"\ud83d\ude00 \uD834\uDD1E"})"));
+    EXPECT(message.Get(kJsonFieldText) == "\xf0\x9f\x98\x80 \xf0\x9d\x84\x9e");
+
+    // Lone or reversed surrogates become U+FFFD
+    const std::string replacement = "\xef\xbf\xbd";
+    EXPECT(Parse(message, R"({"text":"\ud83d"})") && message.Get(kJsonFieldText) == replacement);
+    EXPECT(Parse(message, R"({"text":"\ude00"})") && message.Get(kJsonFieldText) == replacement);
+    EXPECT(Parse(message, R"({"text":"\ud83dx"})") && message.Get(kJsonFieldText) == replacement + "x");
+    EXPECT(Parse(message, R"({"text":"\ude00\ud83d"})") && message.Get(kJsonFieldText) == replacement + replacement);
+    EXPECT(Parse(message, R"({"text":"\ud83d\u0041"})") && message.Get(kJsonFieldText) == replacement + "A");
+    EXPECT(Parse(message, R"({"text":"\ud83d\n"})") && message.Get(kJsonFieldText) == replacement + "\n");
+
+    // A \u with too few hex digits
+    EXPECT(Parse(message, R"({"text":"\u12"})") && message.Get(kJsonFieldText) == "?12");
+    EXPECT(Parse(message, R"({"text":"\uzzzz"})") && message.Get(kJsonFieldText) == "?zzzz");
+
+    // Several escaped fields, each view stays valid after the later ones are unescaped
+    std::string json = R"({"type":"tts","text":"\u4e2d\u6587","emotion":"\"happy\"","session_id":"\\s","state":"st\u006fp"})";
+    EXPECT(Parse(message, json));
+    EXPECT(message.Get(kJsonFieldText) == "\xe4\xb8\xad\xe6\x96\x87" && message.Get(kJsonFieldEmotion) == "\"happy\"");
+    EXPECT(message.Get(kJsonFieldSessionId) == "\\s" && message.state() == kJsonStateStop);
+
+    // Escaped keys are not matched
+    EXPECT(Parse(message, R"({"t\u0065xt":"x"})") && !message.Has(kJsonFieldText));
+}
+
+// payload and commands keep the JSON text of their value, whatever it holds
+static void TestRawFields() {
+    JsonMessage message;
+    std::string payload = R"({"jsonrpc":"2.0","id":1,"params":{"s":"}]\"{[","a":[1,{"b":[]},"]"],"e":{}}})";
+    std::string commands = R"([{"name":"x","args":["\\",{}]},[]])";
+    std::string json = "{\"type\":\"mcp\",\"payload\":" + payload + ",\"commands\" : " + commands +
+        ",\"session_id\":\"s\"}";
+    EXPECT(Parse(message, json));
+    EXPECT(message.type() == kJsonMessageMcp && message.Get(kJsonFieldSessionId) == "s");
+    EXPECT(message.Get(kJsonFieldPayload) == payload && message.Get(kJsonFieldCommands) == commands);
+
+    // Any value type, taken as written
+    EXPECT(Parse(message, R"({"payload":"a\"b","commands":null})"));
+    EXPECT(message.Get(kJsonFieldPayload) == R"("a\"b")" && message.Get(kJsonFieldCommands) == "null");
+    EXPECT(Parse(message, R"({"payload":-12.5})") && message.Get(kJsonFieldPayload) == "-12.5");
+
+    // Unbalanced nesting is an error
+    EXPECT(!Parse(message, R"({"payload":{"a":[1,2}})"));
+    EXPECT(!Parse(message, R"({"payload":{"a":"}"})"));
+}
+
+// No prefix of a message parses, so a cut frame is never half handled; run
+// under ASan to also check that none reads past its end
+static void TestTruncation() {
+    const std::string messages[] = {
+        R"({"type":"tts","state":"sentence_start","text":"\u4e2d\ud83d\ude00\"x\""})",
+        R"({"type":"mcp","payload":{"a":"}","b":[1,{"c":"\\"}]},"session_id":"s"})",
+        R"({ "type" : "llm" , "emotion" : "happy" , "n" : 12345 })",
+    };
+    JsonMessage message;
+    for (auto& json : messages) {
+        EXPECT(Parse(message, json));
+        bool any_prefix = false;
+        for (size_t size = 0; size < json.size(); size++) {
+            // A copy of exactly that size, so reading past it is caught
+            std::vector<char> cut(json.begin(), json.begin() + size);
+            any_prefix |= message.Parse(cut.data(), cut.size());
+        }
+        EXPECT(!any_prefix);
+    }
+}
+
+/* Random strings of code points written with raw UTF-8 and every escape form */
+
+static void AppendUtf8(std::string& out, uint32_t code) {
+    if (code < 0x80) {
+        out.push_back(code);
+    } else if (code < 0x800) {
+        out.push_back(0xC0 | (code >> 6));
+        out.push_back(0x80 | (code & 0x3F));
+    } else if (code < 0x10000) {
+        out.push_back(0xE0 | (code >> 12));
+        out.push_back(0x80 | ((code >> 6) & 0x3F));
+        out.push_back(0x80 | (code & 0x3F));
+    } else {
+        out.push_back(0xF0 | (code >> 18));
+        out.push_back(0x80 | ((code >> 12) & 0x3F));
+        out.push_back(0x80 | ((code >> 6) & 0x3F));
+        out.push_back(0x80 | (code & 0x3F));
+    }
+}
+
+static void AppendEscaped(std::string& out, uint32_t code, bool upper) {
+    char hex[8];
+    snprintf(hex, sizeof(hex), upper ? "\\u%04X" : "\\u%04x", code);
+    out += hex;
+}
+
+static uint32_t RandomCodePoint(std::mt19937& rng) {
+    switch (rng() % 4) {
+        case 0: return rng() % 0x80;
+        case 1: return 0x80 + rng() % (0x800 - 0x80);
+        case 2: {
+            uint32_t code = 0x800 + rng() % (0x10000 - 0x800);
+            return code >= 0xD800 && code <= 0xDFFF ? code - 0x800 : code;
+        }
+        default: return 0x10000 + rng() % (0x110000 - 0x10000);
+    }
+}
+
+static void TestRandomStrings() {
+    std::mt19937 rng(5);
+    JsonMessage message;
+    int failures = 0;
+    for (int i = 0; i < 20000; i++) {
+        std::string expected[3];
+        std::string json = "{";
+        const char* keys[] = { "text", "emotion", "session_id" };
+        for (int field = 0; field < 3; field++) {
+            json += field == 0 ? "\"" : ",\"";
+            json += keys[field];
+            json += "\":\"";
+            for (int count = rng() % 12; count > 0; count--) {
+                uint32_t code = RandomCodePoint(rng);
+                AppendUtf8(expected[field], code);
+                bool must_escape = code < 0x20 || code == '"' || code == '\\';
+                const char* short_escape = nullptr;
+                switch (code) {
+                    case '"': short_escape = "\\\""; break;
+                    case '\\': short_escape = "\\\\"; break;
+                    case '/': short_escape = "\\/"; break;
+                    case '\b': short_escape = "\\b"; break;
+                    case '\f': short_escape = "\\f"; break;
+                    case '\n': short_escape = "\\n"; break;
+                    case '\r': short_escape = "\\r"; break;
+                    case '\t': short_escape = "\\t"; break;
+                }
+                int form = rng() % 3;
+                if (short_escape != nullptr && (form == 0 || (must_escape && form == 1))) {
+                    json += short_escape;
+                } else if (form == 1 || must_escape) {
+                    if (code >= 0x10000) {
+                        AppendEscaped(json, 0xD800 + ((code - 0x10000) >> 10), rng() % 2);
+                        AppendEscaped(json, 0xDC00 + ((code - 0x10000) & 0x3FF), rng() % 2);
+                    } else {
+                        AppendEscaped(json, code, rng() % 2);
+                    }
+                } else {
+                    AppendUtf8(json, code);
+                }
+            }
+            json += "\"";
+        }
+        json += "}";
+
+        if (!Parse(message, json) || message.Get(kJsonFieldText) != expected[0] ||
+            message.Get(kJsonFieldEmotion) != expected[1] || message.Get(kJsonFieldSessionId) != expected[2]) {
+            failures++;
+        }
+    }
+    EXPECT(failures == 0);
+}
+
+// Arbitrary bytes after an opening brace must never read out of bounds; run under ASan to check
+static void TestGarbage() {
+    std::mt19937 rng(9);
+    const char alphabet[] = "{}[]\":,\\u0dD8e \"text\"payload";
+    JsonMessage message;
+    for (int i = 0; i < 200000; i++) {
+        std::vector<char> data(1 + rng() % 40);
+        data[0] = '{';
+        for (size_t j = 1; j < data.size(); j++) {
+            data[j] = rng() % 4 == 0 ? static_cast<char>(rng()) : alphabet[rng() % (sizeof(alphabet) - 1)];
+        }
+        if (message.Parse(data.data(), data.size())) {
+            // Whatever was taken lies within the input or the unescape buffer
+            for (int field = 0; field < kJsonFieldCount; field++) {
+                auto value = message.Get(static_cast<JsonMessageField>(field));
+                DoNotOptimize(message.Has(static_cast<JsonMessageField>(field)) ? value.size() : 0);
+            }
+        }
+    }
+}
+
+int main() {
+    TestFields();
+    TestEscapes();
+    TestRawFields();
+    TestTruncation();
+    TestRandomStrings();
+    TestGarbage();
+    return HOST_TEST_RESULT();
+}
@@ -0,0 +1,441 @@
+// JsonWriter against the strict parser and printer in stubs/cJSON.cc: fixed
+// cases, fuzzed escaping and documents, then the messages it replaced.
+#include "json_writer.h"
+#include "cJSON.h"
+#include "host_test.h"
+
+#include <cinttypes>
+#include <climits>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+#include <random>
+#include <string>
+
+static size_t allocations = 0;
+
+void* operator new(size_t size) {
+    allocations++;
+    if (void* p = malloc(size)) {
+        return p;
+    }
+    throw std::bad_alloc();
+}
+
+void operator delete(void* p) noexcept {
+    free(p);
+}
+
+void operator delete(void* p, size_t) noexcept {
+    free(p);
+}
+
+static std::string Print(const cJSON* item) {
+    char* text = cJSON_PrintUnformatted(item);
+    std::string printed = text != NULL ? text : "";
+    cJSON_free(text);
+    return printed;
+}
+
+// Decodes the JSON string starting at `text[i]`, the way the server would.
+// Kept separate from cJSON because it has to accept \u0000
+static bool Unescape(const std::string& text, size_t& i, std::string& out) {
+    if (i >= text.size() || text[i++] != '"') {
+        return false;
+    }
+    while (i < text.size()) {
+        auto c = static_cast<unsigned char>(text[i++]);
+        if (c == '"') {
+            return true;
+        }
+        if (c < 0x20) {
+            return false;
+        }
+        if (c != '\\') {
+            out.push_back(c);
+            continue;
+        }
+        if (i >= text.size()) {
+            return false;
+        }
+        switch (text[i++]) {
+            case '"': out.push_back('"'); break;
+            case '\\': out.push_back('\\'); break;
+            case 'b': out.push_back('\b'); break;
+            case 'f': out.push_back('\f'); break;
+            case 'n': out.push_back('\n'); break;
+            case 'r': out.push_back('\r'); break;
+            case 't': out.push_back('\t'); break;
+            case 'u': {
+                // The writer only emits \u00XX, for control characters
+                if (i + 4 > text.size()) {
+                    return false;
+                }
+                long value = strtol(text.substr(i, 4).c_str(), NULL, 16);
+                i += 4;
+                if (value > 0x1f) {
+                    return false;
+                }
+                out.push_back(static_cast<char>(value));
+                break;
+            }
+            default:
+                return false;
+        }
+    }
+    return false;
+}
+
+static void TestStructure() {
+    JsonWriter json;
+    json.BeginObject();
+    json.Field("a", "x");
+    json.Field("b", 1);
+    json.Field("c", false);
+    json.Key("d").BeginArray().Int(-1).String("y").Null().BeginObject().EndObject().BeginArray().EndArray().EndArray();
+    json.RawField("e", "{\"f\":[1,2]}");
+    json.Key("g").Raw("3");
+    json.EndObject();
+    EXPECT(json.str() == "{\"a\":\"x\",\"b\":1,\"c\":false,\"d\":[-1,\"y\",null,{},[]],\"e\":{\"f\":[1,2]},\"g\":3}");
+
+    JsonWriter escaped;
+    escaped.BeginArray().String("\"\\/\b\f\n\r\t\x01\x1f\x7f").String("\xe4\xbd\xa0\xe5\xa5\xbd").EndArray();
+    EXPECT(escaped.str() == "[\"\\\"\\\\/\\b\\f\\n\\r\\t\\u0001\\u001f\x7f\",\"\xe4\xbd\xa0\xe5\xa5\xbd\"]");
+
+    JsonWriter embedded_null;
+    embedded_null.String(std::string_view("a\0b", 3));
+    EXPECT(embedded_null.str() == "\"a\\u0000b\"");
+}
+
+static void TestIntegers() {
+    const int64_t values[] = {
+        0, 1, -1, 9, 10, -10, 99, 100, INT32_MAX, INT32_MIN, int64_t(INT32_MAX) + 1,
+        int64_t(INT32_MIN) - 1, 999999999999999999, 1000000000000000000, INT64_MAX, INT64_MIN, INT64_MIN + 1,
+    };
+    for (auto value : values) {
+        JsonWriter json;
+        json.Int(value);
+        EXPECT(json.str() == std::to_string(value));
+    }
+    std::mt19937_64 rng(1);
+    for (int i = 0; i < 100000; i++) {
+        // Spread the magnitudes over all digit counts
+        int64_t value = static_cast<int64_t>(rng()) >> (rng() % 64);
+        JsonWriter json;
+        json.Int(value);
+        EXPECT(json.str() == std::to_string(value));
+    }
+}
+
+// Starting from no room at all, every append has to grow the buffer
+static void TestGrowthAndReuse() {
+    for (size_t reserve : {0, 1, 2, 7}) {
+        JsonWriter json(reserve);
+        json.BeginObject();
+        json.Field("session_id", std::string(100, 's'));
+        json.Field("text", "\n\n\n");
+        json.EndObject();
+        EXPECT(json.str() == "{\"session_id\":\"" + std::string(100, 's') + "\",\"text\":\"\\n\\n\\n\"}");
+    }
+
+    // A reused buffer keeps its capacity, so rewriting it allocates nothing
+    std::string buffer;
+    buffer.reserve(256);
+    size_t before = allocations;
+    for (int i = 0; i < 100; i++) {
+        JsonWriter json(buffer);
+        json.BeginObject().Field("type", "hello");
+        json.Field("version", i);
+        json.EndObject();
+        json.str();
+    }
+    EXPECT(allocations == before);
+    EXPECT(buffer == "{\"type\":\"hello\",\"version\":99}");
+
+    // Without str(), as the hello builders do, the caller's string is trimmed when
+    // the writer goes out of scope, not left padded to its capacity with NULs
+    for (int i = 0; i < 3; i++) {
+        {
+            JsonWriter json(buffer);
+            json.BeginObject().Field("type", "goodbye").EndObject();
+        }
+        EXPECT(buffer == "{\"type\":\"goodbye\"}");
+        EXPECT(buffer.size() == strlen(buffer.c_str()) && buffer.back() == '}');
+        EXPECT(buffer.capacity() >= 256);
+    }
+    {
+        JsonWriter json(buffer);
+    }
+    EXPECT(buffer.empty());
+}
+
+static char RandomByte(std::mt19937& rng) {
+    switch (rng() % 4) {
+        case 0: return static_cast<char>(rng() % 0x20);
+        case 1: return "\"\\/"[rng() % 3];
+        default: return static_cast<char>(rng() % 256);
+    }
+}
+
+// Any byte string comes back unchanged, including NUL and invalid UTF-8
+static void TestEscapingFuzz() {
+    std::mt19937 rng(42);
+    int failures = 0;
+    for (int i = 0; i < 200000; i++) {
+        std::string value(rng() % 40, '\0');
+        for (auto& c : value) {
+            c = RandomByte(rng);
+        }
+        JsonWriter json;
+        json.BeginObject();
+        json.Field("k", value);
+        json.EndObject();
+        const auto& text = json.str();
+        size_t position = 5;
+        std::string decoded;
+        if (text.compare(0, 5, "{\"k\":") != 0 || !Unescape(text, position, decoded) || decoded != value ||
+            text.substr(position) != "}") {
+            failures++;
+        }
+    }
+    EXPECT(failures == 0);
+}
+
+/*
+ * Random documents written twice, with JsonWriter and as a cJSON tree. Both
+ * outputs must be the same bytes, and parse back to the same document.
+ * Integers stay in int range, where cJSON prints them the same way.
+ */
+static void WriteRandom(std::mt19937& rng, int depth, JsonWriter& json, cJSON* parent, const char* key) {
+    auto add = [&](cJSON* item) {
+        if (key != NULL) {
+            cJSON_AddItemToObject(parent, key, item);
+        } else {
+            cJSON_AddItemToArray(parent, item);
+        }
+    };
+    int kind = rng() % (depth < 4 ? 7 : 5);
+    if (kind == 0) {
+        int value = static_cast<int>(rng());
+        json.Int(value);
+        add(cJSON_CreateNumber(value));
+    } else if (kind == 1) {
+        bool value = rng() % 2;
+        json.Bool(value);
+        add(cJSON_CreateBool(value));
+    } else if (kind == 2) {
+        json.Null();
+        add(cJSON_CreateNull());
+    } else if (kind <= 4) {
+        // NUL ends a cJSON string, so leave it out here
+        std::string value(rng() % 12, '\0');
+        for (auto& c : value) {
+            while ((c = RandomByte(rng)) == '\0') {}
+        }
+        json.String(value);
+        add(cJSON_CreateString(value.c_str()));
+    } else if (kind == 5) {
+        cJSON* array = cJSON_CreateArray();
+        json.BeginArray();
+        for (int i = rng() % 4; i > 0; i--) {
+            WriteRandom(rng, depth + 1, json, array, NULL);
+        }
+        json.EndArray();
+        add(array);
+    } else {
+        static const char* const kKeys[] = {"", "k1", "k2", "k3"};
+        cJSON* object = cJSON_CreateObject();
+        json.BeginObject();
+        for (int i = rng() % 4; i > 0; i--) {
+            const char* child_key = kKeys[i];
+            // Keys are literals for the writer
+            switch (i) {
+                case 1: json.Key("k1"); break;
+                case 2: json.Key("k2"); break;
+                default: json.Key("k3"); break;
+            }
+            WriteRandom(rng, depth + 1, json, object, child_key);
+        }
+        json.EndObject();
+        add(object);
+    }
+}
+
+static void TestDocumentFuzz() {
+    // The check is only as good as the parser, which must refuse what the server would
+    for (const char* bad : {"[\"\x01\"]", "[\"\\x\"]", "[\"\\u00\"]", "[1,]", "{\"a\"1}", "[01]", "[\"a\"]x", "[\"a]"}) {
+        cJSON* parsed = cJSON_Parse(bad);
+        EXPECT(parsed == NULL);
+        cJSON_Delete(parsed);
+    }
+
+
+    std::mt19937 rng(7);
+    int mismatches = 0;
+    int parse_failures = 0;
+    for (int i = 0; i < 20000; i++) {
+        JsonWriter json;
+        cJSON* root = cJSON_CreateArray();
+        json.BeginArray();
+        WriteRandom(rng, 0, json, root, NULL);
+        WriteRandom(rng, 0, json, root, NULL);
+        json.EndArray();
+        const auto& text = json.str();
+        if (text != Print(root)) {
+            mismatches++;
+        }
+        cJSON* parsed = cJSON_ParseWithLength(text.data(), text.size());
+        if (parsed == NULL || Print(parsed) != text) {
+            parse_failures++;
+        }
+        cJSON_Delete(parsed);
+        cJSON_Delete(root);
+    }
+    EXPECT(mismatches == 0);
+    EXPECT(parse_failures == 0);
+}
+
+/* The messages JsonWriter replaced, the old way and the new way */
+
+static const std::string kSessionId = "a1b2c3d4-e5f6-7890-abcd-ef0123456789";
+static const std::string kToolResult = "{\"content\":[{\"type\":\"text\",\"text\":\"true\"}],\"isError\":false}";
+
+// Stands in for SendText(), so the message has to be complete
+__attribute__((noinline)) static size_t Send(const std::string& text) {
+    return text.size();
+}
+
+static size_t ListenOld() {
+    std::string message = "{\"session_id\":\"" + kSessionId + "\"";
+    message += ",\"type\":\"listen\",\"state\":\"start\"";
+    message += ",\"mode\":\"auto\"";
+    message += "}";
+    return Send(message);
+}
+
+static size_t ListenNew() {
+    JsonWriter json(96 + kSessionId.size());
+    json.BeginObject();
+    json.Field("session_id", kSessionId);
+    json.Field("type", "listen");
+    json.Field("state", "start");
+    json.Field("mode", "auto");
+    json.EndObject();
+    return Send(json.str());
+}
+
+// McpServer::ReplyResult() followed by Protocol::SendMcpMessage()
+static size_t McpReplyOld(int id) {
+    std::string payload = "{\"jsonrpc\":\"2.0\",\"id\":";
+    payload += std::to_string(id) + ",\"result\":";
+    payload += kToolResult;
+    payload += "}";
+    std::string message = "{\"session_id\":\"" + kSessionId + "\",\"type\":\"mcp\",\"payload\":" + payload + "}";
+    return Send(message);
+}
+
+static size_t McpReplyNew(int id) {
+    JsonWriter payload(48 + kToolResult.size());
+    payload.BeginObject();
+    payload.Field("jsonrpc", "2.0");
+    payload.Field("id", id);
+    payload.RawField("result", kToolResult);
+    payload.EndObject();
+    JsonWriter json(96 + kSessionId.size() + payload.str().size());
+    json.BeginObject();
+    json.Field("session_id", kSessionId);
+    json.Field("type", "mcp");
+    json.RawField("payload", payload.str());
+    json.EndObject();
+    return Send(json.str());
+}
+
+// WebsocketProtocol::GetHelloMessage(), built as a cJSON tree
+static std::string HelloOld() {
+    cJSON* root = cJSON_CreateObject();
+    cJSON_AddStringToObject(root, "type", "hello");
+    cJSON_AddNumberToObject(root, "version", 3);
+    cJSON* features = cJSON_CreateObject();
+    cJSON_AddBoolToObject(features, "mcp", true);
+    cJSON_AddItemToObject(root, "features", features);
+    cJSON_AddStringToObject(root, "transport", "websocket");
+    cJSON* audio_params = cJSON_CreateObject();
+    cJSON_AddStringToObject(audio_params, "format", "opus");
+    cJSON_AddNumberToObject(audio_params, "sample_rate", 16000);
+    cJSON_AddNumberToObject(audio_params, "channels", 1);
+    cJSON_AddNumberToObject(audio_params, "frame_duration", 60);
+    cJSON_AddItemToObject(root, "audio_params", audio_params);
+    auto json_str = cJSON_PrintUnformatted(root);
+    std::string hello_message = json_str;
+    cJSON_free(json_str);
+    cJSON_Delete(root);
+    return hello_message;
+}
+
+static void HelloNew(std::string& hello_message) {
+    JsonWriter json(hello_message);
+    json.BeginObject();
+    json.Field("type", "hello");
+    json.Field("version", 3);
+    json.Key("features").BeginObject();
+    json.Field("mcp", true);
+    json.EndObject();
+    json.Field("transport", "websocket");
+    json.Key("audio_params").BeginObject();
+    json.Field("format", "opus");
+    json.Field("sample_rate", 16000);
+    json.Field("channels", 1);
+    json.Field("frame_duration", 60);
+    json.EndObject();
+    json.EndObject();
+}
+
+static void Bench(const char* name, size_t (*old_message)(), size_t (*new_message)()) {
+    const int iterations = 200000;
+    size_t before = allocations;
+    double old_ns = BenchNs(iterations, [&]() { DoNotOptimize(old_message()); });
+    double old_allocations = double(allocations - before) / (iterations * 5);
+    before = allocations;
+    double new_ns = BenchNs(iterations, [&]() { DoNotOptimize(new_message()); });
+    double new_allocations = double(allocations - before) / (iterations * 5);
+    EXPECT(new_allocations < old_allocations);
+    printf("%-10s concat %6.0f ns %.0f allocations, JsonWriter %6.0f ns %.0f allocations\n",
+        name, old_ns, old_allocations, new_ns, new_allocations);
+}
+
+static void TestMessages() {
+    {
+        // Same bytes as before, the server sees no difference
+        std::string message = "{\"session_id\":\"" + kSessionId + "\",\"type\":\"listen\",\"state\":\"start\",\"mode\":\"auto\"}";
+        JsonWriter json;
+        json.BeginObject().Field("session_id", kSessionId);
+        json.Field("type", "listen").Field("state", "start").Field("mode", "auto").EndObject();
+        EXPECT(json.str() == message);
+    }
+    std::string hello;
+    HelloNew(hello);
+    EXPECT(hello == HelloOld());
+
+    Bench("listen", ListenOld, ListenNew);
+    Bench("mcp reply", [] { return McpReplyOld(12345); }, [] { return McpReplyNew(12345); });
+
+    // The hello is rebuilt into the cached string. cJSON allocates with malloc,
+    // which is not counted, so only times are compared
+    const int iterations = 100000;
+    double old_ns = BenchNs(iterations, [&]() { DoNotOptimize(HelloOld()); });
+    double new_ns = BenchNs(iterations, [&]() {
+        HelloNew(hello);
+        DoNotOptimize(hello);
+    });
+    printf("hello      cJSON  %6.0f ns, JsonWriter into the cached string %6.0f ns\n", old_ns, new_ns);
+}
+
+int main() {
+    TestStructure();
+    TestIntegers();
+    TestGrowthAndReuse();
+    TestEscapingFuzz();
+    TestDocumentFuzz();
+    TestMessages();
+    return HOST_TEST_RESULT();
+}
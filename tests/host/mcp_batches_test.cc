@@ -0,0 +1,208 @@
+// JSON-RPC batches answered the way McpServer dispatches them: replies on the
+// batch task, tool calls on the ToolCallPool workers and cancels dropping a call.
+#include "mcp_server.h"
+#include "host_test.h"
+
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <set>
+#include <thread>
+
+static const char kInvalidRequestError[] =
+    "{\"jsonrpc\":\"2.0\",\"id\":null,\"error\":{\"code\":-32600,\"message\":\"Invalid Request\"}}";
+
+static std::string Message(int id, const std::string& result) {
+    return "{\"id\":" + std::to_string(id) + ",\"result\":\"" + result + "\"}";
+}
+
+// Holds a tool call until the test lets it finish
+class Gate {
+public:
+    void Open() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        open_ = true;
+        condition_variable_.notify_all();
+    }
+
+    void Wait() {
+        std::unique_lock<std::mutex> lock(mutex_);
+        condition_variable_.wait(lock, [this]() { return open_; });
+    }
+
+private:
+    std::mutex mutex_;
+    std::condition_variable condition_variable_;
+    bool open_ = false;
+};
+
+// The parts of McpServer around McpBatches. Never deleted, the workers of its pool keep running
+class Server {
+public:
+    Server() {
+        pool_.OnResult([this](int id, const std::string& result) {
+            SendReply(id, Message(id, result));
+        });
+        pool_.OnError([this](int id, const std::string& message) {
+            SendReply(id, Message(id, "error: " + message));
+        });
+    }
+
+    McpBatches& batches() { return batches_; }
+
+    void SendReply(int id, const std::string& message) {
+        auto reply = batches_.Reply(id, message);
+        std::lock_guard<std::mutex> lock(mutex_);
+        replied_.insert(id);
+        if (!reply.empty()) {
+            sent_.push_back(reply);
+        }
+        condition_variable_.notify_all();
+    }
+
+    void CallTool(int id, std::function<std::string()> run) {
+        batches_.AddCall(id);
+        ToolCallRequest request;
+        request.id = id;
+        request.name = "tool";
+        request.run = run;
+        if (!pool_.Submit(std::move(request))) {
+            SendReply(id, Message(id, "error: rejected"));
+        }
+    }
+
+    void Cancel(int id) {
+        if (pool_.Cancel(id)) {
+            auto replies = batches_.Drop(id);
+            std::lock_guard<std::mutex> lock(mutex_);
+            if (!replies.empty()) {
+                sent_.push_back(replies);
+            }
+        }
+    }
+
+    bool WaitReplied(int id) {
+        std::unique_lock<std::mutex> lock(mutex_);
+        return condition_variable_.wait_for(lock, std::chrono::seconds(5), [this, id]() { return replied_.count(id) > 0; });
+    }
+
+    std::vector<std::string> Sent() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return sent_;
+    }
+
+    bool WaitSent(size_t count) {
+        std::unique_lock<std::mutex> lock(mutex_);
+        return condition_variable_.wait_for(lock, std::chrono::seconds(5), [this, count]() { return sent_.size() >= count; });
+    }
+
+private:
+    ToolCallPool pool_;
+    McpBatches batches_;
+    std::mutex mutex_;
+    std::condition_variable condition_variable_;
+    std::set<int> replied_;
+    std::vector<std::string> sent_;
+};
+
+// Sync replies, an invalid element, tool calls finishing before and after the batch is
+// sealed and one cancelled inside the batch go out as one array, in the order they finished
+static void TestMixedBatch() {
+    auto server = new Server();
+    auto slow = new Gate();
+    auto cancelled = new Gate();
+    auto& batches = server->batches();
+
+    batches.Begin();
+    server->SendReply(1, Message(1, "sync"));
+    server->CallTool(2, []() { return std::string("fast"); });
+    EXPECT(server->WaitReplied(2));
+    batches.Reply(kInvalidRequestError);
+    server->CallTool(3, [slow]() { slow->Wait(); return std::string("slow"); });
+    server->CallTool(4, [cancelled]() { cancelled->Wait(); return std::string("cancelled"); });
+    // Wait for call 4 to run, so the cancel drops a running call and not a queued one
+    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    server->Cancel(4);
+    server->SendReply(5, Message(5, "sync"));
+
+    int pending = -1;
+    EXPECT(batches.Seal(pending).empty());
+    EXPECT(pending == 1);
+    EXPECT(server->Sent().empty());
+
+    // The cancelled call finishing changes nothing, the last pending one sends the array
+    cancelled->Open();
+    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    EXPECT(server->Sent().empty());
+    slow->Open();
+    EXPECT(server->WaitSent(1));
+    auto sent = server->Sent();
+    EXPECT(sent.size() == 1);
+    EXPECT(sent[0] == "[" + Message(1, "sync") + "," + Message(2, "fast") + "," + kInvalidRequestError + "," +
+        Message(5, "sync") + "," + Message(3, "slow") + "]");
+
+    // Replies after the batch are sent on their own
+    server->SendReply(6, Message(6, "alone"));
+    EXPECT(server->Sent().size() == 2 && server->Sent()[1] == Message(6, "alone"));
+}
+
+// With every tool call of the batch done before sealing, Seal() returns the array
+static void TestBatchDoneBeforeSeal() {
+    auto server = new Server();
+    auto& batches = server->batches();
+    batches.Begin();
+    server->CallTool(1, []() { return std::string("a"); });
+    server->CallTool(2, []() -> std::string { throw std::runtime_error("failed"); });
+    EXPECT(server->WaitReplied(1) && server->WaitReplied(2));
+    int pending = -1;
+    auto replies = batches.Seal(pending);
+    EXPECT(pending == 0);
+    EXPECT(replies == "[" + Message(1, "a") + "," + Message(2, "error: failed") + "]" ||
+        replies == "[" + Message(2, "error: failed") + "," + Message(1, "a") + "]");
+    EXPECT(server->Sent().empty());
+}
+
+// Cancelling the last pending call of a sealed batch sends what the others replied
+static void TestCancelAfterSeal() {
+    auto server = new Server();
+    auto gate = new Gate();
+    auto& batches = server->batches();
+    batches.Begin();
+    server->SendReply(1, Message(1, "sync"));
+    server->CallTool(2, [gate]() { gate->Wait(); return std::string("late"); });
+    int pending = -1;
+    EXPECT(batches.Seal(pending).empty() && pending == 1);
+    server->Cancel(2);
+    EXPECT(server->Sent().size() == 1 && server->Sent()[0] == "[" + Message(1, "sync") + "]");
+    gate->Open();
+    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    EXPECT(server->Sent().size() == 1);
+}
+
+static void TestNoReplies() {
+    McpBatches batches;
+    // Only notifications: no response at all
+    batches.Begin();
+    int pending = -1;
+    EXPECT(batches.Seal(pending).empty() && pending == 0);
+
+    // A reply made on another task while a batch is open is not part of it
+    batches.Begin();
+    std::string other;
+    std::thread([&]() { other = batches.Reply(7, Message(7, "other")); }).join();
+    EXPECT(other == Message(7, "other"));
+    EXPECT(batches.Reply(8, Message(8, "mine")).empty());
+    EXPECT(batches.Seal(pending) == "[" + Message(8, "mine") + "]");
+
+    // Dropping a call that is not in a batch
+    EXPECT(batches.Drop(9).empty());
+    EXPECT(batches.Reply(9, Message(9, "x")) == Message(9, "x"));
+}
+
+int main() {
+    TestMixedBatch();
+    TestBatchDoneBeforeSeal();
+    TestCancelAfterSeal();
+    TestNoReplies();
+    return HOST_TEST_RESULT();
+}
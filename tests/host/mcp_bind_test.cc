@@ -0,0 +1,258 @@
+#include "mcp_server.h"
+#include "host_test.h"
+
+static PropertyList Schema() {
+    return PropertyList({
+        Property("volume", kPropertyTypeInteger, 0, 100),
+        Property("brightness", kPropertyTypeInteger, 50, 0, 100),
+        Property("mute", kPropertyTypeBoolean, false),
+        Property("theme", kPropertyTypeString, std::string("light")),
+        Property("label", kPropertyTypeString),
+    });
+}
+
+static bool Bind(const PropertyList& schema, const char* json, PropertyList& arguments, std::string& error) {
+    cJSON* root = json != NULL ? cJSON_Parse(json) : NULL;
+    EXPECT(json == NULL || root != NULL);
+    bool bound = schema.Bind(root, arguments, error);
+    cJSON_Delete(root);
+    return bound;
+}
+
+static void TestDefaults() {
+    auto schema = Schema();
+    PropertyList arguments;
+    std::string error;
+    EXPECT(Bind(schema, R"({"volume":30,"label":"x"})", arguments, error));
+    EXPECT(arguments["volume"].value<int>() == 30);
+    EXPECT(arguments["brightness"].value<int>() == 50);
+    EXPECT(arguments["mute"].value<bool>() == false);
+    EXPECT(arguments["theme"].value<std::string>() == "light");
+    EXPECT(arguments["label"].value<std::string>() == "x");
+    EXPECT(arguments.value<int>(arguments.IndexOf("volume")) == 30);
+
+    // Given values replace the defaults, keys match case insensitively like cJSON_GetObjectItem
+    EXPECT(Bind(schema, R"({"Volume":0,"brightness":100,"mute":true,"theme":"dark","label":""})", arguments, error));
+    EXPECT(arguments["volume"].value<int>() == 0 && arguments["brightness"].value<int>() == 100);
+    EXPECT(arguments["mute"].value<bool>() && arguments["theme"].value<std::string>() == "dark");
+    EXPECT(arguments["label"].value<std::string>().empty());
+
+    // The schema itself reads as its defaults, and a bound list binds again with the same schema
+    EXPECT(schema["brightness"].value<int>() == 50);
+    PropertyList again;
+    EXPECT(Bind(arguments, R"({"volume":1,"label":"y"})", again, error) && again["label"].value<std::string>() == "y");
+
+    // A tool without properties
+    PropertyList empty, empty_arguments;
+    EXPECT(empty.Bind(NULL, empty_arguments, error));
+    EXPECT(Bind(empty, R"({"volume":1})", empty_arguments, error));
+}
+
+// Inclusive, with the messages Property::set_value() used to throw
+static void TestRanges() {
+    auto schema = Schema();
+    PropertyList arguments;
+    std::string error;
+    EXPECT(Bind(schema, R"({"volume":100,"label":"x"})", arguments, error));
+    EXPECT(Bind(schema, R"({"volume":0,"brightness":0,"label":"x"})", arguments, error));
+    EXPECT(!Bind(schema, R"({"volume":101,"label":"x"})", arguments, error) && error == "Value exceeds maximum allowed: 100");
+    EXPECT(!Bind(schema, R"({"volume":-1,"label":"x"})", arguments, error) && error == "Value is below minimum allowed: 0");
+    EXPECT(!Bind(schema, R"({"volume":5,"brightness":200,"label":"x"})", arguments, error) &&
+        error == "Value exceeds maximum allowed: 100");
+}
+
+static void TestTypeMismatches() {
+    auto schema = Schema();
+    PropertyList arguments;
+    std::string error;
+    // A value of the wrong type counts as missing, which is an error for a required argument...
+    EXPECT(!Bind(schema, R"({"label":"x"})", arguments, error) && error == "Missing valid argument: volume");
+    EXPECT(!Bind(schema, R"({"volume":"10","label":"x"})", arguments, error) && error == "Missing valid argument: volume");
+    EXPECT(!Bind(schema, R"({"volume":10,"label":3})", arguments, error) && error == "Missing valid argument: label");
+    EXPECT(!Bind(schema, R"({"volume":null,"label":"x"})", arguments, error) && error == "Missing valid argument: volume");
+    // ...and the default for an optional one
+    EXPECT(Bind(schema, R"({"volume":10,"label":"x","mute":1,"theme":false,"brightness":"9"})", arguments, error));
+    EXPECT(arguments["mute"].value<bool>() == false && arguments["theme"].value<std::string>() == "light");
+    EXPECT(arguments["brightness"].value<int>() == 50);
+    // A later key of the right type still counts
+    EXPECT(Bind(schema, R"({"volume":"10","volume":10,"label":"x"})", arguments, error));
+    EXPECT(arguments["volume"].value<int>() == 10);
+
+    // The first of duplicate keys wins, unknown keys are ignored
+    EXPECT(Bind(schema, R"({"volume":10,"VOLUME":20,"label":"x","extra":1})", arguments, error));
+    EXPECT(arguments["volume"].value<int>() == 10);
+}
+
+// Arguments that are missing or not an object bind like an empty object
+static void TestNonObjectArguments() {
+    auto schema = Schema();
+    PropertyList arguments;
+    std::string error;
+    for (const char* json : {(const char*)NULL, "[10,\"x\"]", "[{\"volume\":10}]", "\"volume\"", "10", "null", "true"}) {
+        error.clear();
+        EXPECT(!Bind(schema, json, arguments, error) && error == "Missing valid argument: volume");
+    }
+    auto optional = PropertyList({ Property("mute", kPropertyTypeBoolean, true) });
+    EXPECT(Bind(optional, "[false]", arguments, error) && arguments["mute"].value<bool>());
+}
+
+static void TestNames() {
+    // Names that differ only in case, and names that hash alike: same length, first and last letter
+    auto schema = PropertyList({
+        Property("mode", kPropertyTypeString),
+        Property("Mode", kPropertyTypeString),
+        Property("made", kPropertyTypeInteger, 1),
+        Property("mire", kPropertyTypeInteger, 2),
+    });
+    EXPECT(schema.IndexOf("mode") == 0 && schema.IndexOf("Mode") == 1);
+    EXPECT(schema.IndexOf("made") == 2 && schema.IndexOf("mire") == 3);
+    EXPECT(schema.IndexOf("MODE") == -1 && schema.IndexOf("mde") == -1 && schema.IndexOf("") == -1);
+
+    PropertyList arguments;
+    std::string error;
+    // Each key takes the lowest property it matches that is still unbound
+    EXPECT(Bind(schema, R"({"mode":"a","Mode":"b","MIRE":7})", arguments, error));
+    EXPECT(arguments["mode"].value<std::string>() == "a" && arguments["Mode"].value<std::string>() == "b");
+    EXPECT(arguments["made"].value<int>() == 1 && arguments["mire"].value<int>() == 7);
+    EXPECT(Bind(schema, R"({"MODE":"a","mode":"b"})", arguments, error));
+    EXPECT(arguments["mode"].value<std::string>() == "a" && arguments["Mode"].value<std::string>() == "b");
+    EXPECT(!Bind(schema, R"({"mode":"a"})", arguments, error) && error == "Missing valid argument: Mode");
+
+    // A name the tool did not declare throws, for the tool call pool to report
+    bool threw = false;
+    try {
+        arguments["nope"];
+    } catch (const std::runtime_error&) {
+        threw = true;
+    }
+    EXPECT(threw);
+
+    // Every slot of the table is usable
+    PropertyList full;
+    for (size_t i = 0; i < 32; i++) {
+        full.AddProperty(Property("p" + std::to_string(i), kPropertyTypeInteger, static_cast<int>(i)));
+    }
+    bool all_found = true;
+    for (size_t i = 0; i < 32; i++) {
+        all_found &= full.IndexOf("p" + std::to_string(i)) == static_cast<int>(i);
+    }
+    EXPECT(all_found);
+    threw = false;
+    try {
+        full.AddProperty(Property("p32", kPropertyTypeInteger));
+    } catch (const std::invalid_argument&) {
+        threw = true;
+    }
+    EXPECT(threw);
+}
+
+/* The binding DoToolCall() did before: copy the schema, look each property up, throw on a range */
+
+static bool BindOld(const std::vector<Property>& schema, const cJSON* json, std::vector<Property>& arguments, std::string& error) {
+    arguments = schema;
+    try {
+        for (auto& argument : arguments) {
+            bool found = false;
+            auto value = cJSON_GetObjectItem(json, argument.name().c_str());
+            if (argument.type() == kPropertyTypeBoolean && cJSON_IsBool(value)) {
+                argument.set_value<bool>(value->valueint == 1);
+                found = true;
+            } else if (argument.type() == kPropertyTypeInteger && cJSON_IsNumber(value)) {
+                argument.set_value<int>(value->valueint);
+                found = true;
+            } else if (argument.type() == kPropertyTypeString && cJSON_IsString(value)) {
+                argument.set_value<std::string>(value->valuestring);
+                found = true;
+            }
+            if (!argument.has_default_value() && !found) {
+                error = "Missing valid argument: " + argument.name();
+                return false;
+            }
+        }
+    } catch (const std::exception& e) {
+        error = e.what();
+        return false;
+    }
+    return true;
+}
+
+static const Property& GetOld(const std::vector<Property>& arguments, const std::string& name) {
+    for (auto& property : arguments) {
+        if (property.name() == name) {
+            return property;
+        }
+    }
+    throw std::runtime_error("Property not found: " + name);
+}
+
+static void Bench() {
+    auto one = PropertyList({ Property("volume", kPropertyTypeInteger, 0, 100) });
+    std::vector<Property> one_old({ Property("volume", kPropertyTypeInteger, 0, 100) });
+    auto five = Schema();
+    std::vector<Property> five_old({
+        Property("volume", kPropertyTypeInteger, 0, 100),
+        Property("brightness", kPropertyTypeInteger, 50, 0, 100),
+        Property("mute", kPropertyTypeBoolean, false),
+        Property("theme", kPropertyTypeString, std::string("light")),
+        Property("label", kPropertyTypeString),
+    });
+    cJSON* small = cJSON_Parse(R"({"volume":42})");
+    cJSON* big = cJSON_Parse(R"({"volume":42,"mute":true,"theme":"dark","label":"living room lamp"})");
+    cJSON* bad = cJSON_Parse(R"({"volume":420})");
+    const int iterations = 200000;
+
+    // As the tool does: bind the call, then read its arguments
+    double old_one = BenchNs(iterations, [&]() {
+        std::vector<Property> arguments;
+        std::string error;
+        BindOld(one_old, small, arguments, error);
+        DoNotOptimize(GetOld(arguments, "volume").value<int>());
+    });
+    double new_one = BenchNs(iterations, [&]() {
+        PropertyList arguments;
+        std::string error;
+        one.Bind(small, arguments, error);
+        DoNotOptimize(arguments["volume"].value<int>());
+    });
+    double old_five = BenchNs(iterations, [&]() {
+        std::vector<Property> arguments;
+        std::string error;
+        BindOld(five_old, big, arguments, error);
+        DoNotOptimize(GetOld(arguments, "volume").value<int>() + GetOld(arguments, "label").value<std::string>().size());
+    });
+    double new_five = BenchNs(iterations, [&]() {
+        PropertyList arguments;
+        std::string error;
+        five.Bind(big, arguments, error);
+        DoNotOptimize(arguments["volume"].value<int>() + arguments["label"].value<std::string>().size());
+    });
+    double old_bad = BenchNs(iterations, [&]() {
+        std::vector<Property> arguments;
+        std::string error;
+        BindOld(one_old, bad, arguments, error);
+        DoNotOptimize(error);
+    });
+    double new_bad = BenchNs(iterations, [&]() {
+        PropertyList arguments;
+        std::string error;
+        one.Bind(bad, arguments, error);
+        DoNotOptimize(error);
+    });
+    cJSON_Delete(small);
+    cJSON_Delete(big);
+    cJSON_Delete(bad);
+
+    printf("bind and read, 1 argument:           old %4.0f ns, new %4.0f ns\n", old_one, new_one);
+    printf("bind and read, 5 properties, 4 given: old %4.0f ns, new %4.0f ns\n", old_five, new_five);
+    printf("bind out of range:                   old %4.0f ns, new %4.0f ns\n", old_bad, new_bad);
+}
+
+int main() {
+    TestDefaults();
+    TestRanges();
+    TestTypeMismatches();
+    TestNonObjectArguments();
+    TestNames();
+    Bench();
+    return HOST_TEST_RESULT();
+}
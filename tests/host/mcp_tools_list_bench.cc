@@ -0,0 +1,232 @@
+// tools/list and the tools/call lookup with a few hundred registered tools.
+// McpTool, its cached descriptor and BuildToolsPages() are the real ones. The
+// lookup of a page by its cursor and the reply around it are replayed from
+// McpServer::GetToolsList(), which needs the application and the board, next
+// to the GetToolsList() that rebuilt every page per request before.
+#include "mcp_server.h"
+#include "json_writer.h"
+#include "host_test.h"
+
+#include <algorithm>
+#include <cstring>
+
+static const int kToolCount = 300;
+
+static std::vector<McpTool*> tools;
+static std::unordered_map<std::string_view, McpTool*> tool_index;
+
+static std::vector<McpToolsPage> tools_pages;
+
+// Stands in for ReplyResult(), which wraps the result in the JSON-RPC envelope
+static std::string ReplyResult(int id, const std::string& result) {
+    JsonWriter json(48 + result.size());
+    json.BeginObject();
+    json.Field("jsonrpc", "2.0");
+    json.Field("id", id);
+    json.RawField("result", result);
+    json.EndObject();
+    return json.str();
+}
+
+// GetToolsList() before: every descriptor rebuilt and every page cut again per request
+static std::string GetToolsListOld(int id, const std::string& cursor) {
+    std::string json = "{\"tools\":[";
+    bool found_cursor = cursor.empty();
+    auto it = tools.begin();
+    std::string next_cursor = "";
+    while (it != tools.end()) {
+        if (!found_cursor) {
+            if ((*it)->name() == cursor) {
+                found_cursor = true;
+            } else {
+                ++it;
+                continue;
+            }
+        }
+        std::string tool_json = (*it)->to_json() + ",";
+        if (json.length() + tool_json.length() + 30 > MAX_TOOLS_LIST_PAYLOAD_SIZE) {
+            next_cursor = (*it)->name();
+            break;
+        }
+        json += tool_json;
+        ++it;
+    }
+    if (json.back() == ',') {
+        json.pop_back();
+    }
+    if (next_cursor.empty()) {
+        json += "]}";
+    } else {
+        json += "],\"nextCursor\":\"" + next_cursor + "\"}";
+    }
+    return ReplyResult(id, json);
+}
+
+// GetToolsList() now: the pages are built on the first request after a change
+static std::string GetToolsList(int id, const std::string& cursor) {
+    if (tools_pages.empty()) {
+        tools_pages = BuildToolsPages(tools, MAX_TOOLS_LIST_PAYLOAD_SIZE);
+    }
+    auto page = std::find_if(tools_pages.begin(), tools_pages.end(),
+        [&cursor](const McpToolsPage& page) { return page.cursor == cursor; });
+    if (page == tools_pages.end() || page->result.empty()) {
+        return "";
+    }
+    return ReplyResult(id, page->result);
+}
+
+static std::string NextCursor(const std::string& reply) {
+    // It comes last, after the tools
+    auto start = reply.rfind("\"nextCursor\":\"");
+    if (start == std::string::npos) {
+        return "";
+    }
+    start += strlen("\"nextCursor\":\"");
+    return reply.substr(start, reply.find('"', start) - start);
+}
+
+// Every tool is listed once, in order, on pages within the payload limit, and
+// each page's nextCursor is the cursor of the page after it
+static void CheckPages(const std::vector<McpTool*>& tools, size_t max_payload_size) {
+    auto pages = BuildToolsPages(tools, max_payload_size);
+    std::vector<std::string> listed;
+    for (size_t i = 0; i < pages.size(); i++) {
+        auto& page = pages[i];
+        EXPECT(page.cursor == (i == 0 ? "" : tools[listed.size()]->name()));
+        if (page.result.empty()) {
+            // Only the last page, for a tool that does not fit on its own
+            EXPECT(i + 1 == pages.size() && listed.size() < tools.size());
+            size_t next = listed.size() + 1;
+            size_t tail = next < tools.size() ? strlen(",\"nextCursor\":\"\"") + tools[next]->name().size() : 0;
+            EXPECT(tools[listed.size()]->json().size() + strlen("{\"tools\":[]}") + tail > max_payload_size);
+            return;
+        }
+        EXPECT(page.result.size() <= max_payload_size);
+
+        cJSON* root = cJSON_Parse(page.result.c_str());
+        EXPECT(root != NULL);
+        size_t before = listed.size();
+        cJSON* tool;
+        cJSON_ArrayForEach(tool, cJSON_GetObjectItem(root, "tools")) {
+            listed.push_back(cJSON_GetObjectItem(tool, "name")->valuestring);
+        }
+        EXPECT(listed.size() > before);
+        cJSON* next_cursor = cJSON_GetObjectItem(root, "nextCursor");
+        if (i + 1 < pages.size()) {
+            EXPECT(cJSON_IsString(next_cursor) && pages[i + 1].cursor == next_cursor->valuestring);
+            // The page is full: the next tool would not have fitted
+            size_t with_next = page.result.size() + 1 + tools[listed.size()]->json().size();
+            if (listed.size() + 1 < tools.size()) {
+                with_next += tools[listed.size() + 1]->name().size() - tools[listed.size()]->name().size();
+            } else {
+                with_next -= strlen(",\"nextCursor\":\"\"") + tools[listed.size()]->name().size();
+            }
+            EXPECT(with_next > max_payload_size);
+        } else {
+            EXPECT(next_cursor == NULL);
+        }
+        cJSON_Delete(root);
+    }
+    EXPECT(listed.size() == tools.size());
+    for (size_t i = 0; i < listed.size() && i < tools.size(); i++) {
+        EXPECT(listed[i] == tools[i]->name());
+    }
+}
+
+static void TestPages() {
+    CheckPages(tools, MAX_TOOLS_LIST_PAYLOAD_SIZE);
+    EXPECT(BuildToolsPages(tools, MAX_TOOLS_LIST_PAYLOAD_SIZE).size() > 1);
+
+    // Tools of mixed sizes, with names from short to long, under tighter limits
+    std::vector<McpTool*> mixed;
+    for (int i = 0; i < 60; i++) {
+        std::string name = "t" + std::to_string(i) + std::string(i % 7 * 9, 'x');
+        mixed.push_back(new McpTool(name, std::string(20 + i * 37 % 400, 'd'), PropertyList(),
+            [](const PropertyList&) -> ReturnValue { return true; }));
+    }
+    for (size_t limit : {600, 1000, 2500, 8000}) {
+        CheckPages(mixed, limit);
+    }
+    // A tool too large for any page ends the list there
+    CheckPages(mixed, 300);
+    EXPECT(BuildToolsPages(mixed, 300).back().result.empty());
+    for (auto tool : mixed) {
+        delete tool;
+    }
+
+    auto empty = BuildToolsPages({}, MAX_TOOLS_LIST_PAYLOAD_SIZE);
+    EXPECT(empty.size() == 1 && empty[0].cursor.empty() && empty[0].result == "{\"tools\":[]}");
+
+    // Walked the way a client does, through McpServer's lookup
+    std::string cursor;
+    size_t pages = 0;
+    do {
+        auto reply = GetToolsList(1, cursor);
+        EXPECT(!reply.empty());
+        cursor = NextCursor(reply);
+        pages++;
+    } while (!cursor.empty() && pages <= tools.size());
+    EXPECT(pages == tools_pages.size());
+    EXPECT(GetToolsList(1, "no.such.tool").empty());
+}
+
+int main() {
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < kToolCount; i++) {
+        char name[64];
+        snprintf(name, sizeof(name), "self.device%03d.set_value", i);
+        auto tool = new McpTool(name, "Sets the value of a synthetic device, one of many registered for the benchmark.",
+            PropertyList({
+                Property("value", kPropertyTypeInteger, 0, 100),
+                Property("enabled", kPropertyTypeBoolean, true),
+                Property("label", kPropertyTypeString),
+            }),
+            [](const PropertyList&) -> ReturnValue { return true; });
+        tools.push_back(tool);
+        tool_index.emplace(tool->name(), tool);
+    }
+    double register_us = std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count();
+
+    TestPages();
+
+    // A client walks all pages after connecting
+    auto list_all = [](std::string (*get_tools_list)(int, const std::string&)) {
+        std::string cursor;
+        do {
+            auto reply = get_tools_list(1, cursor);
+            DoNotOptimize(reply);
+            cursor = NextCursor(reply);
+        } while (!cursor.empty());
+    };
+    double old_ns = BenchNs(20, [&]() { list_all(GetToolsListOld); });
+    double new_ns = BenchNs(1000, [&]() { list_all(GetToolsList); });
+    double build_ns = BenchNs(200, [&]() { DoNotOptimize(BuildToolsPages(tools, MAX_TOOLS_LIST_PAYLOAD_SIZE)); });
+
+    // tools/call looks a tool up by name
+    std::vector<std::string> names;
+    for (int i = 0; i < 1000; i++) {
+        names.push_back(tools[(i * 7919) % tools.size()]->name());
+    }
+    size_t next = 0;
+    double find_ns = BenchNs(100000, [&]() {
+        auto& name = names[next++ % names.size()];
+        auto it = std::find_if(tools.begin(), tools.end(), [&name](const McpTool* tool) { return tool->name() == name; });
+        DoNotOptimize(*it);
+    });
+    double index_ns = BenchNs(100000, [&]() {
+        auto it = tool_index.find(names[next++ % names.size()]);
+        DoNotOptimize(it->second);
+    });
+    EXPECT(new_ns * 10 < old_ns);
+
+    printf("%d tools in %zu pages, registered in %.0f us including their descriptors\n",
+        kToolCount, tools_pages.size(), register_us);
+    printf("tools/list, all pages: rebuilt per request %.0f us, cached %.1f us, building the cache %.1f us\n",
+        old_ns / 1000, new_ns / 1000, build_ns / 1000);
+    printf("tools/call lookup: find_if %.0f ns, index %.0f ns\n", find_ns, index_ns);
+
+    for (auto tool : tools) {
+        delete tool;
+    }
+    return HOST_TEST_RESULT();
+}
@@ -0,0 +1,127 @@
+// The hello as the transports cache it and send it again with the resume token
+// of the last server hello.
+#include "protocols/protocol.h"
+#include "json_writer.h"
+#include "host_test.h"
+
+#include <cstring>
+
+class TestProtocol : public Protocol {
+public:
+    bool Start() override { return true; }
+    bool OpenAudioChannel() override { return true; }
+    void CloseAudioChannel() override {}
+    bool IsAudioChannelOpened() const override { return true; }
+    bool SendAudio(const AudioStreamPacket&) override { return true; }
+
+    // Built like WebsocketProtocol::GetHelloMessage(), into the cached string
+    std::string GetHelloMessage() {
+        if (!hello_message_.empty()) {
+            return AppendResumeToken(hello_message_);
+        }
+        JsonWriter json(hello_message_);
+        json.BeginObject();
+        json.Field("type", "hello");
+        json.Field("version", 3);
+        json.Key("features").BeginObject();
+        json.Field("mcp", true);
+        json.Field("binary_control", true);
+        json.EndObject();
+        json.Field("transport", "websocket");
+        json.Key("audio_params").BeginObject();
+        json.Field("format", "opus");
+        json.Field("sample_rate", 16000);
+        json.Field("channels", 1);
+        json.Field("frame_duration", 60);
+        json.EndObject();
+        json.EndObject();
+        return AppendResumeToken(json.str());
+    }
+
+    void ReceiveServerHello(const char* json) {
+        cJSON* root = cJSON_Parse(json);
+        EXPECT(root != NULL);
+        ParseResumeToken(root);
+        cJSON_Delete(root);
+    }
+
+    const std::string& hello_message() const { return hello_message_; }
+    const std::string& resume_token() const { return resume_token_; }
+    bool session_resumed() const { return session_resumed_; }
+
+private:
+    std::string hello_message_;
+
+    bool SendText(const std::string&) override { return true; }
+};
+
+static const char kHello[] = "{\"type\":\"hello\",\"version\":3,\"features\":{\"mcp\":true,\"binary_control\":true},"
+    "\"transport\":\"websocket\",\"audio_params\":{\"format\":\"opus\",\"sample_rate\":16000,\"channels\":1,"
+    "\"frame_duration\":60}}";
+
+static std::string TokenOf(const std::string& hello) {
+    cJSON* root = cJSON_Parse(hello.c_str());
+    EXPECT(root != NULL);
+    cJSON* token = cJSON_GetObjectItem(root, "resume_token");
+    std::string value = cJSON_IsString(token) ? token->valuestring : "";
+    cJSON_Delete(root);
+    return value;
+}
+
+static bool EndsWith(const std::string& text, const std::string& suffix) {
+    return text.size() >= suffix.size() && text.compare(text.size() - suffix.size(), suffix.size(), suffix) == 0;
+}
+
+static void TestHelloWithoutToken() {
+    TestProtocol protocol;
+    auto hello = protocol.GetHelloMessage();
+    // The cached hello has no padding left over from building it
+    EXPECT(hello == kHello);
+    EXPECT(protocol.hello_message().size() == strlen(protocol.hello_message().c_str()));
+    EXPECT(protocol.GetHelloMessage() == kHello);
+}
+
+static void TestHelloWithToken() {
+    TestProtocol protocol;
+    protocol.GetHelloMessage();
+    protocol.ReceiveServerHello(R"({"type":"hello","transport":"websocket","resume_token":"abc123"})");
+    EXPECT(!protocol.session_resumed() && protocol.resume_token() == "abc123");
+
+    auto hello = protocol.GetHelloMessage();
+    EXPECT(EndsWith(hello, ",\"resume_token\":\"abc123\"}"));
+    EXPECT(hello == std::string(kHello, strlen(kHello) - 1) + ",\"resume_token\":\"abc123\"}");
+    EXPECT(TokenOf(hello) == "abc123");
+    // Added to a copy, the cached hello stays as it was
+    EXPECT(protocol.hello_message() == kHello);
+
+    // The next server hello replaces the token, and one without a token drops it
+    protocol.ReceiveServerHello(R"({"type":"hello","resumed":true,"resume_token":"def"})");
+    EXPECT(protocol.session_resumed() && EndsWith(protocol.GetHelloMessage(), ",\"resume_token\":\"def\"}"));
+    protocol.ReceiveServerHello(R"({"type":"hello","resumed":true})");
+    EXPECT(protocol.GetHelloMessage() == kHello);
+    protocol.ReceiveServerHello(R"({"type":"hello","resume_token":7})");
+    EXPECT(protocol.GetHelloMessage() == kHello);
+
+    // A token that came before the hello was first built goes into that hello too
+    TestProtocol fresh;
+    fresh.ReceiveServerHello(R"({"type":"hello","resume_token":"abc123"})");
+    EXPECT(EndsWith(fresh.GetHelloMessage(), ",\"resume_token\":\"abc123\"}"));
+    EXPECT(fresh.hello_message() == kHello);
+}
+
+// The token is the server's, whatever it contains goes back to it unchanged
+static void TestTokenEscaping() {
+    TestProtocol protocol;
+    protocol.GetHelloMessage();
+    protocol.ReceiveServerHello(R"({"type":"hello","resume_token":"a\"b\\c\nd\u0001/é"})");
+    auto hello = protocol.GetHelloMessage();
+    EXPECT(EndsWith(hello, ",\"resume_token\":\"a\\\"b\\\\c\\nd\\u0001/é\"}"));
+    EXPECT(TokenOf(hello) == "a\"b\\c\nd\x01/é");
+}
+
+int main() {
+    TestHelloWithoutToken();
+    TestHelloWithToken();
+    TestTokenEscaping();
+    return HOST_TEST_RESULT();
+}
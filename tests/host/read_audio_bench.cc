@@ -0,0 +1,146 @@
+// Capture path of Application::ReadAudio(), before and after it kept its scratch
+// buffers as members. Application itself needs the board, so the stereo
+// deinterleave / resample / interleave steps are replayed here with a
+// stand-in resampler (24 kHz codec to 16 kHz, 30 ms per read).
+#include "host_test.h"
+
+#include <cstdint>
+#include <cstdlib>
+#include <new>
+#include <vector>
+
+static size_t allocations = 0;
+
+void* operator new(size_t size) {
+    allocations++;
+    if (void* p = malloc(size)) {
+        return p;
+    }
+    throw std::bad_alloc();
+}
+
+void operator delete(void* p) noexcept {
+    free(p);
+}
+
+void operator delete(void* p, size_t) noexcept {
+    free(p);
+}
+
+// Same interface as OpusResampler, picks the nearest sample for 3:2
+class Resampler {
+public:
+    int GetOutputSamples(int input_samples) const {
+        return input_samples * 2 / 3;
+    }
+
+    void Process(const int16_t* input, int input_samples, int16_t* output) {
+        int output_samples = GetOutputSamples(input_samples);
+        for (int i = 0; i < output_samples; i++) {
+            output[i] = input[i * 3 / 2];
+        }
+    }
+};
+
+static const int kCodecRate = 24000;
+static const int kChannels = 2;
+static const int kSamples = 16000 * 30 / 1000;
+
+static Resampler input_resampler;
+static Resampler reference_resampler;
+
+static void FillInput(std::vector<int16_t>& data) {
+    for (size_t i = 0; i < data.size(); i++) {
+        data[i] = static_cast<int16_t>(i * 7);
+    }
+}
+
+// As ReadAudio() was: four temporaries per read
+static void ReadAudioOld(std::vector<int16_t>& data) {
+    data.resize(kSamples * kCodecRate / 16000 * kChannels);
+    FillInput(data);
+    auto mic_channel = std::vector<int16_t>(data.size() / 2);
+    auto reference_channel = std::vector<int16_t>(data.size() / 2);
+    for (size_t i = 0, j = 0; i < mic_channel.size(); ++i, j += 2) {
+        mic_channel[i] = data[j];
+        reference_channel[i] = data[j + 1];
+    }
+    auto resampled_mic = std::vector<int16_t>(input_resampler.GetOutputSamples(mic_channel.size()));
+    auto resampled_reference = std::vector<int16_t>(reference_resampler.GetOutputSamples(reference_channel.size()));
+    input_resampler.Process(mic_channel.data(), mic_channel.size(), resampled_mic.data());
+    reference_resampler.Process(reference_channel.data(), reference_channel.size(), resampled_reference.data());
+    data.resize(resampled_mic.size() + resampled_reference.size());
+    for (size_t i = 0, j = 0; i < resampled_mic.size(); ++i, j += 2) {
+        data[j] = resampled_mic[i];
+        data[j + 1] = resampled_reference[i];
+    }
+}
+
+// As ReadAudio() is: scratch buffers reserved once, as Application::Start() does
+struct Capture {
+    std::vector<int16_t> mic;
+    std::vector<int16_t> reference;
+    std::vector<int16_t> resampled_mic;
+    std::vector<int16_t> resampled_reference;
+
+    Capture() {
+        size_t max_input_samples = kCodecRate * 60 / 1000;
+        mic.reserve(max_input_samples);
+        reference.reserve(max_input_samples);
+        resampled_mic.reserve(max_input_samples);
+        resampled_reference.reserve(max_input_samples);
+    }
+
+    void ReadAudio(std::vector<int16_t>& data) {
+        data.resize(kSamples * kCodecRate / 16000 * kChannels);
+        FillInput(data);
+        mic.resize(data.size() / 2);
+        reference.resize(data.size() / 2);
+        for (size_t i = 0, j = 0; i < mic.size(); ++i, j += 2) {
+            mic[i] = data[j];
+            reference[i] = data[j + 1];
+        }
+        resampled_mic.resize(input_resampler.GetOutputSamples(mic.size()));
+        resampled_reference.resize(reference_resampler.GetOutputSamples(reference.size()));
+        input_resampler.Process(mic.data(), mic.size(), resampled_mic.data());
+        reference_resampler.Process(reference.data(), reference.size(), resampled_reference.data());
+        data.resize(resampled_mic.size() + resampled_reference.size());
+        for (size_t i = 0, j = 0; i < resampled_mic.size(); ++i, j += 2) {
+            data[j] = resampled_mic[i];
+            data[j + 1] = resampled_reference[i];
+        }
+    }
+};
+
+int main() {
+    // The capture buffer is a member too, reserved for a 60 ms read of the codec rate
+    std::vector<int16_t> old_data;
+    std::vector<int16_t> new_data;
+    new_data.reserve(kCodecRate * 60 / 1000 * kChannels);
+    Capture capture;
+
+    ReadAudioOld(old_data);
+    capture.ReadAudio(new_data);
+    EXPECT(old_data == new_data);
+    EXPECT(new_data.size() == kSamples * kChannels);
+
+    const int iterations = 20000;
+    size_t before = allocations;
+    double old_ns = BenchNs(iterations, [&]() {
+        ReadAudioOld(old_data);
+        DoNotOptimize(old_data);
+    });
+    double old_allocations = double(allocations - before) / (iterations * 5);
+
+    before = allocations;
+    double new_ns = BenchNs(iterations, [&]() {
+        capture.ReadAudio(new_data);
+        DoNotOptimize(new_data);
+    });
+    double new_allocations = double(allocations - before) / (iterations * 5);
+    EXPECT(new_allocations == 0);
+
+    printf("ReadAudio, stereo %d Hz, 30 ms: old %.0f ns %.1f allocations, new %.0f ns %.1f allocations per read\n",
+        kCodecRate, old_ns, old_allocations, new_ns, new_allocations);
+    return HOST_TEST_RESULT();
+}
@@ -0,0 +1,221 @@
+#include "protocols/reorder_window.h"
+#include "host_test.h"
+
+#include <algorithm>
+#include <random>
+#include <set>
+#include <vector>
+
+// Records what a window hands on
+struct Sink {
+    std::vector<uint32_t> delivered;
+    uint32_t lost = 0;
+
+    explicit Sink(ReorderWindow& window) {
+        window.OnDeliver([this](AudioStreamPacket&& packet) {
+            delivered.push_back(packet.timestamp);
+        });
+        window.OnLoss([this](uint32_t count, const AudioStreamPacket& /* next */) {
+            lost += count;
+        });
+    }
+};
+
+// The timestamp carries the sequence, so the sink sees what was delivered
+static void Push(ReorderWindow& window, uint32_t sequence, int64_t now_ms) {
+    AudioStreamPacket packet;
+    packet.timestamp = sequence;
+    packet.payload.assign(8, static_cast<uint8_t>(sequence));
+    window.Push(sequence, packet, now_ms);
+}
+
+static void TestInOrderAndReordered() {
+    ReorderWindow window(4, 120);
+    Sink sink(window);
+    Push(window, 10, 0);
+    Push(window, 12, 20);
+    Push(window, 13, 40);
+    EXPECT(sink.delivered == std::vector<uint32_t>({10}));
+    EXPECT(window.held() == 2);
+    Push(window, 11, 60);
+    EXPECT(sink.delivered == std::vector<uint32_t>({10, 11, 12, 13}));
+    EXPECT(window.held() == 0);
+    EXPECT(window.stats().reordered_packets == 1 && window.stats().lost_packets == 0);
+}
+
+static void TestDuplicateAndLate() {
+    ReorderWindow window(4, 120);
+    Sink sink(window);
+    Push(window, 1, 0);
+    Push(window, 1, 0);
+    Push(window, 3, 0);
+    Push(window, 3, 0);
+    EXPECT(window.stats().duplicate_packets == 2);
+    // 2 is given up once 3 has waited max_hold_ms, then it is late
+    Push(window, 4, 120);
+    EXPECT(sink.delivered == std::vector<uint32_t>({1, 3, 4}));
+    EXPECT(sink.lost == 1);
+    Push(window, 2, 130);
+    EXPECT(window.stats().late_packets == 1);
+    EXPECT(sink.delivered.size() == 3);
+}
+
+// More packets held than the window has slots gives up the oldest gap
+static void TestWindowFull() {
+    ReorderWindow window(2, 1000);
+    Sink sink(window);
+    Push(window, 1, 0);
+    Push(window, 3, 0);
+    Push(window, 4, 0);
+    EXPECT(sink.delivered == std::vector<uint32_t>({1}));
+    Push(window, 6, 0);
+    EXPECT(sink.delivered == std::vector<uint32_t>({1, 3, 4}));
+    EXPECT(sink.lost == 1 && window.held() == 1);
+}
+
+// A full window and a packet from inside the gap, before everything held: only
+// what is in front of it is lost, and it goes out before the held packets
+static void TestWindowFullBeforeHeld() {
+    ReorderWindow window(4, 1000);
+    Sink sink(window);
+    Push(window, 100, 0);
+    for (uint32_t sequence = 103; sequence <= 106; sequence++) {
+        Push(window, sequence, 0);
+    }
+    EXPECT(window.held() == 4);
+    Push(window, 102, 0);
+    EXPECT(sink.delivered == std::vector<uint32_t>({100, 102, 103, 104, 105, 106}));
+    EXPECT(sink.lost == 1 && window.held() == 0);
+    EXPECT(window.stats().late_packets == 0 && window.stats().lost_packets == 1);
+    // 101 is given up: late if it comes now, and 102 is known as delivered
+    Push(window, 101, 0);
+    Push(window, 102, 0);
+    EXPECT(window.stats().late_packets == 1 && window.stats().duplicate_packets == 1);
+    Push(window, 107, 0);
+    EXPECT(sink.delivered.back() == 107);
+
+    // With nothing missing in front of it, the packet just fills the gap
+    ReorderWindow full(2, 1000);
+    Sink full_sink(full);
+    Push(full, 1, 0);
+    Push(full, 3, 0);
+    Push(full, 4, 0);
+    Push(full, 2, 0);
+    EXPECT(full_sink.delivered == std::vector<uint32_t>({1, 2, 3, 4}) && full_sink.lost == 0);
+}
+
+// The end of a response: nothing arrives after the gap to push the held packets out
+static void TestTailOfStream() {
+    ReorderWindow window(4, 120);
+    Sink sink(window);
+    Push(window, 1, 0);
+    Push(window, 2, 20);
+    Push(window, 4, 60);
+    Push(window, 5, 80);
+    EXPECT(sink.delivered == std::vector<uint32_t>({1, 2}));
+    window.Expire(179);
+    EXPECT(window.held() == 2);
+    window.Expire(180);
+    EXPECT(sink.delivered == std::vector<uint32_t>({1, 2, 4, 5}));
+    EXPECT(sink.lost == 1 && window.held() == 0);
+
+    // A tts stop flushes right away, whatever the hold time
+    Push(window, 8, 200);
+    Push(window, 7, 200);
+    EXPECT(window.held() == 2);
+    window.Flush();
+    EXPECT(sink.delivered == std::vector<uint32_t>({1, 2, 4, 5, 7, 8}));
+    EXPECT(sink.lost == 2);
+    window.Flush();
+    window.Expire(10000);
+    EXPECT(sink.delivered.size() == 6);
+}
+
+static void TestResetAndWrap() {
+    ReorderWindow window(4, 120);
+    Sink sink(window);
+    Push(window, 100, 0);
+    Push(window, 102, 0);
+    window.Reset();
+    EXPECT(window.held() == 0);
+    // A new stream may start anywhere, including just before the sequence wraps
+    Push(window, 0xfffffffe, 0);
+    Push(window, 0, 0);
+    Push(window, 0xffffffff, 0);
+    Push(window, 1, 0);
+    EXPECT(sink.delivered == std::vector<uint32_t>({100, 0xfffffffe, 0xffffffff, 0, 1}));
+    EXPECT(sink.lost == 0);
+}
+
+/*
+ * A long stream with loss, duplicates and reordering, seeded so failures
+ * reproduce. Packets arrive every 20 ms and move at most `displacement`
+ * places. Whatever happens, delivery is strictly in order and every sequence
+ * number is either delivered or reported lost exactly once.
+ */
+static void TestShuffledStream(uint32_t seed, int displacement, bool expect_no_false_loss) {
+    std::mt19937 rng(seed);
+    const uint32_t count = 5000;
+    std::vector<uint32_t> sent;
+    std::set<uint32_t> unique_sent;
+    for (uint32_t sequence = 1; sequence <= count; sequence++) {
+        if (rng() % 50 == 0 && sequence != count) {
+            continue;
+        }
+        sent.push_back(sequence);
+        unique_sent.insert(sequence);
+        if (rng() % 100 == 0) {
+            sent.push_back(sequence);
+        }
+    }
+    // Sorting by position plus a random delay moves no packet more than `displacement` places.
+    // The first packet stays first, it sets where the stream starts
+    std::vector<std::pair<size_t, uint32_t>> keyed;
+    for (size_t i = 0; i < sent.size(); i++) {
+        keyed.emplace_back(i == 0 ? 0 : i + 1 + rng() % (displacement + 1), sent[i]);
+    }
+    std::stable_sort(keyed.begin(), keyed.end(), [](const auto& a, const auto& b) {
+        return a.first < b.first;
+    });
+    for (size_t i = 0; i < sent.size(); i++) {
+        sent[i] = keyed[i].second;
+    }
+
+    ReorderWindow window(4, 120);
+    Sink sink(window);
+    int64_t now_ms = 0;
+    for (auto sequence : sent) {
+        Push(window, sequence, now_ms);
+        now_ms += 20;
+    }
+    window.Flush();
+
+    auto& delivered = sink.delivered;
+    bool ordered = std::adjacent_find(delivered.begin(), delivered.end(), std::greater_equal<uint32_t>()) == delivered.end();
+    EXPECT(ordered);
+    EXPECT(delivered.size() + sink.lost == count);
+    EXPECT(window.stats().lost_packets == sink.lost);
+    // Every packet that made it is delivered or counted late, none disappears. A late
+    // packet that also arrives twice is counted late twice
+    EXPECT(delivered.size() + window.stats().late_packets >= unique_sent.size());
+    if (expect_no_false_loss) {
+        EXPECT(window.stats().late_packets == 0);
+        EXPECT(std::vector<uint32_t>(unique_sent.begin(), unique_sent.end()) == delivered);
+    }
+}
+
+int main() {
+    TestInOrderAndReordered();
+    TestDuplicateAndLate();
+    TestWindowFull();
+    TestWindowFullBeforeHeld();
+    TestTailOfStream();
+    TestResetAndWrap();
+    for (uint32_t seed = 1; seed <= 20; seed++) {
+        // Swaps with a neighbour never outrun the window
+        TestShuffledStream(seed, 1, true);
+        // Jumps beyond the window and the hold time make some packets late
+        TestShuffledStream(seed, 12, false);
+    }
+    return HOST_TEST_RESULT();
+}
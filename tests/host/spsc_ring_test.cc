@@ -0,0 +1,127 @@
+#include "spsc_ring.h"
+#include "host_test.h"
+
+#include <atomic>
+#include <thread>
+#include <vector>
+
+struct Packet {
+    uint32_t sequence = 0;
+    std::vector<uint8_t> payload;
+};
+
+static void TestSingleThread() {
+    SpscRing<Packet, 4> ring;
+    EXPECT(ring.empty() && ring.Front() == nullptr);
+
+    for (uint32_t i = 1; i <= 4; i++) {
+        auto slot = ring.BeginPush();
+        EXPECT(slot != nullptr);
+        slot->sequence = i;
+        ring.CommitPush();
+    }
+    EXPECT(ring.size() == 4);
+    EXPECT(ring.BeginPush() == nullptr);
+
+    EXPECT(ring.Front()->sequence == 1);
+    ring.Pop();
+    EXPECT(ring.BeginPush() != nullptr);
+
+    // Clear() drops what was pushed before it, not what comes after
+    ring.Clear();
+    EXPECT(ring.empty() && ring.Front() == nullptr);
+    ring.BeginPush()->sequence = 9;
+    ring.CommitPush();
+    EXPECT(ring.size() == 1 && ring.Front()->sequence == 9);
+    ring.Pop();
+    EXPECT(ring.empty());
+}
+
+// Slots are reused in place, so a refilled payload must not reallocate
+static void TestSlotsKeepCapacity() {
+    SpscRing<Packet, 2> ring;
+    for (int i = 0; i < 2; i++) {
+        ring.BeginPush()->payload.assign(256, 1);
+        ring.CommitPush();
+        ring.Pop();
+    }
+    auto slot = ring.BeginPush();
+    auto data = slot->payload.data();
+    slot->payload.assign(200, 2);
+    EXPECT(slot->payload.data() == data);
+}
+
+// One producer and one consumer at full speed, as the UDP receive task and the
+// decode job use it. Every element must arrive once, in order, with its payload.
+static void TestStress(bool with_clear) {
+    const uint32_t count = 2000000;
+    SpscRing<Packet, 40> ring;
+    std::atomic<bool> producer_done{false};
+    std::atomic<uint32_t> bad{0};
+    uint32_t received = 0;
+
+    std::thread consumer([&]() {
+        uint32_t last = 0;
+        while (true) {
+            auto slot = ring.Front();
+            if (slot == nullptr) {
+                if (producer_done.load() && ring.Front() == nullptr) {
+                    break;
+                }
+                std::this_thread::yield();
+                continue;
+            }
+            bool payload_ok = slot->payload.size() == 4 && slot->payload[0] == static_cast<uint8_t>(slot->sequence);
+            if (slot->sequence <= last || (!with_clear && slot->sequence != last + 1) || !payload_ok) {
+                bad++;
+            }
+            last = slot->sequence;
+            received++;
+            ring.Pop();
+        }
+    });
+
+    std::thread clearer;
+    if (with_clear) {
+        // Clear() may come from any task, e.g. when a new response starts
+        clearer = std::thread([&]() {
+            while (!producer_done.load()) {
+                ring.Clear();
+                std::this_thread::sleep_for(std::chrono::microseconds(50));
+            }
+        });
+    }
+
+    for (uint32_t i = 1; i <= count;) {
+        auto slot = ring.BeginPush();
+        if (slot == nullptr) {
+            std::this_thread::yield();
+            continue;
+        }
+        slot->sequence = i;
+        slot->payload.assign(4, static_cast<uint8_t>(i));
+        ring.CommitPush();
+        i++;
+    }
+    producer_done = true;
+    consumer.join();
+    if (clearer.joinable()) {
+        clearer.join();
+    }
+
+    EXPECT(bad.load() == 0);
+    if (with_clear) {
+        EXPECT(received <= count);
+        printf("stress with Clear(): %u of %u delivered\n", received, count);
+    } else {
+        EXPECT(received == count);
+    }
+}
+
+int main() {
+    TestSingleThread();
+    TestSlotsKeepCapacity();
+    TestStress(false);
+    TestStress(true);
+    return HOST_TEST_RESULT();
+}
@@ -0,0 +1,515 @@
+// Host implementation of the cJSON subset in cJSON.h. It keeps cJSON's node
+// layout and allocation pattern (a node per item, a strdup per key and string),
+// prints the way cJSON does, and parses strictly: anything that is not valid
+// JSON returns NULL, so tests can use it to check generated text.
+#include "cJSON.h"
+
+#include <climits>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <strings.h>
+#include <string>
+
+static cJSON* NewItem(int type) {
+    auto item = static_cast<cJSON*>(calloc(1, sizeof(cJSON)));
+    if (item != NULL) {
+        item->type = type;
+    }
+    return item;
+}
+
+static void SetNumber(cJSON* item, double number) {
+    item->valuedouble = number;
+    if (number >= INT_MAX) {
+        item->valueint = INT_MAX;
+    } else if (number <= static_cast<double>(INT_MIN)) {
+        item->valueint = INT_MIN;
+    } else {
+        item->valueint = static_cast<int>(number);
+    }
+}
+
+void cJSON_Delete(cJSON* item) {
+    while (item != NULL) {
+        cJSON* next = item->next;
+        cJSON_Delete(item->child);
+        free(item->valuestring);
+        free(item->string);
+        free(item);
+        item = next;
+    }
+}
+
+void cJSON_free(void* object) {
+    free(object);
+}
+
+cJSON* cJSON_CreateObject() { return NewItem(cJSON_Object); }
+cJSON* cJSON_CreateArray() { return NewItem(cJSON_Array); }
+cJSON* cJSON_CreateNull() { return NewItem(cJSON_NULL); }
+
+cJSON* cJSON_CreateBool(cJSON_bool boolean) {
+    return NewItem(boolean ? cJSON_True : cJSON_False);
+}
+
+cJSON* cJSON_CreateNumber(double number) {
+    cJSON* item = NewItem(cJSON_Number);
+    if (item != NULL) {
+        SetNumber(item, number);
+    }
+    return item;
+}
+
+cJSON* cJSON_CreateString(const char* string) {
+    cJSON* item = NewItem(cJSON_String);
+    if (item != NULL) {
+        item->valuestring = strdup(string);
+    }
+    return item;
+}
+
+cJSON_bool cJSON_AddItemToArray(cJSON* array, cJSON* item) {
+    if (array == NULL || item == NULL || array == item) {
+        return 0;
+    }
+    // As in cJSON, the first child's prev points at the last one
+    if (array->child == NULL) {
+        array->child = item;
+        item->prev = item;
+        item->next = NULL;
+    } else {
+        cJSON* last = array->child->prev;
+        last->next = item;
+        item->prev = last;
+        array->child->prev = item;
+    }
+    return 1;
+}
+
+cJSON_bool cJSON_AddItemToObject(cJSON* object, const char* string, cJSON* item) {
+    if (object == NULL || string == NULL || item == NULL) {
+        return 0;
+    }
+    free(item->string);
+    item->string = strdup(string);
+    return cJSON_AddItemToArray(object, item);
+}
+
+cJSON* cJSON_AddStringToObject(cJSON* object, const char* name, const char* string) {
+    cJSON* item = cJSON_CreateString(string);
+    if (!cJSON_AddItemToObject(object, name, item)) {
+        cJSON_Delete(item);
+        return NULL;
+    }
+    return item;
+}
+
+cJSON* cJSON_AddNumberToObject(cJSON* object, const char* name, double number) {
+    cJSON* item = cJSON_CreateNumber(number);
+    if (!cJSON_AddItemToObject(object, name, item)) {
+        cJSON_Delete(item);
+        return NULL;
+    }
+    return item;
+}
+
+cJSON* cJSON_AddBoolToObject(cJSON* object, const char* name, cJSON_bool boolean) {
+    cJSON* item = cJSON_CreateBool(boolean);
+    if (!cJSON_AddItemToObject(object, name, item)) {
+        cJSON_Delete(item);
+        return NULL;
+    }
+    return item;
+}
+
+// Like cJSON, object keys are matched case-insensitively
+cJSON* cJSON_GetObjectItem(const cJSON* object, const char* string) {
+    if (object == NULL || string == NULL) {
+        return NULL;
+    }
+    for (cJSON* item = object->child; item != NULL; item = item->next) {
+        if (item->string != NULL && strcasecmp(item->string, string) == 0) {
+            return item;
+        }
+    }
+    return NULL;
+}
+
+cJSON* cJSON_GetArrayItem(const cJSON* array, int index) {
+    if (array == NULL || index < 0) {
+        return NULL;
+    }
+    cJSON* item = array->child;
+    while (item != NULL && index-- > 0) {
+        item = item->next;
+    }
+    return item;
+}
+
+int cJSON_GetArraySize(const cJSON* array) {
+    int size = 0;
+    for (cJSON* item = array != NULL ? array->child : NULL; item != NULL; item = item->next) {
+        size++;
+    }
+    return size;
+}
+
+cJSON_bool cJSON_IsString(const cJSON* item) { return item != NULL && (item->type & 0xff) == cJSON_String; }
+cJSON_bool cJSON_IsNumber(const cJSON* item) { return item != NULL && (item->type & 0xff) == cJSON_Number; }
+cJSON_bool cJSON_IsBool(const cJSON* item) { return item != NULL && (item->type & (cJSON_True | cJSON_False)) != 0; }
+cJSON_bool cJSON_IsObject(const cJSON* item) { return item != NULL && (item->type & 0xff) == cJSON_Object; }
+cJSON_bool cJSON_IsArray(const cJSON* item) { return item != NULL && (item->type & 0xff) == cJSON_Array; }
+cJSON_bool cJSON_IsTrue(const cJSON* item) { return item != NULL && (item->type & 0xff) == cJSON_True; }
+cJSON_bool cJSON_IsFalse(const cJSON* item) { return item != NULL && (item->type & 0xff) == cJSON_False; }
+cJSON_bool cJSON_IsNull(const cJSON* item) { return item != NULL && (item->type & 0xff) == cJSON_NULL; }
+
+cJSON* cJSON_Duplicate(const cJSON* item, cJSON_bool recurse) {
+    if (item == NULL) {
+        return NULL;
+    }
+    cJSON* copy = NewItem(item->type);
+    if (copy == NULL) {
+        return NULL;
+    }
+    copy->valueint = item->valueint;
+    copy->valuedouble = item->valuedouble;
+    copy->valuestring = item->valuestring != NULL ? strdup(item->valuestring) : NULL;
+    copy->string = item->string != NULL ? strdup(item->string) : NULL;
+    if (recurse) {
+        for (cJSON* child = item->child; child != NULL; child = child->next) {
+            cJSON_AddItemToArray(copy, cJSON_Duplicate(child, true));
+        }
+    }
+    return copy;
+}
+
+/* Printing */
+
+static void PrintString(std::string& out, const char* string) {
+    out += '"';
+    for (const char* p = string; *p != '\0'; p++) {
+        auto c = static_cast<unsigned char>(*p);
+        switch (c) {
+            case '"': out += "\\\""; break;
+            case '\\': out += "\\\\"; break;
+            case '\b': out += "\\b"; break;
+            case '\f': out += "\\f"; break;
+            case '\n': out += "\\n"; break;
+            case '\r': out += "\\r"; break;
+            case '\t': out += "\\t"; break;
+            default:
+                if (c < 0x20) {
+                    char escape[7];
+                    snprintf(escape, sizeof(escape), "\\u%04x", c);
+                    out += escape;
+                } else {
+                    out += static_cast<char>(c);
+                }
+                break;
+        }
+    }
+    out += '"';
+}
+
+static void PrintNumber(std::string& out, const cJSON* item) {
+    double number = item->valuedouble;
+    char buffer[32];
+    if (std::isnan(number) || std::isinf(number)) {
+        strcpy(buffer, "null");
+    } else if (number == item->valueint) {
+        snprintf(buffer, sizeof(buffer), "%d", item->valueint);
+    } else {
+        // The shortest of 15 or 17 digits that reads back the same
+        snprintf(buffer, sizeof(buffer), "%1.15g", number);
+        if (strtod(buffer, NULL) != number) {
+            snprintf(buffer, sizeof(buffer), "%1.17g", number);
+        }
+    }
+    out += buffer;
+}
+
+static void PrintValue(std::string& out, const cJSON* item) {
+    switch (item->type & 0xff) {
+        case cJSON_False: out += "false"; break;
+        case cJSON_True: out += "true"; break;
+        case cJSON_NULL: out += "null"; break;
+        case cJSON_Number: PrintNumber(out, item); break;
+        case cJSON_String: PrintString(out, item->valuestring != NULL ? item->valuestring : ""); break;
+        case cJSON_Array:
+        case cJSON_Object: {
+            bool is_object = (item->type & 0xff) == cJSON_Object;
+            out += is_object ? '{' : '[';
+            for (cJSON* child = item->child; child != NULL; child = child->next) {
+                if (child != item->child) {
+                    out += ',';
+                }
+                if (is_object) {
+                    PrintString(out, child->string != NULL ? child->string : "");
+                    out += ':';
+                }
+                PrintValue(out, child);
+            }
+            out += is_object ? '}' : ']';
+            break;
+        }
+        default: out += "null"; break;
+    }
+}
+
+char* cJSON_PrintUnformatted(const cJSON* item) {
+    if (item == NULL) {
+        return NULL;
+    }
+    std::string out;
+    PrintValue(out, item);
+    return strdup(out.c_str());
+}
+
+char* cJSON_Print(const cJSON* item) {
+    return cJSON_PrintUnformatted(item);
+}
+
+/* Parsing */
+
+namespace {
+
+struct Parser {
+    const char* p;
+    const char* end;
+    int depth = 0;
+
+    void SkipSpace() {
+        while (p < end && (*p == ' ' || *p == '\t' || *p == '\n' || *p == '\r')) {
+            p++;
+        }
+    }
+
+    bool Consume(const char* word) {
+        size_t size = strlen(word);
+        if (static_cast<size_t>(end - p) < size || memcmp(p, word, size) != 0) {
+            return false;
+        }
+        p += size;
+        return true;
+    }
+
+    bool Hex4(unsigned& value) {
+        if (end - p < 4) {
+            return false;
+        }
+        value = 0;
+        for (int i = 0; i < 4; i++) {
+            char c = *p++;
+            value <<= 4;
+            if (c >= '0' && c <= '9') {
+                value |= c - '0';
+            } else if (c >= 'a' && c <= 'f') {
+                value |= c - 'a' + 10;
+            } else if (c >= 'A' && c <= 'F') {
+                value |= c - 'A' + 10;
+            } else {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    static void PutUtf8(std::string& out, unsigned code) {
+        if (code < 0x80) {
+            out += static_cast<char>(code);
+        } else if (code < 0x800) {
+            out += static_cast<char>(0xc0 | (code >> 6));
+            out += static_cast<char>(0x80 | (code & 0x3f));
+        } else if (code < 0x10000) {
+            out += static_cast<char>(0xe0 | (code >> 12));
+            out += static_cast<char>(0x80 | ((code >> 6) & 0x3f));
+            out += static_cast<char>(0x80 | (code & 0x3f));
+        } else {
+            out += static_cast<char>(0xf0 | (code >> 18));
+            out += static_cast<char>(0x80 | ((code >> 12) & 0x3f));
+            out += static_cast<char>(0x80 | ((code >> 6) & 0x3f));
+            out += static_cast<char>(0x80 | (code & 0x3f));
+        }
+    }
+
+    // Control characters must be escaped and only the JSON escapes are accepted.
+    // As in cJSON, \u0000 cannot be represented and is rejected.
+    char* String() {
+        if (p >= end || *p != '"') {
+            return NULL;
+        }
+        p++;
+        std::string out;
+        while (p < end && *p != '"') {
+            auto c = static_cast<unsigned char>(*p++);
+            if (c < 0x20) {
+                return NULL;
+            }
+            if (c != '\\') {
+                out += static_cast<char>(c);
+                continue;
+            }
+            if (p >= end) {
+                return NULL;
+            }
+            switch (*p++) {
+                case '"': out += '"'; break;
+                case '\\': out += '\\'; break;
+                case '/': out += '/'; break;
+                case 'b': out += '\b'; break;
+                case 'f': out += '\f'; break;
+                case 'n': out += '\n'; break;
+                case 'r': out += '\r'; break;
+                case 't': out += '\t'; break;
+                case 'u': {
+                    unsigned code;
+                    if (!Hex4(code) || code == 0 || (code >= 0xdc00 && code <= 0xdfff)) {
+                        return NULL;
+                    }
+                    if (code >= 0xd800 && code <= 0xdbff) {
+                        unsigned low;
+                        if (!Consume("\\u") || !Hex4(low) || low < 0xdc00 || low > 0xdfff) {
+                            return NULL;
+                        }
+                        code = 0x10000 + ((code - 0xd800) << 10) + (low - 0xdc00);
+                    }
+                    PutUtf8(out, code);
+                    break;
+                }
+                default:
+                    return NULL;
+            }
+        }
+        if (p >= end) {
+            return NULL;
+        }
+        p++;
+        return strdup(out.c_str());
+    }
+
+    cJSON* Number() {
+        const char* start = p;
+        if (p < end && *p == '-') {
+            p++;
+        }
+        if (p < end && *p == '0') {
+            p++;
+        } else if (p < end && *p >= '1' && *p <= '9') {
+            while (p < end && *p >= '0' && *p <= '9') p++;
+        } else {
+            return NULL;
+        }
+        if (p < end && *p == '.') {
+            p++;
+            if (p >= end || *p < '0' || *p > '9') return NULL;
+            while (p < end && *p >= '0' && *p <= '9') p++;
+        }
+        if (p < end && (*p == 'e' || *p == 'E')) {
+            p++;
+            if (p < end && (*p == '+' || *p == '-')) p++;
+            if (p >= end || *p < '0' || *p > '9') return NULL;
+            while (p < end && *p >= '0' && *p <= '9') p++;
+        }
+        return cJSON_CreateNumber(strtod(std::string(start, p).c_str(), NULL));
+    }
+
+    cJSON* Container(bool is_object) {
+        if (++depth > 1000) {
+            return NULL;
+        }
+        cJSON* container = NewItem(is_object ? cJSON_Object : cJSON_Array);
+        char close = is_object ? '}' : ']';
+        p++;
+        SkipSpace();
+        if (p < end && *p == close) {
+            p++;
+            depth--;
+            return container;
+        }
+        while (true) {
+            char* key = NULL;
+            if (is_object) {
+                SkipSpace();
+                key = String();
+                SkipSpace();
+                if (key == NULL || !Consume(":")) {
+                    free(key);
+                    cJSON_Delete(container);
+                    return NULL;
+                }
+            }
+            cJSON* item = Value();
+            if (item == NULL) {
+                free(key);
+                cJSON_Delete(container);
+                return NULL;
+            }
+            item->string = key;
+            cJSON_AddItemToArray(container, item);
+            SkipSpace();
+            if (Consume(",")) {
+                continue;
+            }
+            if (p < end && *p == close) {
+                p++;
+                depth--;
+                return container;
+            }
+            cJSON_Delete(container);
+            return NULL;
+        }
+    }
+
+    cJSON* Value() {
+        SkipSpace();
+        if (p >= end) {
+            return NULL;
+        }
+        switch (*p) {
+            case '{': return Container(true);
+            case '[': return Container(false);
+            case '"': {
+                char* string = String();
+                if (string == NULL) {
+                    return NULL;
+                }
+                cJSON* item = NewItem(cJSON_String);
+                item->valuestring = string;
+                return item;
+            }
+            case 't':
+                if (Consume("true")) {
+                    cJSON* item = NewItem(cJSON_True);
+                    item->valueint = 1;
+                    return item;
+                }
+                return NULL;
+            case 'f': return Consume("false") ? NewItem(cJSON_False) : NULL;
+            case 'n': return Consume("null") ? NewItem(cJSON_NULL) : NULL;
+            default: return Number();
+        }
+    }
+};
+
+} // namespace
+
+// Unlike cJSON_Parse, anything but whitespace after the value is an error
+cJSON* cJSON_ParseWithLength(const char* value, size_t length) {
+    if (value == NULL) {
+        return NULL;
+    }
+    Parser parser{value, value + length};
+    cJSON* item = parser.Value();
+    parser.SkipSpace();
+    if (item != NULL && parser.p != parser.end) {
+        cJSON_Delete(item);
+        return NULL;
+    }
+    return item;
+}
+
+cJSON* cJSON_Parse(const char* value) {
+    return value != NULL ? cJSON_ParseWithLength(value, strlen(value)) : NULL;
+}
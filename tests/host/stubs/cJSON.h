@@ -0,0 +1,62 @@
+#ifndef CJSON_H
+#define CJSON_H
+
+// The subset of the cJSON API used by main/, implemented by cJSON.cc
+#include <cstddef>
+
+#define cJSON_Invalid (0)
+#define cJSON_False  (1 << 0)
+#define cJSON_True   (1 << 1)
+#define cJSON_NULL   (1 << 2)
+#define cJSON_Number (1 << 3)
+#define cJSON_String (1 << 4)
+#define cJSON_Array  (1 << 5)
+#define cJSON_Object (1 << 6)
+
+typedef struct cJSON {
+    struct cJSON* next;
+    struct cJSON* prev;
+    struct cJSON* child;
+    int type;
+    char* valuestring;
+    int valueint;
+    double valuedouble;
+    char* string;
+} cJSON;
+
+typedef int cJSON_bool;
+
+cJSON* cJSON_Parse(const char* value);
+cJSON* cJSON_ParseWithLength(const char* value, size_t length);
+void cJSON_Delete(cJSON* item);
+cJSON* cJSON_GetObjectItem(const cJSON* object, const char* string);
+cJSON* cJSON_GetArrayItem(const cJSON* array, int index);
+int cJSON_GetArraySize(const cJSON* array);
+cJSON_bool cJSON_IsString(const cJSON* item);
+cJSON_bool cJSON_IsNumber(const cJSON* item);
+cJSON_bool cJSON_IsBool(const cJSON* item);
+cJSON_bool cJSON_IsObject(const cJSON* item);
+cJSON_bool cJSON_IsArray(const cJSON* item);
+cJSON_bool cJSON_IsTrue(const cJSON* item);
+cJSON_bool cJSON_IsFalse(const cJSON* item);
+cJSON_bool cJSON_IsNull(const cJSON* item);
+cJSON* cJSON_CreateObject();
+cJSON* cJSON_CreateArray();
+cJSON* cJSON_CreateString(const char* string);
+cJSON* cJSON_CreateNumber(double number);
+cJSON* cJSON_CreateBool(cJSON_bool boolean);
+cJSON* cJSON_CreateNull();
+cJSON* cJSON_AddStringToObject(cJSON* object, const char* name, const char* string);
+cJSON* cJSON_AddNumberToObject(cJSON* object, const char* name, double number);
+cJSON* cJSON_AddBoolToObject(cJSON* object, const char* name, cJSON_bool boolean);
+cJSON_bool cJSON_AddItemToObject(cJSON* object, const char* string, cJSON* item);
+cJSON_bool cJSON_AddItemToArray(cJSON* array, cJSON* item);
+cJSON* cJSON_Duplicate(const cJSON* item, cJSON_bool recurse);
+char* cJSON_PrintUnformatted(const cJSON* item);
+char* cJSON_Print(const cJSON* item);
+void cJSON_free(void* object);
+
+#define cJSON_ArrayForEach(element, array) \
+    for (element = (array != NULL) ? (array)->child : NULL; element != NULL; element = element->next)
+
+#endif // CJSON_H
@@ -0,0 +1,121 @@
+// The FreeRTOS task and esp_timer functions the stubs declare, run on std::thread
+// for tests of code that starts tasks. A task cannot be stopped from outside, so
+// vTaskDelete() does nothing: keep what a task waits on alive until the test exits.
+#include <freertos/task.h>
+#include <esp_timer.h>
+
+#include <chrono>
+#include <condition_variable>
+#include <map>
+#include <mutex>
+#include <thread>
+
+static std::mutex task_mutex;
+static std::map<std::thread::id, TaskHandle_t> tasks;
+static intptr_t next_task = 1;
+
+BaseType_t xTaskCreate(TaskFunction_t function, const char* /* name */, uint32_t /* stack_depth */, void* arg,
+    UBaseType_t /* priority */, TaskHandle_t* handle) {
+    std::lock_guard<std::mutex> lock(task_mutex);
+    auto task = (TaskHandle_t)next_task++;
+    if (handle != nullptr) {
+        *handle = task;
+    }
+    // Registered before the task can ask for its handle, which needs the lock
+    std::thread thread(function, arg);
+    tasks[thread.get_id()] = task;
+    thread.detach();
+    return pdPASS;
+}
+
+void vTaskDelete(TaskHandle_t /* handle */) {
+}
+
+TaskHandle_t xTaskGetCurrentTaskHandle() {
+    std::lock_guard<std::mutex> lock(task_mutex);
+    auto& task = tasks[std::this_thread::get_id()];
+    if (task == nullptr) {
+        // A thread the test started itself, like the one running main()
+        task = (TaskHandle_t)next_task++;
+    }
+    return task;
+}
+
+int64_t esp_timer_get_time() {
+    static const auto start = std::chrono::steady_clock::now();
+    return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count();
+}
+
+// Each timer has a thread that runs its callback, like the esp_timer task does
+struct HostTimer {
+    esp_timer_create_args_t args;
+    std::mutex mutex;
+    std::condition_variable condition_variable;
+    int64_t expiry = -1;            // -1 while stopped
+    uint64_t period_us = 0;         // 0 for a one-shot timer
+    bool deleted = false;
+};
+
+static void TimerLoop(HostTimer* timer) {
+    std::unique_lock<std::mutex> lock(timer->mutex);
+    while (!timer->deleted) {
+        if (timer->expiry < 0) {
+            timer->condition_variable.wait(lock);
+            continue;
+        }
+        auto now = esp_timer_get_time();
+        if (now < timer->expiry) {
+            timer->condition_variable.wait_for(lock, std::chrono::microseconds(timer->expiry - now));
+            continue;
+        }
+        timer->expiry = timer->period_us > 0 ? timer->expiry + timer->period_us : -1;
+        lock.unlock();
+        timer->args.callback(timer->args.arg);
+        lock.lock();
+    }
+    lock.unlock();
+    delete timer;
+}
+
+esp_err_t esp_timer_create(const esp_timer_create_args_t* create_args, esp_timer_handle_t* out_handle) {
+    auto timer = new HostTimer{*create_args};
+    std::thread(TimerLoop, timer).detach();
+    *out_handle = timer;
+    return 0;
+}
+
+static esp_err_t StartTimer(esp_timer_handle_t handle, uint64_t timeout_us, uint64_t period_us) {
+    auto timer = (HostTimer*)handle;
+    {
+        std::lock_guard<std::mutex> lock(timer->mutex);
+        timer->expiry = esp_timer_get_time() + timeout_us;
+        timer->period_us = period_us;
+    }
+    timer->condition_variable.notify_all();
+    return 0;
+}
+
+esp_err_t esp_timer_start_once(esp_timer_handle_t timer, uint64_t timeout_us) {
+    return StartTimer(timer, timeout_us, 0);
+}
+
+esp_err_t esp_timer_start_periodic(esp_timer_handle_t timer, uint64_t period_us) {
+    return StartTimer(timer, period_us, period_us);
+}
+
+esp_err_t esp_timer_stop(esp_timer_handle_t handle) {
+    auto timer = (HostTimer*)handle;
+    std::lock_guard<std::mutex> lock(timer->mutex);
+    timer->expiry = -1;
+    return 0;
+}
+
+esp_err_t esp_timer_delete(esp_timer_handle_t handle) {
+    auto timer = (HostTimer*)handle;
+    {
+        std::lock_guard<std::mutex> lock(timer->mutex);
+        timer->deleted = true;
+    }
+    timer->condition_variable.notify_all();
+    return 0;
+}
@@ -0,0 +1,22 @@
+#ifndef MBEDTLS_AES_H
+#define MBEDTLS_AES_H
+
+// Declarations for the host's libmbedcrypto, the context is oversized so any 2.x or 3.x layout fits
+#include <cstddef>
+
+#define MBEDTLS_AES_ENCRYPT 1
+#define MBEDTLS_AES_DECRYPT 0
+
+typedef struct {
+    alignas(16) unsigned char opaque[512];
+} mbedtls_aes_context;
+
+extern "C" {
+void mbedtls_aes_init(mbedtls_aes_context* ctx);
+void mbedtls_aes_free(mbedtls_aes_context* ctx);
+int mbedtls_aes_setkey_enc(mbedtls_aes_context* ctx, const unsigned char* key, unsigned int keybits);
+int mbedtls_aes_crypt_ctr(mbedtls_aes_context* ctx, size_t length, size_t* nc_off, unsigned char nonce_counter[16],
+    unsigned char stream_block[16], const unsigned char* input, unsigned char* output);
+}
+
+#endif // MBEDTLS_AES_H
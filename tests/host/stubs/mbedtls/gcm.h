@@ -0,0 +1,28 @@
+#ifndef MBEDTLS_GCM_H
+#define MBEDTLS_GCM_H
+
+// Declarations for the host's libmbedcrypto, the context is oversized so any 2.x or 3.x layout fits
+#include <cstddef>
+
+#define MBEDTLS_GCM_ENCRYPT 1
+#define MBEDTLS_GCM_DECRYPT 0
+
+typedef enum {
+    MBEDTLS_CIPHER_ID_AES = 2,
+} mbedtls_cipher_id_t;
+
+typedef struct {
+    alignas(16) unsigned char opaque[1024];
+} mbedtls_gcm_context;
+
+extern "C" {
+void mbedtls_gcm_init(mbedtls_gcm_context* ctx);
+void mbedtls_gcm_free(mbedtls_gcm_context* ctx);
+int mbedtls_gcm_setkey(mbedtls_gcm_context* ctx, mbedtls_cipher_id_t cipher, const unsigned char* key, unsigned int keybits);
+int mbedtls_gcm_crypt_and_tag(mbedtls_gcm_context* ctx, int mode, size_t length, const unsigned char* iv, size_t iv_len,
+    const unsigned char* add, size_t add_len, const unsigned char* input, unsigned char* output, size_t tag_len, unsigned char* tag);
+int mbedtls_gcm_auth_decrypt(mbedtls_gcm_context* ctx, size_t length, const unsigned char* iv, size_t iv_len,
+    const unsigned char* add, size_t add_len, const unsigned char* tag, size_t tag_len, const unsigned char* input, unsigned char* output);
+}
+
+#endif // MBEDTLS_GCM_H
@@ -0,0 +1,224 @@
+// ToolCallPool on threads: resources, queue limit, timeouts and cancels. Pools are
+// never deleted, their workers keep waiting on them until the test exits.
+#include "tool_call_pool.h"
+#include "host_test.h"
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+
+using namespace std::chrono_literals;
+
+// Holds tool calls until the test lets them finish
+class Gate {
+public:
+    void Open() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        open_ = true;
+        condition_variable_.notify_all();
+    }
+
+    void Wait() {
+        std::unique_lock<std::mutex> lock(mutex_);
+        condition_variable_.wait(lock, [this]() { return open_; });
+    }
+
+private:
+    std::mutex mutex_;
+    std::condition_variable condition_variable_;
+    bool open_ = false;
+};
+
+// A pool and what it replied
+class Harness {
+public:
+    Harness() {
+        pool.OnResult([this](int id, const std::string& result) { Record(id, result); });
+        pool.OnError([this](int id, const std::string& message) { Record(id, "error: " + message); });
+    }
+
+    ToolCallPool pool;
+    std::atomic<int> started{0};
+
+    bool Submit(int id, const std::string& resource, std::function<std::string()> run, int timeout_ms = 5000) {
+        ToolCallRequest request;
+        request.id = id;
+        request.name = "tool" + std::to_string(id);
+        request.resource = resource;
+        request.timeout_ms = timeout_ms;
+        request.run = [this, run]() {
+            started++;
+            return run();
+        };
+        return pool.Submit(std::move(request));
+    }
+
+    // The reply to call id, empty if none came within the timeout
+    std::string Wait(int id, std::chrono::milliseconds timeout = 5s) {
+        std::unique_lock<std::mutex> lock(mutex_);
+        condition_variable_.wait_for(lock, timeout, [this, id]() { return replies_.count(id) > 0; });
+        auto it = replies_.find(id);
+        return it != replies_.end() ? it->second : "";
+    }
+
+    bool WaitStarted(int count) {
+        for (int i = 0; i < 500 && started < count; i++) {
+            std::this_thread::sleep_for(10ms);
+        }
+        return started == count;
+    }
+
+    size_t replies() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return replies_.size();
+    }
+
+private:
+    std::mutex mutex_;
+    std::condition_variable condition_variable_;
+    std::map<int, std::string> replies_;
+
+    void Record(int id, const std::string& reply) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        EXPECT(replies_.count(id) == 0);
+        replies_[id] = reply;
+        condition_variable_.notify_all();
+    }
+};
+
+// Calls on one resource run one at a time, in the order they came in
+static void TestSameResource() {
+    auto harness = new Harness();
+    std::mutex order_mutex;
+    std::vector<int> order;
+    std::atomic<int> running{0};
+    std::atomic<int> max_running{0};
+    for (int id = 1; id <= 4; id++) {
+        EXPECT(harness->Submit(id, "speaker", [&, id]() {
+            int now = ++running;
+            max_running = std::max(max_running.load(), now);
+            {
+                std::lock_guard<std::mutex> lock(order_mutex);
+                order.push_back(id);
+            }
+            std::this_thread::sleep_for(20ms);
+            running--;
+            return std::string("done");
+        }));
+    }
+    for (int id = 1; id <= 4; id++) {
+        EXPECT(harness->Wait(id) == "done");
+    }
+    EXPECT(max_running == 1);
+    EXPECT(order == std::vector<int>({1, 2, 3, 4}));
+}
+
+// Calls on different resources, or on none, run at the same time
+static void TestDifferentResources() {
+    auto harness = new Harness();
+    std::atomic<int> arrived{0};
+    auto meet = [&arrived]() {
+        arrived++;
+        for (int i = 0; i < 500 && arrived < 3; i++) {
+            std::this_thread::sleep_for(10ms);
+        }
+        return std::string(arrived == 3 ? "met" : "alone");
+    };
+    EXPECT(harness->Submit(1, "speaker", meet));
+    EXPECT(harness->Submit(2, "display", meet));
+    EXPECT(harness->Submit(3, "", meet));
+    for (int id = 1; id <= 3; id++) {
+        EXPECT(harness->Wait(id) == "met");
+    }
+}
+
+// With every worker busy, TOOL_CALL_QUEUE_SIZE calls wait and the next one is rejected
+static void TestQueueFull() {
+    auto harness = new Harness();
+    auto gate = new Gate();
+    const int workers = TOOL_CALL_SMALL_WORKERS + TOOL_CALL_LARGE_WORKERS;
+    auto blocked = [gate]() {
+        gate->Wait();
+        return std::string("done");
+    };
+    for (int id = 1; id <= workers; id++) {
+        EXPECT(harness->Submit(id, "", blocked));
+    }
+    EXPECT(harness->WaitStarted(workers));
+    for (int id = workers + 1; id <= workers + TOOL_CALL_QUEUE_SIZE; id++) {
+        EXPECT(harness->Submit(id, "", blocked));
+    }
+    EXPECT(!harness->Submit(100, "", blocked));
+    EXPECT(harness->pool.GetStats()["tool100"].rejected == 1);
+
+    gate->Open();
+    for (int id = 1; id <= workers + TOOL_CALL_QUEUE_SIZE; id++) {
+        EXPECT(harness->Wait(id) == "done");
+    }
+    EXPECT(harness->Wait(100, 50ms).empty());
+    // Room again once the queue drained
+    EXPECT(harness->Submit(101, "", []() { return std::string("done"); }));
+    EXPECT(harness->Wait(101) == "done");
+}
+
+// A queued call that times out never runs. A running one cannot be stopped: the
+// client gets the error right away, the result is dropped and the resource stays
+// busy until the call returns
+static void TestTimeouts() {
+    auto harness = new Harness();
+    auto gate = new Gate();
+    std::atomic<bool> queued_ran{false};
+    std::atomic<bool> next_ran{false};
+    EXPECT(harness->Submit(1, "speaker", [gate]() { gate->Wait(); return std::string("late"); }, 100));
+    EXPECT(harness->WaitStarted(1));
+    EXPECT(harness->Submit(2, "speaker", [&queued_ran]() { queued_ran = true; return std::string("ran"); }, 50));
+    EXPECT(harness->Submit(3, "speaker", [&next_ran]() { next_ran = true; return std::string("ran"); }, 5000));
+
+    auto start = std::chrono::steady_clock::now();
+    EXPECT(harness->Wait(2) == "error: Tool call timed out");
+    EXPECT(harness->Wait(1) == "error: Tool call timed out");
+    EXPECT(std::chrono::steady_clock::now() - start < 1s);
+    std::this_thread::sleep_for(50ms);
+    EXPECT(!queued_ran && !next_ran);
+
+    gate->Open();
+    EXPECT(harness->Wait(3) == "ran");
+    EXPECT(!queued_ran);
+    EXPECT(harness->replies() == 3);
+    auto stats = harness->pool.GetStats();
+    EXPECT(stats["tool1"].timeouts == 1 && stats["tool1"].calls == 1);
+    EXPECT(stats["tool2"].timeouts == 1 && stats["tool2"].calls == 0);
+}
+
+// Cancelled calls get no reply at all, a queued one never runs
+static void TestCancel() {
+    auto harness = new Harness();
+    auto gate = new Gate();
+    std::atomic<bool> queued_ran{false};
+    EXPECT(harness->Submit(1, "speaker", [gate]() { gate->Wait(); return std::string("late"); }));
+    EXPECT(harness->WaitStarted(1));
+    EXPECT(harness->Submit(2, "speaker", [&queued_ran]() { queued_ran = true; return std::string("ran"); }));
+    EXPECT(harness->Submit(3, "speaker", []() { return std::string("ran"); }));
+
+    EXPECT(harness->pool.Cancel(2));
+    EXPECT(harness->pool.Cancel(1));
+    EXPECT(!harness->pool.Cancel(1) && !harness->pool.Cancel(2) && !harness->pool.Cancel(42));
+    gate->Open();
+    EXPECT(harness->Wait(3) == "ran");
+    EXPECT(harness->Wait(1, 50ms).empty() && harness->Wait(2, 0ms).empty());
+    EXPECT(!queued_ran);
+    auto stats = harness->pool.GetStats();
+    EXPECT(stats["tool1"].cancelled == 1 && stats["tool1"].calls == 1);
+    EXPECT(stats["tool2"].cancelled == 1 && stats["tool2"].calls == 0);
+}
+
+int main() {
+    TestSameResource();
+    TestDifferentResources();
+    TestQueueFull();
+    TestTimeouts();
+    TestCancel();
+    return HOST_TEST_RESULT();
+}